@@ -0,0 +1,210 @@
+package main
+
+import (
+	"context"
+	"fmt"
+	"net/netip"
+	"strings"
+	"sync"
+	"sync/atomic"
+)
+
+// Access control for exported ports.
+//
+// export_acls restricts exported ports to tailnet peers by user, node or
+// tag. A port covered by at least one entry admits only peers matched by one
+// of its entries; other ports stay open to the whole tailnet. The check runs
+// in the netstack's fallback handler, so a refused peer gets a reset before
+// the handshake completes and the app never sees it.
+//
+// Decisions are cached per peer address as the set of entries the peer
+// matches, a bitmask, stamped with the peer index generation and the
+// compiled table. A netmap or a reload makes them stale, and the next flow
+// from the peer looks its identity up again through the WhoIs cache
+// (identity.go). Allowed flows from a cached peer take a read lock and a map
+// lookup, with no allocation. A peer whose identity can't be looked up is
+// refused.
+
+const aclMaxRules = 64 // one bit each in a peer's match mask
+
+// ExportACL admits peers matching any of Users, Nodes or Tags to Ports.
+type ExportACL struct {
+	Ports string `json:"ports"`           // exported ports, e.g. "22,8000-8100"
+	Users string `json:"users,omitempty"` // login names, e.g. "alice@example.com"
+	Nodes string `json:"nodes,omitempty"` // machine names or MagicDNS FQDNs
+	Tags  string `json:"tags,omitempty"`  // ACL tags, e.g. "tag:ci"
+}
+
+type aclRule struct {
+	ports portSet
+	users []string
+	nodes []string
+	tags  []string
+}
+
+// aclTable is the compiled form of export_acls.
+type aclTable struct {
+	rules   []aclRule
+	covered [65536 / 64]uint64 // ports with at least one rule
+}
+
+func compileACLs(acls []ExportACL) (*aclTable, error) {
+	if len(acls) == 0 {
+		return nil, nil
+	}
+	if len(acls) > aclMaxRules {
+		return nil, fmt.Errorf("export_acls: %d entries, at most %d are supported", len(acls), aclMaxRules)
+	}
+	t := &aclTable{}
+	for i, acl := range acls {
+		ports, err := parsePortSpec(acl.Ports)
+		if err != nil {
+			return nil, fmt.Errorf("export_acls[%d]: %w", i, err)
+		}
+		if ports == nil {
+			return nil, fmt.Errorf("export_acls[%d]: ports is required", i)
+		}
+		r := aclRule{
+			ports: ports,
+			users: splitList(acl.Users),
+			nodes: splitList(acl.Nodes),
+			tags:  splitList(acl.Tags),
+		}
+		if len(r.users)+len(r.nodes)+len(r.tags) == 0 {
+			return nil, fmt.Errorf("export_acls[%d]: no users, nodes or tags", i)
+		}
+		for _, tag := range r.tags {
+			if !strings.HasPrefix(tag, "tag:") {
+				return nil, fmt.Errorf("export_acls[%d]: tag %q must start with tag:", i, tag)
+			}
+		}
+		for _, pr := range ports {
+			for port := pr.lo; port <= pr.hi; port++ {
+				t.covered[port/64] |= 1 << (port % 64)
+			}
+		}
+		t.rules = append(t.rules, r)
+	}
+	return t, nil
+}
+
+// splitList splits a comma-separated list, dropping empty items.
+func splitList(s string) []string {
+	var out []string
+	for _, item := range strings.Split(s, ",") {
+		if item = strings.TrimSpace(item); item != "" {
+			out = append(out, item)
+		}
+	}
+	return out
+}
+
+// covers reports whether any rule restricts port.
+func (t *aclTable) covers(port uint16) bool {
+	return t != nil && t.covered[port/64]&(1<<(port%64)) != 0
+}
+
+// match returns the mask of rules that admit id.
+func (t *aclTable) match(id *peerIdentity) uint64 {
+	var mask uint64
+	for i, r := range t.rules {
+		if r.matches(id) {
+			mask |= 1 << i
+		}
+	}
+	return mask
+}
+
+func (r *aclRule) matches(id *peerIdentity) bool {
+	for _, u := range r.users {
+		if id.user != "" && strings.EqualFold(u, id.user) {
+			return true
+		}
+	}
+	// The machine name is the first label of the FQDN
+	short, _, _ := strings.Cut(id.node, ".")
+	for _, n := range r.nodes {
+		if id.node != "" && (strings.EqualFold(n, id.node) || strings.EqualFold(n, short)) {
+			return true
+		}
+	}
+	for _, tag := range r.tags {
+		for _, have := range id.tags {
+			if tag == have {
+				return true
+			}
+		}
+	}
+	return false
+}
+
+// allows reports whether a peer with mask may connect to port.
+func (t *aclTable) allows(mask uint64, port uint16) bool {
+	for i := range t.rules {
+		if mask&(1<<i) != 0 && t.rules[i].ports.contains(int(port)) {
+			return true
+		}
+	}
+	return false
+}
+
+type aclDecision struct {
+	gen   uint64
+	table *aclTable
+	mask  uint64
+}
+
+// aclCache memoises the rules each peer address matches.
+type aclCache struct {
+	whois *whoisCache
+
+	mu      sync.RWMutex
+	entries map[netip.Addr]aclDecision
+
+	hits   atomic.Uint64
+	misses atomic.Uint64
+}
+
+func newACLCache(whois *whoisCache) *aclCache {
+	return &aclCache{whois: whois, entries: make(map[netip.Addr]aclDecision)}
+}
+
+// allows reports whether the peer at addr may connect to port under t. It
+// looks the peer up if no current decision is cached.
+func (c *aclCache) allows(ctx context.Context, t *aclTable, addr netip.Addr, port uint16) bool {
+	addr = addr.Unmap()
+	gen := c.whois.node.peers.refreshes.Load()
+	if allowed, ok := c.cached(t, addr, port); ok {
+		return allowed
+	}
+	c.misses.Add(1)
+
+	id, err := c.whois.lookup(ctx, addr)
+	if err != nil {
+		return false
+	}
+	d := aclDecision{gen: gen, table: t, mask: t.match(id)}
+	c.mu.Lock()
+	if len(c.entries) >= whoisCacheLimit {
+		clear(c.entries)
+	}
+	c.entries[addr] = d
+	c.mu.Unlock()
+	return t.allows(d.mask, port)
+}
+
+// cached reports whether the peer at addr may connect to port under t, if a
+// current decision is cached. It never looks the peer up.
+func (c *aclCache) cached(t *aclTable, addr netip.Addr, port uint16) (allowed, ok bool) {
+	addr = addr.Unmap()
+	gen := c.whois.node.peers.refreshes.Load()
+
+	c.mu.RLock()
+	d, ok := c.entries[addr]
+	c.mu.RUnlock()
+	if !ok || d.gen != gen || d.table != t {
+		return false, false
+	}
+	c.hits.Add(1)
+	return t.allows(d.mask, port), true
+}
@@ -0,0 +1,99 @@
+package main
+
+import (
+	"strings"
+	"testing"
+)
+
+func TestCompileACLsErrors(t *testing.T) {
+	tests := []struct {
+		name string
+		acls []ExportACL
+		want string // substring of the error
+	}{
+		{"bad ports", []ExportACL{{Ports: "0", Users: "ann"}}, "export_acls[0]: invalid port"},
+		{"no ports", []ExportACL{{Users: "ann"}}, "ports is required"},
+		{"no principals", []ExportACL{{Ports: "22", Users: " , "}}, "no users, nodes or tags"},
+		{"bare tag", []ExportACL{{Ports: "22", Users: "ann"}, {Ports: "80", Tags: "ci"}}, "export_acls[1]: tag \"ci\""},
+		{"too many", make([]ExportACL, aclMaxRules+1), "at most 64"},
+	}
+	for _, tt := range tests {
+		_, err := compileACLs(tt.acls)
+		if err == nil || !strings.Contains(err.Error(), tt.want) {
+			t.Errorf("%s: error = %v, want it to contain %q", tt.name, err, tt.want)
+		}
+	}
+
+	table, err := compileACLs(nil)
+	if table != nil || err != nil {
+		t.Errorf("compileACLs(nil) = %v, %v", table, err)
+	}
+	if table.covers(22) {
+		t.Error("nil table covers port 22")
+	}
+}
+
+func TestACLRuleMatches(t *testing.T) {
+	table, err := compileACLs([]ExportACL{
+		{Ports: "22", Users: "Ann@Example.com, bob@example.com"},
+		{Ports: "8000-8100", Nodes: "build, db.tail1234.ts.net"},
+		{Ports: "8080,9000", Tags: "tag:ci"},
+	})
+	if err != nil {
+		t.Fatal(err)
+	}
+	tests := []struct {
+		name string
+		id   peerIdentity
+		mask uint64
+	}{
+		{"user, any case", peerIdentity{user: "ann@example.com"}, 0b001},
+		{"second user", peerIdentity{user: "bob@example.com"}, 0b001},
+		{"unknown user", peerIdentity{user: "eve@example.com"}, 0},
+		{"node by short name", peerIdentity{node: "build.tail1234.ts.net"}, 0b010},
+		{"node by fqdn, any case", peerIdentity{node: "DB.tail1234.ts.net"}, 0b010},
+		{"fqdn entry needs the fqdn", peerIdentity{node: "db.other.ts.net"}, 0},
+		{"tag", peerIdentity{tags: []string{"tag:dev", "tag:ci"}}, 0b100},
+		{"tags are case sensitive", peerIdentity{tags: []string{"tag:CI"}}, 0},
+		{"several rules", peerIdentity{user: "ann@example.com", node: "build", tags: []string{"tag:ci"}}, 0b111},
+		{"empty identity", peerIdentity{}, 0},
+	}
+	for _, tt := range tests {
+		if got := table.match(&tt.id); got != tt.mask {
+			t.Errorf("%s: match = %03b, want %03b", tt.name, got, tt.mask)
+		}
+	}
+}
+
+func TestACLTableAllows(t *testing.T) {
+	table, err := compileACLs([]ExportACL{
+		{Ports: "22", Users: "ann@example.com"},
+		{Ports: "8000-8100", Tags: "tag:ci"},
+		{Ports: "8080", Tags: "tag:dev"},
+	})
+	if err != nil {
+		t.Fatal(err)
+	}
+	tests := []struct {
+		port    uint16
+		covered bool
+		mask    uint64
+		allowed bool
+	}{
+		{22, true, 0b001, true},
+		{22, true, 0b110, false},
+		{8000, true, 0b010, true},
+		{8080, true, 0b100, true},
+		{8081, true, 0b100, false},
+		{8101, false, 0b111, false},
+		{443, false, 0, false},
+	}
+	for _, tt := range tests {
+		if got := table.covers(tt.port); got != tt.covered {
+			t.Errorf("covers(%d) = %v, want %v", tt.port, got, tt.covered)
+		}
+		if got := table.allows(tt.mask, tt.port); got != tt.allowed {
+			t.Errorf("allows(%03b, %d) = %v, want %v", tt.mask, tt.port, got, tt.allowed)
+		}
+	}
+}
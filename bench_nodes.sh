@@ -0,0 +1,105 @@
+#!/bin/bash
+# Aggregate throughput benchmark for multiple tsnet nodes
+#
+# Runs a proxy-only tailproxy with 1, 2, 4 and 8 nodes and downloads BENCH_URL
+# through it with PARALLEL concurrent curls, printing total MB/s per run.
+# Different hosts in BENCH_URLS spread across nodes with -node-balance=hash;
+# a single URL needs -node-balance=least-load (set BENCH_BALANCE).
+
+set -e
+
+if [ ! -f "./tailproxy" ]; then
+    echo "Error: tailproxy not found. Run 'make build' first."
+    exit 1
+fi
+
+# Source .env for authkey if it exists
+if [ -f ".env" ]; then
+    source .env
+fi
+
+if [ -z "$AUTHKEY" ]; then
+    echo "Error: AUTHKEY must be set (or provided in .env); each node authenticates separately."
+    exit 1
+fi
+
+BENCH_URLS="${BENCH_URLS:-$BENCH_URL}"
+if [ -z "$BENCH_URLS" ]; then
+    echo "Usage: BENCH_URL=http://peer:8000/large.bin $0"
+    echo "   or: BENCH_URLS=\"http://a/large.bin http://b/large.bin\" $0"
+    exit 1
+fi
+
+PARALLEL="${PARALLEL:-16}"
+BENCH_BALANCE="${BENCH_BALANCE:-least-load}"
+BENCH_PORT="${BENCH_PORT:-19180}"
+BENCH_HOSTNAME="nodebench-$$"
+EXTRA_FLAGS=""
+if [ -n "$EXIT_NODE" ]; then
+    EXTRA_FLAGS="-exit-node=$EXIT_NODE"
+fi
+
+cleanup() {
+    if [ -n "$PROXY_PID" ]; then
+        kill $PROXY_PID 2>/dev/null || true
+        wait $PROXY_PID 2>/dev/null || true
+    fi
+}
+trap cleanup EXIT
+
+echo "=== TailProxy Node Throughput Benchmark ==="
+echo "URLs: $BENCH_URLS"
+echo "Parallel downloads: $PARALLEL, balance: $BENCH_BALANCE"
+echo
+printf "%-6s %12s %10s %10s\n" "nodes" "bytes" "seconds" "MB/s"
+
+for NODES in 1 2 4 8; do
+    LOG="/tmp/tailproxy-bench-nodes-$NODES.log"
+    ./tailproxy -nodes="$NODES" -node-balance="$BENCH_BALANCE" -hostname="$BENCH_HOSTNAME" \
+        -port="$BENCH_PORT" -authkey="$AUTHKEY" -verbose $EXTRA_FLAGS > "$LOG" 2>&1 &
+    PROXY_PID=$!
+
+    # Wait for the proxy to finish authenticating every node
+    WAITED=0
+    until grep -q "SOCKS5 proxy running" "$LOG" 2>/dev/null; do
+        if ! kill -0 $PROXY_PID 2>/dev/null || [ $WAITED -ge 120 ]; then
+            echo "ERROR: proxy with $NODES nodes did not start; see $LOG"
+            exit 1
+        fi
+        sleep 1
+        WAITED=$((WAITED + 1))
+    done
+
+    # Warm-up request so path discovery is not measured
+    for URL in $BENCH_URLS; do
+        curl -s -o /dev/null --max-time 30 --socks5-hostname "127.0.0.1:$BENCH_PORT" "$URL" || true
+    done
+
+    START=$(date +%s.%N)
+    TOTAL=0
+    PIDS=()
+    for i in $(seq 1 "$PARALLEL"); do
+        URLS=($BENCH_URLS)
+        URL=${URLS[$(( (i - 1) % ${#URLS[@]} ))]}
+        curl -s -o /dev/null -w "%{size_download}\n" --socks5-hostname "127.0.0.1:$BENCH_PORT" "$URL" \
+            > "/tmp/tailproxy-bench-nodes-$NODES-$i.out" &
+        PIDS+=($!)
+    done
+    wait "${PIDS[@]}" || true
+    END=$(date +%s.%N)
+
+    for i in $(seq 1 "$PARALLEL"); do
+        BYTES=$(cat "/tmp/tailproxy-bench-nodes-$NODES-$i.out" 2>/dev/null || echo 0)
+        TOTAL=$((TOTAL + ${BYTES:-0}))
+        rm -f "/tmp/tailproxy-bench-nodes-$NODES-$i.out"
+    done
+
+    awk -v n="$NODES" -v b="$TOTAL" -v s="$START" -v e="$END" \
+        'BEGIN { t = e - s; printf "%-6d %12d %10.2f %10.1f\n", n, b, t, b / t / 1e6 }'
+
+    cleanup
+    PROXY_PID=""
+done
+
+echo
+echo "Per-node logs (with per-node throughput and process CPU): /tmp/tailproxy-bench-nodes-*.log"
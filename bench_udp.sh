@@ -0,0 +1,158 @@
+#!/bin/bash
+# Packet-rate benchmark for exported UDP ports
+#
+# Runs a UDP echo server under tailproxy -export-listeners and sends it
+# datagrams from this host over the tailnet, through the local tailscaled, so
+# this host must be on the same tailnet. For each payload size it sends COUNT
+# datagrams from FLOWS sockets, keeping at most WINDOW per flow unanswered,
+# and prints echoed packets per second and loss.
+
+set -e
+
+if [ ! -f "./tailproxy" ] || [ ! -f "./libtailproxy.so" ]; then
+    echo "Error: tailproxy or libtailproxy.so not found. Run 'make build' first."
+    exit 1
+fi
+if ! command -v tailscale > /dev/null; then
+    echo "Error: the tailscale CLI is needed; this host sends the datagrams over the tailnet."
+    exit 1
+fi
+
+# Source .env for authkey if it exists
+if [ -f ".env" ]; then
+    source .env
+fi
+
+AUTHKEY_FLAG=""
+if [ -n "$AUTHKEY" ]; then
+    AUTHKEY_FLAG="-authkey=$AUTHKEY"
+fi
+
+COUNT="${COUNT:-200000}"
+FLOWS="${FLOWS:-4}"
+WINDOW="${WINDOW:-64}"
+SIZES="${SIZES:-64 512 1200}"
+BENCH_PORT="${BENCH_PORT:-19190}"
+UDP_PORT="${UDP_PORT:-19053}"
+BENCH_HOSTNAME="udpbench-$$"
+LOG="/tmp/tailproxy-bench-udp.log"
+
+cleanup() {
+    if [ -n "$PROXY_PID" ]; then
+        kill $PROXY_PID 2>/dev/null || true
+        wait $PROXY_PID 2>/dev/null || true
+    fi
+}
+trap cleanup EXIT
+
+ECHO_SERVER='
+import socket, sys
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+s.bind(("0.0.0.0", int(sys.argv[1])))
+while True:
+    data, peer = s.recvfrom(65535)
+    s.sendto(data, peer)
+'
+
+./tailproxy -export-listeners -hostname="$BENCH_HOSTNAME" -port="$BENCH_PORT" -verbose $AUTHKEY_FLAG \
+    python3 -c "$ECHO_SERVER" "$UDP_PORT" > "$LOG" 2>&1 &
+PROXY_PID=$!
+
+WAITED=0
+until grep -q "Exporting UDP port $UDP_PORT on tailnet" "$LOG" 2>/dev/null; do
+    if ! kill -0 $PROXY_PID 2>/dev/null || [ $WAITED -ge 120 ]; then
+        echo "ERROR: UDP port was not exported; see $LOG"
+        exit 1
+    fi
+    sleep 1
+    WAITED=$((WAITED + 1))
+done
+
+TARGET=""
+for i in $(seq 1 30); do
+    TARGET=$(tailscale ip -4 "$BENCH_HOSTNAME" 2>/dev/null || true)
+    [ -n "$TARGET" ] && break
+    sleep 1
+done
+if [ -z "$TARGET" ]; then
+    echo "ERROR: $BENCH_HOSTNAME did not appear in this host's netmap"
+    exit 1
+fi
+
+echo "=== TailProxy UDP Export Benchmark ==="
+echo "Target: $TARGET:$UDP_PORT, $COUNT datagrams per size, $FLOWS flows, window $WINDOW"
+echo
+printf "%-6s %10s %10s %12s %8s\n" "bytes" "sent" "echoed" "echoed/s" "loss%"
+
+for SIZE in $SIZES; do
+    python3 - "$TARGET" "$UDP_PORT" "$SIZE" "$COUNT" "$FLOWS" "$WINDOW" <<'EOF'
+import select, socket, sys, time
+
+host, port, size, count, flows, window = sys.argv[1], int(sys.argv[2]), *map(int, sys.argv[3:])
+payload = b"x" * size
+socks = []
+for _ in range(flows):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+    s.connect((host, port))
+    s.setblocking(False)
+    socks.append(s)
+
+# Warm-up so path discovery is not measured
+for s in socks:
+    s.send(payload)
+time.sleep(1)
+for s in socks:
+    try:
+        while s.recv(65535):
+            pass
+    except BlockingIOError:
+        pass
+
+per_flow = count // flows
+sent = [0] * flows
+outstanding = [0] * flows
+echoed = 0
+poller = select.epoll()
+for i, s in enumerate(socks):
+    poller.register(s.fileno(), select.EPOLLIN)
+index = {s.fileno(): i for i, s in enumerate(socks)}
+
+start = time.monotonic()
+last_progress = start
+while True:
+    for i, s in enumerate(socks):
+        while sent[i] < per_flow and outstanding[i] < window:
+            try:
+                s.send(payload)
+            except BlockingIOError:
+                break
+            sent[i] += 1
+            outstanding[i] += 1
+    if all(n == per_flow for n in sent) and sum(outstanding) == 0:
+        break
+    events = poller.poll(0.2)
+    if not events:
+        # Nothing for 200ms: count what is still outstanding as lost
+        if time.monotonic() - last_progress > 0.2:
+            outstanding = [0] * flows
+        continue
+    for fd, _ in events:
+        i = index[fd]
+        try:
+            while socks[i].recv(65535):
+                echoed += 1
+                outstanding[i] = max(0, outstanding[i] - 1)
+        except BlockingIOError:
+            pass
+    last_progress = time.monotonic()
+elapsed = last_progress - start
+
+total = sum(sent)
+print("%-6d %10d %10d %12.0f %8.2f" % (size, total, echoed, echoed / elapsed, 100.0 * (total - echoed) / total))
+EOF
+done
+
+echo
+echo "Per-port flow and batch counters: tailproxy_export_udp_* on -metrics-listen; proxy log: $LOG"
@@ -0,0 +1,208 @@
+package main
+
+import (
+	"context"
+	"errors"
+	"net"
+	"strings"
+	"sync"
+	"syscall"
+	"time"
+)
+
+// SOCKS5 reply codes (RFC 1928 section 6)
+const (
+	socksReplySucceeded           byte = 0x00
+	socksReplyGeneralFailure      byte = 0x01
+	socksReplyNotAllowed          byte = 0x02
+	socksReplyNetworkUnreachable  byte = 0x03
+	socksReplyHostUnreachable     byte = 0x04
+	socksReplyConnectionRefused   byte = 0x05
+	socksReplyTTLExpired          byte = 0x06
+	socksReplyCommandNotSupported byte = 0x07
+	socksReplyAddressNotSupported byte = 0x08
+)
+
+// dialErrorReply maps a dial error to the most specific SOCKS5 reply code.
+// The preload turns these back into ECONNREFUSED, ENETUNREACH, EHOSTUNREACH
+// and ETIMEDOUT for the application.
+func dialErrorReply(err error) byte {
+	switch {
+	case errors.Is(err, syscall.ECONNREFUSED):
+		return socksReplyConnectionRefused
+	case errors.Is(err, syscall.ENETUNREACH):
+		return socksReplyNetworkUnreachable
+	case errors.Is(err, syscall.EHOSTUNREACH):
+		return socksReplyHostUnreachable
+	case errors.Is(err, syscall.ETIMEDOUT), errors.Is(err, context.DeadlineExceeded):
+		return socksReplyTTLExpired
+	}
+
+	var dnsErr *net.DNSError
+	if errors.As(err, &dnsErr) {
+		return socksReplyHostUnreachable
+	}
+	var netErr net.Error
+	if errors.As(err, &netErr) && netErr.Timeout() {
+		return socksReplyTTLExpired
+	}
+
+	// The userspace netstack reports most failures as plain strings
+	msg := strings.ToLower(err.Error())
+	switch {
+	case strings.Contains(msg, "refused"):
+		return socksReplyConnectionRefused
+	case strings.Contains(msg, "network is unreachable"), strings.Contains(msg, "no route to network"):
+		return socksReplyNetworkUnreachable
+	case strings.Contains(msg, "no route"), strings.Contains(msg, "unreachable"), strings.Contains(msg, "no such host"):
+		return socksReplyHostUnreachable
+	case strings.Contains(msg, "timed out"), strings.Contains(msg, "timeout"):
+		return socksReplyTTLExpired
+	}
+	return socksReplyGeneralFailure
+}
+
+type breakerState int
+
+const (
+	breakerClosed breakerState = iota
+	breakerOpen
+	breakerHalfOpen
+)
+
+type breakerEntry struct {
+	state     breakerState
+	failures  int  // consecutive failures
+	reply     byte // reply code of the most recent failure
+	lastFail  time.Time
+	openUntil time.Time
+	cooldown  time.Duration
+}
+
+// dialBreaker fails dials fast for destinations that recently failed.
+//
+// Every failure is remembered for negativeTTL, during which further dials to
+// the same destination are answered immediately with the cached reply code.
+// After threshold consecutive failures the breaker opens for cooldown
+// (doubling on each failed probe, up to maxBreakerCooldown); once that
+// expires, a single dial is let through as a half-open probe while the rest
+// keep failing fast.
+type dialBreaker struct {
+	mu          sync.Mutex
+	entries     map[string]*breakerEntry
+	negativeTTL time.Duration
+	threshold   int
+	cooldown    time.Duration
+}
+
+const (
+	maxBreakerCooldown = 2 * time.Minute
+	breakerSweepSize   = 4096
+)
+
+func newDialBreaker(config *Config) *dialBreaker {
+	b := &dialBreaker{
+		entries:   make(map[string]*breakerEntry),
+		threshold: config.DialBreakerThreshold,
+	}
+	if config.DialNegativeTTLMs > 0 {
+		b.negativeTTL = time.Duration(config.DialNegativeTTLMs) * time.Millisecond
+	}
+	if config.DialBreakerCooldownMs > 0 {
+		b.cooldown = time.Duration(config.DialBreakerCooldownMs) * time.Millisecond
+	}
+	return b
+}
+
+// allow reports whether a dial to target may proceed. If not, it returns the
+// reply code to send to the client instead.
+func (b *dialBreaker) allow(target string) (byte, bool) {
+	b.mu.Lock()
+	defer b.mu.Unlock()
+
+	e, ok := b.entries[target]
+	if !ok {
+		return 0, true
+	}
+
+	now := time.Now()
+	switch e.state {
+	case breakerOpen:
+		if now.Before(e.openUntil) {
+			return e.reply, false
+		}
+		// This caller becomes the probe
+		e.state = breakerHalfOpen
+		return 0, true
+	case breakerHalfOpen:
+		return e.reply, false
+	}
+
+	if b.negativeTTL > 0 && now.Sub(e.lastFail) < b.negativeTTL {
+		return e.reply, false
+	}
+	return 0, true
+}
+
+// record updates the breaker with the outcome of a dial that allow let
+// through. aborted marks dials that ended because the proxy or client gave
+// up, which say nothing about the destination.
+func (b *dialBreaker) record(target string, err error, aborted bool) {
+	b.mu.Lock()
+	defer b.mu.Unlock()
+
+	if err == nil {
+		delete(b.entries, target)
+		return
+	}
+
+	e, ok := b.entries[target]
+	if aborted {
+		if ok && e.state == breakerHalfOpen {
+			// Let the next caller probe instead
+			e.state = breakerOpen
+			e.openUntil = time.Time{}
+		}
+		return
+	}
+
+	now := time.Now()
+	if !ok {
+		if len(b.entries) >= breakerSweepSize {
+			b.sweep(now)
+		}
+		e = &breakerEntry{cooldown: b.cooldown}
+		b.entries[target] = e
+	}
+
+	if e.state == breakerClosed && now.Sub(e.lastFail) > max(b.negativeTTL, b.cooldown) {
+		// Old failures are no longer consecutive
+		e.failures = 0
+	}
+	e.failures++
+	e.reply = dialErrorReply(err)
+	e.lastFail = now
+
+	switch {
+	case e.state == breakerHalfOpen:
+		e.cooldown = min(e.cooldown*2, maxBreakerCooldown)
+		e.state = breakerOpen
+		e.openUntil = now.Add(e.cooldown)
+	case b.threshold > 0 && b.cooldown > 0 && e.failures >= b.threshold:
+		e.state = breakerOpen
+		e.openUntil = now.Add(e.cooldown)
+	}
+}
+
+// sweep drops entries whose failures are too old to matter. Open and
+// half-open entries go too once their own cooldown has passed, so
+// destinations that are never dialed again don't stay forever.
+// Called with b.mu held.
+func (b *dialBreaker) sweep(now time.Time) {
+	horizon := max(b.negativeTTL, b.cooldown)
+	for target, e := range b.entries {
+		if now.Sub(e.lastFail) > max(horizon, e.cooldown) {
+			delete(b.entries, target)
+		}
+	}
+}
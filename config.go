@@ -3,18 +3,78 @@ package main
 import (
 	"encoding/json"
 	"os"
+	"strings"
 )
 
 type Config struct {
-	ExitNode         string `json:"exit_node"`
-	Hostname         string `json:"hostname"`
-	AuthKey          string `json:"authkey"`
-	ProxyPort        int    `json:"proxy_port"`
-	Verbose          bool   `json:"verbose"`
-	ExportListeners  bool   `json:"export_listeners"`
-	ExportAllowPorts string `json:"export_allow_ports"`
-	ExportDenyPorts  string `json:"export_deny_ports"`
-	ExportMax        int    `json:"export_max"`
+	ExitNode         string   `json:"exit_node"`
+	ExitNodes        []string `json:"exit_nodes"`
+	ExitNodeProbeMs  int      `json:"exit_node_probe_ms"`
+	Nodes            int      `json:"nodes"`
+	NodeBalance      string   `json:"node_balance"`
+	Hostname         string   `json:"hostname"`
+	AuthKey          string   `json:"authkey"`
+	ProxyPort        int      `json:"proxy_port"`
+	Verbose          bool     `json:"verbose"`
+	ExportListeners  bool     `json:"export_listeners"`
+	ExportAllowPorts string   `json:"export_allow_ports"`
+	ExportDenyPorts  string   `json:"export_deny_ports"`
+	ExportMax        int      `json:"export_max"`
+	ExportWarmConns  int      `json:"export_warm_conns"` // loopback connections kept open per export
+	ExportInject     bool     `json:"export_inject"`     // pass connections into the app's accept()
+	ExportGraceMs    int      `json:"export_grace_ms"`   // keep a closed port exported this long
+	ExportGraceQueue int      `json:"export_grace_queue"`
+	Bypass           string   `json:"bypass"` // addresses and CIDRs the preload connects to directly
+	MetricsListen    string   `json:"metrics_listen"`
+	TraceFile        string   `json:"trace_file"`
+	TraceSample      float64  `json:"trace_sample"` // fraction of connections traced
+
+	ExportMaxConns      int `json:"export_max_conns"` // concurrent forwards per port, 0 for no limit
+	ExportConnQueue     int `json:"export_conn_queue"`
+	ExportIdleTimeoutMs int `json:"export_idle_timeout_ms"`
+	ExportMaxLifetimeMs int `json:"export_max_lifetime_ms"`
+
+	ExportProxyProtocol string `json:"export_proxy_protocol"` // ports that get a PROXY v2 header
+
+	ExportUDPIdleMs   int    `json:"export_udp_idle_ms"`   // close UDP flows idle this long
+	ExportUDPMaxFlows int    `json:"export_udp_max_flows"` // per exported UDP port
+	ExportUnix        string `json:"export_unix"`          // Unix socket path=port pairs
+
+	DialTimeoutMs         int `json:"dial_timeout_ms"`
+	DialNegativeTTLMs     int `json:"dial_negative_ttl_ms"`
+	DialBreakerThreshold  int `json:"dial_breaker_threshold"`
+	DialBreakerCooldownMs int `json:"dial_breaker_cooldown_ms"`
+	DialStaggerMs         int `json:"dial_stagger_ms"`
+	DialHedgeMs           int `json:"dial_hedge_ms"`
+
+	PreconnectSize        int `json:"preconnect_size"`
+	PreconnectMinConnects int `json:"preconnect_min_connects"`
+	PreconnectTTLMs       int `json:"preconnect_ttl_ms"`
+
+	SchedRateKBps          int    `json:"sched_rate_kbps"`
+	SchedInteractivePorts  string `json:"sched_interactive_ports"`
+	SchedBulkPorts         string `json:"sched_bulk_ports"`
+	SchedBulkKBps          int    `json:"sched_bulk_kbps"`
+	SchedWeightInteractive int    `json:"sched_weight_interactive"`
+	SchedWeightDefault     int    `json:"sched_weight_default"`
+	SchedWeightBulk        int    `json:"sched_weight_bulk"`
+
+	PathWarmMs     int `json:"path_warm_ms"`
+	PathWarmIdleMs int `json:"path_warm_idle_ms"`
+	PathWaitMs     int `json:"path_wait_ms"`
+
+	DrainTimeoutMs   int `json:"drain_timeout_ms"`
+	UpgradeTimeoutMs int `json:"upgrade_timeout_ms"`
+
+	// Rate limits can be changed at runtime by editing the config file and
+	// sending SIGHUP
+	RateLimits []RateLimit `json:"rate_limits"`
+
+	// ExportACLs restrict exported ports to some tailnet peers; reloadable
+	ExportACLs []ExportACL `json:"export_acls"`
+
+	// ProcessNodes pins connections from an executable to a tsnet node index
+	ProcessNodes map[string]int `json:"process_nodes"`
 }
 
 func LoadConfig(path string) (*Config, error) {
@@ -36,7 +96,76 @@ func LoadConfig(path string) (*Config, error) {
 		config.ProxyPort = 1080
 	}
 	if config.ExportMax == 0 {
-		config.ExportMax = 32
+		config.ExportMax = 4096
+	}
+	if config.ExportGraceQueue == 0 {
+		config.ExportGraceQueue = 64
+	}
+	if config.ExportConnQueue == 0 {
+		config.ExportConnQueue = 64
+	}
+	if config.ExportUDPIdleMs == 0 {
+		config.ExportUDPIdleMs = 30000
+	}
+	if config.ExportUDPMaxFlows == 0 {
+		config.ExportUDPMaxFlows = 1024
+	}
+	if config.TraceSample == 0 {
+		config.TraceSample = 0.01
+	}
+	if config.DialTimeoutMs == 0 {
+		config.DialTimeoutMs = 30000
+	}
+	if config.DialNegativeTTLMs == 0 {
+		config.DialNegativeTTLMs = 1000
+	}
+	if config.DialBreakerThreshold == 0 {
+		config.DialBreakerThreshold = 5
+	}
+	if config.DialBreakerCooldownMs == 0 {
+		config.DialBreakerCooldownMs = 5000
+	}
+	if config.DialStaggerMs == 0 {
+		config.DialStaggerMs = 250
+	}
+	if config.Nodes == 0 {
+		config.Nodes = 1
+	}
+	if config.NodeBalance == "" {
+		config.NodeBalance = nodeBalanceHash
+	}
+	if config.ExitNodeProbeMs == 0 {
+		config.ExitNodeProbeMs = 30000
+	}
+	if config.PreconnectMinConnects == 0 {
+		config.PreconnectMinConnects = 20
+	}
+	if config.PreconnectTTLMs == 0 {
+		config.PreconnectTTLMs = 10000
+	}
+	if config.SchedInteractivePorts == "" {
+		config.SchedInteractivePorts = defaultInteractivePorts
+	}
+	if config.SchedBulkKBps == 0 {
+		config.SchedBulkKBps = 1024
+	}
+	if config.SchedWeightInteractive == 0 {
+		config.SchedWeightInteractive = 8
+	}
+	if config.SchedWeightDefault == 0 {
+		config.SchedWeightDefault = 4
+	}
+	if config.SchedWeightBulk == 0 {
+		config.SchedWeightBulk = 1
+	}
+	if config.PathWarmIdleMs == 0 {
+		config.PathWarmIdleMs = 600000
+	}
+	if config.DrainTimeoutMs == 0 {
+		config.DrainTimeoutMs = 30000
+	}
+	if config.UpgradeTimeoutMs == 0 {
+		config.UpgradeTimeoutMs = 120000
 	}
 
 	return &config, nil
@@ -49,3 +178,24 @@ func (c *Config) Save(path string) error {
 	}
 	return os.WriteFile(path, data, 0600)
 }
+
+// exitNodeCandidates returns the configured exit nodes in configuration order.
+// ExitNode may itself be a comma-separated list.
+func (c *Config) exitNodeCandidates() []string {
+	var names []string
+	seen := make(map[string]bool)
+	add := func(name string) {
+		name = strings.TrimSpace(name)
+		if name != "" && !seen[name] {
+			seen[name] = true
+			names = append(names, name)
+		}
+	}
+	for _, name := range strings.Split(c.ExitNode, ",") {
+		add(name)
+	}
+	for _, name := range c.ExitNodes {
+		add(name)
+	}
+	return names
+}
@@ -0,0 +1,228 @@
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Live connection registry.
+//
+// Every proxied and exported connection is registered for its lifetime so
+// the connection table can be read at any time over the control socket
+// (tailproxy -top). Connections are spread over shards by id, so accepts on
+// different goroutines rarely share a lock, and byte counts are atomics the
+// relay updates directly.
+
+const connShards = 32
+
+type connKind uint8
+
+const (
+	connProxy  connKind = iota // SOCKS connection out to the tailnet
+	connExport                 // tailnet connection in to an exported port
+)
+
+func (k connKind) String() string {
+	if k == connExport {
+		return "export"
+	}
+	return "proxy"
+}
+
+// connEntry is one open connection. Only the byte counts change after it is
+// registered.
+type connEntry struct {
+	id         uint64
+	kind       connKind
+	started    time.Time
+	dest       string // host:port dialed, for proxied connections
+	peer       string // tailnet peer, for exports
+	node       string
+	process    string
+	pid        int32
+	exportPort uint16
+
+	bytesUp   atomic.Uint64 // towards the tailnet
+	bytesDown atomic.Uint64 // towards the local side
+}
+
+type connShard struct {
+	mu    sync.Mutex
+	conns map[uint64]*connEntry
+	_     [48]byte // keep shards on separate cache lines
+}
+
+type connRegistry struct {
+	next   atomic.Uint64
+	shards [connShards]connShard
+}
+
+func newConnRegistry() *connRegistry {
+	r := &connRegistry{}
+	for i := range r.shards {
+		r.shards[i].conns = make(map[uint64]*connEntry)
+	}
+	return r
+}
+
+// add registers e under a new id and returns it.
+func (r *connRegistry) add(e *connEntry) *connEntry {
+	e.id = r.next.Add(1)
+	e.started = time.Now()
+	s := &r.shards[e.id%connShards]
+	s.mu.Lock()
+	s.conns[e.id] = e
+	s.mu.Unlock()
+	return e
+}
+
+func (r *connRegistry) remove(e *connEntry) {
+	s := &r.shards[e.id%connShards]
+	s.mu.Lock()
+	delete(s.conns, e.id)
+	s.mu.Unlock()
+}
+
+// count returns the number of open connections of the given kind.
+func (r *connRegistry) count(kind connKind) int {
+	n := 0
+	for i := range r.shards {
+		s := &r.shards[i]
+		s.mu.Lock()
+		for _, e := range s.conns {
+			if e.kind == kind {
+				n++
+			}
+		}
+		s.mu.Unlock()
+	}
+	return n
+}
+
+// connSnapshot is a point-in-time view of one connection.
+type connSnapshot struct {
+	ID         uint64
+	Kind       connKind
+	Started    time.Time
+	Dest       string
+	Peer       string
+	Node       string
+	Process    string
+	PID        int32
+	ExportPort uint16
+	BytesUp    uint64
+	BytesDown  uint64
+}
+
+func (r *connRegistry) snapshot() []connSnapshot {
+	var out []connSnapshot
+	for i := range r.shards {
+		s := &r.shards[i]
+		s.mu.Lock()
+		for _, e := range s.conns {
+			out = append(out, connSnapshot{
+				ID:         e.id,
+				Kind:       e.kind,
+				Started:    e.started,
+				Dest:       e.dest,
+				Peer:       e.peer,
+				Node:       e.node,
+				Process:    e.process,
+				PID:        e.pid,
+				ExportPort: e.exportPort,
+				BytesUp:    e.bytesUp.Load(),
+				BytesDown:  e.bytesDown.Load(),
+			})
+		}
+		s.mu.Unlock()
+	}
+	return out
+}
+
+// Connection table wire format, all integers big-endian:
+//
+//	header: "TPC1" now:int64 count:uint32
+//	entry:  id:uint64 kind:uint8 started:int64 up:uint64 down:uint64
+//	        pid:int32 export_port:uint16 then dest, peer, node and process,
+//	        each as len:uint8 bytes
+//
+// Times are Unix nanoseconds.
+const connTableMagic = "TPC1"
+
+func writeConnTable(w io.Writer, now time.Time, conns []connSnapshot) error {
+	bw := bufio.NewWriter(w)
+	var hdr [16]byte
+	copy(hdr[:4], connTableMagic)
+	binary.BigEndian.PutUint64(hdr[4:], uint64(now.UnixNano()))
+	binary.BigEndian.PutUint32(hdr[12:], uint32(len(conns)))
+	bw.Write(hdr[:])
+
+	var buf [39]byte
+	for i := range conns {
+		c := &conns[i]
+		binary.BigEndian.PutUint64(buf[0:], c.ID)
+		buf[8] = byte(c.Kind)
+		binary.BigEndian.PutUint64(buf[9:], uint64(c.Started.UnixNano()))
+		binary.BigEndian.PutUint64(buf[17:], c.BytesUp)
+		binary.BigEndian.PutUint64(buf[25:], c.BytesDown)
+		binary.BigEndian.PutUint32(buf[33:], uint32(c.PID))
+		binary.BigEndian.PutUint16(buf[37:], c.ExportPort)
+		bw.Write(buf[:])
+		for _, s := range [...]string{c.Dest, c.Peer, c.Node, c.Process} {
+			if len(s) > 255 {
+				s = s[:255]
+			}
+			bw.WriteByte(byte(len(s)))
+			bw.WriteString(s)
+		}
+	}
+	return bw.Flush()
+}
+
+func readConnTable(r io.Reader) (time.Time, []connSnapshot, error) {
+	br := bufio.NewReader(r)
+	var hdr [16]byte
+	if _, err := io.ReadFull(br, hdr[:]); err != nil {
+		return time.Time{}, nil, err
+	}
+	if string(hdr[:4]) != connTableMagic {
+		return time.Time{}, nil, fmt.Errorf("unexpected connection table header %q", hdr[:4])
+	}
+	now := time.Unix(0, int64(binary.BigEndian.Uint64(hdr[4:])))
+	count := binary.BigEndian.Uint32(hdr[12:])
+
+	conns := make([]connSnapshot, 0, min(count, 1<<16))
+	var buf [39]byte
+	for i := uint32(0); i < count; i++ {
+		if _, err := io.ReadFull(br, buf[:]); err != nil {
+			return now, nil, err
+		}
+		c := connSnapshot{
+			ID:         binary.BigEndian.Uint64(buf[0:]),
+			Kind:       connKind(buf[8]),
+			Started:    time.Unix(0, int64(binary.BigEndian.Uint64(buf[9:]))),
+			BytesUp:    binary.BigEndian.Uint64(buf[17:]),
+			BytesDown:  binary.BigEndian.Uint64(buf[25:]),
+			PID:        int32(binary.BigEndian.Uint32(buf[33:])),
+			ExportPort: binary.BigEndian.Uint16(buf[37:]),
+		}
+		for _, s := range [...]*string{&c.Dest, &c.Peer, &c.Node, &c.Process} {
+			n, err := br.ReadByte()
+			if err != nil {
+				return now, nil, err
+			}
+			b := make([]byte, n)
+			if _, err := io.ReadFull(br, b); err != nil {
+				return now, nil, err
+			}
+			*s = string(b)
+		}
+		conns = append(conns, c)
+	}
+	return now, conns, nil
+}
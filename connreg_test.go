@@ -0,0 +1,95 @@
+package main
+
+import (
+	"bytes"
+	"reflect"
+	"strings"
+	"testing"
+	"time"
+)
+
+func TestConnTableRoundTrip(t *testing.T) {
+	started := time.Unix(1700000000, 123456789)
+	long := strings.Repeat("x", 300)
+	tests := []struct {
+		name  string
+		conns []connSnapshot
+		want  []connSnapshot // nil means the same as conns
+	}{
+		{name: "empty", conns: []connSnapshot{}},
+		{
+			name: "proxy and export",
+			conns: []connSnapshot{
+				{ID: 1, Kind: connProxy, Started: started, Dest: "example.com:443", Node: "tailproxy",
+					Process: "curl", PID: 4242, BytesUp: 512, BytesDown: 1 << 40},
+				{ID: 2, Kind: connExport, Started: started.Add(time.Second), Dest: "127.0.0.1:8000",
+					Peer: "100.64.0.7:51234", Node: "tailproxy-1", ExportPort: 8000, BytesUp: 7},
+			},
+		},
+		{
+			name:  "negative pid",
+			conns: []connSnapshot{{ID: 3, Started: started, PID: -1}},
+		},
+		{
+			name:  "long strings are cut at 255 bytes",
+			conns: []connSnapshot{{ID: 4, Started: started, Dest: long, Process: long}},
+			want:  []connSnapshot{{ID: 4, Started: started, Dest: long[:255], Process: long[:255]}},
+		},
+	}
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			now := started.Add(time.Minute)
+			var buf bytes.Buffer
+			if err := writeConnTable(&buf, now, tt.conns); err != nil {
+				t.Fatal(err)
+			}
+			gotNow, got, err := readConnTable(&buf)
+			if err != nil {
+				t.Fatal(err)
+			}
+			if !gotNow.Equal(now) {
+				t.Errorf("now = %v, want %v", gotNow, now)
+			}
+			want := tt.want
+			if want == nil {
+				want = tt.conns
+			}
+			if len(got) != len(want) {
+				t.Fatalf("read %d conns, want %d", len(got), len(want))
+			}
+			for i := range want {
+				// Compare times by instant; the monotonic reading is not sent
+				if !got[i].Started.Equal(want[i].Started) {
+					t.Errorf("conn %d: started %v, want %v", i, got[i].Started, want[i].Started)
+				}
+				got[i].Started, want[i].Started = time.Time{}, time.Time{}
+				if !reflect.DeepEqual(got[i], want[i]) {
+					t.Errorf("conn %d:\n got %+v\nwant %+v", i, got[i], want[i])
+				}
+			}
+		})
+	}
+}
+
+func TestReadConnTableErrors(t *testing.T) {
+	var full bytes.Buffer
+	writeConnTable(&full, time.Unix(1, 0), []connSnapshot{{ID: 1, Dest: "a:1"}})
+
+	tests := []struct {
+		name string
+		data []byte
+	}{
+		{"empty", nil},
+		{"bad magic", append([]byte("NOPE"), full.Bytes()[4:]...)},
+		{"truncated header", full.Bytes()[:10]},
+		{"truncated entry", full.Bytes()[:30]},
+		{"truncated string", full.Bytes()[:full.Len()-1]},
+	}
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			if _, _, err := readConnTable(bytes.NewReader(tt.data)); err == nil {
+				t.Error("no error")
+			}
+		})
+	}
+}
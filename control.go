@@ -0,0 +1,174 @@
+package main
+
+import (
+	"bufio"
+	"context"
+	"errors"
+	"fmt"
+	"log"
+	"net"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"time"
+)
+
+// Control socket.
+//
+// A Unix socket in node 0's state directory, only accessible to its owner.
+// In export mode the preload reports listeners on it with their bound address
+// ("LISTEN tcp4 8000 127.0.0.1:8000", "CLOSE tcp4 8000"), and bound UDP
+// sockets the same way with udp4 and udp6, and Unix socket listeners mapped by
+// export_unix as "LISTEN unix 8000"; "CONNS" returns the live connection table
+// in the binary format of connreg.go and closes, which is what tailproxy -top
+// reads.
+// "RELOAD" reloads the config file like SIGHUP and answers "OK <generation>"
+// or "ERR <reason>".
+
+// startControlSocket starts the Unix socket control server
+func (p *ProxyServer) startControlSocket(ctx context.Context, socketPath string) error {
+	listener, err := p.listenControlSocket(socketPath)
+	if err != nil {
+		return err
+	}
+	p.mu.Lock()
+	p.controlListener = listener
+	p.mu.Unlock()
+
+	if p.config.Verbose {
+		log.Printf("Control socket listening on %s", socketPath)
+	}
+
+	go func() {
+		<-ctx.Done()
+		listener.Close()
+	}()
+
+	// Accept connections in background
+	go func() {
+		for {
+			conn, err := listener.Accept()
+			if err != nil {
+				// Closed on shutdown, or handed to an upgraded process
+				if ctx.Err() != nil || errors.Is(err, net.ErrClosed) {
+					return
+				}
+				if p.config.Verbose {
+					log.Printf("Control socket accept error: %v", err)
+				}
+				continue
+			}
+
+			go p.handleControlConnection(conn)
+		}
+	}()
+
+	return nil
+}
+
+// listenControlSocket creates the control socket, or returns the one
+// inherited from the process this one replaces.
+func (p *ProxyServer) listenControlSocket(socketPath string) (*net.UnixListener, error) {
+	if p.handoff != nil {
+		return p.handoff.control, nil
+	}
+
+	// Remove existing socket if it exists
+	os.Remove(socketPath)
+
+	// Ensure directory exists
+	dir := filepath.Dir(socketPath)
+	if err := os.MkdirAll(dir, 0700); err != nil {
+		return nil, fmt.Errorf("failed to create control socket directory: %w", err)
+	}
+
+	// Create Unix domain socket listener
+	listener, err := net.ListenUnix("unix", &net.UnixAddr{Name: socketPath, Net: "unix"})
+	if err != nil {
+		return nil, fmt.Errorf("failed to create control socket: %w", err)
+	}
+
+	// Set permissions
+	if err := os.Chmod(socketPath, 0600); err != nil {
+		listener.Close()
+		return nil, fmt.Errorf("failed to set socket permissions: %w", err)
+	}
+	return listener, nil
+}
+
+func (p *ProxyServer) handleControlConnection(conn net.Conn) {
+	defer conn.Close()
+
+	scanner := bufio.NewScanner(conn)
+	for scanner.Scan() {
+		line := strings.TrimSpace(scanner.Text())
+		if line == "" {
+			continue
+		}
+
+		if line == "RELOAD" {
+			if gen, err := p.ReloadConfig(); err != nil {
+				log.Printf("Failed to reload config: %v", err)
+				fmt.Fprintf(conn, "ERR %v\n", err)
+			} else {
+				fmt.Fprintf(conn, "OK %d\n", gen)
+			}
+			continue
+		}
+
+		if line == "CONNS" {
+			conn.SetWriteDeadline(time.Now().Add(5 * time.Second))
+			if err := writeConnTable(conn, time.Now(), p.conns.snapshot()); err != nil && p.config.Verbose {
+				log.Printf("Failed to send connection table: %v", err)
+			}
+			return
+		}
+
+		parts := strings.Fields(line)
+		if len(parts) < 3 {
+			if p.config.Verbose {
+				log.Printf("Invalid control message: %s", line)
+			}
+			continue
+		}
+
+		cmd := parts[0]
+		family := parts[1] // tcp4, tcp6, udp4, udp6 or unix
+		portStr := parts[2]
+		addr := "" // bound address, sent by newer preloads
+		if len(parts) > 3 {
+			addr = parts[3]
+		}
+
+		port, err := strconv.Atoi(portStr)
+		if err != nil {
+			if p.config.Verbose {
+				log.Printf("Invalid port in control message: %s", portStr)
+			}
+			continue
+		}
+
+		em := p.exporterManager
+		switch {
+		case em == nil:
+			if p.config.Verbose {
+				log.Printf("Ignoring %s for port %d: export listeners disabled", cmd, port)
+			}
+		case cmd == "LISTEN" && family == "unix":
+			em.handleListenUnix(port, addr)
+		case cmd == "LISTEN" && strings.HasPrefix(family, "udp"):
+			em.handleListenUDP(port, exportLocalAddr(family, addr, port))
+		case cmd == "CLOSE" && strings.HasPrefix(family, "udp"):
+			em.handleCloseUDP(port)
+		case cmd == "LISTEN":
+			em.handleListen(port, exportLocalAddr(family, addr, port))
+		case cmd == "CLOSE":
+			em.handleClose(port)
+		default:
+			if p.config.Verbose {
+				log.Printf("Unknown control command: %s", cmd)
+			}
+		}
+	}
+}
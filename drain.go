@@ -0,0 +1,271 @@
+package main
+
+import (
+	"context"
+	"fmt"
+	"io"
+	"log"
+	"net"
+	"os"
+	"os/exec"
+	"sort"
+	"strconv"
+	"strings"
+	"time"
+)
+
+// Graceful drain and hot upgrade.
+//
+// Draining stops accepting SOCKS and exported connections and waits up to a
+// deadline for the ones in flight to finish, then logs the connections it
+// had to cut.
+//
+// On SIGUSR2 a proxy-only tailproxy starts a new copy of its executable with
+// the same arguments. The copy inherits the SOCKS and control listening
+// sockets as extra files, so the sockets never close and connects are never
+// refused. It brings up its own tsnet nodes and reports readiness on a pipe.
+// The old process then drains and exits, while the new one takes over new
+// connections. Two processes cannot run the same tsnet node at once, so the
+// new process uses the other of two state slots: the usual state directory
+// and a "slot-b" directory inside it. The slot-b node is ephemeral, so it is
+// removed from the tailnet once it goes offline, and the next upgrade returns
+// to the usual node with its name and address. Registering it needs an auth
+// key; there is no one to complete an interactive login within the upgrade
+// timeout, so upgrading into slot-b without one is refused.
+
+const (
+	envUpgradeFDs = "TAILPROXY_UPGRADE_FDS" // "socks,control,ready" fd numbers
+	envStateSlot  = "TAILPROXY_STATE_SLOT"  // "" or "b"
+
+	drainPollInterval = 50 * time.Millisecond
+	drainReportMax    = 20 // cut connections listed individually
+)
+
+// upgradeHandoff holds what a new process inherited from the one it replaces.
+type upgradeHandoff struct {
+	socks   net.Listener
+	control *net.UnixListener
+	ready   *os.File
+}
+
+// takeUpgradeHandoff adopts the listeners passed by an upgrading parent, if
+// any, and clears the variable so commands run by this process do not see it.
+func takeUpgradeHandoff() (*upgradeHandoff, error) {
+	spec := os.Getenv(envUpgradeFDs)
+	if spec == "" {
+		return nil, nil
+	}
+	os.Unsetenv(envUpgradeFDs)
+
+	var fds [3]int
+	parts := strings.Split(spec, ",")
+	if len(parts) != len(fds) {
+		return nil, fmt.Errorf("invalid %s %q", envUpgradeFDs, spec)
+	}
+	for i, part := range parts {
+		fd, err := strconv.Atoi(part)
+		if err != nil {
+			return nil, fmt.Errorf("invalid %s %q", envUpgradeFDs, spec)
+		}
+		fds[i] = fd
+	}
+
+	h := &upgradeHandoff{ready: os.NewFile(uintptr(fds[2]), "upgrade-ready")}
+	for i, name := range []string{"socks", "control"} {
+		f := os.NewFile(uintptr(fds[i]), "upgrade-"+name)
+		l, err := net.FileListener(f)
+		f.Close()
+		if err != nil {
+			return nil, fmt.Errorf("failed to inherit %s listener: %w", name, err)
+		}
+		if i == 0 {
+			h.socks = l
+		} else {
+			ul, ok := l.(*net.UnixListener)
+			if !ok {
+				l.Close()
+				return nil, fmt.Errorf("inherited control listener is not a Unix socket")
+			}
+			// The parent still serves on the socket path until this
+			// process is ready, so leave it in place if startup fails
+			ul.SetUnlinkOnClose(false)
+			h.control = ul
+		}
+	}
+	return h, nil
+}
+
+// signalReady tells the parent this process is accepting connections.
+func (h *upgradeHandoff) signalReady() {
+	if h == nil || h.ready == nil {
+		return
+	}
+	h.control.SetUnlinkOnClose(true)
+	io.WriteString(h.ready, "ready\n")
+	h.ready.Close()
+	h.ready = nil
+}
+
+// nextStateSlot is the state slot an upgraded process should use.
+func nextStateSlot() string {
+	if os.Getenv(envStateSlot) == "" {
+		return "b"
+	}
+	return ""
+}
+
+// Upgrade starts a new copy of the running executable on the current
+// listeners and waits until it is accepting connections. The caller should
+// then drain and exit.
+func (p *ProxyServer) Upgrade(timeout time.Duration) error {
+	p.mu.Lock()
+	socks, ok := p.listener.(*net.TCPListener)
+	control := p.controlListener
+	p.mu.Unlock()
+	if !ok || control == nil {
+		return fmt.Errorf("listeners are not ready")
+	}
+	slot := nextStateSlot()
+	if slot != "" && p.config.AuthKey == "" {
+		return fmt.Errorf("no auth key to register the slot-%s node with", slot)
+	}
+	socksFile, err := socks.File()
+	if err != nil {
+		return fmt.Errorf("failed to pass SOCKS listener: %w", err)
+	}
+	defer socksFile.Close()
+	controlFile, err := control.File()
+	if err != nil {
+		return fmt.Errorf("failed to pass control listener: %w", err)
+	}
+	defer controlFile.Close()
+	readyR, readyW, err := os.Pipe()
+	if err != nil {
+		return err
+	}
+	defer readyR.Close()
+
+	exe, err := os.Executable()
+	if err != nil {
+		return fmt.Errorf("failed to find executable: %w", err)
+	}
+	cmd := exec.Command(exe, os.Args[1:]...)
+	cmd.Stdout = os.Stdout
+	cmd.Stderr = os.Stderr
+	// ExtraFiles start at fd 3
+	cmd.ExtraFiles = []*os.File{socksFile, controlFile, readyW}
+	for _, kv := range os.Environ() {
+		if !strings.HasPrefix(kv, envUpgradeFDs+"=") && !strings.HasPrefix(kv, envStateSlot+"=") {
+			cmd.Env = append(cmd.Env, kv)
+		}
+	}
+	cmd.Env = append(cmd.Env, envUpgradeFDs+"=3,4,5")
+	if slot != "" {
+		cmd.Env = append(cmd.Env, envStateSlot+"="+slot)
+	}
+	if err := cmd.Start(); err != nil {
+		readyW.Close()
+		return fmt.Errorf("failed to start %s: %w", exe, err)
+	}
+	readyW.Close()
+	log.Printf("Started upgraded tailproxy (pid %d), waiting for it to be ready", cmd.Process.Pid)
+
+	ready := make(chan error, 1)
+	go func() {
+		buf := make([]byte, 16)
+		n, err := readyR.Read(buf)
+		if n > 0 {
+			err = nil
+		} else if err == io.EOF {
+			err = fmt.Errorf("exited before it was ready")
+		}
+		ready <- err
+	}()
+
+	select {
+	case err = <-ready:
+	case <-time.After(timeout):
+		err = fmt.Errorf("not ready after %v", timeout)
+	}
+	if err != nil {
+		cmd.Process.Kill()
+		cmd.Wait()
+		return fmt.Errorf("upgraded process %d: %w", cmd.Process.Pid, err)
+	}
+	cmd.Process.Release()
+	log.Printf("Upgraded tailproxy (pid %d) is accepting connections", cmd.Process.Pid)
+	return nil
+}
+
+// Drain stops accepting connections and waits for the ones in flight to
+// finish, until timeout or ctx is done. It logs the connections still open
+// at that point, which the caller then cuts by shutting down. With handoff
+// set the control socket is handed to an upgraded process rather than
+// removed.
+func (p *ProxyServer) Drain(ctx context.Context, timeout time.Duration, handoff bool) {
+	p.draining.Store(true)
+	p.mu.Lock()
+	listener, control, inject := p.listener, p.controlListener, p.injectListener
+	p.mu.Unlock()
+	if listener != nil {
+		listener.Close()
+	}
+	if handoff && control != nil {
+		control.SetUnlinkOnClose(false)
+		control.Close()
+	}
+	if handoff && inject != nil {
+		// The upgraded process has bound its own inject socket at the path
+		inject.SetUnlinkOnClose(false)
+		inject.Close()
+	}
+	if p.exporterManager != nil {
+		p.exporterManager.Stop()
+	}
+
+	start := time.Now()
+	active := p.inflight.Load() + int64(p.conns.count(connExport))
+	log.Printf("Draining %d connections (up to %v)", active, timeout)
+
+	deadline := time.NewTimer(timeout)
+	defer deadline.Stop()
+	ticker := time.NewTicker(drainPollInterval)
+	defer ticker.Stop()
+	for p.inflight.Load() > 0 || p.conns.count(connExport) > 0 {
+		select {
+		case <-ctx.Done():
+		case <-deadline.C:
+		case <-ticker.C:
+			continue
+		}
+		break
+	}
+
+	open := p.conns.snapshot()
+	pending := p.inflight.Load() - int64(p.conns.count(connProxy))
+	if len(open) == 0 && pending <= 0 {
+		log.Printf("Drained all connections in %v", time.Since(start).Round(time.Millisecond))
+		return
+	}
+
+	sort.Slice(open, func(i, j int) bool { return open[i].Started.Before(open[j].Started) })
+	log.Printf("Drain ended after %v; cutting %d relaying connections and %d still in handshake or dial",
+		time.Since(start).Round(time.Millisecond), len(open), max(pending, 0))
+	now := time.Now()
+	for i, c := range open {
+		if i == drainReportMax {
+			log.Printf("  ... and %d more", len(open)-i)
+			break
+		}
+		dest := c.Dest
+		if c.Kind == connExport {
+			dest = fmt.Sprintf("%s -> :%d", c.Peer, c.ExportPort)
+		}
+		process := c.Process
+		if c.PID != 0 {
+			process = fmt.Sprintf("%s[%d]", c.Process, c.PID)
+		}
+		log.Printf("  cut %s %s process=%s age=%v up=%d down=%d",
+			c.Kind, dest, process, now.Sub(c.Started).Round(time.Second), c.BytesUp, c.BytesDown)
+	}
+}
@@ -0,0 +1,488 @@
+package main
+
+import (
+	"context"
+	"fmt"
+	"hash/fnv"
+	"log"
+	"net/netip"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"tailscale.com/client/tailscale"
+	"tailscale.com/ipn"
+	"tailscale.com/tailcfg"
+)
+
+// Exit node selection.
+//
+// The configured candidates are resolved against the node's peer index and
+// probed periodically with disco pings for latency and path type (direct or
+// DERP-relayed). A tsnet node carries a single exit-node pref, so the
+// selector keeps one active exit per node: among the candidates whose probe
+// is within tolerance of the best one, it picks by rendezvous hash of the
+// node's affinity key, which keeps the choice stable while latencies
+// fluctuate. The active exit is only replaced when it stops answering or
+// goes offline, so established sessions are not moved needlessly.
+
+const (
+	exitProbeTimeout   = 5 * time.Second
+	exitProbeFailLimit = 2                     // consecutive failed probes before failover
+	exitRelayPenalty   = 50 * time.Millisecond // DERP paths rank behind direct ones
+	exitTolerance      = 1.5                   // latency factor within which candidates are equivalent
+	exitToleranceSlack = 10 * time.Millisecond
+)
+
+type exitCandidate struct {
+	name string
+
+	// Guarded by exitSelector.mu
+	id       tailcfg.StableNodeID
+	ip       netip.Addr
+	online   bool
+	probed   bool
+	latency  time.Duration
+	direct   bool
+	derp     string
+	failures int // consecutive failed probes
+
+	conns atomic.Uint64 // connections carried while active
+}
+
+// exitStatus is a point-in-time view of one candidate.
+type exitStatus struct {
+	Name    string
+	IP      netip.Addr
+	Online  bool
+	Active  bool
+	Latency time.Duration
+	Direct  bool
+	DERP    string
+	Conns   uint64
+}
+
+type exitSelector struct {
+	config   *Config
+	key      string // affinity key of the tsnet node this selector drives
+	interval time.Duration
+
+	ctx   context.Context
+	lc    *tailscale.LocalClient
+	peers *peerMonitor
+
+	mu         sync.Mutex
+	candidates []*exitCandidate
+	active     *exitCandidate
+	looping    bool
+
+	reselectMu sync.Mutex // serializes reselections after reloads
+}
+
+func newExitSelector(config *Config, key string) *exitSelector {
+	s := &exitSelector{
+		config:   config,
+		key:      key,
+		interval: time.Duration(config.ExitNodeProbeMs) * time.Millisecond,
+	}
+	for _, name := range config.exitNodeCandidates() {
+		s.candidates = append(s.candidates, &exitCandidate{name: name})
+	}
+	return s
+}
+
+func (s *exitSelector) enabled() bool {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	return len(s.candidates) > 0
+}
+
+// start resolves and probes the candidates, activates the best one and keeps
+// probing in the background until ctx is done.
+func (s *exitSelector) start(ctx context.Context, lc *tailscale.LocalClient, peers *peerMonitor) error {
+	s.mu.Lock()
+	s.ctx = ctx
+	s.lc = lc
+	s.peers = peers
+	s.mu.Unlock()
+	if !s.enabled() {
+		return nil
+	}
+
+	s.resolve()
+	s.probe(ctx)
+
+	best := s.choose()
+	if best == nil {
+		// Probes can fail for reasons unrelated to routing; an online peer
+		// is still worth trying, as before probing existed
+		best = s.firstOnline()
+	}
+	if best == nil {
+		return fmt.Errorf("no usable exit node among %q (are they online and in your tailnet?)", s.names())
+	}
+	if err := s.activate(ctx, best); err != nil {
+		return err
+	}
+
+	s.mu.Lock()
+	s.startLoopLocked()
+	s.mu.Unlock()
+	return nil
+}
+
+// startLoopLocked starts background probing if it is not running. Called
+// with s.mu held.
+func (s *exitSelector) startLoopLocked() {
+	if s.interval > 0 && !s.looping {
+		s.looping = true
+		go s.loop(s.ctx)
+	}
+}
+
+// reload replaces the candidate list. Candidates that remain keep their
+// probe state, and an active exit that remains stays active. Otherwise a new
+// exit is selected in the background, or the exit node is cleared when no
+// candidates are left.
+func (s *exitSelector) reload(names []string) {
+	s.mu.Lock()
+	old := make(map[string]*exitCandidate, len(s.candidates))
+	for _, c := range s.candidates {
+		old[c.name] = c
+	}
+	candidates := make([]*exitCandidate, 0, len(names))
+	kept := false
+	for _, name := range names {
+		c := old[name]
+		if c == nil {
+			c = &exitCandidate{name: name}
+		}
+		kept = kept || c == s.active
+		candidates = append(candidates, c)
+	}
+	s.candidates = candidates
+	unchanged := kept || (s.active == nil && len(candidates) == 0)
+	started := s.ctx != nil
+	s.mu.Unlock()
+
+	if started && !unchanged {
+		go s.reselect()
+	}
+}
+
+func (s *exitSelector) reselect() {
+	s.reselectMu.Lock()
+	defer s.reselectMu.Unlock()
+	ctx := s.ctx
+
+	if !s.enabled() {
+		prefs := &ipn.MaskedPrefs{ExitNodeIPSet: true}
+		if _, err := s.lc.EditPrefs(ctx, prefs); err != nil {
+			log.Printf("Failed to clear exit node of %s: %v", s.key, err)
+			return
+		}
+		s.mu.Lock()
+		s.active = nil
+		s.mu.Unlock()
+		s.peers.setExit(netip.Addr{})
+		log.Printf("Exit node of %s cleared", s.key)
+		return
+	}
+
+	s.resolve()
+	s.probe(ctx)
+	best := s.choose()
+	if best == nil {
+		best = s.firstOnline()
+	}
+	if best == nil {
+		log.Printf("No usable exit node among %q, keeping %q", s.names(), s.current())
+		return
+	}
+	if err := s.activate(ctx, best); err != nil {
+		log.Printf("Failed to switch exit node of %s to %s: %v", s.key, best.name, err)
+		return
+	}
+	log.Printf("Exit node of %s is now %s", s.key, best.name)
+
+	s.mu.Lock()
+	s.startLoopLocked()
+	s.mu.Unlock()
+}
+
+func (s *exitSelector) loop(ctx context.Context) {
+	ticker := time.NewTicker(s.interval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-ctx.Done():
+			return
+		case <-ticker.C:
+		}
+
+		if !s.enabled() {
+			continue // cleared by a reload
+		}
+		s.resolve()
+		s.probe(ctx)
+
+		s.mu.Lock()
+		active := s.active
+		healthy := active != nil && active.online && active.failures < exitProbeFailLimit
+		s.mu.Unlock()
+		if healthy {
+			continue
+		}
+
+		next := s.choose()
+		if next == nil || next == active {
+			log.Printf("Exit node %s is unavailable and no other candidate is usable", s.current())
+			continue
+		}
+		log.Printf("Exit node %s is unavailable, failing over to %s", s.current(), next.name)
+		if err := s.activate(ctx, next); err != nil {
+			log.Printf("Failover to exit node %s failed: %v", next.name, err)
+		}
+	}
+}
+
+// resolve maps candidate names to peers in the tailnet.
+func (s *exitSelector) resolve() {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	for _, c := range s.candidates {
+		c.ip = netip.Addr{}
+		c.online = false
+		if peer := s.peers.lookup(c.name); peer != nil {
+			c.id = peer.id
+			c.ip = peer.ips[0]
+			c.online = peer.online
+		}
+	}
+}
+
+// probe pings every resolved candidate concurrently.
+func (s *exitSelector) probe(ctx context.Context) {
+	s.mu.Lock()
+	type target struct {
+		c  *exitCandidate
+		ip netip.Addr
+	}
+	var targets []target
+	for _, c := range s.candidates {
+		if c.ip.IsValid() && c.online {
+			targets = append(targets, target{c, c.ip})
+		} else {
+			c.failures++
+		}
+	}
+	s.mu.Unlock()
+
+	var wg sync.WaitGroup
+	for _, t := range targets {
+		wg.Add(1)
+		go func(c *exitCandidate, ip netip.Addr) {
+			defer wg.Done()
+			pctx, cancel := context.WithTimeout(ctx, exitProbeTimeout)
+			res, err := s.lc.Ping(pctx, ip, tailcfg.PingDisco)
+			cancel()
+
+			s.mu.Lock()
+			defer s.mu.Unlock()
+			if err == nil && res.Err != "" {
+				err = fmt.Errorf("%s", res.Err)
+			}
+			if err != nil {
+				c.failures++
+				if s.config.Verbose {
+					log.Printf("Exit node %s probe failed: %v", c.name, err)
+				}
+				return
+			}
+			c.failures = 0
+			c.probed = true
+			c.latency = time.Duration(res.LatencySeconds * float64(time.Second))
+			c.direct = res.Endpoint != ""
+			c.derp = res.DERPRegionCode
+			if s.config.Verbose {
+				log.Printf("Exit node %s: latency=%v direct=%v derp=%q", c.name, c.latency, c.direct, c.derp)
+			}
+		}(t.c, t.ip)
+	}
+	wg.Wait()
+}
+
+func (s *exitSelector) firstOnline() *exitCandidate {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	for _, c := range s.candidates {
+		if c.online && c.ip.IsValid() {
+			return c
+		}
+	}
+	return nil
+}
+
+// rank is the probe latency with relayed paths penalised.
+func (c *exitCandidate) rank() time.Duration {
+	if c.direct {
+		return c.latency
+	}
+	return c.latency + exitRelayPenalty
+}
+
+// choose picks the candidate for this node among the healthy ones.
+func (s *exitSelector) choose() *exitCandidate {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	return s.pickLocked(s.key)
+}
+
+// pickLocked returns the candidate that key has affinity to among those
+// within tolerance of the best probe. Called with s.mu held.
+func (s *exitSelector) pickLocked(key string) *exitCandidate {
+	var healthy []*exitCandidate
+	var best time.Duration
+	for _, c := range s.candidates {
+		if !c.online || !c.probed || c.failures >= exitProbeFailLimit {
+			continue
+		}
+		healthy = append(healthy, c)
+		if len(healthy) == 1 || c.rank() < best {
+			best = c.rank()
+		}
+	}
+
+	limit := time.Duration(float64(best)*exitTolerance) + exitToleranceSlack
+	var chosen *exitCandidate
+	var chosenScore uint64
+	for _, c := range healthy {
+		if c.rank() > limit {
+			continue
+		}
+		if score := rendezvousScore(key, c.name); chosen == nil || score > chosenScore {
+			chosen, chosenScore = c, score
+		}
+	}
+	return chosen
+}
+
+// rendezvousScore is the highest-random-weight hash of key for a candidate.
+func rendezvousScore(key, name string) uint64 {
+	h := fnv.New64a()
+	h.Write([]byte(key))
+	h.Write([]byte{0})
+	h.Write([]byte(name))
+	return h.Sum64()
+}
+
+// activate points the node's exit-node pref at c and verifies it took effect.
+func (s *exitSelector) activate(ctx context.Context, c *exitCandidate) error {
+	s.mu.Lock()
+	ip, id := c.ip, c.id
+	s.mu.Unlock()
+
+	if s.config.Verbose {
+		log.Printf("Setting exit node to %s (IP: %s)", c.name, ip)
+	}
+
+	prefs := &ipn.MaskedPrefs{
+		Prefs: ipn.Prefs{
+			ExitNodeIP: ip,
+		},
+		ExitNodeIPSet: true,
+	}
+	if _, err := s.lc.EditPrefs(ctx, prefs); err != nil {
+		return fmt.Errorf("failed to set exit node: %w", err)
+	}
+
+	// Verify the exit node is actually active
+	time.Sleep(500 * time.Millisecond) // Give it a moment to apply
+	status, err := s.lc.Status(ctx)
+	if err != nil {
+		return fmt.Errorf("failed to verify exit node status: %w", err)
+	}
+	if status.ExitNodeStatus == nil {
+		return fmt.Errorf("exit node configuration failed: exit node not active")
+	}
+	if status.ExitNodeStatus.ID != id {
+		return fmt.Errorf("exit node configuration failed: expected %s, got a different exit node", c.name)
+	}
+	if !status.ExitNodeStatus.Online {
+		return fmt.Errorf("exit node %q became offline during configuration", c.name)
+	}
+
+	s.mu.Lock()
+	s.active = c
+	s.mu.Unlock()
+	s.peers.setExit(ip)
+
+	if s.config.Verbose {
+		log.Printf("Exit node %s verified and active", c.name)
+	}
+	return nil
+}
+
+// current returns the name of the active exit node, or "" if none.
+func (s *exitSelector) current() string {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if s.active == nil {
+		return ""
+	}
+	return s.active.name
+}
+
+// recordConn attributes a new connection to the active exit node and
+// returns its name.
+func (s *exitSelector) recordConn() string {
+	s.mu.Lock()
+	active := s.active
+	s.mu.Unlock()
+	if active == nil {
+		return ""
+	}
+	active.conns.Add(1)
+	return active.name
+}
+
+func (s *exitSelector) names() []string {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	names := make([]string, len(s.candidates))
+	for i, c := range s.candidates {
+		names[i] = c.name
+	}
+	return names
+}
+
+// snapshot returns the state of every candidate.
+func (s *exitSelector) snapshot() []exitStatus {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	out := make([]exitStatus, len(s.candidates))
+	for i, c := range s.candidates {
+		out[i] = exitStatus{
+			Name:    c.name,
+			IP:      c.ip,
+			Online:  c.online,
+			Active:  c == s.active,
+			Latency: c.latency,
+			Direct:  c.direct,
+			DERP:    c.derp,
+			Conns:   c.conns.Load(),
+		}
+	}
+	return out
+}
+
+func (s *exitSelector) logSummary() {
+	for _, st := range s.snapshot() {
+		path := "direct"
+		if !st.Direct {
+			path = "derp:" + st.DERP
+		}
+		log.Printf("Exit node %s: active=%v online=%v latency=%v path=%s conns=%d",
+			st.Name, st.Active, st.Online, st.Latency, path, st.Conns)
+	}
+}
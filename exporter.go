@@ -1,165 +1,192 @@
 package main
 
 import (
-	"bufio"
 	"context"
 	"fmt"
-	"io"
 	"log"
 	"net"
-	"os"
-	"path/filepath"
+	"net/netip"
+	"runtime/pprof"
 	"strconv"
 	"strings"
 	"sync"
+	"sync/atomic"
+	"time"
 
 	"tailscale.com/tsnet"
 )
 
-// ExporterManager manages port exports over tsnet
+// ExporterManager manages port exports over tsnet.
+//
+// Exports share one fallback TCP handler registered with node 0's netstack
+// rather than a tsnet listener each. The handler looks the destination port
+// up in a table of atomic pointers, so exporting or unexporting a port is a
+// single store and incoming flows never take a lock. Flows to ports that are
+// not exported are refused.
+//
+// With export_max_conns set, a port forwards at most that many connections
+// at once. Further connections wait in a queue of export_conn_queue for up
+// to exportQueueTimeout. Once the queue is full, new flows are refused in the
+// netstack before their handshake completes, so a burst against a slow app
+// costs neither goroutines nor buffers.
 type ExporterManager struct {
-	config    *Config
-	server    *tsnet.Server
-	mu        sync.Mutex
-	exporters map[int]*portExporter // port -> exporter
-	ctx       context.Context
-	cancel    context.CancelFunc
+	config     *Config
+	server     *tsnet.Server
+	limits     *rateLimiter
+	conns      *connRegistry
+	policy     atomic.Pointer[exportPolicy]
+	ports      [65536]atomic.Pointer[portExporter] // written with mu held
+	unregister func()
+	injectors  *injectTable // nil unless export_inject is set
+	whois      *whoisCache
+	acls       *aclCache
+	mu         sync.Mutex
+	exporters  map[int]*portExporter // port -> exporter
+	stats      map[int]*exportPortStats
+	udp        map[int]*udpExporter // port -> UDP exporter (udpexport.go)
+	udpStats   map[int]*udpPortStats
+	unix       map[int]string // export_unix as of startup (unixexport.go)
+	ctx        context.Context
+	cancel     context.CancelFunc
 }
 
 type portExporter struct {
-	port      int
-	listener  net.Listener
-	refcount  int
-	ctx       context.Context
-	cancel    context.CancelFunc
-	wg        sync.WaitGroup
+	port     int
+	refcount int
+	ctx      context.Context
+	cancel   context.CancelFunc
+	st       *exportPortStats
+	handle   func(net.Conn)               // passed to the netstack for each flow
+	local    atomic.Pointer[string]       // address the local listener is bound to
+	warm     atomic.Pointer[loopbackPool] // nil unless export_warm_conns is set and local is TCP
+	grace    *time.Timer                  // pending unexport after the last CLOSE; em.mu
+	waiting  atomic.Int32                 // connections waiting for the listener
 }
 
+const (
+	exportRetryMin     = 5 * time.Millisecond
+	exportRetryMax     = 200 * time.Millisecond
+	exportQueueTimeout = 10 * time.Second
+)
+
 // NewExporterManager creates a new exporter manager
-func NewExporterManager(config *Config, server *tsnet.Server) *ExporterManager {
+func NewExporterManager(config *Config, node *tsnetNode, limits *rateLimiter, conns *connRegistry, policy *exportPolicy) *ExporterManager {
 	ctx, cancel := context.WithCancel(context.Background())
-	return &ExporterManager{
+	em := &ExporterManager{
 		config:    config,
-		server:    server,
+		server:    node.server,
+		whois:     newWhoisCache(node),
+		limits:    limits,
+		conns:     conns,
 		exporters: make(map[int]*portExporter),
+		stats:     make(map[int]*exportPortStats),
+		udp:       make(map[int]*udpExporter),
+		udpStats:  make(map[int]*udpPortStats),
 		ctx:       ctx,
 		cancel:    cancel,
 	}
-}
-
-// StartControlSocket starts the Unix socket control server
-func (em *ExporterManager) StartControlSocket(socketPath string) error {
-	// Remove existing socket if it exists
-	os.Remove(socketPath)
-
-	// Ensure directory exists
-	dir := filepath.Dir(socketPath)
-	if err := os.MkdirAll(dir, 0700); err != nil {
-		return fmt.Errorf("failed to create control socket directory: %w", err)
+	if config.ExportInject {
+		em.injectors = newInjectTable()
 	}
+	em.acls = newACLCache(em.whois)
+	em.unix = policy.unix
+	em.policy.Store(policy)
+	em.unregister = node.server.RegisterFallbackTCPHandler(em.route)
+	return em
+}
 
-	// Create Unix domain socket listener
-	listener, err := net.Listen("unix", socketPath)
-	if err != nil {
-		return fmt.Errorf("failed to create control socket: %w", err)
+// route is the netstack's fallback TCP handler. It claims flows to exported
+// ports that export_acls admits the peer to; the netstack refuses the rest.
+func (em *ExporterManager) route(src, dst netip.AddrPort) (handler func(net.Conn), intercept bool) {
+	exp := em.ports[dst.Port()].Load()
+	if exp == nil {
+		return nil, false
 	}
-
-	// Set permissions
-	if err := os.Chmod(socketPath, 0600); err != nil {
-		listener.Close()
-		return fmt.Errorf("failed to set socket permissions: %w", err)
+	if acl := em.policy.Load().acl; acl.covers(dst.Port()) && !em.acls.allows(em.ctx, acl, src.Addr(), dst.Port()) {
+		exp.st.denied.Add(1)
+		return nil, false
 	}
-
-	if em.config.Verbose {
-		log.Printf("Control socket listening on %s", socketPath)
+	if exp.st.saturated(em.config.ExportConnQueue) {
+		// Refused before the handshake rather than accepted and closed
+		exp.st.rejected.Add(1)
+		return nil, false
 	}
-
-	// Accept connections in background
-	go func() {
-		defer listener.Close()
-		for {
-			select {
-			case <-em.ctx.Done():
-				return
-			default:
-			}
-
-			conn, err := listener.Accept()
-			if err != nil {
-				if em.ctx.Err() != nil {
-					return
-				}
-				if em.config.Verbose {
-					log.Printf("Control socket accept error: %v", err)
-				}
-				continue
-			}
-
-			go em.handleControlConnection(conn)
-		}
-	}()
-
-	return nil
+	return exp.handle, true
 }
 
-func (em *ExporterManager) handleControlConnection(conn net.Conn) {
-	defer conn.Close()
-
-	scanner := bufio.NewScanner(conn)
-	for scanner.Scan() {
-		line := strings.TrimSpace(scanner.Text())
-		if line == "" {
-			continue
-		}
-
-		parts := strings.Fields(line)
-		if len(parts) < 3 {
-			if em.config.Verbose {
-				log.Printf("Invalid control message: %s", line)
-			}
-			continue
-		}
-
-		cmd := parts[0]
-		// family := parts[1] // tcp4 or tcp6
-		portStr := parts[2]
-
-		port, err := strconv.Atoi(portStr)
-		if err != nil {
-			if em.config.Verbose {
-				log.Printf("Invalid port in control message: %s", portStr)
-			}
-			continue
-		}
+// saturated reports whether the port is at export_max_conns with a full
+// wait queue.
+func (st *exportPortStats) saturated(queue int) bool {
+	return st.slots != nil && len(st.slots) == cap(st.slots) && st.queued.Load() >= int64(queue)
+}
 
-		switch cmd {
-		case "LISTEN":
-			em.handleListen(port)
-		case "CLOSE":
-			em.handleClose(port)
-		default:
-			if em.config.Verbose {
-				log.Printf("Unknown control command: %s", cmd)
-			}
-		}
+// acquire takes a forwarding slot on the port, waiting in its queue if all
+// are taken. It fails if the queue is full, the wait times out or the port
+// is unexported.
+func (st *exportPortStats) acquire(ctx context.Context, queue int) bool {
+	if st.slots == nil {
+		return true
+	}
+	select {
+	case st.slots <- struct{}{}:
+		return true
+	default:
 	}
+	if st.queued.Add(1) > int64(queue) {
+		st.queued.Add(-1)
+		return false
+	}
+	defer st.queued.Add(-1)
+	timeout := time.NewTimer(exportQueueTimeout)
+	defer timeout.Stop()
+	select {
+	case st.slots <- struct{}{}:
+		return true
+	case <-ctx.Done():
+	case <-timeout.C:
+	}
+	return false
 }
 
-func (em *ExporterManager) handleListen(port int) {
-	em.mu.Lock()
-	defer em.mu.Unlock()
+func (st *exportPortStats) release() {
+	if st.slots != nil {
+		<-st.slots
+	}
+}
 
+// handleListen exports port. local is the address the listener is bound to,
+// as reported by the preload; forwarded connections are dialed there.
+func (em *ExporterManager) handleListen(port int, local string) {
 	// Check if port is allowed
-	if !em.isPortAllowed(port) {
+	policy := em.policy.Load()
+	if !policy.allows(port) {
 		if em.config.Verbose {
 			log.Printf("Port %d not allowed by export policy", port)
 		}
 		return
 	}
 
+	em.mu.Lock()
+	defer em.mu.Unlock()
+
+	// Stopped, or draining before shutdown
+	if em.ctx.Err() != nil {
+		return
+	}
+
 	// Check if already exported
 	if exp, exists := em.exporters[port]; exists {
 		exp.refcount++
+		if exp.grace != nil {
+			// Listening again within the grace period, possibly elsewhere
+			exp.grace.Stop()
+			exp.grace = nil
+			em.setLocalLocked(exp, local)
+			if em.config.Verbose {
+				log.Printf("Port %d listening again (local %s), export kept", port, local)
+			}
+			return
+		}
 		if em.config.Verbose {
 			log.Printf("Port %d already exported, refcount now %d", port, exp.refcount)
 		}
@@ -167,17 +194,15 @@ func (em *ExporterManager) handleListen(port int) {
 	}
 
 	// Check max exports
-	if len(em.exporters) >= em.config.ExportMax {
+	if len(em.exporters)+len(em.udp) >= policy.max {
 		if em.config.Verbose {
-			log.Printf("Cannot export port %d: max exports (%d) reached", port, em.config.ExportMax)
+			log.Printf("Cannot export port %d: max exports (%d) reached", port, policy.max)
 		}
 		return
 	}
 
 	// Create new exporter
-	if err := em.startExporter(port); err != nil {
-		log.Printf("Failed to export port %d: %v", port, err)
-	}
+	em.startExporter(port, local)
 }
 
 func (em *ExporterManager) handleClose(port int) {
@@ -185,7 +210,7 @@ func (em *ExporterManager) handleClose(port int) {
 	defer em.mu.Unlock()
 
 	exp, exists := em.exporters[port]
-	if !exists {
+	if !exists || exp.grace != nil {
 		return
 	}
 
@@ -195,42 +220,83 @@ func (em *ExporterManager) handleClose(port int) {
 	}
 
 	if exp.refcount <= 0 {
+		if grace := em.config.ExportGraceMs; grace > 0 {
+			// Keep the port exported in case the app is restarting its
+			// listener; connections meanwhile wait in connectLocal
+			exp.grace = time.AfterFunc(time.Duration(grace)*time.Millisecond, func() { em.graceExpired(exp) })
+			if em.config.Verbose {
+				log.Printf("Port %d closed, keeping it exported for %dms", port, grace)
+			}
+			return
+		}
 		em.stopExporter(port)
 	}
 }
 
-func (em *ExporterManager) startExporter(port int) error {
-	// Listen on tailnet
-	listener, err := em.server.Listen("tcp", fmt.Sprintf(":%d", port))
-	if err != nil {
-		return fmt.Errorf("failed to listen on tailnet port %d: %w", port, err)
+// graceExpired unexports a port whose listener did not come back.
+func (em *ExporterManager) graceExpired(exp *portExporter) {
+	em.mu.Lock()
+	defer em.mu.Unlock()
+	if em.exporters[exp.port] == exp && exp.grace != nil {
+		if em.config.Verbose {
+			log.Printf("Port %d not listened on again within %dms", exp.port, em.config.ExportGraceMs)
+		}
+		em.stopExporter(exp.port)
+	}
+}
+
+// setLocalLocked points exp at a new local address, restarting its warm
+// pool if it moved. Called with em.mu held.
+func (em *ExporterManager) setLocalLocked(exp *portExporter, local string) {
+	if *exp.local.Load() == local {
+		return
+	}
+	exp.local.Store(&local)
+	if pool := exp.warm.Load(); pool != nil {
+		pool.close()
+		exp.warm.Store(nil)
+	}
+	if em.config.ExportWarmConns > 0 && !strings.HasPrefix(local, unixLocalPrefix) {
+		exp.warm.Store(startLoopbackPool(exp.ctx, local, em.config.ExportWarmConns, em.portStatsLocked(exp.port)))
 	}
+}
 
+// startExporter starts routing tailnet flows to port. Called with em.mu held.
+func (em *ExporterManager) startExporter(port int, local string) {
 	ctx, cancel := context.WithCancel(em.ctx)
+	st := em.portStatsLocked(port)
 	exp := &portExporter{
 		port:     port,
-		listener: listener,
 		refcount: 1,
 		ctx:      ctx,
 		cancel:   cancel,
+		st:       st,
+	}
+	exp.local.Store(&local)
+	if em.config.ExportWarmConns > 0 && !strings.HasPrefix(local, unixLocalPrefix) {
+		exp.warm.Store(startLoopbackPool(ctx, local, em.config.ExportWarmConns, st))
+	}
+	exp.handle = func(conn net.Conn) {
+		st.accepts.Add(1)
+		if !st.acquire(ctx, em.config.ExportConnQueue) {
+			st.rejected.Add(1)
+			conn.Close()
+			return
+		}
+		defer st.release()
+		em.forwardConnection(ctx, conn, exp, st)
 	}
 
 	em.exporters[port] = exp
+	em.ports[port].Store(exp)
 
 	if em.config.Verbose {
-		log.Printf("Exporting port %d on tailnet", port)
+		log.Printf("Exporting port %d on tailnet (local %s)", port, local)
 	}
-
-	// Start accept loop
-	exp.wg.Add(1)
-	go func() {
-		defer exp.wg.Done()
-		em.acceptLoop(exp)
-	}()
-
-	return nil
 }
 
+// stopExporter stops routing new flows to port. Flows already forwarded are
+// left to finish. Called with em.mu held.
 func (em *ExporterManager) stopExporter(port int) {
 	exp, exists := em.exporters[port]
 	if !exists {
@@ -241,47 +307,51 @@ func (em *ExporterManager) stopExporter(port int) {
 		log.Printf("Stopping export of port %d", port)
 	}
 
+	if exp.grace != nil {
+		exp.grace.Stop()
+		exp.grace = nil
+	}
+	em.ports[port].Store(nil)
 	exp.cancel()
-	exp.listener.Close()
 	delete(em.exporters, port)
-
-	// Wait for accept loop to finish
-	go exp.wg.Wait()
-}
-
-func (em *ExporterManager) acceptLoop(exp *portExporter) {
-	for {
-		conn, err := exp.listener.Accept()
-		if err != nil {
-			if exp.ctx.Err() != nil {
-				return
-			}
-			if em.config.Verbose {
-				log.Printf("Accept error on port %d: %v", exp.port, err)
-			}
-			continue
-		}
-
-		go em.forwardConnection(exp.ctx, conn, exp.port)
-	}
 }
 
-func (em *ExporterManager) forwardConnection(ctx context.Context, tsConn net.Conn, port int) {
+func (em *ExporterManager) forwardConnection(ctx context.Context, tsConn net.Conn, exp *portExporter, st *exportPortStats) {
 	defer tsConn.Close()
+	port := exp.port
+	pprof.SetGoroutineLabels(pprof.WithLabels(ctx, pprof.Labels("stage", "export", "export_port", strconv.Itoa(port))))
 
-	// Try IPv4 loopback first
-	localConn, err := net.Dial("tcp", fmt.Sprintf("127.0.0.1:%d", port))
+	dialStart := time.Now()
+	localConn, err := em.connectLocal(ctx, exp, tsConn.RemoteAddr(), st)
 	if err != nil {
-		// Try IPv6 loopback
-		localConn, err = net.Dial("tcp", fmt.Sprintf("[::1]:%d", port))
-		if err != nil {
+		st.forwardFailures.Add(1)
+		if em.config.Verbose {
+			log.Printf("Failed to connect to local port %d: %v", port, err)
+		}
+		return
+	}
+	st.forwardLatency.observe(time.Since(dialStart))
+	defer localConn.Close()
+	if em.policy.Load().proxy.contains(port) {
+		if err := em.sendProxyHeader(ctx, localConn, tsConn); err != nil {
+			st.forwardFailures.Add(1)
 			if em.config.Verbose {
-				log.Printf("Failed to connect to local port %d: %v", port, err)
+				log.Printf("Failed to send PROXY header to local port %d: %v", port, err)
 			}
 			return
 		}
 	}
-	defer localConn.Close()
+	st.active.Add(1)
+	defer st.active.Add(-1)
+
+	entry := em.conns.add(&connEntry{
+		kind:       connExport,
+		peer:       tsConn.RemoteAddr().String(),
+		node:       em.config.Hostname,
+		exportPort: uint16(port),
+	})
+	defer em.conns.remove(entry)
+	defer em.watchDeadlines(entry, st, tsConn, localConn)()
 
 	if em.config.Verbose {
 		log.Printf("Forwarding connection to local port %d", port)
@@ -301,68 +371,314 @@ func (em *ExporterManager) forwardConnection(ctx context.Context, tsConn net.Con
 		}
 	}
 
+	limits := em.limits.exportFlow(port)
+
 	go func() {
 		defer wg.Done()
-		io.Copy(localConn, tsConn)
+		relay(localConn, tsConn, relayDir{limits: limits, ccount: &entry.bytesDown})
 		closeWrite(localConn)
 	}()
 
 	go func() {
 		defer wg.Done()
-		io.Copy(tsConn, localConn)
+		relay(tsConn, localConn, relayDir{limits: limits, ccount: &entry.bytesUp})
 		closeWrite(tsConn)
 	}()
 
 	wg.Wait()
 }
 
-func (em *ExporterManager) isPortAllowed(port int) bool {
-	// Check deny list first
-	if em.config.ExportDenyPorts != "" {
-		if em.matchesPortSpec(port, em.config.ExportDenyPorts) {
-			return false
+// sendProxyHeader writes a PROXY v2 header for tsConn to the app. If the
+// peer's identity can't be looked up the header carries only its address.
+func (em *ExporterManager) sendProxyHeader(ctx context.Context, localConn, tsConn net.Conn) error {
+	src, err := netip.ParseAddrPort(tsConn.RemoteAddr().String())
+	if err != nil {
+		return err
+	}
+	dst, err := netip.ParseAddrPort(tsConn.LocalAddr().String())
+	if err != nil {
+		return err
+	}
+	id, err := em.whois.lookup(ctx, src.Addr())
+	if err != nil && em.config.Verbose {
+		log.Printf("No identity for %s: %v", src.Addr(), err)
+	}
+	_, err = localConn.Write(proxyHeader(src, dst, id))
+	return err
+}
+
+// watchDeadlines closes a forwarded connection once no bytes have moved in
+// either direction for export_idle_timeout_ms (checked every half of it), or
+// export_max_lifetime_ms after it started. The returned func stops watching.
+func (em *ExporterManager) watchDeadlines(entry *connEntry, st *exportPortStats, conns ...net.Conn) func() {
+	idle := time.Duration(em.config.ExportIdleTimeoutMs) * time.Millisecond
+	lifetime := time.Duration(em.config.ExportMaxLifetimeMs) * time.Millisecond
+	if idle <= 0 && lifetime <= 0 {
+		return func() {}
+	}
+
+	var (
+		mu         sync.Mutex
+		stopped    bool
+		idleTimer  *time.Timer
+		lifeTimer  *time.Timer
+		lastBytes  uint64
+		lastChange = time.Now()
+	)
+	cut := func() {
+		if !stopped {
+			stopped = true
+			st.deadlineCloses.Add(1)
+			for _, c := range conns {
+				c.Close()
+			}
 		}
 	}
 
-	// Check allow list (if specified)
-	if em.config.ExportAllowPorts != "" {
-		return em.matchesPortSpec(port, em.config.ExportAllowPorts)
+	mu.Lock()
+	defer mu.Unlock()
+	if lifetime > 0 {
+		lifeTimer = time.AfterFunc(lifetime, func() {
+			mu.Lock()
+			defer mu.Unlock()
+			cut()
+		})
+	}
+	if idle > 0 {
+		idleTimer = time.AfterFunc(idle/2, func() {
+			mu.Lock()
+			defer mu.Unlock()
+			if stopped {
+				return
+			}
+			if moved := entry.bytesUp.Load() + entry.bytesDown.Load(); moved != lastBytes {
+				lastBytes, lastChange = moved, time.Now()
+			} else if time.Since(lastChange) >= idle {
+				cut()
+				return
+			}
+			idleTimer.Reset(idle / 2)
+		})
 	}
+	return func() {
+		mu.Lock()
+		defer mu.Unlock()
+		stopped = true
+		if lifeTimer != nil {
+			lifeTimer.Stop()
+		}
+		if idleTimer != nil {
+			idleTimer.Stop()
+		}
+	}
+}
+
+// connectLocal connects a tailnet connection from peer to the app. If the
+// app is not accepting, because it is restarting its listener or has closed
+// it, the connection waits with backoff retries for up to export_grace_ms,
+// with at most export_grace_queue connections waiting per port.
+func (em *ExporterManager) connectLocal(ctx context.Context, exp *portExporter, peer net.Addr, st *exportPortStats) (net.Conn, error) {
+	conn, err := em.tryLocal(exp, peer, st)
+	if err == nil || em.config.ExportGraceMs <= 0 {
+		return conn, err
+	}
+	if exp.waiting.Add(1) > int32(em.config.ExportGraceQueue) {
+		exp.waiting.Add(-1)
+		return nil, fmt.Errorf("%w (%d connections already waiting)", err, em.config.ExportGraceQueue)
+	}
+	defer exp.waiting.Add(-1)
+	st.held.Add(1)
 
-	// No allow list specified, allow by default (subject to deny list)
-	return true
+	deadline := time.NewTimer(time.Duration(em.config.ExportGraceMs) * time.Millisecond)
+	defer deadline.Stop()
+	backoff := exportRetryMin
+	for {
+		retry := time.NewTimer(backoff)
+		select {
+		case <-ctx.Done():
+			// Unexported: the grace period ended or the proxy is stopping
+			retry.Stop()
+			return nil, err
+		case <-deadline.C:
+			retry.Stop()
+			return nil, err
+		case <-retry.C:
+		}
+		if conn, err = em.tryLocal(exp, peer, st); err == nil {
+			return conn, nil
+		}
+		backoff = min(backoff*2, exportRetryMax)
+	}
 }
 
-func (em *ExporterManager) matchesPortSpec(port int, spec string) bool {
-	parts := strings.Split(spec, ",")
-	for _, part := range parts {
-		part = strings.TrimSpace(part)
+// tryLocal makes one attempt to connect to the app: by injection, from the
+// warm pool, or by dialing the listener, which may be a Unix socket.
+func (em *ExporterManager) tryLocal(exp *portExporter, peer net.Addr, st *exportPortStats) (net.Conn, error) {
+	if conn := em.injectors.inject(exp.port, peer); conn != nil {
+		st.injected.Add(1)
+		return conn, nil
+	}
+	if conn := exp.warm.Load().get(); conn != nil {
+		return conn, nil
+	}
+	local := *exp.local.Load()
+	conn, err := dialLocal(local)
+	if err != nil && !strings.HasPrefix(local, unixLocalPrefix) {
+		// The listener may have been replaced by one on the other
+		// loopback family since it was reported
+		conn, err = net.Dial("tcp", otherLoopback(local))
+	}
+	return conn, err
+}
 
-		// Check for range
-		if strings.Contains(part, "-") {
-			rangeParts := strings.Split(part, "-")
-			if len(rangeParts) != 2 {
-				continue
-			}
-			start, err1 := strconv.Atoi(strings.TrimSpace(rangeParts[0]))
-			end, err2 := strconv.Atoi(strings.TrimSpace(rangeParts[1]))
-			if err1 == nil && err2 == nil && port >= start && port <= end {
-				return true
-			}
+// exportLocalAddr is the address to dial for a listener on port, given the
+// family and bound address from a LISTEN message. addr may be empty (older
+// preloads send only the family); a wildcard address is dialed on loopback.
+func exportLocalAddr(family, addr string, port int) string {
+	ip := netip.IPv4Unspecified()
+	if family == "tcp6" || family == "udp6" {
+		ip = netip.IPv6Unspecified()
+	}
+	if ap, err := netip.ParseAddrPort(addr); err == nil {
+		ip = ap.Addr().Unmap()
+	}
+	if ip.IsUnspecified() {
+		if ip.Is4() {
+			ip = netip.AddrFrom4([4]byte{127, 0, 0, 1})
 		} else {
-			// Single port
-			p, err := strconv.Atoi(part)
-			if err == nil && p == port {
-				return true
-			}
+			ip = netip.IPv6Loopback()
+		}
+	}
+	return netip.AddrPortFrom(ip, uint16(port)).String()
+}
+
+// otherLoopback returns local with its address replaced by the loopback
+// address of the other family.
+func otherLoopback(local string) string {
+	ap, err := netip.ParseAddrPort(local)
+	if err != nil {
+		return local
+	}
+	ip := netip.IPv6Loopback()
+	if ap.Addr().Is6() {
+		ip = netip.AddrFrom4([4]byte{127, 0, 0, 1})
+	}
+	return netip.AddrPortFrom(ip, ap.Port()).String()
+}
+
+// exportPolicy is the compiled form of export_allow_ports,
+// export_deny_ports, export_max, export_proxy_protocol, export_acls and
+// export_unix. A reload swaps it whole, though the exporter keeps the
+// export_unix mapping it started with, as the preload does. The allowed
+// ports are a 65536-bit bitmap, which is also published to the preload (see
+// policy.go) so it does not report ports that can never be exported.
+type exportPolicy struct {
+	allowed [65536 / 64]uint64
+	max     int
+	proxy   portSet        // ports that get a PROXY v2 header (identity.go)
+	acl     *aclTable      // nil without export_acls (acl.go)
+	unix    map[int]string // export_unix, port -> path (unixexport.go)
+}
+
+func compileExportPolicy(config *Config) (*exportPolicy, error) {
+	allow, err := parsePortSpec(config.ExportAllowPorts)
+	if err != nil {
+		return nil, fmt.Errorf("export_allow_ports: %w", err)
+	}
+	deny, err := parsePortSpec(config.ExportDenyPorts)
+	if err != nil {
+		return nil, fmt.Errorf("export_deny_ports: %w", err)
+	}
+	proxy, err := parsePortSpec(config.ExportProxyProtocol)
+	if err != nil {
+		return nil, fmt.Errorf("export_proxy_protocol: %w", err)
+	}
+	acl, err := compileACLs(config.ExportACLs)
+	if err != nil {
+		return nil, err
+	}
+	unix, err := parseUnixExports(config.ExportUnix)
+	if err != nil {
+		return nil, err
+	}
+	pol := &exportPolicy{max: config.ExportMax, proxy: proxy, acl: acl, unix: unix}
+	for port := 1; port <= 65535; port++ {
+		// Deny wins; with no allow list every port not denied is allowed
+		if !deny.contains(port) && (allow == nil || allow.contains(port)) {
+			pol.allowed[port/64] |= 1 << (port % 64)
+		}
+	}
+	return pol, nil
+}
+
+func (pol *exportPolicy) allows(port int) bool {
+	return port > 0 && port <= 65535 && pol.allowed[port/64]&(1<<(port%64)) != 0
+}
+
+// setPolicy swaps in a new export policy and stops exports it no longer
+// allows. Connections already forwarded on them are left to finish.
+func (em *ExporterManager) setPolicy(policy *exportPolicy) {
+	em.policy.Store(policy)
+
+	em.mu.Lock()
+	defer em.mu.Unlock()
+	for port := range em.exporters {
+		if !policy.allows(port) {
+			log.Printf("Port %d no longer allowed by export policy, unexporting", port)
+			em.stopExporter(port)
+		}
+	}
+	for port := range em.udp {
+		if !policy.allows(port) {
+			log.Printf("UDP port %d no longer allowed by export policy, unexporting", port)
+			em.stopUDPExporter(port)
+		}
+	}
+}
+
+// portSet is a parsed port spec.
+type portSet []portRange
+
+type portRange struct{ lo, hi int }
+
+// parsePortSpec parses a comma-separated list of ports and ranges such as
+// "3000,8080,10000-10100". An empty spec gives a nil set.
+func parsePortSpec(spec string) (portSet, error) {
+	var set portSet
+	for _, part := range strings.Split(spec, ",") {
+		part = strings.TrimSpace(part)
+		if part == "" {
+			continue
+		}
+		lo, hi, isRange := strings.Cut(part, "-")
+		r := portRange{}
+		var err1, err2 error
+		r.lo, err1 = strconv.Atoi(strings.TrimSpace(lo))
+		r.hi, err2 = r.lo, nil
+		if isRange {
+			r.hi, err2 = strconv.Atoi(strings.TrimSpace(hi))
+		}
+		if err1 != nil || err2 != nil || r.lo < 1 || r.hi > 65535 || r.lo > r.hi {
+			return nil, fmt.Errorf("invalid port or range %q", part)
+		}
+		set = append(set, r)
+	}
+	return set, nil
+}
+
+func (s portSet) contains(port int) bool {
+	for _, r := range s {
+		if port >= r.lo && port <= r.hi {
+			return true
 		}
 	}
 	return false
 }
 
-// Stop stops all exporters and the control socket
+// Stop stops all exporters
 func (em *ExporterManager) Stop() {
 	em.cancel()
+	em.unregister()
 
 	em.mu.Lock()
 	defer em.mu.Unlock()
@@ -370,4 +686,7 @@ func (em *ExporterManager) Stop() {
 	for port := range em.exporters {
 		em.stopExporter(port)
 	}
+	for port := range em.udp {
+		em.stopUDPExporter(port)
+	}
 }
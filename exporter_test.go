@@ -0,0 +1,108 @@
+package main
+
+import (
+	"reflect"
+	"strings"
+	"testing"
+)
+
+func TestParsePortSpec(t *testing.T) {
+	tests := []struct {
+		spec    string
+		want    portSet
+		wantErr bool
+	}{
+		{spec: "", want: nil},
+		{spec: " , ", want: nil},
+		{spec: "22", want: portSet{{22, 22}}},
+		{spec: "3000, 8080,10000-10100", want: portSet{{3000, 3000}, {8080, 8080}, {10000, 10100}}},
+		{spec: "1-65535", want: portSet{{1, 65535}}},
+		{spec: "8000 - 8005", want: portSet{{8000, 8005}}},
+		{spec: "0", wantErr: true},
+		{spec: "65536", wantErr: true},
+		{spec: "10-5", wantErr: true},
+		{spec: "http", wantErr: true},
+		{spec: "80-", wantErr: true},
+		{spec: "22,x", wantErr: true},
+	}
+	for _, tt := range tests {
+		got, err := parsePortSpec(tt.spec)
+		if (err != nil) != tt.wantErr {
+			t.Errorf("parsePortSpec(%q) error = %v, wantErr %v", tt.spec, err, tt.wantErr)
+			continue
+		}
+		if !reflect.DeepEqual(got, tt.want) {
+			t.Errorf("parsePortSpec(%q) = %v, want %v", tt.spec, got, tt.want)
+		}
+	}
+}
+
+func TestPortSetContains(t *testing.T) {
+	set := portSet{{22, 22}, {8000, 8100}}
+	tests := []struct {
+		port int
+		want bool
+	}{
+		{22, true}, {23, false}, {7999, false}, {8000, true}, {8050, true}, {8100, true}, {8101, false},
+	}
+	for _, tt := range tests {
+		if got := set.contains(tt.port); got != tt.want {
+			t.Errorf("contains(%d) = %v, want %v", tt.port, got, tt.want)
+		}
+	}
+}
+
+func TestCompileExportPolicy(t *testing.T) {
+	tests := []struct {
+		name        string
+		allow, deny string
+		allowed     []int
+		denied      []int
+	}{
+		{name: "defaults", allowed: []int{1, 22, 8080, 65535}, denied: []int{0, -1, 65536}},
+		{name: "allow list", allow: "22,8000-8002", allowed: []int{22, 8000, 8001, 8002}, denied: []int{1, 21, 23, 7999, 8003, 65535}},
+		{name: "deny list", deny: "1-1023", allowed: []int{1024, 8080, 65535}, denied: []int{1, 22, 1023}},
+		{name: "deny wins", allow: "8000-8010", deny: "8005", allowed: []int{8000, 8004, 8006, 8010}, denied: []int{8005, 8011}},
+		{name: "word edges", allow: "63-64,127-128,65535", allowed: []int{63, 64, 127, 128, 65535}, denied: []int{62, 65, 126, 129, 65534}},
+		{name: "deny everything", deny: "1-65535", denied: []int{1, 80, 65535}},
+	}
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			pol, err := compileExportPolicy(&Config{ExportAllowPorts: tt.allow, ExportDenyPorts: tt.deny})
+			if err != nil {
+				t.Fatal(err)
+			}
+			for _, port := range tt.allowed {
+				if !pol.allows(port) {
+					t.Errorf("port %d denied", port)
+				}
+			}
+			for _, port := range tt.denied {
+				if pol.allows(port) {
+					t.Errorf("port %d allowed", port)
+				}
+			}
+			if pol.allowed[0]&1 != 0 {
+				t.Error("port 0 set in the bitmap")
+			}
+		})
+	}
+}
+
+func TestCompileExportPolicyErrors(t *testing.T) {
+	tests := []struct {
+		config Config
+		prefix string
+	}{
+		{Config{ExportAllowPorts: "0"}, "export_allow_ports: "},
+		{Config{ExportDenyPorts: "9-1"}, "export_deny_ports: "},
+		{Config{ExportProxyProtocol: "x"}, "export_proxy_protocol: "},
+		{Config{ExportUnix: "relative.sock=80"}, "export_unix: "},
+	}
+	for _, tt := range tests {
+		_, err := compileExportPolicy(&tt.config)
+		if err == nil || !strings.HasPrefix(err.Error(), tt.prefix) {
+			t.Errorf("compileExportPolicy(%+v) error = %v, want prefix %q", tt.config, err, tt.prefix)
+		}
+	}
+}
@@ -0,0 +1,299 @@
+package main
+
+import (
+	"context"
+	"errors"
+	"log"
+	"net"
+	"net/netip"
+	"sort"
+	"sync"
+	"time"
+
+	"golang.org/x/net/dns/dnsmessage"
+)
+
+// Happy Eyeballs (RFC 8305) dialing for domain CONNECT requests.
+//
+// The hostname is resolved through the tailnet's DNS (MagicDNS, or the exit
+// node's resolvers) and the addresses are raced: families are interleaved,
+// a new attempt starts every stagger interval or as soon as one fails, and
+// the first connection to complete wins while the others are canceled. An
+// optional hedge re-dials the first address if nothing has connected after
+// the hedge delay, which covers a lost SYN on an otherwise healthy path.
+
+// maxRaceAddrs bounds how many resolved addresses a single dial will try.
+const maxRaceAddrs = 8
+
+type raceResult struct {
+	conn  net.Conn
+	err   error
+	index int
+	hedge bool
+}
+
+// destDialStats counts race outcomes for one host:port.
+type destDialStats struct {
+	Races          uint64
+	Failures       uint64
+	FirstWins      uint64 // won by the first address
+	FallbackWins   uint64 // won by a later address
+	HedgesLaunched uint64
+	HedgeWins      uint64
+}
+
+// dialStats tracks race outcomes per destination.
+type dialStats struct {
+	mu    sync.Mutex
+	dests map[string]*destDialStats
+}
+
+// maxDialStatsDests bounds the number of destinations tracked.
+const maxDialStatsDests = 4096
+
+func newDialStats() *dialStats {
+	return &dialStats{dests: make(map[string]*destDialStats)}
+}
+
+func (s *dialStats) update(target string, fn func(*destDialStats)) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	d, ok := s.dests[target]
+	if !ok {
+		if len(s.dests) >= maxDialStatsDests {
+			return
+		}
+		d = &destDialStats{}
+		s.dests[target] = d
+	}
+	fn(d)
+}
+
+// snapshot returns a copy of the per-destination statistics.
+func (s *dialStats) snapshot() map[string]destDialStats {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	out := make(map[string]destDialStats, len(s.dests))
+	for target, d := range s.dests {
+		out[target] = *d
+	}
+	return out
+}
+
+func (s *dialStats) logSummary() {
+	snap := s.snapshot()
+	targets := make([]string, 0, len(snap))
+	for target := range snap {
+		targets = append(targets, target)
+	}
+	sort.Strings(targets)
+	for _, target := range targets {
+		d := snap[target]
+		log.Printf("Dial stats %s: races=%d failures=%d first=%d fallback=%d hedges=%d hedge_wins=%d",
+			target, d.Races, d.Failures, d.FirstWins, d.FallbackWins, d.HedgesLaunched, d.HedgeWins)
+	}
+}
+
+// resolveTailnet looks up A and AAAA records for host through the tsnet
+// node's resolver and returns them interleaved by family, IPv6 first.
+func (p *ProxyServer) resolveTailnet(ctx context.Context, node *tsnetNode, host string) ([]netip.Addr, error) {
+	if node.lc == nil {
+		return nil, errors.New("local client not ready")
+	}
+
+	type answer struct {
+		addrs []netip.Addr
+		err   error
+	}
+	query := func(qtype string, ch chan<- answer) {
+		msg, _, err := node.lc.QueryDNS(ctx, host, qtype)
+		if err != nil {
+			ch <- answer{err: err}
+			return
+		}
+		addrs, err := parseDNSAddrs(msg)
+		ch <- answer{addrs: addrs, err: err}
+	}
+
+	ch4 := make(chan answer, 1)
+	ch6 := make(chan answer, 1)
+	go query("A", ch4)
+	go query("AAAA", ch6)
+	a4, a6 := <-ch4, <-ch6
+
+	addrs := interleaveFamilies(a6.addrs, a4.addrs)
+	if len(addrs) == 0 {
+		if a4.err != nil {
+			return nil, a4.err
+		}
+		if a6.err != nil {
+			return nil, a6.err
+		}
+		return nil, &net.DNSError{Err: "no such host", Name: host, IsNotFound: true}
+	}
+	return addrs, nil
+}
+
+func parseDNSAddrs(msg []byte) ([]netip.Addr, error) {
+	var parser dnsmessage.Parser
+	if _, err := parser.Start(msg); err != nil {
+		return nil, err
+	}
+	if err := parser.SkipAllQuestions(); err != nil {
+		return nil, err
+	}
+
+	var addrs []netip.Addr
+	for {
+		h, err := parser.AnswerHeader()
+		if err == dnsmessage.ErrSectionDone {
+			return addrs, nil
+		}
+		if err != nil {
+			return addrs, err
+		}
+		switch h.Type {
+		case dnsmessage.TypeA:
+			r, err := parser.AResource()
+			if err != nil {
+				return addrs, err
+			}
+			addrs = append(addrs, netip.AddrFrom4(r.A))
+		case dnsmessage.TypeAAAA:
+			r, err := parser.AAAAResource()
+			if err != nil {
+				return addrs, err
+			}
+			addrs = append(addrs, netip.AddrFrom16(r.AAAA))
+		default:
+			if err := parser.SkipAnswer(); err != nil {
+				return addrs, err
+			}
+		}
+	}
+}
+
+// interleaveFamilies alternates between the two lists (RFC 8305 section 4).
+func interleaveFamilies(first, second []netip.Addr) []netip.Addr {
+	out := make([]netip.Addr, 0, len(first)+len(second))
+	for i := 0; i < len(first) || i < len(second); i++ {
+		if i < len(first) {
+			out = append(out, first[i])
+		}
+		if i < len(second) {
+			out = append(out, second[i])
+		}
+	}
+	if len(out) > maxRaceAddrs {
+		out = out[:maxRaceAddrs]
+	}
+	return out
+}
+
+// dialHappyEyeballs resolves host and races connections to its addresses.
+// If resolution fails it falls back to letting tsnet resolve and dial the
+// name directly.
+func (p *ProxyServer) dialHappyEyeballs(ctx context.Context, node *tsnetNode, host, port string) (net.Conn, error) {
+	target := net.JoinHostPort(host, port)
+	addrs, err := p.resolveTailnet(ctx, node, host)
+	if err != nil {
+		if p.config.Verbose {
+			log.Printf("Resolving %s via tailnet failed, dialing by name: %v", host, err)
+		}
+		return node.server.Dial(ctx, "tcp", target)
+	}
+	return p.dialRace(ctx, node, target, addrs, port)
+}
+
+func (p *ProxyServer) dialRace(ctx context.Context, node *tsnetNode, target string, addrs []netip.Addr, port string) (net.Conn, error) {
+	ctx, cancel := context.WithCancel(ctx)
+	defer cancel()
+
+	// Buffered so that attempts finishing after the race never block
+	results := make(chan raceResult, len(addrs)+1)
+	launch := func(i int, hedge bool) {
+		go func() {
+			conn, err := node.server.Dial(ctx, "tcp", net.JoinHostPort(addrs[i].String(), port))
+			results <- raceResult{conn: conn, err: err, index: i, hedge: hedge}
+		}()
+	}
+
+	stagger := time.Duration(p.config.DialStaggerMs) * time.Millisecond
+	staggerTimer := time.NewTimer(stagger)
+	defer staggerTimer.Stop()
+	staggerC := staggerTimer.C
+
+	var hedgeC <-chan time.Time
+	if p.config.DialHedgeMs > 0 {
+		hedgeTimer := time.NewTimer(time.Duration(p.config.DialHedgeMs) * time.Millisecond)
+		defer hedgeTimer.Stop()
+		hedgeC = hedgeTimer.C
+	}
+
+	launch(0, false)
+	next, inflight := 1, 1
+	launchNext := func() {
+		if next >= len(addrs) {
+			staggerC = nil
+			return
+		}
+		launch(next, false)
+		next++
+		inflight++
+		staggerTimer.Reset(stagger)
+	}
+	if next >= len(addrs) {
+		staggerC = nil
+	}
+
+	var firstErr error
+	for inflight > 0 {
+		select {
+		case r := <-results:
+			inflight--
+			if r.err == nil {
+				p.dialStats.update(target, func(d *destDialStats) {
+					d.Races++
+					switch {
+					case r.hedge:
+						d.HedgeWins++
+					case r.index == 0:
+						d.FirstWins++
+					default:
+						d.FallbackWins++
+					}
+				})
+				if p.config.Verbose && (r.index > 0 || r.hedge) {
+					log.Printf("Dial to %s won by %s (attempt %d, hedge=%v)", target, addrs[r.index], r.index, r.hedge)
+				}
+				// Close losers that still manage to connect
+				go func(pending int) {
+					for ; pending > 0; pending-- {
+						if lr := <-results; lr.conn != nil {
+							lr.conn.Close()
+						}
+					}
+				}(inflight)
+				return r.conn, nil
+			}
+			if firstErr == nil {
+				firstErr = r.err
+			}
+			// A failed attempt starts the next one right away
+			launchNext()
+		case <-staggerC:
+			launchNext()
+		case <-hedgeC:
+			hedgeC = nil
+			launch(0, true)
+			inflight++
+			p.dialStats.update(target, func(d *destDialStats) { d.HedgesLaunched++ })
+		}
+	}
+
+	p.dialStats.update(target, func(d *destDialStats) {
+		d.Races++
+		d.Failures++
+	})
+	return nil, firstErr
+}
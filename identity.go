@@ -0,0 +1,178 @@
+package main
+
+import (
+	"context"
+	"encoding/binary"
+	"fmt"
+	"net/netip"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Tailnet peer identity for exported connections.
+//
+// Ports in export_proxy_protocol get a PROXY protocol v2 header ahead of the
+// tailnet client's bytes, so the app sees the client's tailnet address rather
+// than loopback. The header also carries the peer's identity as TLVs in the
+// range the spec reserves for custom use:
+//
+//	0xE0  node name (MagicDNS FQDN, no trailing dot)
+//	0xE1  user login name
+//	0xE2  ACL tags, comma-separated
+//
+// Identity comes from a WhoIs lookup on node 0, cached by peer address. Each
+// entry records the peer index generation it was looked up in (see peers.go),
+// and any netmap that advances the generation makes it stale, so tag and
+// ownership changes are seen on the next connection. Concurrent connections
+// from a peer share one lookup.
+
+const (
+	pp2TypeNodeName = 0xE0
+	pp2TypeUser     = 0xE1
+	pp2TypeTags     = 0xE2
+
+	whoisTimeout    = 2 * time.Second
+	whoisCacheLimit = 4096
+)
+
+var pp2Signature = []byte("\r\n\r\n\x00\r\nQUIT\n")
+
+// peerIdentity is what the tailnet knows about a peer node.
+type peerIdentity struct {
+	node string
+	user string
+	tags []string
+}
+
+type whoisEntry struct {
+	gen  uint64
+	done chan struct{} // closed when the lookup finishes
+	id   *peerIdentity
+	err  error
+}
+
+// whoisCache caches WhoIs results for peers of one node.
+type whoisCache struct {
+	node *tsnetNode
+
+	mu      sync.Mutex
+	entries map[netip.Addr]*whoisEntry
+
+	hits     atomic.Uint64
+	misses   atomic.Uint64
+	failures atomic.Uint64
+}
+
+func newWhoisCache(node *tsnetNode) *whoisCache {
+	return &whoisCache{node: node, entries: make(map[netip.Addr]*whoisEntry)}
+}
+
+// lookup returns the identity of the peer at addr.
+func (c *whoisCache) lookup(ctx context.Context, addr netip.Addr) (*peerIdentity, error) {
+	addr = addr.Unmap()
+	gen := c.node.peers.refreshes.Load()
+
+	c.mu.Lock()
+	e, ok := c.entries[addr]
+	if ok && e.gen == gen {
+		c.mu.Unlock()
+		c.hits.Add(1)
+		select {
+		case <-e.done:
+		case <-ctx.Done():
+			return nil, ctx.Err()
+		}
+		return e.id, e.err
+	}
+	if len(c.entries) >= whoisCacheLimit {
+		// Peers come and go with the netmap; start over rather than track
+		// which are still around
+		clear(c.entries)
+	}
+	e = &whoisEntry{gen: gen, done: make(chan struct{})}
+	c.entries[addr] = e
+	c.mu.Unlock()
+	c.misses.Add(1)
+
+	e.id, e.err = c.whois(addr)
+	close(e.done)
+	if e.err != nil {
+		c.failures.Add(1)
+		// Don't cache failures; the next connection tries again
+		c.mu.Lock()
+		if c.entries[addr] == e {
+			delete(c.entries, addr)
+		}
+		c.mu.Unlock()
+	}
+	return e.id, e.err
+}
+
+func (c *whoisCache) whois(addr netip.Addr) (*peerIdentity, error) {
+	if c.node.lc == nil {
+		return nil, fmt.Errorf("node %s not started", c.node.hostname)
+	}
+	// Not tied to the caller: connections waiting on this lookup share it
+	ctx, cancel := context.WithTimeout(context.Background(), whoisTimeout)
+	defer cancel()
+	// WhoIs wants an ip:port; any port matches a node's address
+	who, err := c.node.lc.WhoIs(ctx, netip.AddrPortFrom(addr, 0).String())
+	if err != nil {
+		return nil, fmt.Errorf("whois %s: %w", addr, err)
+	}
+	id := &peerIdentity{}
+	if who.Node != nil {
+		id.node = strings.TrimSuffix(who.Node.Name, ".")
+		id.tags = who.Node.Tags
+	}
+	if who.UserProfile != nil && len(id.tags) == 0 {
+		// Tagged nodes are owned by their tags, not the user who tagged them
+		id.user = who.UserProfile.LoginName
+	}
+	return id, nil
+}
+
+// proxyHeader encodes a PROXY protocol v2 header for a TCP connection from
+// src to dst, with id's TLVs if id is not nil.
+func proxyHeader(src, dst netip.AddrPort, id *peerIdentity) []byte {
+	srcIP, dstIP := src.Addr().Unmap(), dst.Addr().Unmap()
+	fam := byte(0x11) // TCP over IPv4
+	if !srcIP.Is4() || !dstIP.Is4() {
+		fam = 0x21 // TCP over IPv6; a v4 address is sent v4-mapped
+	}
+
+	var tlvs []byte
+	addTLV := func(typ byte, value string) {
+		if value == "" || len(value) > 0xffff {
+			return
+		}
+		tlvs = append(tlvs, typ, byte(len(value)>>8), byte(len(value)))
+		tlvs = append(tlvs, value...)
+	}
+	if id != nil {
+		addTLV(pp2TypeNodeName, id.node)
+		addTLV(pp2TypeUser, id.user)
+		addTLV(pp2TypeTags, strings.Join(id.tags, ","))
+	}
+
+	h := make([]byte, 16, 16+36+len(tlvs))
+	copy(h, pp2Signature)
+	h[12] = 0x21 // version 2, PROXY
+	h[13] = fam
+	if fam == 0x11 {
+		s, d := srcIP.As4(), dstIP.As4()
+		h = append(h, s[:]...)
+		h = append(h, d[:]...)
+	} else {
+		s, d := srcIP.As16(), dstIP.As16()
+		h = append(h, s[:]...)
+		h = append(h, d[:]...)
+	}
+	h = binary.BigEndian.AppendUint16(h, src.Port())
+	h = binary.BigEndian.AppendUint16(h, dst.Port())
+	h = append(h, tlvs...)
+	binary.BigEndian.PutUint16(h[14:], uint16(len(h)-16))
+	return h
+}
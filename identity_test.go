@@ -0,0 +1,78 @@
+package main
+
+import (
+	"encoding/hex"
+	"net/netip"
+	"strings"
+	"testing"
+)
+
+func TestProxyHeader(t *testing.T) {
+	const sig = "0d0a0d0a000d0a515549540a"
+	tests := []struct {
+		name     string
+		src, dst string
+		id       *peerIdentity
+		want     string // hex, spaces ignored
+	}{
+		{
+			name: "tcp4",
+			src:  "100.64.0.1:54321", dst: "127.0.0.1:8080",
+			want: sig + "21 11 000c 64400001 7f000001 d431 1f90",
+		},
+		{
+			name: "tcp4 from mapped addresses",
+			src:  "[::ffff:100.64.0.1]:54321", dst: "[::ffff:127.0.0.1]:8080",
+			want: sig + "21 11 000c 64400001 7f000001 d431 1f90",
+		},
+		{
+			name: "tcp6",
+			src:  "[fd7a:115c:a1e0::1]:443", dst: "[::1]:22",
+			want: sig + "21 21 0024" +
+				"fd7a115ca1e000000000000000000001" +
+				"00000000000000000000000000000001" +
+				"01bb 0016",
+		},
+		{
+			name: "mixed families send v4 mapped",
+			src:  "[fd7a:115c:a1e0::1]:443", dst: "127.0.0.1:22",
+			want: sig + "21 21 0024" +
+				"fd7a115ca1e000000000000000000001" +
+				"00000000000000000000ffff7f000001" +
+				"01bb 0016",
+		},
+		{
+			name: "identity tlvs",
+			src:  "100.64.0.1:54321", dst: "127.0.0.1:8080",
+			id: &peerIdentity{node: "laptop", user: "ann@example.com", tags: []string{"tag:ci", "tag:dev"}},
+			want: sig + "21 11 0038 64400001 7f000001 d431 1f90" +
+				"e0 0006 6c6170746f70" + // laptop
+				"e1 000f 616e6e406578616d706c652e636f6d" + // ann@example.com
+				"e2 000e 7461673a63692c7461673a646576", // tag:ci,tag:dev
+		},
+		{
+			name: "empty values skipped",
+			src:  "100.64.0.1:54321", dst: "127.0.0.1:8080",
+			id:   &peerIdentity{node: "laptop"},
+			want: sig + "21 11 0015 64400001 7f000001 d431 1f90 e0 0006 6c6170746f70",
+		},
+		{
+			name: "no values",
+			src:  "100.64.0.1:54321", dst: "127.0.0.1:8080",
+			id:   &peerIdentity{},
+			want: sig + "21 11 000c 64400001 7f000001 d431 1f90",
+		},
+	}
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			want, err := hex.DecodeString(strings.ReplaceAll(tt.want, " ", ""))
+			if err != nil {
+				t.Fatal(err)
+			}
+			got := proxyHeader(netip.MustParseAddrPort(tt.src), netip.MustParseAddrPort(tt.dst), tt.id)
+			if string(got) != string(want) {
+				t.Errorf("proxyHeader =\n%x\nwant\n%x", got, want)
+			}
+		})
+	}
+}
@@ -0,0 +1,232 @@
+package main
+
+import (
+	"context"
+	"errors"
+	"fmt"
+	"log"
+	"net"
+	"net/netip"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+)
+
+// Connection injection (export_inject).
+//
+// Normally an exported connection is relayed from the netstack into a new
+// loopback TCP connection to the app. With export_inject the preload opens a
+// channel per exported listener to the inject socket, a SOCK_SEQPACKET Unix
+// socket next to the control socket, and announces it with
+// "INJECT tcp4 8000". For each tailnet connection the exporter creates a Unix
+// stream socketpair, relays the tailnet side into one end and passes the
+// other over the channel with SCM_RIGHTS, along with the peer address as
+// "<ip> <port>". The preload returns it from accept() on that listener and
+// reports the tailnet peer from getpeername(), so the app reads the tailnet
+// connection without a loopback TCP handshake or a pass through the kernel
+// TCP stack.
+//
+// A channel holds at most net.unix.max_dgram_qlen connections the app has
+// not accepted yet. If no channel can take a connection (none open, queue
+// full, or an IPv6 peer for an IPv4 listener), it is forwarded over loopback
+// as usual.
+
+const injectHelloTimeout = 5 * time.Second
+
+var errInjectFamily = errors.New("peer address family does not match the listener")
+
+// injectChan is one preload channel, for one listener.
+type injectChan struct {
+	conn   *net.UnixConn
+	family string // of the listener, tcp4 or tcp6
+}
+
+// injectTable holds the open channels by port. Lists are replaced, never
+// modified, so inject reads them without holding mu.
+type injectTable struct {
+	mu    sync.RWMutex
+	chans map[int][]*injectChan
+	next  atomic.Uint32 // round-robin over a port's channels
+}
+
+func newInjectTable() *injectTable {
+	return &injectTable{chans: make(map[int][]*injectChan)}
+}
+
+func (t *injectTable) add(port int, ch *injectChan) {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	t.chans[port] = append(t.chans[port][:len(t.chans[port]):len(t.chans[port])], ch)
+}
+
+func (t *injectTable) remove(port int, ch *injectChan) {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	var kept []*injectChan
+	for _, c := range t.chans[port] {
+		if c != ch {
+			kept = append(kept, c)
+		}
+	}
+	if len(kept) == 0 {
+		delete(t.chans, port)
+	} else {
+		t.chans[port] = kept
+	}
+}
+
+// inject passes a new connection from peer to an app listening on port and
+// returns the proxy's end, or nil if no channel took it.
+func (t *injectTable) inject(port int, peer net.Addr) net.Conn {
+	if t == nil {
+		return nil
+	}
+	t.mu.RLock()
+	chans := t.chans[port]
+	t.mu.RUnlock()
+	if len(chans) == 0 {
+		return nil
+	}
+	src, err := netip.ParseAddrPort(peer.String())
+	if err != nil {
+		return nil
+	}
+
+	fds, err := syscall.Socketpair(syscall.AF_UNIX, syscall.SOCK_STREAM|syscall.SOCK_CLOEXEC, 0)
+	if err != nil {
+		return nil
+	}
+	// The app holds its own reference once the fd is sent
+	defer syscall.Close(fds[1])
+
+	start := int(t.next.Add(1))
+	for i := range chans {
+		if chans[(start+i)%len(chans)].send(fds[1], src) != nil {
+			continue
+		}
+		f := os.NewFile(uintptr(fds[0]), "inject")
+		conn, err := net.FileConn(f)
+		f.Close()
+		if err != nil {
+			return nil
+		}
+		return conn
+	}
+	syscall.Close(fds[0])
+	return nil
+}
+
+// send passes fd to the preload without blocking.
+func (ch *injectChan) send(fd int, peer netip.AddrPort) error {
+	addr := peer.Addr().WithZone("").Unmap()
+	if ch.family == "tcp6" {
+		if addr.Is4() {
+			addr = netip.AddrFrom16(addr.As16()) // as a dual-stack accept reports it
+		}
+	} else if !addr.Is4() {
+		return errInjectFamily
+	}
+	msg := []byte(addr.String() + " " + strconv.Itoa(int(peer.Port())))
+
+	rc, err := ch.conn.SyscallConn()
+	if err != nil {
+		return err
+	}
+	var serr error
+	err = rc.Write(func(s uintptr) bool {
+		serr = syscall.Sendmsg(int(s), msg, syscall.UnixRights(fd), nil, syscall.MSG_DONTWAIT|syscall.MSG_NOSIGNAL)
+		return true
+	})
+	if err != nil {
+		return err
+	}
+	return serr
+}
+
+// startInjectSocket listens for preload channels on path.
+func (p *ProxyServer) startInjectSocket(ctx context.Context, path string) error {
+	os.Remove(path)
+	if err := os.MkdirAll(filepath.Dir(path), 0700); err != nil {
+		return fmt.Errorf("failed to create inject socket directory: %w", err)
+	}
+	listener, err := net.ListenUnix("unixpacket", &net.UnixAddr{Name: path, Net: "unixpacket"})
+	if err != nil {
+		return fmt.Errorf("failed to create inject socket: %w", err)
+	}
+	if err := os.Chmod(path, 0600); err != nil {
+		listener.Close()
+		return fmt.Errorf("failed to set socket permissions: %w", err)
+	}
+	p.mu.Lock()
+	p.injectListener = listener
+	p.mu.Unlock()
+
+	go func() {
+		<-ctx.Done()
+		listener.Close()
+	}()
+	go func() {
+		for {
+			conn, err := listener.AcceptUnix()
+			if err != nil {
+				if ctx.Err() != nil || errors.Is(err, net.ErrClosed) {
+					return
+				}
+				if p.config.Verbose {
+					log.Printf("Inject socket accept error: %v", err)
+				}
+				continue
+			}
+			go p.handleInjectChannel(conn)
+		}
+	}()
+	return nil
+}
+
+// handleInjectChannel registers a preload channel until the preload closes
+// it, which it does when the listener is closed.
+func (p *ProxyServer) handleInjectChannel(conn *net.UnixConn) {
+	defer conn.Close()
+	em := p.exporterManager
+	if em == nil || em.injectors == nil {
+		return
+	}
+
+	buf := make([]byte, 64)
+	conn.SetReadDeadline(time.Now().Add(injectHelloTimeout))
+	n, err := conn.Read(buf)
+	if err != nil {
+		return
+	}
+	conn.SetReadDeadline(time.Time{})
+	parts := strings.Fields(string(buf[:n]))
+	if len(parts) != 3 || parts[0] != "INJECT" || (parts[1] != "tcp4" && parts[1] != "tcp6") {
+		if p.config.Verbose {
+			log.Printf("Invalid inject channel hello: %q", buf[:n])
+		}
+		return
+	}
+	port, err := strconv.Atoi(parts[2])
+	if err != nil || port < 1 || port > 65535 {
+		return
+	}
+
+	ch := &injectChan{conn: conn, family: parts[1]}
+	em.injectors.add(port, ch)
+	defer em.injectors.remove(port, ch)
+	if p.config.Verbose {
+		log.Printf("Injecting connections to port %d into the app's accept()", port)
+	}
+
+	// The preload sends nothing more; a read returns when it closes
+	for {
+		if _, err := conn.Read(buf); err != nil {
+			return
+		}
+	}
+}
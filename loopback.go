@@ -0,0 +1,183 @@
+package main
+
+import (
+	"context"
+	"net"
+	"syscall"
+	"time"
+	"unsafe"
+)
+
+// Warm loopback connections for exported ports.
+//
+// With export_warm_conns > 0 each export keeps that many connections to its
+// local listener established ahead of time, so a tailnet client is relayed
+// as soon as it arrives instead of waiting for a loopback connect. Idle
+// connections are replaced after loopbackWarmTTL, before typical server idle
+// timeouts, and their TCP state is checked before use, so one the server
+// closed is discarded. Data the server sends first (a banner) stays queued in
+// the socket for the client that takes the connection.
+//
+// Servers that handle one connection at a time block on a warm connection
+// until it is used, so this is off by default.
+
+const (
+	loopbackWarmTTL     = 10 * time.Second
+	loopbackDialTimeout = time.Second
+	loopbackRetry       = time.Second
+
+	tcpEstablished = 1 // TCP_ESTABLISHED in linux/tcp_states.h
+)
+
+type warmConn struct {
+	conn    net.Conn
+	created time.Time
+}
+
+type loopbackPool struct {
+	addr string
+	size int
+	st   *exportPortStats
+	idle chan warmConn
+	kick chan struct{}
+	stop context.CancelFunc
+}
+
+// startLoopbackPool keeps size connections to addr until ctx is done or the
+// pool is closed.
+func startLoopbackPool(ctx context.Context, addr string, size int, st *exportPortStats) *loopbackPool {
+	ctx, stop := context.WithCancel(ctx)
+	lp := &loopbackPool{
+		addr: addr,
+		size: size,
+		st:   st,
+		idle: make(chan warmConn, size),
+		kick: make(chan struct{}, 1),
+		stop: stop,
+	}
+	go lp.run(ctx)
+	return lp
+}
+
+// close stops the pool and closes its idle connections.
+func (lp *loopbackPool) close() {
+	lp.stop()
+}
+
+// get returns a live warm connection, or nil if none is ready.
+func (lp *loopbackPool) get() net.Conn {
+	if lp == nil {
+		return nil
+	}
+	defer lp.refill()
+	for {
+		select {
+		case wc := <-lp.idle:
+			if time.Since(wc.created) < loopbackWarmTTL && loopbackAlive(wc.conn) {
+				lp.st.warmHits.Add(1)
+				return wc.conn
+			}
+			wc.conn.Close()
+		default:
+			lp.st.warmMisses.Add(1)
+			return nil
+		}
+	}
+}
+
+func (lp *loopbackPool) refill() {
+	select {
+	case lp.kick <- struct{}{}:
+	default:
+	}
+}
+
+func (lp *loopbackPool) run(ctx context.Context) {
+	defer func() {
+		for {
+			select {
+			case wc := <-lp.idle:
+				wc.conn.Close()
+			default:
+				return
+			}
+		}
+	}()
+
+	ticker := time.NewTicker(loopbackWarmTTL / 2)
+	defer ticker.Stop()
+	dialer := net.Dialer{Timeout: loopbackDialTimeout}
+	for {
+		// Top up; stop at the first failure and retry after a pause, since
+		// the server may not be accepting yet
+		failed := false
+		for len(lp.idle) < lp.size && ctx.Err() == nil {
+			conn, err := dialer.DialContext(ctx, "tcp", lp.addr)
+			if err != nil {
+				failed = true
+				break
+			}
+			select {
+			case lp.idle <- warmConn{conn, time.Now()}:
+			default:
+				conn.Close()
+			}
+		}
+		if failed {
+			select {
+			case <-ctx.Done():
+				return
+			case <-time.After(loopbackRetry):
+			}
+			continue
+		}
+
+		select {
+		case <-ctx.Done():
+			return
+		case <-lp.kick:
+		case <-ticker.C:
+			lp.expire()
+		}
+	}
+}
+
+// expire replaces idle connections that are too old or closed.
+func (lp *loopbackPool) expire() {
+	for n := len(lp.idle); n > 0; n-- {
+		select {
+		case wc := <-lp.idle:
+			if time.Since(wc.created) < loopbackWarmTTL && loopbackAlive(wc.conn) {
+				lp.idle <- wc
+			} else {
+				wc.conn.Close()
+			}
+		default:
+			return
+		}
+	}
+}
+
+// loopbackAlive reports whether conn is still established, that is, the
+// server has not closed or reset it. It reads the socket state from TCP_INFO
+// rather than peeking, which would not see a close queued behind data the
+// server already sent.
+func loopbackAlive(conn net.Conn) bool {
+	sc, ok := conn.(syscall.Conn)
+	if !ok {
+		return true
+	}
+	rc, err := sc.SyscallConn()
+	if err != nil {
+		return false
+	}
+	alive := false
+	rc.Control(func(fd uintptr) {
+		var info syscall.TCPInfo
+		size := uint32(unsafe.Sizeof(info))
+		_, _, errno := syscall.Syscall6(syscall.SYS_GETSOCKOPT, fd, syscall.IPPROTO_TCP, syscall.TCP_INFO,
+			uintptr(unsafe.Pointer(&info)), uintptr(unsafe.Pointer(&size)), 0)
+		alive = errno == 0 && info.State == tcpEstablished
+	})
+	return alive
+}
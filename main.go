@@ -14,7 +14,10 @@ import (
 )
 
 var (
-	exitNode         = flag.String("exit-node", "", "Tailscale exit node to use (hostname or IP)")
+	exitNode         = flag.String("exit-node", "", "Tailscale exit node to use (hostname or IP; comma-separated for failover candidates)")
+	nodes            = flag.Int("nodes", 1, "Number of tsnet nodes to spread outbound connections across")
+	nodeBalance      = flag.String("node-balance", "hash", "How to spread connections across nodes: 'hash' (by destination) or 'least-load'")
+	exitNodeProbeMs  = flag.Int("exit-node-probe-ms", 30000, "Interval between exit node latency probes in milliseconds (0 disables failover)")
 	configFile       = flag.String("config", "", "Path to configuration file")
 	hostname         = flag.String("hostname", "tailproxy", "Hostname for this tsnet node")
 	authKey          = flag.String("authkey", "", "Tailscale auth key (optional, for unattended setup)")
@@ -23,7 +26,52 @@ var (
 	exportListeners  = flag.Bool("export-listeners", false, "Export bound ports via tsnet")
 	exportAllowPorts = flag.String("export-allow-ports", "", "Comma-separated ports or ranges to allow (e.g. '3000,8080,10000-10100')")
 	exportDenyPorts  = flag.String("export-deny-ports", "", "Comma-separated ports or ranges to deny")
-	exportMax        = flag.Int("export-max", 32, "Maximum number of simultaneous exported ports")
+	exportMax        = flag.Int("export-max", 4096, "Maximum number of simultaneous exported ports")
+	exportWarmConns  = flag.Int("export-warm-conns", 0, "Loopback connections to keep open to each exported port (0 disables)")
+	exportInject     = flag.Bool("export-inject", false, "Pass exported connections directly into the app's accept() instead of over loopback")
+	exportGraceMs    = flag.Int("export-grace-ms", 0, "Keep a port exported this long after the app closes its listener, holding new connections until it listens again (0 disables)")
+	exportGraceQueue = flag.Int("export-grace-queue", 64, "Maximum connections held per port while waiting for the app to listen again")
+	exportMaxConns   = flag.Int("export-max-conns", 0, "Maximum connections forwarded at once per exported port (0 for no limit)")
+	exportConnQueue  = flag.Int("export-conn-queue", 64, "Connections that may wait per exported port once export-max-conns is reached")
+	exportIdleMs     = flag.Int("export-idle-timeout-ms", 0, "Close exported connections idle this long in milliseconds (0 disables)")
+	exportLifetimeMs = flag.Int("export-max-lifetime-ms", 0, "Close exported connections open this long in milliseconds (0 disables)")
+	exportProxyProto = flag.String("export-proxy-protocol", "", "Exported ports or ranges that get a PROXY v2 header with the tailnet peer's address and identity")
+	exportUDPIdleMs  = flag.Int("export-udp-idle-ms", 30000, "Close an exported UDP port's flow to a tailnet peer after this many idle milliseconds")
+	exportUDPFlows   = flag.Int("export-udp-max-flows", 1024, "Maximum tailnet peers with a flow open per exported UDP port")
+	exportUnix       = flag.String("export-unix", "", "Export Unix socket listeners as tailnet ports (e.g. '/run/app.sock=8000,@name=9000')")
+	bypass           = flag.String("bypass", "", "Comma-separated addresses or CIDRs to connect to directly instead of through the tailnet")
+	traceFile        = flag.String("trace-file", "", "Write sampled connection traces to this file in Chrome trace format")
+	traceSample      = flag.Float64("trace-sample", 0.01, "Fraction of connections to trace")
+	top              = flag.Bool("top", false, "Show the live connection table of the proxy running as -hostname, then exit")
+	topSort          = flag.String("top-sort", topSortRate, "Sort -top by 'rate', 'age' or 'bytes'")
+	topIntervalMs    = flag.Int("top-interval-ms", 1000, "Refresh -top this often in milliseconds (0 prints once)")
+	metricsListen    = flag.String("metrics-listen", "", "Serve Prometheus metrics and pprof on this loopback address or unix:/path")
+
+	dialTimeoutMs         = flag.Int("dial-timeout-ms", 30000, "Timeout for tailnet dials in milliseconds")
+	dialNegativeTTLMs     = flag.Int("dial-negative-ttl-ms", 1000, "Fail dials fast for this long after a destination fails (negative disables)")
+	dialBreakerThreshold  = flag.Int("dial-breaker-threshold", 5, "Consecutive dial failures that open a destination's circuit breaker (negative disables)")
+	dialBreakerCooldownMs = flag.Int("dial-breaker-cooldown-ms", 5000, "How long an open circuit breaker fails dials before probing again")
+	dialStaggerMs         = flag.Int("dial-stagger-ms", 250, "Delay between racing attempts to a hostname's addresses (negative dials by name without racing)")
+	dialHedgeMs           = flag.Int("dial-hedge-ms", 0, "Start a hedged retry if a dial has not connected after this many milliseconds (0 disables)")
+
+	preconnectSize        = flag.Int("preconnect-size", 0, "Idle pre-established tailnet connections kept per hot destination (0 disables)")
+	preconnectMinConnects = flag.Int("preconnect-min-connects", 20, "CONNECTs within 10s that mark a destination as hot")
+	preconnectTTLMs       = flag.Int("preconnect-ttl-ms", 10000, "Discard pre-established connections unused for this many milliseconds")
+
+	schedRateKBps          = flag.Int("sched-rate-kbps", 0, "Per-node relay capacity in KiB/s for fair queuing between flow classes (0 disables)")
+	schedInteractivePorts  = flag.String("sched-interactive-ports", defaultInteractivePorts, "Destination ports scheduled as interactive")
+	schedBulkPorts         = flag.String("sched-bulk-ports", "", "Destination ports scheduled as bulk")
+	schedBulkKBps          = flag.Int("sched-bulk-kbps", 1024, "Flows moving more than this many KiB in one second are demoted to bulk")
+	schedWeightInteractive = flag.Int("sched-weight-interactive", 8, "Scheduler weight of interactive flows")
+	schedWeightDefault     = flag.Int("sched-weight-default", 4, "Scheduler weight of default flows")
+	schedWeightBulk        = flag.Int("sched-weight-bulk", 1, "Scheduler weight of bulk flows")
+
+	pathWarmMs     = flag.Int("path-warm-ms", 0, "Ping the exit node and recently used peers this often to keep paths warm (0 disables)")
+	pathWarmIdleMs = flag.Int("path-warm-idle-ms", 600000, "Stop warming a peer's path after this long without connections")
+	pathWaitMs     = flag.Int("path-wait-ms", 0, "Delay new connections up to this long while a direct path to their peer is established (0 disables)")
+
+	drainTimeoutMs   = flag.Int("drain-timeout-ms", 30000, "On shutdown in proxy-only mode, wait this long for open connections to finish")
+	upgradeTimeoutMs = flag.Int("upgrade-timeout-ms", 120000, "On SIGUSR2, wait this long for the upgraded process to be ready")
 )
 
 func init() {
@@ -40,7 +88,9 @@ func init() {
 		fmt.Fprintf(os.Stderr, "  # Run proxy server only\n")
 		fmt.Fprintf(os.Stderr, "  %s -exit-node=exit-node-1\n\n", os.Args[0])
 		fmt.Fprintf(os.Stderr, "  # Execute command with transparent proxying\n")
-		fmt.Fprintf(os.Stderr, "  %s -exit-node=exit-node-1 curl https://ifconfig.me\n", os.Args[0])
+		fmt.Fprintf(os.Stderr, "  %s -exit-node=exit-node-1 curl https://ifconfig.me\n\n", os.Args[0])
+		fmt.Fprintf(os.Stderr, "  # Watch the connections of a running proxy\n")
+		fmt.Fprintf(os.Stderr, "  %s -top\n", os.Args[0])
 	}
 }
 
@@ -61,6 +111,9 @@ func main() {
 	} else {
 		config = &Config{
 			ExitNode:         *exitNode,
+			ExitNodeProbeMs:  *exitNodeProbeMs,
+			Nodes:            *nodes,
+			NodeBalance:      *nodeBalance,
 			Hostname:         *hostname,
 			AuthKey:          *authKey,
 			ProxyPort:        *proxyPort,
@@ -69,42 +122,78 @@ func main() {
 			ExportAllowPorts: *exportAllowPorts,
 			ExportDenyPorts:  *exportDenyPorts,
 			ExportMax:        *exportMax,
+			ExportWarmConns:  *exportWarmConns,
+			ExportInject:     *exportInject,
+			ExportGraceMs:    *exportGraceMs,
+			ExportGraceQueue: *exportGraceQueue,
+			Bypass:           *bypass,
+			MetricsListen:    *metricsListen,
+			TraceFile:        *traceFile,
+			TraceSample:      *traceSample,
+
+			ExportMaxConns:      *exportMaxConns,
+			ExportConnQueue:     *exportConnQueue,
+			ExportIdleTimeoutMs: *exportIdleMs,
+			ExportMaxLifetimeMs: *exportLifetimeMs,
+			ExportProxyProtocol: *exportProxyProto,
+
+			ExportUDPIdleMs:   *exportUDPIdleMs,
+			ExportUDPMaxFlows: *exportUDPFlows,
+			ExportUnix:        *exportUnix,
+
+			DialTimeoutMs:         *dialTimeoutMs,
+			DialNegativeTTLMs:     *dialNegativeTTLMs,
+			DialBreakerThreshold:  *dialBreakerThreshold,
+			DialBreakerCooldownMs: *dialBreakerCooldownMs,
+			DialStaggerMs:         *dialStaggerMs,
+			DialHedgeMs:           *dialHedgeMs,
+
+			PreconnectSize:        *preconnectSize,
+			PreconnectMinConnects: *preconnectMinConnects,
+			PreconnectTTLMs:       *preconnectTTLMs,
+
+			SchedRateKBps:          *schedRateKBps,
+			SchedInteractivePorts:  *schedInteractivePorts,
+			SchedBulkPorts:         *schedBulkPorts,
+			SchedBulkKBps:          *schedBulkKBps,
+			SchedWeightInteractive: *schedWeightInteractive,
+			SchedWeightDefault:     *schedWeightDefault,
+			SchedWeightBulk:        *schedWeightBulk,
+
+			PathWarmMs:     *pathWarmMs,
+			PathWarmIdleMs: *pathWarmIdleMs,
+			PathWaitMs:     *pathWaitMs,
+
+			DrainTimeoutMs:   *drainTimeoutMs,
+			UpgradeTimeoutMs: *upgradeTimeoutMs,
 		}
 	}
 
-	// Override config with command-line flags if provided
-	if *exitNode != "" {
-		config.ExitNode = *exitNode
-	}
-	if *hostname != "tailproxy" {
-		config.Hostname = *hostname
-	}
-	if *authKey != "" {
-		config.AuthKey = *authKey
-	}
-	if flag.Lookup("export-listeners").Value.String() != flag.Lookup("export-listeners").DefValue {
-		config.ExportListeners = *exportListeners
-	}
-	if *exportAllowPorts != "" {
-		config.ExportAllowPorts = *exportAllowPorts
-	}
-	if *exportDenyPorts != "" {
-		config.ExportDenyPorts = *exportDenyPorts
-	}
-	if *exportMax != 32 {
-		config.ExportMax = *exportMax
+	applyFlagOverrides(config)
+
+	if *top {
+		interval := time.Duration(*topIntervalMs) * time.Millisecond
+		if err := runTop(topSocketPath(config.Hostname), *topSort, interval); err != nil {
+			log.Fatalf("%v", err)
+		}
+		return
 	}
 
 	ctx, cancel := context.WithCancel(context.Background())
 	defer cancel()
 
-	// Handle signals
+	// Handle signals. Once the proxy is ready, proxy-only mode takes over
+	// signal handling to drain connections before exiting.
 	sigChan := make(chan os.Signal, 1)
 	signal.Notify(sigChan, os.Interrupt, syscall.SIGTERM)
+	takeSignals := make(chan struct{})
 	go func() {
-		<-sigChan
-		log.Println("Received interrupt signal, shutting down...")
-		cancel()
+		select {
+		case <-sigChan:
+			log.Println("Received interrupt signal, shutting down...")
+			cancel()
+		case <-takeSignals:
+		}
 	}()
 
 	// Start the proxy server
@@ -113,6 +202,28 @@ func main() {
 		log.Fatalf("Failed to create proxy server: %v", err)
 	}
 
+	// SIGHUP, or RELOAD on the control socket, re-reads the config file for
+	// settings that can change at runtime
+	if *configFile != "" {
+		proxy.loadConfig = func() (*Config, error) {
+			config, err := LoadConfig(*configFile)
+			if err != nil {
+				return nil, err
+			}
+			applyFlagOverrides(config)
+			return config, nil
+		}
+	}
+	hupChan := make(chan os.Signal, 1)
+	signal.Notify(hupChan, syscall.SIGHUP)
+	go func() {
+		for range hupChan {
+			if _, err := proxy.ReloadConfig(); err != nil {
+				log.Printf("Failed to reload config: %v", err)
+			}
+		}
+	}()
+
 	proxyChan := make(chan error, 1)
 	readyChan := make(chan struct{})
 	go func() {
@@ -130,16 +241,57 @@ func main() {
 	if proxyOnly {
 		// Proxy-only mode: just wait for interrupt
 		fmt.Fprintf(os.Stderr, "SOCKS5 proxy running on 127.0.0.1:%d\n", config.ProxyPort)
-		if config.ExitNode != "" {
-			fmt.Fprintf(os.Stderr, "Using exit node: %s\n", config.ExitNode)
+		for _, node := range proxy.nodes {
+			if exit := node.exits.current(); exit != "" {
+				fmt.Fprintf(os.Stderr, "Using exit node: %s (via %s)\n", exit, node.hostname)
+			}
 		}
 		if config.ExportListeners {
 			fmt.Fprintf(os.Stderr, "Export listeners mode: enabled\n")
 		}
 		fmt.Fprintf(os.Stderr, "Press Ctrl+C to stop\n")
 
-		// Wait for interrupt
-		<-sigChan
+		// SIGUSR2 hands the listeners to a new copy of the executable
+		upgradeChan := make(chan os.Signal, 1)
+		signal.Notify(upgradeChan, syscall.SIGUSR2)
+		close(takeSignals)
+
+		handoff := false
+	wait:
+		for {
+			select {
+			case <-sigChan:
+				log.Println("Received interrupt signal, draining connections (interrupt again to stop now)...")
+				break wait
+			case <-upgradeChan:
+				log.Println("Received SIGUSR2, upgrading...")
+				if err := proxy.Upgrade(time.Duration(config.UpgradeTimeoutMs) * time.Millisecond); err != nil {
+					log.Printf("Upgrade failed, still serving: %v", err)
+					continue
+				}
+				handoff = true
+				break wait
+			case err := <-proxyChan:
+				if err != nil && err != context.Canceled {
+					log.Printf("Proxy server error: %v", err)
+				}
+				proxy.Stop()
+				return
+			}
+		}
+
+		// Drain open connections, or stop at once on a second interrupt
+		drainCtx, stopDrain := context.WithCancel(ctx)
+		go func() {
+			select {
+			case <-sigChan:
+				log.Println("Received interrupt signal, shutting down...")
+				stopDrain()
+			case <-drainCtx.Done():
+			}
+		}()
+		proxy.Drain(drainCtx, time.Duration(config.DrainTimeoutMs)*time.Millisecond, handoff)
+		stopDrain()
 		cancel()
 
 		// Wait for proxy to finish
@@ -153,6 +305,7 @@ func main() {
 				log.Println("Timeout waiting for proxy to stop")
 			}
 		}
+		proxy.Stop()
 		return
 	}
 
@@ -179,6 +332,7 @@ func main() {
 		fmt.Sprintf("LD_PRELOAD=%s", preloadLib),
 		fmt.Sprintf("TAILPROXY_HOST=127.0.0.1"),
 		fmt.Sprintf("TAILPROXY_PORT=%d", config.ProxyPort),
+		fmt.Sprintf("TAILPROXY_POLICY_SHM=%s", proxy.GetPolicyShmPath()),
 	)
 
 	if config.Verbose {
@@ -191,6 +345,19 @@ func main() {
 			"TAILPROXY_EXPORT_LISTENERS=1",
 			fmt.Sprintf("TAILPROXY_CONTROL_SOCK=%s", proxy.GetControlSocketPath()),
 		)
+		if config.ExportInject {
+			env = append(env, fmt.Sprintf("TAILPROXY_INJECT_SOCK=%s", proxy.GetInjectSocketPath()))
+		}
+		if spec := proxy.GetExportUnixSpec(); spec != "" {
+			env = append(env, fmt.Sprintf("TAILPROXY_EXPORT_UNIX=%s", spec))
+		}
+	}
+
+	if tracePath := proxy.GetTraceFilePath(); tracePath != "" {
+		env = append(env,
+			fmt.Sprintf("TAILPROXY_TRACE_FILE=%s", tracePath),
+			fmt.Sprintf("TAILPROXY_TRACE_SAMPLE=%g", config.TraceSample),
+		)
 	}
 
 	cmd.Env = env
@@ -229,3 +396,150 @@ func main() {
 		log.Fatalf("Command failed: %v", cmdErr)
 	}
 }
+
+// applyFlagOverrides overrides config with command-line flags that differ from
+// their defaults. Reloads apply them again, so flags keep precedence over the
+// config file.
+func applyFlagOverrides(config *Config) {
+	if *exitNode != "" {
+		config.ExitNode = *exitNode
+	}
+	if *exitNodeProbeMs != 30000 {
+		config.ExitNodeProbeMs = *exitNodeProbeMs
+	}
+	if *nodes != 1 {
+		config.Nodes = *nodes
+	}
+	if *nodeBalance != "hash" {
+		config.NodeBalance = *nodeBalance
+	}
+	if *hostname != "tailproxy" {
+		config.Hostname = *hostname
+	}
+	if *authKey != "" {
+		config.AuthKey = *authKey
+	}
+	if flag.Lookup("export-listeners").Value.String() != flag.Lookup("export-listeners").DefValue {
+		config.ExportListeners = *exportListeners
+	}
+	if *exportAllowPorts != "" {
+		config.ExportAllowPorts = *exportAllowPorts
+	}
+	if *exportDenyPorts != "" {
+		config.ExportDenyPorts = *exportDenyPorts
+	}
+	if *exportMax != 4096 {
+		config.ExportMax = *exportMax
+	}
+	if *exportWarmConns != 0 {
+		config.ExportWarmConns = *exportWarmConns
+	}
+	if flag.Lookup("export-inject").Value.String() != flag.Lookup("export-inject").DefValue {
+		config.ExportInject = *exportInject
+	}
+	if *exportGraceMs != 0 {
+		config.ExportGraceMs = *exportGraceMs
+	}
+	if *exportGraceQueue != 64 {
+		config.ExportGraceQueue = *exportGraceQueue
+	}
+	if *exportMaxConns != 0 {
+		config.ExportMaxConns = *exportMaxConns
+	}
+	if *exportConnQueue != 64 {
+		config.ExportConnQueue = *exportConnQueue
+	}
+	if *exportIdleMs != 0 {
+		config.ExportIdleTimeoutMs = *exportIdleMs
+	}
+	if *exportLifetimeMs != 0 {
+		config.ExportMaxLifetimeMs = *exportLifetimeMs
+	}
+	if *exportProxyProto != "" {
+		config.ExportProxyProtocol = *exportProxyProto
+	}
+	if *exportUDPIdleMs != 30000 {
+		config.ExportUDPIdleMs = *exportUDPIdleMs
+	}
+	if *exportUDPFlows != 1024 {
+		config.ExportUDPMaxFlows = *exportUDPFlows
+	}
+	if *exportUnix != "" {
+		config.ExportUnix = *exportUnix
+	}
+	if *bypass != "" {
+		config.Bypass = *bypass
+	}
+	if *metricsListen != "" {
+		config.MetricsListen = *metricsListen
+	}
+	if *traceFile != "" {
+		config.TraceFile = *traceFile
+	}
+	if *traceSample != 0.01 {
+		config.TraceSample = *traceSample
+	}
+	if *dialTimeoutMs != 30000 {
+		config.DialTimeoutMs = *dialTimeoutMs
+	}
+	if *dialNegativeTTLMs != 1000 {
+		config.DialNegativeTTLMs = *dialNegativeTTLMs
+	}
+	if *dialBreakerThreshold != 5 {
+		config.DialBreakerThreshold = *dialBreakerThreshold
+	}
+	if *dialBreakerCooldownMs != 5000 {
+		config.DialBreakerCooldownMs = *dialBreakerCooldownMs
+	}
+	if *dialStaggerMs != 250 {
+		config.DialStaggerMs = *dialStaggerMs
+	}
+	if *dialHedgeMs != 0 {
+		config.DialHedgeMs = *dialHedgeMs
+	}
+	if *preconnectSize != 0 {
+		config.PreconnectSize = *preconnectSize
+	}
+	if *preconnectMinConnects != 20 {
+		config.PreconnectMinConnects = *preconnectMinConnects
+	}
+	if *preconnectTTLMs != 10000 {
+		config.PreconnectTTLMs = *preconnectTTLMs
+	}
+	if *schedRateKBps != 0 {
+		config.SchedRateKBps = *schedRateKBps
+	}
+	if *schedInteractivePorts != defaultInteractivePorts {
+		config.SchedInteractivePorts = *schedInteractivePorts
+	}
+	if *schedBulkPorts != "" {
+		config.SchedBulkPorts = *schedBulkPorts
+	}
+	if *schedBulkKBps != 1024 {
+		config.SchedBulkKBps = *schedBulkKBps
+	}
+	if *schedWeightInteractive != 8 {
+		config.SchedWeightInteractive = *schedWeightInteractive
+	}
+	if *schedWeightDefault != 4 {
+		config.SchedWeightDefault = *schedWeightDefault
+	}
+	if *schedWeightBulk != 1 {
+		config.SchedWeightBulk = *schedWeightBulk
+	}
+	if *pathWarmMs != 0 {
+		config.PathWarmMs = *pathWarmMs
+	}
+	if *pathWarmIdleMs != 600000 {
+		config.PathWarmIdleMs = *pathWarmIdleMs
+	}
+	if *pathWaitMs != 0 {
+		config.PathWaitMs = *pathWaitMs
+	}
+	if *drainTimeoutMs != 30000 {
+		config.DrainTimeoutMs = *drainTimeoutMs
+	}
+	if *upgradeTimeoutMs != 120000 {
+		config.UpgradeTimeoutMs = *upgradeTimeoutMs
+	}
+}
@@ -0,0 +1,478 @@
+package main
+
+import (
+	"bufio"
+	"context"
+	"fmt"
+	"log"
+	"net"
+	"net/http"
+	"net/http/pprof"
+	"os"
+	"runtime"
+	"sort"
+	"strconv"
+	"strings"
+	"sync/atomic"
+	"time"
+)
+
+// Metrics and profiling endpoint.
+//
+// With metrics_listen set, tailproxy serves Prometheus text-format metrics
+// on /metrics and the net/http/pprof handlers under /debug/pprof/, on a
+// loopback address or a Unix socket ("unix:/path"). Connection goroutines
+// carry "stage" and "dest" profiler labels (plus "node" while relaying, and
+// "export_port" for exported ports), so CPU, heap and goroutine profiles can
+// be broken down per connection stage and destination.
+
+// SOCKS handshake failure reasons
+const (
+	handshakeGreeting = iota
+	handshakeAuth
+	handshakeRequest
+	handshakeCommand
+	handshakeAddress
+	numHandshakeFailures
+)
+
+var handshakeFailureNames = [numHandshakeFailures]string{"greeting", "auth", "request", "command", "address"}
+
+// Dial outcomes
+const (
+	dialSuccess = iota
+	dialFailure
+	numDialOutcomes
+)
+
+var dialOutcomeNames = [numDialOutcomes]string{"success", "failure"}
+
+// proxyMetrics holds counters that have no other natural home.
+type proxyMetrics struct {
+	handshakeFailures [numHandshakeFailures]atomic.Uint64
+	dialLatency       [numDialOutcomes]latencyHistogram
+	dialFastFailures  atomic.Uint64 // rejected by the breaker without dialing
+	pooledConnects    atomic.Uint64 // served from the pre-connect pool
+}
+
+func (m *proxyMetrics) handshakeFailed(reason int) {
+	m.handshakeFailures[reason].Add(1)
+}
+
+// startMetrics serves the metrics endpoint until ctx is done.
+func (p *ProxyServer) startMetrics(ctx context.Context) error {
+	addr := p.config.MetricsListen
+	var ln net.Listener
+	var err error
+	if path, ok := strings.CutPrefix(addr, "unix:"); ok {
+		os.Remove(path)
+		ln, err = net.Listen("unix", path)
+		if err == nil {
+			os.Chmod(path, 0600)
+		}
+	} else {
+		host, _, splitErr := net.SplitHostPort(addr)
+		if splitErr != nil {
+			return fmt.Errorf("invalid metrics address %q: %w", addr, splitErr)
+		}
+		if ip := net.ParseIP(host); host != "localhost" && (ip == nil || !ip.IsLoopback()) {
+			return fmt.Errorf("metrics address %q must be a loopback address or unix:/path", addr)
+		}
+		ln, err = net.Listen("tcp", addr)
+	}
+	if err != nil {
+		return fmt.Errorf("failed to listen for metrics: %w", err)
+	}
+
+	mux := http.NewServeMux()
+	mux.HandleFunc("/metrics", p.serveMetrics)
+	mux.HandleFunc("/debug/pprof/", pprof.Index)
+	mux.HandleFunc("/debug/pprof/cmdline", pprof.Cmdline)
+	mux.HandleFunc("/debug/pprof/profile", pprof.Profile)
+	mux.HandleFunc("/debug/pprof/symbol", pprof.Symbol)
+	mux.HandleFunc("/debug/pprof/trace", pprof.Trace)
+
+	srv := &http.Server{Handler: mux, ReadHeaderTimeout: 10 * time.Second}
+	go func() {
+		<-ctx.Done()
+		srv.Close()
+	}()
+	go func() {
+		if err := srv.Serve(ln); err != nil && err != http.ErrServerClosed {
+			log.Printf("Metrics server error: %v", err)
+		}
+	}()
+
+	if p.config.Verbose {
+		log.Printf("Serving metrics and pprof on %s", addr)
+	}
+	return nil
+}
+
+// promWriter collects metrics in the Prometheus text exposition format.
+// Samples are grouped under their family's header, whatever order they are
+// added in, since the format requires families to be contiguous.
+type promWriter struct {
+	order    []string
+	families map[string]*promFamily
+}
+
+type promFamily struct {
+	header string
+	lines  []string
+}
+
+func newPromWriter() *promWriter {
+	return &promWriter{families: make(map[string]*promFamily)}
+}
+
+func (pw *promWriter) header(name, typ, help string) {
+	pw.order = append(pw.order, name)
+	pw.families[name] = &promFamily{header: fmt.Sprintf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, typ)}
+}
+
+func (pw *promWriter) add(family, name, labels string, value float64) {
+	if labels != "" {
+		labels = "{" + labels + "}"
+	}
+	f := pw.families[family]
+	f.lines = append(f.lines, name+labels+" "+strconv.FormatFloat(value, 'g', -1, 64)+"\n")
+}
+
+func (pw *promWriter) sample(name, labels string, value float64) {
+	pw.add(name, name, labels, value)
+}
+
+// histogram adds a latency histogram in seconds.
+func (pw *promWriter) histogram(name, labels string, h histogramSnapshot) {
+	sep := ""
+	if labels != "" {
+		sep = ","
+	}
+	var cumulative uint64
+	for i, c := range h.Counts {
+		cumulative += c
+		le := "+Inf"
+		if i < len(latencyBuckets) {
+			le = strconv.FormatFloat(latencyBuckets[i].Seconds(), 'g', -1, 64)
+		}
+		pw.add(name, name+"_bucket", labels+sep+`le="`+le+`"`, float64(cumulative))
+	}
+	pw.add(name, name+"_sum", labels, h.Sum.Seconds())
+	pw.add(name, name+"_count", labels, float64(cumulative))
+}
+
+func (pw *promWriter) writeTo(w *bufio.Writer) {
+	for _, name := range pw.order {
+		f := pw.families[name]
+		w.WriteString(f.header)
+		for _, line := range f.lines {
+			w.WriteString(line)
+		}
+	}
+}
+
+var promEscaper = strings.NewReplacer(`\`, `\\`, `"`, `\"`, "\n", `\n`)
+
+// promLabels formats alternating label names and values.
+func promLabels(kv ...string) string {
+	var b strings.Builder
+	for i := 0; i+1 < len(kv); i += 2 {
+		if i > 0 {
+			b.WriteByte(',')
+		}
+		b.WriteString(kv[i])
+		b.WriteString(`="`)
+		b.WriteString(promEscaper.Replace(kv[i+1]))
+		b.WriteByte('"')
+	}
+	return b.String()
+}
+
+func (p *ProxyServer) serveMetrics(w http.ResponseWriter, r *http.Request) {
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4; charset=utf-8")
+	pw := newPromWriter()
+	defer func() {
+		bw := bufio.NewWriter(w)
+		pw.writeTo(bw)
+		bw.Flush()
+	}()
+
+	// Connections and bytes per node
+	nodes := p.nodeSnapshot()
+	pw.header("tailproxy_connections_active", "gauge", "Proxied connections currently relaying.")
+	for _, st := range nodes {
+		pw.sample("tailproxy_connections_active", promLabels("node", st.Hostname), float64(st.Active))
+	}
+	pw.header("tailproxy_connections_total", "counter", "Proxied connections established.")
+	for _, st := range nodes {
+		pw.sample("tailproxy_connections_total", promLabels("node", st.Hostname), float64(st.Conns))
+	}
+	pw.header("tailproxy_bytes_total", "counter", "Bytes relayed; direction in is tailnet to client.")
+	for _, st := range nodes {
+		pw.sample("tailproxy_bytes_total", promLabels("node", st.Hostname, "direction", "in"), float64(st.BytesIn))
+		pw.sample("tailproxy_bytes_total", promLabels("node", st.Hostname, "direction", "out"), float64(st.BytesOut))
+	}
+
+	// Handshakes and dials
+	pw.header("tailproxy_socks_handshake_failures_total", "counter", "SOCKS5 handshakes that failed, by stage.")
+	for i, name := range handshakeFailureNames {
+		pw.sample("tailproxy_socks_handshake_failures_total", promLabels("reason", name), float64(p.metrics.handshakeFailures[i].Load()))
+	}
+	pw.header("tailproxy_dial_duration_seconds", "histogram", "Tailnet dial latency by outcome.")
+	for i, name := range dialOutcomeNames {
+		pw.histogram("tailproxy_dial_duration_seconds", promLabels("outcome", name), p.metrics.dialLatency[i].snapshot())
+	}
+	pw.header("tailproxy_dial_fast_failures_total", "counter", "Connects refused by the negative cache or circuit breaker without dialing.")
+	pw.sample("tailproxy_dial_fast_failures_total", "", float64(p.metrics.dialFastFailures.Load()))
+	pw.header("tailproxy_preconnect_claims_total", "counter", "Connects served from the pre-connect pool.")
+	pw.sample("tailproxy_preconnect_claims_total", "", float64(p.metrics.pooledConnects.Load()))
+
+	// Exit nodes
+	pw.header("tailproxy_exit_node_active", "gauge", "Whether the exit node is the active one of the tsnet node.")
+	pw.header("tailproxy_exit_node_latency_seconds", "gauge", "Last probe latency of the exit node.")
+	for _, node := range p.nodes {
+		for _, st := range node.exits.snapshot() {
+			labels := promLabels("node", node.hostname, "exit_node", st.Name)
+			active := 0.0
+			if st.Active {
+				active = 1
+			}
+			pw.sample("tailproxy_exit_node_active", labels, active)
+			pw.sample("tailproxy_exit_node_latency_seconds", labels, st.Latency.Seconds())
+		}
+	}
+
+	// Peer paths
+	pw.header("tailproxy_peer_index_refreshes_total", "counter", "Rebuilds of the peer index after netmap changes.")
+	pw.header("tailproxy_peer_path_direct", "gauge", "Whether the last observed path to the peer was direct (1) or DERP-relayed (0).")
+	pw.header("tailproxy_peer_rtt_seconds", "gauge", "Last disco ping round trip to the peer.")
+	pw.header("tailproxy_path_waits_total", "counter", "Connections that waited for a direct path, by whether they got one.")
+	pw.header("tailproxy_path_wait_seconds_total", "counter", "Time connections spent waiting for a direct path.")
+	for _, node := range p.nodes {
+		m := node.peers
+		pw.sample("tailproxy_peer_index_refreshes_total", promLabels("node", node.hostname), float64(m.refreshes.Load()))
+		for _, st := range m.snapshot() {
+			if !st.Known {
+				continue
+			}
+			labels := promLabels("node", node.hostname, "peer", st.Peer, "derp", st.DERP)
+			direct := 0.0
+			if st.Direct {
+				direct = 1
+			}
+			pw.sample("tailproxy_peer_path_direct", labels, direct)
+			if st.RTT > 0 {
+				pw.sample("tailproxy_peer_rtt_seconds", labels, st.RTT.Seconds())
+			}
+		}
+		waits, direct := m.waits.Load(), m.waitsDirect.Load()
+		pw.sample("tailproxy_path_waits_total", promLabels("node", node.hostname, "outcome", "direct"), float64(direct))
+		pw.sample("tailproxy_path_waits_total", promLabels("node", node.hostname, "outcome", "relayed"), float64(waits-direct))
+		pw.sample("tailproxy_path_wait_seconds_total", promLabels("node", node.hostname), time.Duration(m.waitTime.Load()).Seconds())
+	}
+
+	// Scheduler
+	pw.header("tailproxy_sched_bytes_total", "counter", "Bytes granted by the relay scheduler, by class.")
+	pw.header("tailproxy_sched_queue_delay_seconds_total", "counter", "Time chunks spent queued in the relay scheduler, by class.")
+	pw.header("tailproxy_sched_queued_total", "counter", "Chunks that had to queue in the relay scheduler, by class.")
+	for _, node := range p.nodes {
+		for _, s := range []*relayScheduler{node.schedUp, node.schedDown} {
+			if s == nil {
+				continue
+			}
+			for i, st := range s.snapshot() {
+				labels := promLabels("scheduler", s.name, "class", flowClass(i).String())
+				pw.sample("tailproxy_sched_bytes_total", labels, float64(st.Bytes))
+				pw.sample("tailproxy_sched_queue_delay_seconds_total", labels, st.DelayTotal.Seconds())
+				pw.sample("tailproxy_sched_queued_total", labels, float64(st.Queued))
+			}
+		}
+	}
+
+	// Rate limits
+	pw.header("tailproxy_rate_limit_bytes_total", "counter", "Bytes passed through a rate limit.")
+	pw.header("tailproxy_rate_limit_wait_seconds_total", "counter", "Time flows were held back by a rate limit.")
+	for _, st := range p.limits.snapshot() {
+		labels := promLabels("rule", st.Rule)
+		pw.sample("tailproxy_rate_limit_bytes_total", labels, float64(st.Bytes))
+		pw.sample("tailproxy_rate_limit_wait_seconds_total", labels, st.WaitTime.Seconds())
+	}
+
+	// Processes
+	procs := p.procStats.snapshot()
+	pw.header("tailproxy_process_connections_total", "counter", "Proxied connections by originating process.")
+	for _, st := range procs {
+		pw.sample("tailproxy_process_connections_total", promLabels("process", st.Name, "cgroup", st.Cgroup), float64(st.Conns))
+	}
+	pw.header("tailproxy_process_bytes_total", "counter", "Bytes relayed by originating process.")
+	for _, st := range procs {
+		pw.sample("tailproxy_process_bytes_total", promLabels("process", st.Name, "cgroup", st.Cgroup, "direction", "in"), float64(st.BytesIn))
+		pw.sample("tailproxy_process_bytes_total", promLabels("process", st.Name, "cgroup", st.Cgroup, "direction", "out"), float64(st.BytesOut))
+	}
+	pw.header("tailproxy_process_dial_duration_seconds", "histogram", "Tailnet dial latency by originating process.")
+	for _, st := range procs {
+		pw.histogram("tailproxy_process_dial_duration_seconds", promLabels("process", st.Name, "cgroup", st.Cgroup), st.DialLatency)
+	}
+
+	// Exporter
+	if p.exporterManager != nil {
+		exports := p.exporterManager.snapshot()
+		pw.header("tailproxy_export_active", "gauge", "Whether the port is currently exported.")
+		pw.header("tailproxy_export_accepts_total", "counter", "Tailnet connections accepted on an exported port.")
+		pw.header("tailproxy_export_forward_failures_total", "counter", "Accepted connections that could not reach the local port.")
+		pw.header("tailproxy_export_forwards_active", "gauge", "Connections currently forwarded to the local port.")
+		pw.header("tailproxy_export_warm_hits_total", "counter", "Connections forwarded on a warm loopback connection.")
+		pw.header("tailproxy_export_warm_misses_total", "counter", "Connections that found no warm loopback connection ready.")
+		pw.header("tailproxy_export_injected_total", "counter", "Connections passed directly to the app's accept().")
+		pw.header("tailproxy_export_held_total", "counter", "Connections held while the local port was not accepting.")
+		pw.header("tailproxy_export_rejected_total", "counter", "Connections refused because the port was at export_max_conns with a full queue.")
+		pw.header("tailproxy_export_queued", "gauge", "Connections waiting for a forwarding slot.")
+		pw.header("tailproxy_export_deadline_closes_total", "counter", "Forwarded connections closed by the idle or lifetime deadline.")
+		pw.header("tailproxy_export_denied_total", "counter", "Connections refused by export_acls.")
+		for _, st := range exports {
+			labels := promLabels("port", strconv.Itoa(st.Port))
+			active := 0.0
+			if st.Exported {
+				active = 1
+			}
+			pw.sample("tailproxy_export_active", labels, active)
+			pw.sample("tailproxy_export_accepts_total", labels, float64(st.Accepts))
+			pw.sample("tailproxy_export_forward_failures_total", labels, float64(st.ForwardFailures))
+			pw.sample("tailproxy_export_forwards_active", labels, float64(st.Active))
+			pw.sample("tailproxy_export_warm_hits_total", labels, float64(st.WarmHits))
+			pw.sample("tailproxy_export_warm_misses_total", labels, float64(st.WarmMisses))
+			pw.sample("tailproxy_export_injected_total", labels, float64(st.Injected))
+			pw.sample("tailproxy_export_held_total", labels, float64(st.Held))
+			pw.sample("tailproxy_export_rejected_total", labels, float64(st.Rejected))
+			pw.sample("tailproxy_export_queued", labels, float64(st.Queued))
+			pw.sample("tailproxy_export_deadline_closes_total", labels, float64(st.DeadlineCloses))
+			pw.sample("tailproxy_export_denied_total", labels, float64(st.Denied))
+		}
+		pw.header("tailproxy_export_forward_duration_seconds", "histogram", "Latency of connecting to the local port.")
+		for _, st := range exports {
+			pw.histogram("tailproxy_export_forward_duration_seconds", promLabels("port", strconv.Itoa(st.Port)), st.ForwardLatency)
+		}
+		udp := p.exporterManager.snapshotUDP()
+		pw.header("tailproxy_export_udp_flows", "gauge", "Tailnet peers with an open flow to an exported UDP port.")
+		pw.header("tailproxy_export_udp_flows_total", "counter", "Flows started on an exported UDP port.")
+		pw.header("tailproxy_export_udp_flows_expired_total", "counter", "Flows closed after export_udp_idle_ms without traffic.")
+		pw.header("tailproxy_export_udp_dropped_total", "counter", "Datagrams dropped by the flow limit, export_acls or a failed send.")
+		pw.header("tailproxy_export_udp_packets_total", "counter", "Datagrams relayed, by direction (in is toward the app).")
+		pw.header("tailproxy_export_udp_bytes_total", "counter", "Datagram payload bytes relayed, by direction.")
+		pw.header("tailproxy_export_udp_batches_total", "counter", "Batched reads of the app's replies.")
+		for _, st := range udp {
+			port := strconv.Itoa(st.Port)
+			labels := promLabels("port", port)
+			pw.sample("tailproxy_export_udp_flows", labels, float64(st.Flows))
+			pw.sample("tailproxy_export_udp_flows_total", labels, float64(st.FlowsTotal))
+			pw.sample("tailproxy_export_udp_flows_expired_total", labels, float64(st.Expired))
+			pw.sample("tailproxy_export_udp_dropped_total", labels, float64(st.Dropped))
+			pw.sample("tailproxy_export_udp_packets_total", promLabels("port", port, "dir", "in"), float64(st.PacketsIn))
+			pw.sample("tailproxy_export_udp_packets_total", promLabels("port", port, "dir", "out"), float64(st.PacketsOut))
+			pw.sample("tailproxy_export_udp_bytes_total", promLabels("port", port, "dir", "in"), float64(st.BytesIn))
+			pw.sample("tailproxy_export_udp_bytes_total", promLabels("port", port, "dir", "out"), float64(st.BytesOut))
+			pw.sample("tailproxy_export_udp_batches_total", labels, float64(st.Batches))
+		}
+		whois := p.exporterManager.whois
+		pw.header("tailproxy_export_whois_lookups_total", "counter", "Peer identity lookups for PROXY headers, by result.")
+		pw.sample("tailproxy_export_whois_lookups_total", promLabels("result", "hit"), float64(whois.hits.Load()))
+		pw.sample("tailproxy_export_whois_lookups_total", promLabels("result", "miss"), float64(whois.misses.Load()))
+		pw.sample("tailproxy_export_whois_lookups_total", promLabels("result", "error"), float64(whois.failures.Load()))
+		acls := p.exporterManager.acls
+		pw.header("tailproxy_export_acl_decisions_total", "counter", "export_acls checks, by whether a cached decision was used.")
+		pw.sample("tailproxy_export_acl_decisions_total", promLabels("cache", "hit"), float64(acls.hits.Load()))
+		pw.sample("tailproxy_export_acl_decisions_total", promLabels("cache", "miss"), float64(acls.misses.Load()))
+	}
+
+	// Runtime
+	var ms runtime.MemStats
+	runtime.ReadMemStats(&ms)
+	pw.header("tailproxy_goroutines", "gauge", "Number of goroutines.")
+	pw.sample("tailproxy_goroutines", "", float64(runtime.NumGoroutine()))
+	pw.header("tailproxy_heap_alloc_bytes", "gauge", "Bytes of allocated heap objects.")
+	pw.sample("tailproxy_heap_alloc_bytes", "", float64(ms.HeapAlloc))
+	pw.header("tailproxy_gc_cycles_total", "counter", "Completed GC cycles.")
+	pw.sample("tailproxy_gc_cycles_total", "", float64(ms.NumGC))
+	pw.header("tailproxy_relay_buffers_allocated_total", "counter", "Relay buffers allocated by the buffer pool.")
+	pw.sample("tailproxy_relay_buffers_allocated_total", "", float64(relayBufAllocs.Load()))
+	pw.header("tailproxy_relay_buffers_in_use", "gauge", "Relay buffers currently held by connections.")
+	pw.sample("tailproxy_relay_buffers_in_use", "", float64(relayBufInUse.Load()))
+}
+
+// exportPortStats counts activity on one exported port, across re-exports.
+type exportPortStats struct {
+	accepts         atomic.Uint64
+	forwardFailures atomic.Uint64
+	active          atomic.Int64
+	forwardLatency  latencyHistogram
+	warmHits        atomic.Uint64 // forwarded on a warm loopback connection
+	warmMisses      atomic.Uint64 // pool empty, dialed instead
+	injected        atomic.Uint64 // passed to the app's accept() (export_inject)
+	held            atomic.Uint64 // waited for the app to listen again (export_grace_ms)
+	rejected        atomic.Uint64 // refused at export_max_conns with a full queue
+	queued          atomic.Int64  // waiting for a forwarding slot
+	deadlineCloses  atomic.Uint64 // cut by the idle or lifetime deadline
+	denied          atomic.Uint64 // refused by export_acls
+	slots           chan struct{} // export_max_conns; nil if unlimited
+}
+
+// exportSnapshot is a point-in-time view of one exported port.
+type exportSnapshot struct {
+	Port            int
+	Exported        bool
+	Accepts         uint64
+	ForwardFailures uint64
+	Active          int64
+	ForwardLatency  histogramSnapshot
+	WarmHits        uint64
+	WarmMisses      uint64
+	Injected        uint64
+	Held            uint64
+	Rejected        uint64
+	Queued          int64
+	DeadlineCloses  uint64
+	Denied          uint64
+}
+
+// portStatsLocked returns the stats of port, creating them on first export.
+// Called with em.mu held.
+func (em *ExporterManager) portStatsLocked(port int) *exportPortStats {
+	st, ok := em.stats[port]
+	if !ok {
+		st = &exportPortStats{}
+		if em.config.ExportMaxConns > 0 {
+			// Per port, so connections from before a re-export still count
+			st.slots = make(chan struct{}, em.config.ExportMaxConns)
+		}
+		em.stats[port] = st
+	}
+	return st
+}
+
+func (em *ExporterManager) snapshot() []exportSnapshot {
+	em.mu.Lock()
+	defer em.mu.Unlock()
+	out := make([]exportSnapshot, 0, len(em.stats))
+	for port, st := range em.stats {
+		_, exported := em.exporters[port]
+		out = append(out, exportSnapshot{
+			Port:            port,
+			Exported:        exported,
+			Accepts:         st.accepts.Load(),
+			ForwardFailures: st.forwardFailures.Load(),
+			Active:          st.active.Load(),
+			ForwardLatency:  st.forwardLatency.snapshot(),
+			WarmHits:        st.warmHits.Load(),
+			WarmMisses:      st.warmMisses.Load(),
+			Injected:        st.injected.Load(),
+			Held:            st.held.Load(),
+			Rejected:        st.rejected.Load(),
+			Queued:          st.queued.Load(),
+			DeadlineCloses:  st.deadlineCloses.Load(),
+			Denied:          st.denied.Load(),
+		})
+	}
+	sort.Slice(out, func(i, j int) bool { return out[i].Port < out[j].Port })
+	return out
+}
@@ -0,0 +1,177 @@
+package main
+
+import (
+	"fmt"
+	"hash/fnv"
+	"log"
+	"os"
+	"path/filepath"
+	"sync/atomic"
+	"syscall"
+	"time"
+
+	"tailscale.com/client/tailscale"
+	"tailscale.com/tsnet"
+)
+
+// Egress sharding across several tsnet nodes.
+//
+// Each tsnet.Server is one userspace WireGuard device and one gVisor
+// netstack, which caps a single node at a few cores. With nodes > 1 the proxy
+// runs that many tsnet nodes and spreads new connections across them, either
+// by a hash of the destination host (so a destination always leaves through
+// the same node and exit node) or to the node with the fewest active
+// connections. Node 0 keeps the configured hostname and state directory and
+// is the one used for exports and the control socket.
+
+const (
+	nodeBalanceHash      = "hash"
+	nodeBalanceLeastLoad = "least-load"
+)
+
+type tsnetNode struct {
+	index    int
+	hostname string
+	stateDir string
+	server   *tsnet.Server
+	lc       *tailscale.LocalClient
+	exits    *exitSelector
+	peers    *peerMonitor
+
+	// Relay schedulers, nil unless sched_rate_kbps is set
+	schedUp   *relayScheduler // client -> tailnet
+	schedDown *relayScheduler // tailnet -> client
+
+	active   atomic.Int64
+	conns    atomic.Uint64
+	bytesIn  atomic.Uint64 // tailnet -> client
+	bytesOut atomic.Uint64 // client -> tailnet
+}
+
+// nodeStats is a point-in-time view of one node.
+type nodeStats struct {
+	Hostname string
+	Active   int64
+	Conns    uint64
+	BytesIn  uint64
+	BytesOut uint64
+	Exit     string
+}
+
+// nodeHostname returns the tsnet hostname of node index.
+func nodeHostname(hostname string, index int) string {
+	if index == 0 {
+		return hostname
+	}
+	return fmt.Sprintf("%s-%d", hostname, index)
+}
+
+// nodeStateDir returns the state directory of node index. An explicit
+// TAILPROXY_STATE_DIR is shared by all nodes, so extra nodes get
+// subdirectories of it.
+func nodeStateDir(hostname string, index int) string {
+	if index > 0 && os.Getenv("TAILPROXY_STATE_DIR") != "" {
+		return filepath.Join(getStateDir(hostname), fmt.Sprintf("node-%d", index))
+	}
+	return getStateDir(nodeHostname(hostname, index))
+}
+
+func newTsnetNode(config *Config, index int) (*tsnetNode, error) {
+	hostname := nodeHostname(config.Hostname, index)
+
+	// Create state directory - use persistent location for stable node ID
+	stateDir := nodeStateDir(config.Hostname, index)
+	// A process started by a hot upgrade runs alongside the old one until
+	// it drains, so it keeps its tsnet state in the other slot
+	tsnetDir := stateDir
+	if slot := os.Getenv(envStateSlot); slot != "" {
+		tsnetDir = filepath.Join(stateDir, "slot-"+slot)
+	}
+	if err := os.MkdirAll(tsnetDir, 0700); err != nil {
+		return nil, fmt.Errorf("failed to create state directory: %w", err)
+	}
+
+	srv := &tsnet.Server{
+		Hostname: hostname,
+		Dir:      tsnetDir,
+		// The upgrade slot is a stand-in for the usual node; as an
+		// ephemeral node it leaves the tailnet once it goes offline
+		Ephemeral: os.Getenv(envStateSlot) != "",
+		Logf: func(format string, args ...any) {
+			if config.Verbose {
+				log.Printf("[tsnet:"+hostname+"] "+format, args...)
+			}
+		},
+	}
+
+	if config.AuthKey != "" {
+		srv.AuthKey = config.AuthKey
+	}
+
+	return &tsnetNode{
+		index:     index,
+		hostname:  hostname,
+		stateDir:  stateDir,
+		server:    srv,
+		exits:     newExitSelector(config, hostname),
+		peers:     newPeerMonitor(config, hostname),
+		schedUp:   newRelayScheduler(config, hostname+" up"),
+		schedDown: newRelayScheduler(config, hostname+" down"),
+	}, nil
+}
+
+// pickNode chooses the node that carries a new connection to host.
+func (p *ProxyServer) pickNode(host string) *tsnetNode {
+	if len(p.nodes) == 1 {
+		return p.nodes[0]
+	}
+	if p.config.NodeBalance == nodeBalanceLeastLoad {
+		best := p.nodes[0]
+		for _, n := range p.nodes[1:] {
+			if n.active.Load() < best.active.Load() {
+				best = n
+			}
+		}
+		return best
+	}
+	h := fnv.New32a()
+	h.Write([]byte(host))
+	return p.nodes[h.Sum32()%uint32(len(p.nodes))]
+}
+
+func (p *ProxyServer) nodeSnapshot() []nodeStats {
+	out := make([]nodeStats, len(p.nodes))
+	for i, n := range p.nodes {
+		out[i] = nodeStats{
+			Hostname: n.hostname,
+			Active:   n.active.Load(),
+			Conns:    n.conns.Load(),
+			BytesIn:  n.bytesIn.Load(),
+			BytesOut: n.bytesOut.Load(),
+			Exit:     n.exits.current(),
+		}
+	}
+	return out
+}
+
+// processCPUTime returns user and system CPU time consumed by the process.
+// Goroutines of all nodes share one process, so per-node CPU is attributed
+// through the "node" profiler label on relay goroutines instead.
+func processCPUTime() (user, sys time.Duration) {
+	var ru syscall.Rusage
+	if err := syscall.Getrusage(syscall.RUSAGE_SELF, &ru); err != nil {
+		return 0, 0
+	}
+	return time.Duration(ru.Utime.Nano()), time.Duration(ru.Stime.Nano())
+}
+
+func (p *ProxyServer) logNodeSummary(elapsed time.Duration) {
+	user, sys := processCPUTime()
+	secs := elapsed.Seconds()
+	for _, st := range p.nodeSnapshot() {
+		log.Printf("Node %s: conns=%d active=%d in=%.1fMB/s out=%.1fMB/s exit=%q",
+			st.Hostname, st.Conns, st.Active,
+			float64(st.BytesIn)/secs/1e6, float64(st.BytesOut)/secs/1e6, st.Exit)
+	}
+	log.Printf("Process CPU: user=%v sys=%v over %v", user, sys, elapsed.Round(time.Second))
+}
@@ -0,0 +1,445 @@
+package main
+
+import (
+	"context"
+	"fmt"
+	"log"
+	"net/netip"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"tailscale.com/client/tailscale"
+	"tailscale.com/ipn"
+	"tailscale.com/ipn/ipnstate"
+	"tailscale.com/tailcfg"
+)
+
+// Peer index and path monitoring.
+//
+// Each tsnet node keeps an index of its peers by name and address. The index
+// is rebuilt from the node's status when the IPN bus reports a new netmap,
+// so exit node resolution and per-connection peer lookups do not scan
+// status.Peer.
+//
+// Connections after an idle period often ride DERP, or wait for a WireGuard
+// handshake, until magicsock re-establishes a direct path. With path_warm_ms
+// set, every path_warm_ms the node disco-pings the active exit node and every
+// peer it carried a connection to within path_warm_idle_ms. That keeps the
+// handshake fresh and gives magicsock a reason to hold or upgrade the path.
+// Each ping also records whether the peer is direct or relayed, and its RTT.
+// With path_wait_ms set, a new connection whose peer is relayed waits up to
+// that long, pinging, for a direct path before it dials. A peer that stayed
+// relayed through a whole wait (hard NAT, say) is not waited on again for
+// pathWaitRetry, so its connections don't all pay the full wait.
+
+const (
+	peerRefreshMinInterval = time.Second     // coalesces netmap bursts
+	peerWatchRetry         = 2 * time.Second // after the IPN bus watch fails
+	pathPingTimeout        = 2 * time.Second
+	pathWaitPingInterval   = 50 * time.Millisecond
+	pathWaitRetry          = 30 * time.Second // after a wait that found no direct path
+)
+
+// peerEntry is one peer in the index.
+type peerEntry struct {
+	id     tailcfg.StableNodeID
+	name   string // hostname
+	ips    []netip.Addr
+	online bool
+}
+
+type peerTable struct {
+	byName map[string]*peerEntry // hostname, MagicDNS name, short name and each IP
+	byIP   map[netip.Addr]*peerEntry
+}
+
+// pathState is the last known path to one peer.
+type pathState struct {
+	// Guarded by peerMonitor.mu
+	peer     *peerEntry
+	known    bool // direct has been observed
+	direct   bool
+	derp     string
+	rtt      time.Duration
+	pinged   time.Time
+	failures int
+	waiting  chan struct{} // closed when an in-flight wait for a direct path ends
+	waitMiss time.Time     // when a wait last timed out still relayed
+
+	lastUsed atomic.Int64 // unix nanoseconds
+}
+
+type peerMonitor struct {
+	config *Config
+	node   string
+	lc     *tailscale.LocalClient
+
+	table     atomic.Pointer[peerTable]
+	refreshes atomic.Uint64
+	dirty     chan struct{}
+	exit      atomic.Pointer[netip.Addr] // active exit node, kept warm
+
+	mu    sync.Mutex
+	paths map[tailcfg.StableNodeID]*pathState
+
+	waits       atomic.Uint64 // connections that waited for a direct path
+	waitsDirect atomic.Uint64 // ... and got one in time
+	waitTime    atomic.Int64
+}
+
+func newPeerMonitor(config *Config, node string) *peerMonitor {
+	m := &peerMonitor{
+		config: config,
+		node:   node,
+		dirty:  make(chan struct{}, 1),
+		paths:  make(map[tailcfg.StableNodeID]*pathState),
+	}
+	m.table.Store(&peerTable{})
+	return m
+}
+
+// start builds the index and keeps it, and warm paths, up to date until ctx
+// is done.
+func (m *peerMonitor) start(ctx context.Context, lc *tailscale.LocalClient) error {
+	m.lc = lc
+	if err := m.refresh(ctx); err != nil {
+		return err
+	}
+	go m.watch(ctx)
+	go m.refreshLoop(ctx)
+	if m.config.PathWarmMs > 0 {
+		go m.warmLoop(ctx)
+	}
+	return nil
+}
+
+// watch marks the index dirty whenever the IPN bus delivers a netmap.
+func (m *peerMonitor) watch(ctx context.Context) {
+	for ctx.Err() == nil {
+		w, err := m.lc.WatchIPNBus(ctx, ipn.NotifyInitialNetMap|ipn.NotifyNoPrivateKeys)
+		if err != nil {
+			if m.config.Verbose && ctx.Err() == nil {
+				log.Printf("Peer index for %s: IPN bus watch failed: %v", m.node, err)
+			}
+			select {
+			case <-ctx.Done():
+				return
+			case <-time.After(peerWatchRetry):
+			}
+			continue
+		}
+		for {
+			n, err := w.Next()
+			if err != nil {
+				break
+			}
+			if n.NetMap != nil {
+				select {
+				case m.dirty <- struct{}{}:
+				default:
+				}
+			}
+		}
+		w.Close()
+	}
+}
+
+func (m *peerMonitor) refreshLoop(ctx context.Context) {
+	for {
+		select {
+		case <-ctx.Done():
+			return
+		case <-m.dirty:
+		}
+		if err := m.refresh(ctx); err != nil && m.config.Verbose && ctx.Err() == nil {
+			log.Printf("Peer index for %s: refresh failed: %v", m.node, err)
+		}
+		select {
+		case <-ctx.Done():
+			return
+		case <-time.After(peerRefreshMinInterval):
+		}
+	}
+}
+
+// refresh rebuilds the index from the node's status. The path type of
+// active peers is taken from the status too, between pings.
+func (m *peerMonitor) refresh(ctx context.Context) error {
+	status, err := m.lc.Status(ctx)
+	if err != nil {
+		return fmt.Errorf("failed to get status: %w", err)
+	}
+
+	t := &peerTable{
+		byName: make(map[string]*peerEntry, 4*len(status.Peer)),
+		byIP:   make(map[netip.Addr]*peerEntry, 2*len(status.Peer)),
+	}
+	suffix := "." + strings.TrimSuffix(status.MagicDNSSuffix, ".")
+	m.mu.Lock()
+	for _, ps := range status.Peer {
+		if len(ps.TailscaleIPs) == 0 {
+			continue
+		}
+		e := &peerEntry{id: ps.ID, name: ps.HostName, ips: ps.TailscaleIPs, online: ps.Online}
+		fqdn := strings.TrimSuffix(ps.DNSName, ".")
+		for _, key := range []string{ps.HostName, ps.DNSName, fqdn, strings.TrimSuffix(fqdn, suffix)} {
+			if _, taken := t.byName[key]; key != "" && !taken {
+				t.byName[key] = e
+			}
+		}
+		for _, ip := range ps.TailscaleIPs {
+			t.byName[ip.String()] = e
+			t.byIP[ip] = e
+		}
+
+		if st, ok := m.paths[ps.ID]; ok {
+			st.peer = e
+			if ps.Active {
+				st.observeLocked(ps)
+			}
+		}
+	}
+	m.mu.Unlock()
+
+	m.table.Store(t)
+	m.refreshes.Add(1)
+	return nil
+}
+
+func (st *pathState) observeLocked(ps *ipnstate.PeerStatus) {
+	st.known = true
+	st.direct = ps.CurAddr != ""
+	st.derp = ps.Relay
+}
+
+// lookup finds a peer by hostname, MagicDNS name or Tailscale IP.
+func (m *peerMonitor) lookup(name string) *peerEntry {
+	return m.table.Load().byName[strings.TrimSuffix(name, ".")]
+}
+
+// setExit records the active exit node.
+func (m *peerMonitor) setExit(ip netip.Addr) {
+	m.exit.Store(&ip)
+}
+
+// peerFor returns the peer a connection to host leaves the tailnet through:
+// the destination itself if it is a peer, otherwise the active exit node.
+func (m *peerMonitor) peerFor(host string) *peerEntry {
+	t := m.table.Load()
+	if addr, err := netip.ParseAddr(host); err == nil {
+		if e := t.byIP[addr.Unmap()]; e != nil {
+			return e
+		}
+	} else if e := t.byName[strings.TrimSuffix(host, ".")]; e != nil {
+		return e
+	}
+	if exit := m.exit.Load(); exit != nil {
+		return t.byIP[*exit]
+	}
+	return nil
+}
+
+func (m *peerMonitor) path(e *peerEntry) *pathState {
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	st, ok := m.paths[e.id]
+	if !ok {
+		st = &pathState{peer: e}
+		m.paths[e.id] = st
+	}
+	return st
+}
+
+// touch marks the path to e as in use, which keeps it warm.
+func (m *peerMonitor) touch(e *peerEntry) *pathState {
+	st := m.path(e)
+	st.lastUsed.Store(time.Now().UnixNano())
+	return st
+}
+
+// ping disco-pings the peer and records the path it answered on.
+func (m *peerMonitor) ping(ctx context.Context, st *pathState) bool {
+	m.mu.Lock()
+	ip := st.peer.ips[0]
+	m.mu.Unlock()
+
+	ctx, cancel := context.WithTimeout(ctx, pathPingTimeout)
+	res, err := m.lc.Ping(ctx, ip, tailcfg.PingDisco)
+	cancel()
+
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	st.pinged = time.Now()
+	if err == nil && res.Err != "" {
+		err = fmt.Errorf("%s", res.Err)
+	}
+	if err != nil {
+		st.failures++
+		if m.config.Verbose {
+			log.Printf("Path to %s via %s: ping failed: %v", st.peer.name, m.node, err)
+		}
+		return false
+	}
+	wasDirect := st.known && st.direct
+	st.failures = 0
+	st.known = true
+	st.direct = res.Endpoint != ""
+	st.derp = res.DERPRegionCode
+	st.rtt = time.Duration(res.LatencySeconds * float64(time.Second))
+	if st.direct {
+		st.waitMiss = time.Time{}
+	}
+	if m.config.Verbose && st.direct != wasDirect {
+		log.Printf("Path to %s via %s: direct=%v derp=%q rtt=%v", st.peer.name, m.node, st.direct, st.derp, st.rtt)
+	}
+	return st.direct
+}
+
+// warmLoop pings the active exit node and recently used peers.
+func (m *peerMonitor) warmLoop(ctx context.Context) {
+	interval := time.Duration(m.config.PathWarmMs) * time.Millisecond
+	idle := time.Duration(m.config.PathWarmIdleMs) * time.Millisecond
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-ctx.Done():
+			return
+		case <-ticker.C:
+		}
+
+		if exit := m.exit.Load(); exit != nil {
+			if e := m.table.Load().byIP[*exit]; e != nil {
+				m.touch(e)
+			}
+		}
+
+		now := time.Now()
+		m.mu.Lock()
+		var warm []*pathState
+		for id, st := range m.paths {
+			if now.Sub(time.Unix(0, st.lastUsed.Load())) > idle {
+				if st.waiting == nil {
+					delete(m.paths, id)
+				}
+				continue
+			}
+			warm = append(warm, st)
+		}
+		m.mu.Unlock()
+
+		var wg sync.WaitGroup
+		for _, st := range warm {
+			wg.Add(1)
+			go func(st *pathState) {
+				defer wg.Done()
+				m.ping(ctx, st)
+			}(st)
+		}
+		wg.Wait()
+	}
+}
+
+// awaitDirect waits up to path_wait_ms for a direct path to the peer of a
+// new connection, pinging to prompt magicsock to establish one. Concurrent
+// connections to the same peer share one wait.
+func (m *peerMonitor) awaitDirect(ctx context.Context, st *pathState) {
+	m.mu.Lock()
+	if st.known && st.direct {
+		m.mu.Unlock()
+		return
+	}
+	if !st.waitMiss.IsZero() && time.Since(st.waitMiss) < pathWaitRetry {
+		// Recently relayed for a whole wait; waiting again would most
+		// likely only add the same delay
+		m.mu.Unlock()
+		return
+	}
+	if ch := st.waiting; ch != nil {
+		m.mu.Unlock()
+		select {
+		case <-ch:
+		case <-ctx.Done():
+		}
+		return
+	}
+	ch := make(chan struct{})
+	st.waiting = ch
+	m.mu.Unlock()
+
+	start := time.Now()
+	deadline := start.Add(time.Duration(m.config.PathWaitMs) * time.Millisecond)
+	wctx, cancel := context.WithDeadline(ctx, deadline)
+	direct := false
+	for !direct && wctx.Err() == nil {
+		if direct = m.ping(wctx, st); !direct {
+			select {
+			case <-wctx.Done():
+			case <-time.After(pathWaitPingInterval):
+			}
+		}
+	}
+	// A timeout rather than the connection going away
+	missed := !direct && ctx.Err() == nil
+	cancel()
+
+	m.waits.Add(1)
+	if direct {
+		m.waitsDirect.Add(1)
+	}
+	m.waitTime.Add(int64(time.Since(start)))
+
+	m.mu.Lock()
+	st.waiting = nil
+	if missed {
+		st.waitMiss = time.Now()
+	}
+	m.mu.Unlock()
+	close(ch)
+}
+
+// pathStatus is a point-in-time view of the path to one peer.
+type pathStatus struct {
+	Peer   string
+	Known  bool
+	Direct bool
+	DERP   string
+	RTT    time.Duration
+}
+
+func (m *peerMonitor) snapshot() []pathStatus {
+	m.mu.Lock()
+	out := make([]pathStatus, 0, len(m.paths))
+	for _, st := range m.paths {
+		out = append(out, pathStatus{
+			Peer:   st.peer.name,
+			Known:  st.known,
+			Direct: st.direct,
+			DERP:   st.derp,
+			RTT:    st.rtt,
+		})
+	}
+	m.mu.Unlock()
+	sort.Slice(out, func(i, j int) bool { return out[i].Peer < out[j].Peer })
+	return out
+}
+
+func (m *peerMonitor) logSummary() {
+	for _, st := range m.snapshot() {
+		if !st.Known {
+			continue
+		}
+		path := "direct"
+		if !st.Direct {
+			path = "derp:" + st.DERP
+		}
+		log.Printf("Path %s -> %s: path=%s rtt=%v", m.node, st.Peer, path, st.RTT)
+	}
+	if waits := m.waits.Load(); waits > 0 {
+		log.Printf("Path waits via %s: waits=%d direct=%d total_wait=%v",
+			m.node, waits, m.waitsDirect.Load(), time.Duration(m.waitTime.Load()))
+	}
+}
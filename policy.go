@@ -0,0 +1,248 @@
+package main
+
+import (
+	"encoding/binary"
+	"fmt"
+	"log"
+	"net/netip"
+	"os"
+	"strings"
+	"sync/atomic"
+	"syscall"
+	"unsafe"
+)
+
+// Runtime policy.
+//
+// The settings a reload can change are compiled and validated together, so
+// a bad config file changes nothing. They are then swapped in one pointer per
+// subsystem, which connections load without locking:
+//
+//   - rate limits (rateLimiter.table)
+//   - export ports (ExporterManager.policy)
+//   - exit node candidates (exitSelector)
+//   - preload bypass rules
+//
+// The preload's part is published in a small file in node 0's state
+// directory. This covers the bypass rules, the proxy endpoint and the export
+// port bitmap. Every libtailproxy.so in the process tree maps the file
+// read-only (TAILPROXY_POLICY_SHM). The proxy is the only writer and updates
+// it under a sequence lock: seq is odd while a write is in progress, and a
+// reader retries if seq was odd or changed while it read. generation counts
+// publishes and continues across restarts and upgrades.
+
+const (
+	policyShmMagic     = "TPS1"
+	policyShmSize      = 12288
+	policyShmMaxBypass = 64
+
+	policyShmEntry = 20 // family:uint8 bits:uint8 pad[2] addr[16]
+)
+
+// Snapshot layout, integers in host byte order except the proxy endpoint,
+// which is in network byte order:
+//
+//	0   magic "TPS1"
+//	4   seq uint32
+//	8   generation uint64
+//	16  proxy port [2]byte, pad [2]byte
+//	20  proxy IPv4 address [4]byte
+//	24  bypass count uint32
+//	28  flags uint32
+//	32  bypass entries
+//	4096 export port bitmap, 1024 uint64 words; bit p%64 of word p/64 is
+//	     set if port p may be exported
+const (
+	policyOffSeq    = 4
+	policyOffGen    = 8
+	policyOffPort   = 16
+	policyOffAddr   = 20
+	policyOffCount  = 24
+	policyOffFlags  = 28
+	policyOffBypass = 32
+	policyOffPorts  = 4096
+
+	policyFlagExportPorts = 1 // the export port bitmap is valid
+)
+
+// policy is everything a reload can change, in compiled form.
+type policy struct {
+	limits  *limitTable
+	exports *exportPolicy
+	exits   []string
+	bypass  []netip.Prefix
+}
+
+func compilePolicy(config *Config) (*policy, error) {
+	limits, err := compileLimits(config.RateLimits)
+	if err != nil {
+		return nil, err
+	}
+	exports, err := compileExportPolicy(config)
+	if err != nil {
+		return nil, err
+	}
+	bypass, err := parseBypass(config.Bypass)
+	if err != nil {
+		return nil, err
+	}
+	return &policy{
+		limits:  limits,
+		exports: exports,
+		exits:   config.exitNodeCandidates(),
+		bypass:  bypass,
+	}, nil
+}
+
+// parseBypass parses a comma-separated list of addresses and CIDRs.
+func parseBypass(spec string) ([]netip.Prefix, error) {
+	var out []netip.Prefix
+	for _, part := range strings.Split(spec, ",") {
+		part = strings.TrimSpace(part)
+		if part == "" {
+			continue
+		}
+		prefix, err := netip.ParsePrefix(part)
+		if err != nil {
+			addr, aerr := netip.ParseAddr(part)
+			if aerr != nil {
+				return nil, fmt.Errorf("bypass: invalid address or CIDR %q", part)
+			}
+			prefix = netip.PrefixFrom(addr, addr.BitLen())
+		}
+		out = append(out, prefix.Masked())
+	}
+	if len(out) > policyShmMaxBypass {
+		return nil, fmt.Errorf("bypass: %d entries, at most %d are supported", len(out), policyShmMaxBypass)
+	}
+	return out, nil
+}
+
+// ReloadConfig re-reads the configuration file, validates it and swaps in
+// the settings that can change without a restart. It returns the generation
+// published to the preloads.
+func (p *ProxyServer) ReloadConfig() (uint64, error) {
+	if p.loadConfig == nil {
+		return 0, fmt.Errorf("no config file to reload")
+	}
+	p.reloadMu.Lock()
+	defer p.reloadMu.Unlock()
+
+	config, err := p.loadConfig()
+	if err != nil {
+		return 0, err
+	}
+	pol, err := compilePolicy(config)
+	if err != nil {
+		return 0, err
+	}
+	// Scheduler ports take effect on restart, but a bad spec still fails
+	// the reload rather than the next start
+	if _, err := compileSchedPorts(config); err != nil {
+		return 0, err
+	}
+
+	p.limits.swap(pol.limits)
+	if p.exporterManager != nil {
+		p.exporterManager.setPolicy(pol.exports)
+	}
+	for _, node := range p.nodes {
+		node.exits.reload(pol.exits)
+	}
+	gen := p.policyShm.publish(p.config.ProxyPort, pol)
+
+	log.Printf("Reloaded config (generation %d): %d rate limits, %d exit node candidates, %d bypass rules",
+		gen, len(pol.limits.buckets), len(pol.exits), len(pol.bypass))
+	if config.ProxyPort != p.config.ProxyPort || config.Nodes != p.config.Nodes ||
+		config.Hostname != p.config.Hostname || config.ExportListeners != p.config.ExportListeners ||
+		config.ExportUnix != p.config.ExportUnix {
+		log.Printf("proxy_port, nodes, hostname, export_listeners and export_unix take effect on restart")
+	}
+	return gen, nil
+}
+
+// policyShm is the proxy's writable mapping of the preload snapshot.
+type policyShm struct {
+	path string
+	mem  []byte
+}
+
+// openPolicyShm maps the snapshot file at path, creating it if needed. An
+// existing file is never truncated, since preloads may have it mapped.
+func openPolicyShm(path string) (*policyShm, error) {
+	f, err := os.OpenFile(path, os.O_RDWR|os.O_CREATE, 0600)
+	if err != nil {
+		return nil, fmt.Errorf("failed to open policy snapshot: %w", err)
+	}
+	defer f.Close()
+	if fi, err := f.Stat(); err != nil {
+		return nil, err
+	} else if fi.Size() < policyShmSize {
+		if err := f.Truncate(policyShmSize); err != nil {
+			return nil, fmt.Errorf("failed to size policy snapshot: %w", err)
+		}
+	}
+	mem, err := syscall.Mmap(int(f.Fd()), 0, policyShmSize, syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, fmt.Errorf("failed to map policy snapshot: %w", err)
+	}
+	s := &policyShm{path: path, mem: mem}
+	if string(mem[:4]) != policyShmMagic {
+		// New file, or one left in an unknown state: reset it
+		atomic.StoreUint32(s.seq(), 0)
+		atomic.StoreUint64(s.gen(), 0)
+		copy(mem[:4], policyShmMagic)
+	} else if atomic.LoadUint32(s.seq())&1 != 0 {
+		// A writer died mid-publish; the next publish makes it even again
+		atomic.AddUint32(s.seq(), 1)
+	}
+	return s, nil
+}
+
+func (s *policyShm) seq() *uint32 { return (*uint32)(unsafe.Pointer(&s.mem[policyOffSeq])) }
+func (s *policyShm) gen() *uint64 { return (*uint64)(unsafe.Pointer(&s.mem[policyOffGen])) }
+
+// publish writes a new snapshot and returns its generation.
+func (s *policyShm) publish(proxyPort int, pol *policy) uint64 {
+	if s == nil {
+		return 0
+	}
+	mem := s.mem
+	bypass := pol.bypass
+	atomic.AddUint32(s.seq(), 1) // odd: readers retry
+
+	binary.BigEndian.PutUint16(mem[policyOffPort:], uint16(proxyPort))
+	copy(mem[policyOffAddr:policyOffAddr+4], []byte{127, 0, 0, 1})
+	binary.NativeEndian.PutUint32(mem[policyOffCount:], uint32(len(bypass)))
+	for i, prefix := range bypass {
+		e := mem[policyOffBypass+i*policyShmEntry : policyOffBypass+(i+1)*policyShmEntry]
+		clear(e)
+		addr := prefix.Addr()
+		if addr.Is4() {
+			e[0] = 4
+			a4 := addr.As4()
+			copy(e[4:], a4[:])
+		} else {
+			e[0] = 6
+			a16 := addr.As16()
+			copy(e[4:], a16[:])
+		}
+		e[1] = byte(prefix.Bits())
+	}
+	for i, word := range pol.exports.allowed {
+		binary.NativeEndian.PutUint64(mem[policyOffPorts+i*8:], word)
+	}
+	binary.NativeEndian.PutUint32(mem[policyOffFlags:], policyFlagExportPorts)
+	gen := atomic.AddUint64(s.gen(), 1)
+
+	atomic.AddUint32(s.seq(), 1) // even: snapshot complete
+	return gen
+}
+
+func (s *policyShm) close() {
+	if s == nil {
+		return
+	}
+	syscall.Munmap(s.mem)
+	s.mem = nil
+}
@@ -0,0 +1,142 @@
+package main
+
+import (
+	"encoding/binary"
+	"net/netip"
+	"path/filepath"
+	"reflect"
+	"testing"
+)
+
+func TestParseBypass(t *testing.T) {
+	tests := []struct {
+		spec    string
+		want    []string
+		wantErr bool
+	}{
+		{spec: "", want: nil},
+		{spec: "10.0.0.1", want: []string{"10.0.0.1/32"}},
+		{spec: "192.168.1.77/24, fd00::1", want: []string{"192.168.1.0/24", "fd00::1/128"}},
+		{spec: "2001:db8::/32,,", want: []string{"2001:db8::/32"}},
+		{spec: "example.com", wantErr: true},
+		{spec: "10.0.0.0/33", wantErr: true},
+	}
+	for _, tt := range tests {
+		got, err := parseBypass(tt.spec)
+		if (err != nil) != tt.wantErr {
+			t.Errorf("parseBypass(%q) error = %v, wantErr %v", tt.spec, err, tt.wantErr)
+			continue
+		}
+		var gotStr []string
+		for _, p := range got {
+			gotStr = append(gotStr, p.String())
+		}
+		if !reflect.DeepEqual(gotStr, tt.want) {
+			t.Errorf("parseBypass(%q) = %v, want %v", tt.spec, gotStr, tt.want)
+		}
+	}
+}
+
+func TestParseBypassLimit(t *testing.T) {
+	spec := ""
+	for i := 0; i <= policyShmMaxBypass; i++ {
+		spec += netip.AddrFrom4([4]byte{10, 0, byte(i >> 8), byte(i)}).String() + ","
+	}
+	if _, err := parseBypass(spec); err == nil {
+		t.Errorf("accepted %d entries", policyShmMaxBypass+1)
+	}
+}
+
+func TestPolicyShmPublish(t *testing.T) {
+	path := filepath.Join(t.TempDir(), "policy.shm")
+	shm, err := openPolicyShm(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer shm.close()
+
+	tests := []struct {
+		name   string
+		port   int
+		bypass string
+		ports  []int // allowed export ports
+	}{
+		{name: "v4 and v6 rules", port: 1080, bypass: "10.1.2.0/24,fd00::/8", ports: []int{22, 8000, 65535}},
+		{name: "fewer rules", port: 1081, bypass: "192.168.0.1", ports: []int{1}},
+		{name: "none", port: 1082},
+	}
+	for i, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			bypass, err := parseBypass(tt.bypass)
+			if err != nil {
+				t.Fatal(err)
+			}
+			exports := &exportPolicy{}
+			for _, p := range tt.ports {
+				exports.allowed[p/64] |= 1 << (p % 64)
+			}
+
+			gen := shm.publish(tt.port, &policy{bypass: bypass, exports: exports})
+			if want := uint64(i + 1); gen != want {
+				t.Errorf("generation %d, want %d", gen, want)
+			}
+
+			mem := shm.mem
+			if string(mem[:4]) != policyShmMagic {
+				t.Errorf("magic %q", mem[:4])
+			}
+			if seq := binary.NativeEndian.Uint32(mem[policyOffSeq:]); seq != uint32(2*(i+1)) {
+				t.Errorf("seq %d, want %d", seq, 2*(i+1))
+			}
+			if g := binary.NativeEndian.Uint64(mem[policyOffGen:]); g != gen {
+				t.Errorf("stored generation %d, want %d", g, gen)
+			}
+			if p := binary.BigEndian.Uint16(mem[policyOffPort:]); int(p) != tt.port {
+				t.Errorf("port %d, want %d", p, tt.port)
+			}
+			if a := mem[policyOffAddr : policyOffAddr+4]; !reflect.DeepEqual(a, []byte{127, 0, 0, 1}) {
+				t.Errorf("address %v", a)
+			}
+			if n := binary.NativeEndian.Uint32(mem[policyOffCount:]); int(n) != len(bypass) {
+				t.Errorf("bypass count %d, want %d", n, len(bypass))
+			}
+			if f := binary.NativeEndian.Uint32(mem[policyOffFlags:]); f != policyFlagExportPorts {
+				t.Errorf("flags %#x", f)
+			}
+			for j, prefix := range bypass {
+				e := mem[policyOffBypass+j*policyShmEntry : policyOffBypass+(j+1)*policyShmEntry]
+				family, size := byte(4), 4
+				if prefix.Addr().Is6() {
+					family, size = 6, 16
+				}
+				addr, _ := netip.AddrFromSlice(e[4 : 4+size])
+				if e[0] != family || int(e[1]) != prefix.Bits() || addr != prefix.Addr() {
+					t.Errorf("entry %d = %v, want %v", j, e, prefix)
+				}
+			}
+			for port := 1; port <= 65535; port++ {
+				word := binary.NativeEndian.Uint64(mem[policyOffPorts+port/64*8:])
+				got := word&(1<<(port%64)) != 0
+				want := exports.allows(port)
+				if got != want {
+					t.Fatalf("port %d published as %v, want %v", port, got, want)
+				}
+			}
+		})
+	}
+
+	// Reopening keeps the generation, and repairs a seq left odd by a
+	// writer that died mid-publish
+	binary.NativeEndian.PutUint32(shm.mem[policyOffSeq:], 7)
+	again, err := openPolicyShm(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer again.close()
+	if seq := binary.NativeEndian.Uint32(again.mem[policyOffSeq:]); seq != 8 {
+		t.Errorf("seq after reopen %d, want 8", seq)
+	}
+	if gen := again.publish(1080, &policy{exports: &exportPolicy{}}); gen != uint64(len(tests)+1) {
+		t.Errorf("generation after reopen %d, want %d", gen, len(tests)+1)
+	}
+}
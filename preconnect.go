@@ -0,0 +1,378 @@
+package main
+
+import (
+	"context"
+	"errors"
+	"log"
+	"net"
+	"sort"
+	"sync"
+	"time"
+)
+
+// Speculative pre-connect pool.
+//
+// The pool learns hot destinations from CONNECT history: a host:port that
+// sees at least preconnect_min_connects CONNECTs within one learning window
+// is kept topped up with preconnect_size established, unused tailnet
+// connections. An incoming CONNECT to that destination claims one of them
+// instead of paying the tailnet handshake in a node dial. Idle connections
+// are discarded after preconnect_ttl_ms, since servers drop idle clients.
+//
+// Each idle connection has a watcher goroutine parked in a one-byte Read, so
+// a peer closing it is noticed immediately and a server-first greeting is
+// kept and replayed to the client that claims the connection.
+
+const (
+	preconnectWindow   = 10 * time.Second
+	preconnectMaxDests = 256
+)
+
+// preconnectStats counts pool activity for one destination.
+type preconnectStats struct {
+	Claims       uint64 // CONNECTs served from the pool
+	Misses       uint64 // CONNECTs to a hot destination that found the pool empty
+	Dialed       uint64 // speculative connections established
+	Wasted       uint64 // speculative connections closed without being used
+	IdleTimeouts uint64 // wasted connections that hit the idle TTL
+	DialFailures uint64
+}
+
+type pooledConn struct {
+	conn    net.Conn
+	node    *tsnetNode
+	created time.Time
+	done    chan struct{} // closed when the watcher's Read returns
+	claimed bool
+	buf     [1]byte
+	n       int
+	err     error
+}
+
+type preconnectDest struct {
+	host     string
+	port     uint16
+	isDomain bool
+
+	windowStart time.Time
+	windowCount int
+	hot         bool
+
+	idle    []*pooledConn
+	dialing int
+	stats   preconnectStats
+}
+
+type preconnectPool struct {
+	p          *ProxyServer
+	size       int
+	minConnect int
+	ttl        time.Duration
+
+	mu    sync.Mutex
+	ctx   context.Context
+	dests map[string]*preconnectDest
+}
+
+func newPreconnectPool(p *ProxyServer) *preconnectPool {
+	return &preconnectPool{
+		p:          p,
+		size:       p.config.PreconnectSize,
+		minConnect: p.config.PreconnectMinConnects,
+		ttl:        time.Duration(p.config.PreconnectTTLMs) * time.Millisecond,
+		ctx:        context.Background(),
+		dests:      make(map[string]*preconnectDest),
+	}
+}
+
+func (pp *preconnectPool) enabled() bool {
+	return pp.size > 0 && pp.ttl > 0
+}
+
+// start runs the idle-expiry janitor until ctx is done.
+func (pp *preconnectPool) start(ctx context.Context) {
+	if !pp.enabled() {
+		return
+	}
+	pp.mu.Lock()
+	pp.ctx = ctx
+	pp.mu.Unlock()
+
+	go func() {
+		ticker := time.NewTicker(pp.ttl / 2)
+		defer ticker.Stop()
+		for {
+			select {
+			case <-ctx.Done():
+				pp.closeAll()
+				return
+			case <-ticker.C:
+				pp.expire()
+			}
+		}
+	}()
+}
+
+// claim records a CONNECT to target and returns a pooled connection for it
+// and the node that dialed it, or nil if none is available.
+func (pp *preconnectPool) claim(target, host string, port uint16, isDomain bool) (net.Conn, *tsnetNode) {
+	if !pp.enabled() {
+		return nil, nil
+	}
+
+	pp.mu.Lock()
+	d := pp.learn(target, host, port, isDomain)
+	if d == nil || !d.hot {
+		pp.mu.Unlock()
+		return nil, nil
+	}
+
+	var conn net.Conn
+	var node *tsnetNode
+	for conn == nil && len(d.idle) > 0 {
+		// Newest first: least likely to be near the server's idle timeout
+		pc := d.idle[len(d.idle)-1]
+		d.idle = d.idle[:len(d.idle)-1]
+		pc.claimed = true
+		conn, node = pp.takeOver(pc), pc.node
+		if conn == nil {
+			d.stats.Wasted++
+		}
+	}
+	if conn != nil {
+		d.stats.Claims++
+	} else {
+		d.stats.Misses++
+	}
+	pp.refill(target, d)
+	pp.mu.Unlock()
+	return conn, node
+}
+
+// learn updates the CONNECT rate for target. Called with pp.mu held.
+func (pp *preconnectPool) learn(target, host string, port uint16, isDomain bool) *preconnectDest {
+	now := time.Now()
+	d, ok := pp.dests[target]
+	if !ok {
+		if len(pp.dests) >= preconnectMaxDests {
+			pp.evictCold(now)
+			if len(pp.dests) >= preconnectMaxDests {
+				return nil
+			}
+		}
+		d = &preconnectDest{host: host, port: port, isDomain: isDomain, windowStart: now}
+		pp.dests[target] = d
+	}
+
+	if now.Sub(d.windowStart) >= preconnectWindow {
+		// A destination stays hot only while it keeps up the rate
+		d.hot = d.windowCount >= pp.minConnect
+		d.windowStart = now
+		d.windowCount = 0
+		if !d.hot {
+			pp.drain(d)
+		}
+	}
+	d.windowCount++
+	if !d.hot && d.windowCount >= pp.minConnect {
+		d.hot = true
+		if pp.p.config.Verbose {
+			log.Printf("Pre-connecting to hot destination %s", target)
+		}
+	}
+	return d
+}
+
+// takeOver stops a pooled connection's watcher and returns the connection
+// ready for relaying, or nil if the peer has closed it.
+// Called with pp.mu held; the watcher never takes pp.mu for claimed conns.
+func (pp *preconnectPool) takeOver(pc *pooledConn) net.Conn {
+	pc.conn.SetReadDeadline(time.Unix(1, 0))
+	<-pc.done
+	pc.conn.SetReadDeadline(time.Time{})
+
+	if pc.n > 0 {
+		return &prefixedConn{Conn: pc.conn, pending: pc.buf[:pc.n]}
+	}
+	// Only our deadline ended the Read. Netstack conns report it with their
+	// own timeout error, not os.ErrDeadlineExceeded.
+	var ne net.Error
+	if errors.As(pc.err, &ne) && ne.Timeout() {
+		return pc.conn
+	}
+	pc.conn.Close()
+	return nil
+}
+
+// refill starts dials until target has size idle or in-flight connections.
+// Called with pp.mu held.
+func (pp *preconnectPool) refill(target string, d *preconnectDest) {
+	for len(d.idle)+d.dialing < pp.size {
+		d.dialing++
+		go pp.fill(target, d)
+	}
+}
+
+func (pp *preconnectPool) fill(target string, d *preconnectDest) {
+	pp.mu.Lock()
+	ctx := pp.ctx
+	pp.mu.Unlock()
+
+	node := pp.p.pickNode(d.host)
+	conn, err := pp.p.dial(ctx, node, d.host, d.port, d.isDomain)
+
+	pp.mu.Lock()
+	defer pp.mu.Unlock()
+	d.dialing--
+	if err != nil {
+		d.stats.DialFailures++
+		// Stop speculating until the destination proves hot again
+		d.hot = false
+		pp.drain(d)
+		return
+	}
+	d.stats.Dialed++
+	if !d.hot || ctx.Err() != nil || pp.dests[target] != d {
+		conn.Close()
+		d.stats.Wasted++
+		return
+	}
+
+	pc := &pooledConn{conn: conn, node: node, created: time.Now(), done: make(chan struct{})}
+	d.idle = append(d.idle, pc)
+	go pp.watch(target, d, pc)
+}
+
+// watch parks in a Read on an idle connection so that a peer close is
+// noticed while the connection sits in the pool.
+func (pp *preconnectPool) watch(target string, d *preconnectDest, pc *pooledConn) {
+	pc.n, pc.err = pc.conn.Read(pc.buf[:])
+	close(pc.done)
+	if pc.err == nil {
+		// Server spoke first; keep the byte for whoever claims the conn
+		return
+	}
+
+	pp.mu.Lock()
+	defer pp.mu.Unlock()
+	if pc.claimed {
+		return
+	}
+	for i, idle := range d.idle {
+		if idle == pc {
+			d.idle = append(d.idle[:i], d.idle[i+1:]...)
+			d.stats.Wasted++
+			pc.conn.Close()
+			if pp.p.config.Verbose {
+				log.Printf("Pre-connected conn to %s closed by peer: %v", target, pc.err)
+			}
+			break
+		}
+	}
+}
+
+// drain closes all idle connections of d. Called with pp.mu held.
+func (pp *preconnectPool) drain(d *preconnectDest) {
+	for _, pc := range d.idle {
+		pc.claimed = true
+		pc.conn.Close()
+		d.stats.Wasted++
+	}
+	d.idle = nil
+}
+
+// expire closes connections that outlived the idle TTL and forgets
+// destinations that went cold.
+func (pp *preconnectPool) expire() {
+	pp.mu.Lock()
+	defer pp.mu.Unlock()
+
+	now := time.Now()
+	for target, d := range pp.dests {
+		kept := d.idle[:0]
+		for _, pc := range d.idle {
+			if now.Sub(pc.created) >= pp.ttl {
+				pc.claimed = true
+				pc.conn.Close()
+				d.stats.Wasted++
+				d.stats.IdleTimeouts++
+				continue
+			}
+			kept = append(kept, pc)
+		}
+		d.idle = kept
+
+		if now.Sub(d.windowStart) >= preconnectWindow && d.windowCount < pp.minConnect {
+			d.hot = false
+			pp.drain(d)
+		}
+		if d.hot {
+			pp.refill(target, d)
+		}
+	}
+}
+
+// evictCold forgets destinations that are neither hot nor dialing.
+// Called with pp.mu held.
+func (pp *preconnectPool) evictCold(now time.Time) {
+	for target, d := range pp.dests {
+		if !d.hot && d.dialing == 0 && now.Sub(d.windowStart) >= preconnectWindow {
+			delete(pp.dests, target)
+		}
+	}
+}
+
+func (pp *preconnectPool) closeAll() {
+	pp.mu.Lock()
+	defer pp.mu.Unlock()
+	for _, d := range pp.dests {
+		d.hot = false
+		pp.drain(d)
+	}
+}
+
+// snapshot returns a copy of the per-destination statistics.
+func (pp *preconnectPool) snapshot() map[string]preconnectStats {
+	pp.mu.Lock()
+	defer pp.mu.Unlock()
+	out := make(map[string]preconnectStats, len(pp.dests))
+	for target, d := range pp.dests {
+		out[target] = d.stats
+	}
+	return out
+}
+
+func (pp *preconnectPool) logSummary() {
+	snap := pp.snapshot()
+	targets := make([]string, 0, len(snap))
+	for target, st := range snap {
+		if st.Dialed > 0 || st.Claims > 0 {
+			targets = append(targets, target)
+		}
+	}
+	sort.Strings(targets)
+	for _, target := range targets {
+		st := snap[target]
+		hitRate := 0.0
+		if st.Claims+st.Misses > 0 {
+			hitRate = float64(st.Claims) / float64(st.Claims+st.Misses)
+		}
+		log.Printf("Pre-connect stats %s: hit_rate=%.2f claims=%d misses=%d dialed=%d wasted=%d idle_timeouts=%d dial_failures=%d",
+			target, hitRate, st.Claims, st.Misses, st.Dialed, st.Wasted, st.IdleTimeouts, st.DialFailures)
+	}
+}
+
+// prefixedConn replays bytes that were read from Conn before it was handed out.
+type prefixedConn struct {
+	net.Conn
+	pending []byte
+}
+
+func (c *prefixedConn) Read(b []byte) (int, error) {
+	if len(c.pending) > 0 {
+		n := copy(b, c.pending)
+		c.pending = c.pending[n:]
+		return n, nil
+	}
+	return c.Conn.Read(b)
+}
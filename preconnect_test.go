@@ -0,0 +1,92 @@
+package main
+
+import (
+	"errors"
+	"io"
+	"net"
+	"testing"
+	"time"
+)
+
+// netstackTimeout stands in for the timeout error gVisor's gonet conns
+// return when a read deadline passes.
+type netstackTimeout struct{}
+
+func (netstackTimeout) Error() string   { return "i/o timeout" }
+func (netstackTimeout) Timeout() bool   { return true }
+func (netstackTimeout) Temporary() bool { return true }
+
+// netstackConn reports deadline expiry the way a gonet conn does.
+type netstackConn struct {
+	net.Conn
+}
+
+func (c netstackConn) Read(b []byte) (int, error) {
+	n, err := c.Conn.Read(b)
+	var ne net.Error
+	if errors.As(err, &ne) && ne.Timeout() {
+		err = netstackTimeout{}
+	}
+	return n, err
+}
+
+func TestPreconnectTakeOver(t *testing.T) {
+	tests := []struct {
+		name    string
+		wrap    func(net.Conn) net.Conn
+		greet   bool // server writes a byte before the claim
+		close   bool // server closes before the claim
+		wantNil bool
+	}{
+		{name: "pipe idle", wrap: func(c net.Conn) net.Conn { return c }},
+		{name: "netstack idle", wrap: func(c net.Conn) net.Conn { return netstackConn{c} }},
+		{name: "server first", wrap: func(c net.Conn) net.Conn { return netstackConn{c} }, greet: true},
+		{name: "peer closed", wrap: func(c net.Conn) net.Conn { return netstackConn{c} }, close: true, wantNil: true},
+	}
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			client, server := net.Pipe()
+			defer server.Close()
+
+			pp := &preconnectPool{p: &ProxyServer{config: &Config{}}}
+			d := &preconnectDest{}
+			pc := &pooledConn{conn: tt.wrap(client), created: time.Now(), done: make(chan struct{})}
+			d.idle = append(d.idle, pc)
+			go pp.watch("dest:80", d, pc)
+
+			if tt.greet {
+				server.Write([]byte("H"))
+				<-pc.done
+			}
+			if tt.close {
+				server.Close()
+				<-pc.done
+			}
+
+			pp.mu.Lock()
+			pc.claimed = true
+			conn := pp.takeOver(pc)
+			pp.mu.Unlock()
+			if tt.wantNil {
+				if conn != nil {
+					t.Fatal("claimed a connection the peer closed")
+				}
+				return
+			}
+			if conn == nil {
+				t.Fatal("healthy pooled connection was discarded")
+			}
+			defer conn.Close()
+
+			go server.Write([]byte("i"))
+			want := "i"
+			if tt.greet {
+				want = "Hi"
+			}
+			got := make([]byte, len(want))
+			if _, err := io.ReadFull(conn, got); err != nil || string(got) != want {
+				t.Fatalf("read %q, %v; want %q", got, err, want)
+			}
+		})
+	}
+}
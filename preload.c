@@ -1,34 +1,65 @@
 #define _GNU_SOURCE
 #include <dlfcn.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
 
 // Function pointers for original syscalls
+static int (*real_socket)(int, int, int) = NULL;
 static int (*real_connect)(int, const struct sockaddr *, socklen_t) = NULL;
 static int (*real_bind)(int, const struct sockaddr *, socklen_t) = NULL;
 static int (*real_listen)(int, int) = NULL;
 static int (*real_close)(int) = NULL;
+static int (*real_accept)(int, struct sockaddr *, socklen_t *) = NULL;
+static int (*real_accept4)(int, struct sockaddr *, socklen_t *, int) = NULL;
+static int (*real_epoll_ctl)(int, int, int, struct epoll_event *) = NULL;
+static int (*real_poll)(struct pollfd *, nfds_t, int) = NULL;
+static int (*real_getpeername)(int, struct sockaddr *, socklen_t *) = NULL;
+static int (*real_getsockname)(int, struct sockaddr *, socklen_t *) = NULL;
+static int (*real_setsockopt)(int, int, int, const void *, socklen_t) = NULL;
 static int (*real_getaddrinfo)(const char *, const char *, const struct addrinfo *, struct addrinfo **) = NULL;
 static struct hostent *(*real_gethostbyname)(const char *) = NULL;
 
+// Addresses of a connection injected by the proxy (export_inject), which is
+// a Unix socket underneath
+typedef struct {
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    struct sockaddr_storage local;
+    socklen_t local_len;
+} inject_addrs_t;
+
 // FD tracking structure
 #define MAX_FDS 65536
 typedef struct {
     int is_tcp;
+    int is_udp;               // UDP socket bound to a reported port
+    int is_unix;              // Unix socket bound to an export_unix path
+    int unix_len;             // sun_path length of a NUL-padded abstract name
     int is_listener;
     int family;
     int port;
+    int has_inject;           // listener with an injection channel
+    int inject_fd;            // the channel, when has_inject is set
+    inject_addrs_t *injected; // set on connections accepted from a channel
 } fd_info_t;
 
 static fd_info_t fd_table[MAX_FDS];
@@ -41,6 +72,9 @@ static int initialized = 0;
 static int export_enabled = 0;
 static char *control_socket = NULL;
 static int control_fd = -1;
+static char *inject_socket = NULL;
+static char *export_unix = NULL; // "path=port,...", see unix_bind()
+static int inject_listeners = 0; // listeners with a channel, read without the lock
 
 // Helper to send control message
 static void send_control_message(const char *msg) {
@@ -72,15 +106,387 @@ static void send_control_message(const char *msg) {
     send(control_fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL);
 }
 
+// Process identity, sent to the proxy as SOCKS5 username/password (RFC 1929):
+// username "pid=<pid>;exe=<name>", password the process's cgroup
+static pid_t ident_pid = 0;
+static unsigned char ident_user[256];
+static unsigned char ident_pass[256];
+static size_t ident_user_len = 0;
+static size_t ident_pass_len = 0;
+static pthread_mutex_t ident_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Build the identity on first use and again after fork. Called with
+// ident_lock held.
+static void load_process_ident(void) {
+    pid_t pid = getpid();
+    if (ident_pid == pid) {
+        return;
+    }
+
+    char exe[PATH_MAX];
+    const char *name = "unknown";
+    ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (n > 0) {
+        exe[n] = '\0';
+        char *slash = strrchr(exe, '/');
+        name = slash ? slash + 1 : exe;
+    }
+    int len = snprintf((char *)ident_user, sizeof(ident_user), "pid=%d;exe=%s", (int)pid, name);
+    ident_user_len = len < (int)sizeof(ident_user) ? (size_t)len : sizeof(ident_user) - 1;
+
+    // First line of /proc/self/cgroup, e.g. "0::/user.slice/job.scope"
+    ident_pass_len = 0;
+    int fd = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        char cg[512];
+        ssize_t r = read(fd, cg, sizeof(cg) - 1);
+        if (real_close) {
+            real_close(fd);
+        }
+        if (r > 0) {
+            cg[r] = '\0';
+            char *line_end = strchr(cg, '\n');
+            if (line_end) {
+                *line_end = '\0';
+            }
+            // Drop the "hierarchy-id:controllers:" prefix
+            char *path = strchr(cg, ':');
+            path = path ? strchr(path + 1, ':') : NULL;
+            path = path ? path + 1 : cg;
+            ident_pass_len = strlen(path);
+            if (ident_pass_len > sizeof(ident_pass) - 1) {
+                ident_pass_len = sizeof(ident_pass) - 1;
+            }
+            memcpy(ident_pass, path, ident_pass_len);
+        }
+    }
+
+    ident_pid = pid;
+}
+
+// Policy snapshot published by the proxy (see policy.go): bypass rules, the
+// proxy endpoint and the export port bitmap, mapped read-only from
+// TAILPROXY_POLICY_SHM and read under the proxy's sequence lock
+#define POLICY_MAX_BYPASS 64
+#define POLICY_SHM_SIZE 12288
+#define POLICY_PORTS_OFFSET 4096
+#define POLICY_FLAG_EXPORT_PORTS 1
+
+typedef struct {
+    uint8_t family; // 4 or 6
+    uint8_t bits;
+    uint8_t pad[2];
+    uint8_t addr[16];
+} policy_bypass_t;
+
+typedef struct {
+    char magic[4];
+    uint32_t seq;
+    uint64_t generation;
+    uint8_t proxy_port[2]; // network byte order
+    uint8_t pad[2];
+    uint8_t proxy_addr[4]; // network byte order
+    uint32_t bypass_count;
+    uint32_t flags;
+    policy_bypass_t bypass[POLICY_MAX_BYPASS];
+} policy_shm_t;
+
+static const policy_shm_t *policy_shm = NULL;
+static uint64_t policy_seen_gen = 0;
+
+static void map_policy_shm(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    // A file too short for the export bitmap faults on access, so check
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < POLICY_SHM_SIZE) {
+        real_close(fd);
+        return;
+    }
+    void *mem = mmap(NULL, POLICY_SHM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    real_close(fd);
+    if (mem == MAP_FAILED) {
+        return;
+    }
+    if (memcmp(((const policy_shm_t *)mem)->magic, "TPS1", 4) != 0) {
+        munmap(mem, POLICY_SHM_SIZE);
+        return;
+    }
+    policy_shm = mem;
+}
+
+static int prefix_match(const uint8_t *addr, const uint8_t *prefix, int bits) {
+    int bytes = bits / 8;
+    if (memcmp(addr, prefix, bytes) != 0) {
+        return 0;
+    }
+    int rem = bits % 8;
+    if (rem == 0) {
+        return 1;
+    }
+    uint8_t mask = (uint8_t)(0xFF << (8 - rem));
+    return (addr[bytes] & mask) == (prefix[bytes] & mask);
+}
+
+// Read the current snapshot: whether addr is bypassed, and the proxy
+// endpoint. Returns 0, leaving proxy untouched, if there is no snapshot or
+// it could not be read consistently.
+static int policy_read(const struct sockaddr *addr, struct sockaddr_in *proxy, int *bypass) {
+    const policy_shm_t *shm = policy_shm;
+    if (!shm) {
+        return 0;
+    }
+
+    uint8_t a[16];
+    int family;
+    if (addr->sa_family == AF_INET) {
+        family = 4;
+        memcpy(a, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+    } else {
+        family = 6;
+        memcpy(a, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+    }
+
+    for (int tries = 0; tries < 100; tries++) {
+        uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        uint64_t gen = __atomic_load_n(&shm->generation, __ATOMIC_RELAXED);
+        uint32_t count = shm->bypass_count;
+        if (count > POLICY_MAX_BYPASS) {
+            count = POLICY_MAX_BYPASS;
+        }
+        int match = 0;
+        for (uint32_t i = 0; i < count && !match; i++) {
+            const policy_bypass_t *e = &shm->bypass[i];
+            int bits = e->bits;
+            if (e->family == family && bits <= (family == 4 ? 32 : 128)) {
+                match = prefix_match(a, e->addr, bits);
+            }
+        }
+        uint16_t port;
+        uint32_t ip;
+        memcpy(&port, shm->proxy_port, sizeof(port));
+        memcpy(&ip, shm->proxy_addr, sizeof(ip));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+
+        if (gen == 0) {
+            return 0; // not published yet
+        }
+        if (port != 0) {
+            proxy->sin_port = port;
+            proxy->sin_addr.s_addr = ip;
+        }
+        *bypass = match;
+        uint64_t prev = __atomic_exchange_n(&policy_seen_gen, gen, __ATOMIC_RELAXED);
+        if (prev != gen && getenv("TAILPROXY_VERBOSE")) {
+            fprintf(stderr, "[tailproxy] Policy generation %llu: %u bypass rules\n",
+                    (unsigned long long)gen, count);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Whether the proxy would export port. Unknown (no snapshot, or port 0 before
+// the kernel picks one) counts as allowed, and the proxy decides.
+static int policy_export_allowed(int port) {
+    const policy_shm_t *shm = policy_shm;
+    if (!shm || port <= 0 || port > 65535) {
+        return 1;
+    }
+    const uint64_t *ports = (const uint64_t *)((const char *)shm + POLICY_PORTS_OFFSET);
+
+    for (int tries = 0; tries < 100; tries++) {
+        uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        uint32_t flags = __atomic_load_n(&shm->flags, __ATOMIC_RELAXED);
+        uint64_t word = __atomic_load_n(&ports[port / 64], __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        if (!(flags & POLICY_FLAG_EXPORT_PORTS)) {
+            return 1;
+        }
+        return (word >> (port % 64)) & 1;
+    }
+    return 1;
+}
+
+// Sampled connection tracing (see trace.go). A sampled connect() appends its
+// stages as Chrome trace events to TAILPROXY_TRACE_FILE, which the proxy
+// created, and passes its trace id to the proxy in the SOCKS5 username.
+static char *trace_file = NULL;
+static double trace_sample = 0;
+static int trace_fd = -1;
+static pid_t trace_pid = 0; // process whose name has been written
+static unsigned int trace_seq = 0;
+static __thread uint64_t trace_rng = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Stage timestamps of one traced connect(), in microseconds since the epoch
+// (0 if the stage was not reached)
+typedef struct {
+    uint64_t id;
+    int64_t start;
+    int64_t proxy_connected;
+    int64_t greeted;
+    int64_t replied;
+} conn_trace_t;
+
+static int64_t trace_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Decide whether to trace a connect() and return its id, or 0. Ids embed
+// the pid so processes never collide, and fit in 53 bits for JSON.
+static uint64_t trace_sample_id(void) {
+    if (!trace_file || trace_sample <= 0) {
+        return 0;
+    }
+    if (trace_rng == 0) {
+        trace_rng = ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)&trace_rng ^
+                    (uint64_t)trace_now_us();
+        trace_rng |= 1;
+    }
+    // xorshift64
+    trace_rng ^= trace_rng << 13;
+    trace_rng ^= trace_rng >> 7;
+    trace_rng ^= trace_rng << 17;
+    if ((double)(trace_rng >> 11) / (double)(1ULL << 53) >= trace_sample) {
+        return 0;
+    }
+    unsigned int seq = __atomic_add_fetch(&trace_seq, 1, __ATOMIC_RELAXED);
+    return (((uint64_t)getpid() << 24) | (seq & 0xFFFFFF)) & ((1ULL << 53) - 1);
+}
+
+static int trace_span(char *buf, size_t size, int pid, uint64_t id,
+                      const char *name, int64_t start, int64_t end) {
+    if (start == 0 || end == 0) {
+        return 0;
+    }
+    int n = snprintf(buf, size,
+                     "{\"name\":\"%s\",\"cat\":\"conn\",\"ph\":\"X\",\"ts\":%lld,"
+                     "\"dur\":%lld,\"pid\":%d,\"tid\":%llu},\n",
+                     name, (long long)start, (long long)(end - start), pid,
+                     (unsigned long long)id);
+    return n < (int)size ? n : 0;
+}
+
+// Append a traced connect()'s events to the trace file in one write.
+// Preserves errno.
+static void trace_emit(const conn_trace_t *tr, const struct sockaddr *addr, int err) {
+    if (!tr) {
+        return;
+    }
+    int saved_errno = errno;
+    int64_t end = trace_now_us();
+
+    char ip[INET6_ADDRSTRLEN] = "?";
+    int port = 0;
+    if (addr->sa_family == AF_INET) {
+        struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
+        inet_ntop(AF_INET, &addr_in->sin_addr, ip, sizeof(ip));
+        port = ntohs(addr_in->sin_port);
+    } else if (addr->sa_family == AF_INET6) {
+        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)addr;
+        inet_ntop(AF_INET6, &addr_in6->sin6_addr, ip, sizeof(ip));
+        port = ntohs(addr_in6->sin6_port);
+    }
+
+    int pid = (int)getpid();
+    char buf[2048];
+    size_t pos = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd < 0) {
+        trace_fd = open(trace_file, O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+    if (trace_fd < 0) {
+        pthread_mutex_unlock(&trace_lock);
+        errno = saved_errno;
+        return;
+    }
+    if (trace_pid != pid) {
+        // Name the process once; quotes and control characters are dropped
+        // so the name cannot break the JSON
+        char name[64];
+        size_t i = 0;
+        for (const char *c = program_invocation_short_name; *c && i < sizeof(name) - 1; c++) {
+            if (*c != '"' && *c != '\\' && (unsigned char)*c >= 0x20) {
+                name[i++] = *c;
+            }
+        }
+        name[i] = '\0';
+        pos += snprintf(buf + pos, sizeof(buf) - pos,
+                        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                        "\"args\":{\"name\":\"%s (%d)\"}},\n", pid, name, pid);
+        trace_pid = pid;
+    }
+
+    unsigned long long id = (unsigned long long)tr->id;
+    pos += snprintf(buf + pos, sizeof(buf) - pos,
+                    "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%llu,"
+                    "\"args\":{\"name\":\"%s%s%s:%d\"}},\n",
+                    pid, id, addr->sa_family == AF_INET6 ? "[" : "", ip,
+                    addr->sa_family == AF_INET6 ? "]" : "", port);
+    pos += snprintf(buf + pos, sizeof(buf) - pos,
+                    "{\"name\":\"connect\",\"cat\":\"conn\",\"ph\":\"X\",\"ts\":%lld,"
+                    "\"dur\":%lld,\"pid\":%d,\"tid\":%llu,\"args\":{\"errno\":%d}},\n",
+                    (long long)tr->start, (long long)(end - tr->start), pid, id, err);
+    pos += trace_span(buf + pos, sizeof(buf) - pos, pid, tr->id,
+                      "proxy connect", tr->start, tr->proxy_connected);
+    pos += trace_span(buf + pos, sizeof(buf) - pos, pid, tr->id,
+                      "socks greeting", tr->proxy_connected, tr->greeted);
+    pos += trace_span(buf + pos, sizeof(buf) - pos, pid, tr->id,
+                      "socks request", tr->greeted, tr->replied);
+    if (tr->greeted) {
+        // Flow arrow to the proxy's side of the connection
+        pos += snprintf(buf + pos, sizeof(buf) - pos,
+                        "{\"name\":\"socks\",\"cat\":\"conn\",\"ph\":\"s\",\"ts\":%lld,"
+                        "\"pid\":%d,\"tid\":%llu,\"id\":\"%llx\"},\n",
+                        (long long)tr->greeted, pid, id, id);
+    }
+    if (pos < sizeof(buf)) {
+        ssize_t w = write(trace_fd, buf, pos);
+        (void)w;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    errno = saved_errno;
+}
+
 // Initialize the library
 static void init_preload(void) {
     if (initialized) return;
 
     // Load original function pointers
+    real_socket = dlsym(RTLD_NEXT, "socket");
     real_connect = dlsym(RTLD_NEXT, "connect");
     real_bind = dlsym(RTLD_NEXT, "bind");
     real_listen = dlsym(RTLD_NEXT, "listen");
     real_close = dlsym(RTLD_NEXT, "close");
+    real_accept = dlsym(RTLD_NEXT, "accept");
+    real_accept4 = dlsym(RTLD_NEXT, "accept4");
+    real_epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+    real_poll = dlsym(RTLD_NEXT, "poll");
+    real_getpeername = dlsym(RTLD_NEXT, "getpeername");
+    real_getsockname = dlsym(RTLD_NEXT, "getsockname");
+    real_setsockopt = dlsym(RTLD_NEXT, "setsockopt");
     real_getaddrinfo = dlsym(RTLD_NEXT, "getaddrinfo");
     real_gethostbyname = dlsym(RTLD_NEXT, "gethostbyname");
 
@@ -98,31 +504,65 @@ static void init_preload(void) {
         proxy_host = env_host;
     }
 
+    char *env_policy = getenv("TAILPROXY_POLICY_SHM");
+    if (env_policy && real_close) {
+        map_policy_shm(env_policy);
+    }
+
     // Check if export mode is enabled
     if (getenv("TAILPROXY_EXPORT_LISTENERS")) {
         export_enabled = 1;
         control_socket = getenv("TAILPROXY_CONTROL_SOCK");
+        if (real_accept && real_accept4 && real_poll) {
+            inject_socket = getenv("TAILPROXY_INJECT_SOCK");
+        }
+        export_unix = getenv("TAILPROXY_EXPORT_UNIX");
+    }
+
+    // Sampled connection tracing
+    trace_file = getenv("TAILPROXY_TRACE_FILE");
+    char *env_sample = getenv("TAILPROXY_TRACE_SAMPLE");
+    if (trace_file && env_sample) {
+        trace_sample = strtod(env_sample, NULL);
     }
 
     initialized = 1;
 
     if (getenv("TAILPROXY_VERBOSE")) {
-        fprintf(stderr, "[tailproxy] Initialized: proxy=%s:%d, export=%d\n",
-                proxy_host, proxy_port, export_enabled);
+        fprintf(stderr, "[tailproxy] Initialized: proxy=%s:%d, export=%d, trace=%g\n",
+                proxy_host, proxy_port, export_enabled, trace_file ? trace_sample : 0.0);
+    }
+}
+
+// Map a SOCKS5 reply code to the errno a direct connect() would have produced
+static int socks5_reply_errno(unsigned char reply) {
+    switch (reply) {
+    case 0x02: return EACCES;        // Connection not allowed by ruleset
+    case 0x03: return ENETUNREACH;   // Network unreachable
+    case 0x04: return EHOSTUNREACH;  // Host unreachable
+    case 0x05: return ECONNREFUSED;  // Connection refused
+    case 0x06: return ETIMEDOUT;     // TTL expired (dial timed out)
+    case 0x07: return EOPNOTSUPP;    // Command not supported
+    case 0x08: return EAFNOSUPPORT;  // Address type not supported
+    default:   return ECONNREFUSED;  // General failure
     }
 }
 
 // SOCKS5 handshake and connect
-static int socks5_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
-    unsigned char buf[512];
+static int socks5_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen,
+                          conn_trace_t *tr) {
+    // Large enough for the RFC 1929 subnegotiation with both fields at
+    // their 255-byte cap: 1 + 1 + 255 + 1 + 255
+    unsigned char buf[515];
     int ret;
 
     // SOCKS5 greeting
     buf[0] = 0x05; // SOCKS version 5
-    buf[1] = 0x01; // 1 auth method
-    buf[2] = 0x00; // No authentication
+    buf[1] = 0x02; // 2 auth methods
+    buf[2] = 0x02; // Username/password, carrying the process identity
+    buf[3] = 0x00; // No authentication
 
-    if (send(sockfd, buf, 3, 0) != 3) {
+    if (send(sockfd, buf, 4, 0) != 4) {
         return -1;
     }
 
@@ -131,11 +571,51 @@ static int socks5_connect(int sockfd, const struct sockaddr *addr, socklen_t add
         return -1;
     }
 
-    if (buf[0] != 0x05 || buf[1] != 0x00) {
+    if (buf[0] != 0x05 || (buf[1] != 0x00 && buf[1] != 0x02)) {
         errno = ECONNREFUSED;
         return -1;
     }
 
+    if (buf[1] == 0x02) {
+        // Username/password subnegotiation
+        pthread_mutex_lock(&ident_lock);
+        load_process_ident();
+        int pos = 0;
+        buf[pos++] = 0x01; // Subnegotiation version
+        int ulen_pos = pos++;
+        memcpy(&buf[pos], ident_user, ident_user_len);
+        size_t ulen = ident_user_len;
+        if (tr) {
+            // Pass the trace id to the proxy with the identity
+            char tid[32];
+            int n = snprintf(tid, sizeof(tid), ";trace=%llx", (unsigned long long)tr->id);
+            if (n > 0 && ulen + n <= 255) {
+                memcpy(&buf[pos + ulen], tid, n);
+                ulen += n;
+            }
+        }
+        buf[ulen_pos] = (unsigned char)ulen;
+        pos += ulen;
+        buf[pos++] = (unsigned char)ident_pass_len;
+        memcpy(&buf[pos], ident_pass, ident_pass_len);
+        pos += ident_pass_len;
+        pthread_mutex_unlock(&ident_lock);
+
+        if (send(sockfd, buf, pos, 0) != pos) {
+            return -1;
+        }
+        if (recv(sockfd, buf, 2, 0) != 2) {
+            return -1;
+        }
+        if (buf[0] != 0x01 || buf[1] != 0x00) {
+            errno = EACCES;
+            return -1;
+        }
+    }
+    if (tr) {
+        tr->greeted = trace_now_us();
+    }
+
     // Build SOCKS5 connect request
     buf[0] = 0x05; // SOCKS version
     buf[1] = 0x01; // CONNECT command
@@ -169,14 +649,21 @@ static int socks5_connect(int sockfd, const struct sockaddr *addr, socklen_t add
 
     // Read connect response
     ret = recv(sockfd, buf, sizeof(buf), 0);
+    if (tr) {
+        tr->replied = trace_now_us();
+    }
     if (ret < 7) {
         return -1;
     }
 
-    if (buf[0] != 0x05 || buf[1] != 0x00) {
+    if (buf[0] != 0x05) {
         errno = ECONNREFUSED;
         return -1;
     }
+    if (buf[1] != 0x00) {
+        errno = socks5_reply_errno(buf[1]);
+        return -1;
+    }
 
     return 0;
 }
@@ -218,6 +705,19 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
         }
     }
 
+    // The proxy endpoint, and whether the destination bypasses it, come
+    // from the policy snapshot when there is one
+    struct sockaddr_in proxy_addr;
+    memset(&proxy_addr, 0, sizeof(proxy_addr));
+    proxy_addr.sin_family = AF_INET;
+    proxy_addr.sin_port = htons(proxy_port);
+    inet_pton(AF_INET, proxy_host, &proxy_addr.sin_addr);
+    int bypass = 0;
+    policy_read(addr, &proxy_addr, &bypass);
+    if (bypass) {
+        return real_connect(sockfd, addr, addrlen);
+    }
+
     if (getenv("TAILPROXY_VERBOSE")) {
         if (addr->sa_family == AF_INET) {
             struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
@@ -228,6 +728,12 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
         }
     }
 
+    conn_trace_t trace = { .id = trace_sample_id() };
+    conn_trace_t *tr = trace.id ? &trace : NULL;
+    if (tr) {
+        tr->start = trace_now_us();
+    }
+
     // Save original socket flags and make socket blocking for SOCKS5 handshake
     int flags = fcntl(sockfd, F_GETFL, 0);
     int was_nonblocking = (flags != -1 && (flags & O_NONBLOCK));
@@ -236,17 +742,12 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
     }
 
     // Connect to SOCKS5 proxy
-    struct sockaddr_in proxy_addr;
-    memset(&proxy_addr, 0, sizeof(proxy_addr));
-    proxy_addr.sin_family = AF_INET;
-    proxy_addr.sin_port = htons(proxy_port);
-    inet_pton(AF_INET, proxy_host, &proxy_addr.sin_addr);
-
     int ret = real_connect(sockfd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr));
     if (ret != 0 && errno != EINPROGRESS) {
         if (getenv("TAILPROXY_VERBOSE")) {
             fprintf(stderr, "[tailproxy] Failed to connect to proxy: %s\n", strerror(errno));
         }
+        trace_emit(tr, addr, errno);
         if (was_nonblocking) {
             fcntl(sockfd, F_SETFL, flags);
         }
@@ -261,6 +762,7 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
                 fcntl(sockfd, F_SETFL, flags);
             }
             errno = ETIMEDOUT;
+            trace_emit(tr, addr, errno);
             return -1;
         }
         // Check if connect succeeded
@@ -272,18 +774,25 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
                 fcntl(sockfd, F_SETFL, flags);
             }
             errno = error;
+            trace_emit(tr, addr, errno);
             return -1;
         }
     }
+    if (tr) {
+        tr->proxy_connected = trace_now_us();
+    }
 
     // Perform SOCKS5 handshake
-    if (socks5_connect(sockfd, addr, addrlen) != 0) {
+    if (socks5_connect(sockfd, addr, addrlen, tr) != 0) {
+        int saved_errno = errno;
+        trace_emit(tr, addr, saved_errno);
         if (getenv("TAILPROXY_VERBOSE")) {
-            fprintf(stderr, "[tailproxy] SOCKS5 handshake failed: %s\n", strerror(errno));
+            fprintf(stderr, "[tailproxy] SOCKS5 handshake failed: %s\n", strerror(saved_errno));
         }
         if (was_nonblocking) {
             fcntl(sockfd, F_SETFL, flags);
         }
+        errno = saved_errno;
         return -1;
     }
 
@@ -292,9 +801,195 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
         fcntl(sockfd, F_SETFL, flags);
     }
 
+    trace_emit(tr, addr, 0);
     return 0;
 }
 
+// Format the address a socket is bound to as "ip:port" (IPv6 in brackets)
+// into buf, and return the port, or 0 if it is not an IP socket. buf is left
+// empty if the address can't be formatted.
+static int bound_addr(int sockfd, int *family, char *buf, size_t size) {
+    struct sockaddr_storage ss;
+    socklen_t slen = sizeof(ss);
+    char ip[INET6_ADDRSTRLEN];
+    int port = 0;
+
+    buf[0] = '\0';
+    if (real_getsockname(sockfd, (struct sockaddr *)&ss, &slen) != 0) {
+        return 0;
+    }
+    *family = ss.ss_family;
+    if (ss.ss_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+        port = ntohs(sin->sin_port);
+        if (inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip))) {
+            snprintf(buf, size, "%s:%d", ip, port);
+        }
+    } else if (ss.ss_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+        port = ntohs(sin6->sin6_port);
+        if (inet_ntop(AF_INET6, &sin6->sin6_addr, ip, sizeof(ip))) {
+            snprintf(buf, size, "[%s]:%d", ip, port);
+        }
+    }
+    return port;
+}
+
+// UDP sockets have no listen(), so one bound to a fixed port is reported
+// when it binds. The bind is not rewritten to loopback: unlike a TCP
+// listener, the same socket may send to other hosts.
+static int udp_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    int ret = real_bind(sockfd, addr, addrlen);
+    if (ret != 0 || sockfd < 0 || sockfd >= MAX_FDS) {
+        return ret;
+    }
+    // Port 0 is a client asking for an ephemeral port
+    if (addr->sa_family == AF_INET) {
+        if (((const struct sockaddr_in *)addr)->sin_port == 0) return ret;
+    } else if (addr->sa_family == AF_INET6) {
+        if (((const struct sockaddr_in6 *)addr)->sin6_port == 0) return ret;
+    } else {
+        return ret;
+    }
+
+    int family = AF_INET;
+    char bound[INET6_ADDRSTRLEN + 8];
+    int port = bound_addr(sockfd, &family, bound, sizeof(bound));
+    if (port <= 0 || !policy_export_allowed(port)) {
+        return ret;
+    }
+    const char *family_str = family == AF_INET ? "udp4" : "udp6";
+
+    pthread_mutex_lock(&fd_table_lock);
+    fd_table[sockfd].is_udp = 1;
+    fd_table[sockfd].is_listener = 1;
+    fd_table[sockfd].family = family;
+    fd_table[sockfd].port = port;
+    pthread_mutex_unlock(&fd_table_lock);
+
+    char msg[128];
+    if (bound[0]) {
+        snprintf(msg, sizeof(msg), "LISTEN %s %d %s\n", family_str, port, bound);
+    } else {
+        snprintf(msg, sizeof(msg), "LISTEN %s %d\n", family_str, port);
+    }
+    send_control_message(msg);
+
+    if (getenv("TAILPROXY_VERBOSE")) {
+        fprintf(stderr, "[tailproxy] Notifying UDP socket on port %d\n", port);
+    }
+    return ret;
+}
+
+// Format the path a Unix socket address names into buf: absolute, against
+// the working directory if it was relative, or "@name" for an abstract
+// socket. An abstract name bound with its trailing NUL padding (addrlen of
+// sizeof(struct sockaddr_un)) is formatted without it, and *padded gets the
+// padded sun_path length, which is part of the name; otherwise *padded is 0.
+// Returns 0, or -1 for an unnamed socket or one that doesn't fit.
+static int unix_path(const struct sockaddr *addr, socklen_t addrlen, char *buf, size_t size, int *padded) {
+    const struct sockaddr_un *sun = (const struct sockaddr_un *)addr;
+    size_t off = offsetof(struct sockaddr_un, sun_path);
+    if (addrlen <= off) {
+        return -1;
+    }
+    size_t len = addrlen - off;
+    if (len > sizeof(sun->sun_path)) {
+        len = sizeof(sun->sun_path);
+    }
+
+    *padded = 0;
+    if (sun->sun_path[0] == '\0') {
+        // Abstract: the name is every byte after the NUL
+        size_t full = len;
+        while (len > 1 && sun->sun_path[len - 1] == '\0') {
+            len--;
+        }
+        if (len < 2 || len >= size || memchr(sun->sun_path + 1, '\0', len - 1)) {
+            return -1;
+        }
+        if (full != len) {
+            *padded = (int)full;
+        }
+        buf[0] = '@';
+        memcpy(buf + 1, sun->sun_path + 1, len - 1);
+        buf[len] = '\0';
+        return 0;
+    }
+
+    const char *path = sun->sun_path;
+    size_t plen = strnlen(path, len);
+    if (path[0] == '/') {
+        if (plen >= size) return -1;
+        memcpy(buf, path, plen);
+        buf[plen] = '\0';
+        return 0;
+    }
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        return -1;
+    }
+    while (plen >= 2 && path[0] == '.' && path[1] == '/') {
+        path += 2;
+        plen -= 2;
+    }
+    int n = snprintf(buf, size, "%s%s%.*s", cwd, strcmp(cwd, "/") ? "/" : "", (int)plen, path);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+// Look path up in export_unix, returning its port or 0.
+static int unix_export_port(const char *path) {
+    size_t plen = strlen(path);
+    const char *p = export_unix;
+    while (p && *p) {
+        const char *end = strchr(p, ',');
+        size_t elen = end ? (size_t)(end - p) : strlen(p);
+        // The port follows the last '=', which a path may itself contain
+        const char *eq = NULL;
+        for (const char *q = p; q < p + elen; q++) {
+            if (*q == '=') eq = q;
+        }
+        if (eq && (size_t)(eq - p) == plen && memcmp(p, path, plen) == 0) {
+            return atoi(eq + 1);
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+// A Unix stream socket bound to a path in export_unix is reported by
+// listen() as "LISTEN unix <port>"; the proxy knows which path the port maps
+// to and dials it. A padded abstract name adds its length ("LISTEN unix
+// <port> <len>") so the proxy dials the name with the same padding. Other
+// Unix sockets are left alone.
+static int unix_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    int ret = real_bind(sockfd, addr, addrlen);
+    if (ret != 0 || !export_unix || sockfd < 0 || sockfd >= MAX_FDS) {
+        return ret;
+    }
+    char path[PATH_MAX + 2];
+    int padded;
+    if (unix_path(addr, addrlen, path, sizeof(path), &padded) != 0) {
+        return ret;
+    }
+    int port = unix_export_port(path);
+    if (port <= 0) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&fd_table_lock);
+    fd_table[sockfd].is_unix = 1;
+    fd_table[sockfd].unix_len = padded;
+    fd_table[sockfd].family = AF_UNIX;
+    fd_table[sockfd].port = port;
+    pthread_mutex_unlock(&fd_table_lock);
+
+    if (getenv("TAILPROXY_VERBOSE")) {
+        fprintf(stderr, "[tailproxy] Unix socket %s maps to port %d\n", path, port);
+    }
+    return ret;
+}
+
 // Intercepted bind()
 int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
     init_preload();
@@ -316,18 +1011,34 @@ int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
         return real_bind(sockfd, addr, addrlen);
     }
 
+    if (socktype == SOCK_DGRAM) {
+        return udp_bind(sockfd, addr, addrlen);
+    }
     if (socktype != SOCK_STREAM) {
-        // Only intercept TCP sockets
         return real_bind(sockfd, addr, addrlen);
     }
+    if (addr->sa_family == AF_UNIX) {
+        return unix_bind(sockfd, addr, addrlen);
+    }
 
-    // Track as TCP socket
-    pthread_mutex_lock(&fd_table_lock);
-    if (sockfd >= 0 && sockfd < MAX_FDS) {
-        fd_table[sockfd].is_tcp = 1;
-        fd_table[sockfd].family = addr->sa_family;
+    // Ports the proxy will never export are not tracked, so listen() does
+    // not report them. They are still rewritten to loopback below: the
+    // policy decides what the tailnet sees, never what the LAN sees.
+    int bind_port = 0;
+    if (addr->sa_family == AF_INET) {
+        bind_port = ntohs(((const struct sockaddr_in *)addr)->sin_port);
+    } else if (addr->sa_family == AF_INET6) {
+        bind_port = ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+    }
+    if (policy_export_allowed(bind_port)) {
+        // Track as TCP socket
+        pthread_mutex_lock(&fd_table_lock);
+        if (sockfd >= 0 && sockfd < MAX_FDS) {
+            fd_table[sockfd].is_tcp = 1;
+            fd_table[sockfd].family = addr->sa_family;
+        }
+        pthread_mutex_unlock(&fd_table_lock);
     }
-    pthread_mutex_unlock(&fd_table_lock);
 
     // Rewrite bind address to loopback
     if (addr->sa_family == AF_INET) {
@@ -372,6 +1083,243 @@ int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
     return real_bind(sockfd, addr, addrlen);
 }
 
+// Forget what the table holds for fd, reporting a listener's close to the
+// proxy. close() calls this, and so do socket() and accept() for the fds
+// they return: an fd closed without going through close() (fclose() on an
+// fdopen'd stream, dup2(), close_range()) leaves its entry behind, and a new
+// socket with the same number must not inherit it.
+static void fd_reset(int fd) {
+    if (!export_enabled || fd < 0 || fd >= MAX_FDS) {
+        return;
+    }
+    pthread_mutex_lock(&fd_table_lock);
+    if (fd_table[fd].is_listener && fd_table[fd].port > 0) {
+        const char *family_str = fd_table[fd].is_unix ? "unix" :
+            fd_table[fd].is_udp ?
+            ((fd_table[fd].family == AF_INET) ? "udp4" : "udp6") :
+            ((fd_table[fd].family == AF_INET) ? "tcp4" : "tcp6");
+        int port = fd_table[fd].port;
+
+        pthread_mutex_unlock(&fd_table_lock);
+
+        char msg[128];
+        snprintf(msg, sizeof(msg), "CLOSE %s %d\n", family_str, port);
+        send_control_message(msg);
+
+        if (getenv("TAILPROXY_VERBOSE")) {
+            fprintf(stderr, "[tailproxy] Notifying close of listener on port %d\n", port);
+        }
+
+        pthread_mutex_lock(&fd_table_lock);
+    }
+
+    // Closing the channel also takes it out of any epoll set
+    if (fd_table[fd].has_inject) {
+        real_close(fd_table[fd].inject_fd);
+        __atomic_sub_fetch(&inject_listeners, 1, __ATOMIC_RELAXED);
+    }
+    free(fd_table[fd].injected);
+
+    // Clear FD entry
+    memset(&fd_table[fd], 0, sizeof(fd_info_t));
+    pthread_mutex_unlock(&fd_table_lock);
+}
+
+// Connection injection (export_inject). Each exported listener gets a
+// SOCK_SEQPACKET channel to the proxy, which sends one end of a Unix
+// socketpair per tailnet connection along with the peer address. accept()
+// returns those alongside the kernel's own connections, and epoll_ctl() and
+// poll() watch the channel together with the listener, so an injected
+// connection wakes the app as a readable listener.
+
+// Open a listener's channel and announce it. Returns the channel or -1.
+static int inject_open(const char *family_str, int port) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, inject_socket, sizeof(addr.sun_path) - 1);
+
+    char hello[64];
+    int len = snprintf(hello, sizeof(hello), "INJECT %s %d", family_str, port);
+    if (real_connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        send(fd, hello, len, MSG_NOSIGNAL) != len) {
+        real_close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Channel of a listener, or -1 if it has none
+static int inject_channel(int fd) {
+    if (!inject_socket || fd < 0 || fd >= MAX_FDS) {
+        return -1;
+    }
+    pthread_mutex_lock(&fd_table_lock);
+    int chan = fd_table[fd].has_inject ? fd_table[fd].inject_fd : -1;
+    pthread_mutex_unlock(&fd_table_lock);
+    return chan;
+}
+
+// Stop injecting into a listener whose proxy has gone away
+static void inject_detach(int listener, int chan) {
+    pthread_mutex_lock(&fd_table_lock);
+    if (fd_table[listener].has_inject && fd_table[listener].inject_fd == chan) {
+        fd_table[listener].has_inject = 0;
+        real_close(chan);
+        __atomic_sub_fetch(&inject_listeners, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&fd_table_lock);
+}
+
+// Take one injected connection off a listener's channel without blocking.
+// Returns the new fd; -1 with errno EAGAIN if none is queued (or
+// ECONNABORTED for a malformed message); -2 if the channel is gone.
+static int inject_receive(int listener, int chan, int flags, inject_addrs_t *addrs) {
+    char buf[96];
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    struct iovec iov = { buf, sizeof(buf) - 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+
+    ssize_t n = recvmsg(chan, &msg, MSG_DONTWAIT | ((flags & SOCK_CLOEXEC) ? MSG_CMSG_CLOEXEC : 0));
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            errno = EAGAIN;
+            return -1;
+        }
+        inject_detach(listener, chan);
+        return -2;
+    }
+    if (n == 0) {
+        inject_detach(listener, chan);
+        return -2;
+    }
+
+    int fd = -1;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS &&
+        c->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(&fd, CMSG_DATA(c), sizeof(int));
+    }
+
+    // "<ip> <port>" of the tailnet peer, in the listener's family
+    char ip[INET6_ADDRSTRLEN];
+    int port = 0;
+    buf[n] = '\0';
+    memset(addrs, 0, sizeof(*addrs));
+    if (fd >= 0 && sscanf(buf, "%45s %d", ip, &port) == 2) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&addrs->peer;
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addrs->peer;
+        if (inet_pton(AF_INET, ip, &sin->sin_addr) == 1) {
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(port);
+            addrs->peer_len = sizeof(*sin);
+        } else if (inet_pton(AF_INET6, ip, &sin6->sin6_addr) == 1) {
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(port);
+            addrs->peer_len = sizeof(*sin6);
+        }
+    }
+    if (addrs->peer_len == 0) {
+        if (fd >= 0) {
+            real_close(fd);
+        }
+        errno = ECONNABORTED;
+        return -1;
+    }
+
+    if (flags & SOCK_NONBLOCK) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    addrs->local_len = sizeof(addrs->local);
+    if (real_getsockname(listener, (struct sockaddr *)&addrs->local, &addrs->local_len) < 0) {
+        addrs->local_len = 0;
+    }
+    return fd;
+}
+
+// accept() on a listener with a channel: injected connections first, then
+// the kernel's. A blocking accept waits for either.
+static int inject_accept(int sockfd, int chan, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+    int nonblocking = fcntl(sockfd, F_GETFL) & O_NONBLOCK;
+    for (;;) {
+        inject_addrs_t addrs;
+        int fd = inject_receive(sockfd, chan, flags, &addrs);
+        if (fd >= 0) {
+            if (addr && addrlen) {
+                memcpy(addr, &addrs.peer, *addrlen < addrs.peer_len ? *addrlen : addrs.peer_len);
+                *addrlen = addrs.peer_len;
+            }
+            fd_reset(fd);
+            inject_addrs_t *a = malloc(sizeof(*a));
+            if (a) {
+                *a = addrs;
+            }
+            pthread_mutex_lock(&fd_table_lock);
+            if (fd < MAX_FDS) {
+                free(fd_table[fd].injected);
+                fd_table[fd].injected = a;
+                a = NULL;
+            }
+            pthread_mutex_unlock(&fd_table_lock);
+            free(a);
+            return fd;
+        }
+        if (fd == -1 && errno != EAGAIN) {
+            return -1;
+        }
+        if (fd == -2 || nonblocking) {
+            break;
+        }
+
+        struct pollfd pfd[2] = { { sockfd, POLLIN, 0 }, { chan, POLLIN, 0 } };
+        if (real_poll(pfd, 2, -1) < 0) {
+            return -1;
+        }
+        if (pfd[0].revents) {
+            break;
+        }
+    }
+    int fd = real_accept4(sockfd, addr, addrlen, flags);
+    fd_reset(fd);
+    return fd;
+}
+
+// Copy the stored peer or local address of an injected connection. Returns
+// 0 if fd is not one.
+static int inject_addr(int fd, int peer, struct sockaddr *addr, socklen_t *addrlen) {
+    if (!inject_socket || fd < 0 || fd >= MAX_FDS) {
+        return 0;
+    }
+    int found = 0;
+    pthread_mutex_lock(&fd_table_lock);
+    inject_addrs_t *a = fd_table[fd].injected;
+    if (a) {
+        struct sockaddr_storage *src = peer ? &a->peer : &a->local;
+        socklen_t len = peer ? a->peer_len : a->local_len;
+        if (len > 0 && addr && addrlen) {
+            memcpy(addr, src, *addrlen < len ? *addrlen : len);
+            *addrlen = len;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&fd_table_lock);
+    return found;
+}
+
 // Intercepted listen()
 int listen(int sockfd, int backlog) {
     init_preload();
@@ -390,40 +1338,65 @@ int listen(int sockfd, int backlog) {
     // If export mode enabled and this is a TCP socket, notify Go
     if (export_enabled && sockfd >= 0 && sockfd < MAX_FDS) {
         pthread_mutex_lock(&fd_table_lock);
+        if (fd_table[sockfd].is_unix) {
+            // unix_bind() found the port; export_unix has the path
+            fd_table[sockfd].is_listener = 1;
+            int port = fd_table[sockfd].port;
+            int unix_len = fd_table[sockfd].unix_len;
+            pthread_mutex_unlock(&fd_table_lock);
+
+            char msg[64];
+            if (unix_len) {
+                snprintf(msg, sizeof(msg), "LISTEN unix %d %d\n", port, unix_len);
+            } else {
+                snprintf(msg, sizeof(msg), "LISTEN unix %d\n", port);
+            }
+            send_control_message(msg);
+
+            if (getenv("TAILPROXY_VERBOSE")) {
+                fprintf(stderr, "[tailproxy] Notifying Unix socket listener for port %d\n", port);
+            }
+            return ret;
+        }
         if (fd_table[sockfd].is_tcp) {
             fd_table[sockfd].is_listener = 1;
 
-            // Get actual bound port
-            struct sockaddr_storage ss;
-            socklen_t slen = sizeof(ss);
-            if (getsockname(sockfd, (struct sockaddr *)&ss, &slen) == 0) {
-                int port = 0;
-                const char *family_str = "tcp4";
-
-                if (ss.ss_family == AF_INET) {
-                    struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
-                    port = ntohs(sin->sin_port);
-                    family_str = "tcp4";
-                } else if (ss.ss_family == AF_INET6) {
-                    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
-                    port = ntohs(sin6->sin6_port);
-                    family_str = "tcp6";
-                }
+            // Get actual bound port, and the address so the proxy dials
+            // the listener directly
+            int family = AF_INET;
+            char addr[INET6_ADDRSTRLEN + 8];
+            int port = bound_addr(sockfd, &family, addr, sizeof(addr));
+            const char *family_str = family == AF_INET ? "tcp4" : "tcp6";
 
+            // Only reported ports are recorded, so close() reports
+            // exactly what listen() did
+            if (port > 0 && policy_export_allowed(port)) {
                 fd_table[sockfd].port = port;
-
-                if (port > 0) {
-                    char msg[128];
+                char msg[128];
+                if (addr[0]) {
+                    snprintf(msg, sizeof(msg), "LISTEN %s %d %s\n", family_str, port, addr);
+                } else {
                     snprintf(msg, sizeof(msg), "LISTEN %s %d\n", family_str, port);
-                    pthread_mutex_unlock(&fd_table_lock);
+                }
+                pthread_mutex_unlock(&fd_table_lock);
 
-                    send_control_message(msg);
+                send_control_message(msg);
 
-                    if (getenv("TAILPROXY_VERBOSE")) {
-                        fprintf(stderr, "[tailproxy] Notifying listener on port %d\n", port);
-                    }
+                if (getenv("TAILPROXY_VERBOSE")) {
+                    fprintf(stderr, "[tailproxy] Notifying listener on port %d\n", port);
+                }
+
+                int chan = inject_socket ? inject_open(family_str, port) : -1;
 
-                    pthread_mutex_lock(&fd_table_lock);
+                pthread_mutex_lock(&fd_table_lock);
+                if (chan >= 0) {
+                    if (fd_table[sockfd].is_listener && !fd_table[sockfd].has_inject) {
+                        fd_table[sockfd].has_inject = 1;
+                        fd_table[sockfd].inject_fd = chan;
+                        __atomic_add_fetch(&inject_listeners, 1, __ATOMIC_RELAXED);
+                    } else {
+                        real_close(chan);
+                    }
                 }
             }
         }
@@ -442,32 +1415,237 @@ int close(int fd) {
         return -1;
     }
 
-    // If export mode enabled and this was a listener, notify Go
-    if (export_enabled && fd >= 0 && fd < MAX_FDS) {
-        pthread_mutex_lock(&fd_table_lock);
-        if (fd_table[fd].is_listener && fd_table[fd].port > 0) {
-            const char *family_str = (fd_table[fd].family == AF_INET) ? "tcp4" : "tcp6";
-            int port = fd_table[fd].port;
+    // Forget the trace file if the application closes its descriptor
+    if (trace_file && fd >= 0) {
+        pthread_mutex_lock(&trace_lock);
+        if (fd == trace_fd) {
+            trace_fd = -1;
+        }
+        pthread_mutex_unlock(&trace_lock);
+    }
 
-            pthread_mutex_unlock(&fd_table_lock);
+    // If this was a listener, notify Go
+    fd_reset(fd);
 
-            char msg[128];
-            snprintf(msg, sizeof(msg), "CLOSE %s %d\n", family_str, port);
-            send_control_message(msg);
+    return real_close(fd);
+}
 
-            if (getenv("TAILPROXY_VERBOSE")) {
-                fprintf(stderr, "[tailproxy] Notifying close of listener on port %d\n", port);
+// Intercepted socket() - a new fd starts with a clean table entry
+int socket(int domain, int type, int protocol) {
+    init_preload();
+
+    if (!real_socket) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    int fd = real_socket(domain, type, protocol);
+    fd_reset(fd);
+    return fd;
+}
+
+// Intercepted accept()
+int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+    init_preload();
+
+    if (!real_accept) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    int chan = inject_channel(sockfd);
+    if (chan < 0) {
+        int fd = real_accept(sockfd, addr, addrlen);
+        fd_reset(fd);
+        return fd;
+    }
+    return inject_accept(sockfd, chan, addr, addrlen, 0);
+}
+
+// Intercepted accept4()
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+    init_preload();
+
+    if (!real_accept4) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    int chan = inject_channel(sockfd);
+    if (chan < 0) {
+        int fd = real_accept4(sockfd, addr, addrlen, flags);
+        fd_reset(fd);
+        return fd;
+    }
+    return inject_accept(sockfd, chan, addr, addrlen, flags);
+}
+
+// Intercepted epoll_ctl() - a listener's channel follows it into and out of
+// epoll sets with the same event data, so its events read as the listener's
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    init_preload();
+
+    if (!real_epoll_ctl) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    int ret = real_epoll_ctl(epfd, op, fd, event);
+    int chan = ret == 0 ? inject_channel(fd) : -1;
+    if (chan >= 0) {
+        int saved_errno = errno;
+        if (op == EPOLL_CTL_DEL) {
+            real_epoll_ctl(epfd, op, chan, NULL);
+        } else if (event) {
+            struct epoll_event ev = *event;
+            ev.events &= EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE | EPOLLWAKEUP;
+            if (real_epoll_ctl(epfd, op, chan, &ev) != 0 && op == EPOLL_CTL_MOD) {
+                real_epoll_ctl(epfd, EPOLL_CTL_ADD, chan, &ev);
             }
+        }
+        errno = saved_errno;
+    }
+    return ret;
+}
 
-            pthread_mutex_lock(&fd_table_lock);
+// Intercepted poll() - polling a listener for POLLIN also polls its channel
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    init_preload();
+
+    if (!real_poll) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (__atomic_load_n(&inject_listeners, __ATOMIC_RELAXED) == 0 || nfds == 0 || nfds > MAX_FDS) {
+        return real_poll(fds, nfds, timeout);
+    }
+
+    // Most polls include no listener with a channel; find out without the
+    // lock. The locked pass below decides.
+    nfds_t i;
+    for (i = 0; i < nfds; i++) {
+        int fd = fds[i].fd;
+        if (fd >= 0 && fd < MAX_FDS && (fds[i].events & POLLIN) &&
+            __atomic_load_n(&fd_table[fd].has_inject, __ATOMIC_RELAXED)) {
+            break;
         }
+    }
+    if (i == nfds) {
+        return real_poll(fds, nfds, timeout);
+    }
 
-        // Clear FD entry
-        memset(&fd_table[fd], 0, sizeof(fd_info_t));
-        pthread_mutex_unlock(&fd_table_lock);
+    // The caller's entries, then one per listener channel
+    struct pollfd stack_fds[64];
+    nfds_t stack_owner[32];
+    struct pollfd *all = stack_fds;
+    nfds_t *owner = stack_owner;
+    if (nfds > 32) {
+        all = malloc(nfds * 2 * sizeof(*all));
+        owner = malloc(nfds * sizeof(*owner));
+        if (!all || !owner) {
+            free(all);
+            free(owner);
+            return real_poll(fds, nfds, timeout);
+        }
     }
 
-    return real_close(fd);
+    nfds_t extra = 0;
+    memcpy(all, fds, nfds * sizeof(*fds));
+    pthread_mutex_lock(&fd_table_lock);
+    for (nfds_t i = 0; i < nfds; i++) {
+        int fd = fds[i].fd;
+        if (fd >= 0 && fd < MAX_FDS && (fds[i].events & POLLIN) && fd_table[fd].has_inject) {
+            all[nfds + extra].fd = fd_table[fd].inject_fd;
+            all[nfds + extra].events = POLLIN;
+            all[nfds + extra].revents = 0;
+            owner[extra++] = i;
+        }
+    }
+    pthread_mutex_unlock(&fd_table_lock);
+
+    int ret = real_poll(all, nfds + extra, timeout);
+    if (ret > 0) {
+        ret = 0;
+        for (nfds_t i = 0; i < nfds; i++) {
+            fds[i].revents = all[i].revents;
+        }
+        // A hung-up channel is reported too, so accept() can drop it
+        for (nfds_t j = 0; j < extra; j++) {
+            if (all[nfds + j].revents) {
+                fds[owner[j]].revents |= POLLIN;
+            }
+        }
+        for (nfds_t i = 0; i < nfds; i++) {
+            if (fds[i].revents) {
+                ret++;
+            }
+        }
+    } else if (ret == 0) {
+        for (nfds_t i = 0; i < nfds; i++) {
+            fds[i].revents = 0;
+        }
+    }
+
+    if (all != stack_fds) {
+        int saved_errno = errno;
+        free(all);
+        free(owner);
+        errno = saved_errno;
+    }
+    return ret;
+}
+
+// Intercepted getpeername() - an injected connection reports its tailnet peer
+int getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+    init_preload();
+
+    if (!real_getpeername) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (inject_addr(sockfd, 1, addr, addrlen)) {
+        return 0;
+    }
+    return real_getpeername(sockfd, addr, addrlen);
+}
+
+// Intercepted getsockname() - an injected connection reports the listener's
+// address
+int getsockname(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+    init_preload();
+
+    if (!real_getsockname) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (inject_addr(sockfd, 0, addr, addrlen)) {
+        return 0;
+    }
+    return real_getsockname(sockfd, addr, addrlen);
+}
+
+// Intercepted setsockopt() - TCP options on an injected connection, such as
+// TCP_NODELAY, are accepted and ignored
+int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+    init_preload();
+
+    if (!real_setsockopt) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (level == IPPROTO_TCP && inject_socket && sockfd >= 0 && sockfd < MAX_FDS) {
+        pthread_mutex_lock(&fd_table_lock);
+        int injected = fd_table[sockfd].injected != NULL;
+        pthread_mutex_unlock(&fd_table_lock);
+        if (injected) {
+            return 0;
+        }
+    }
+    return real_setsockopt(sockfd, level, optname, optval, optlen);
 }
 
 // Intercepted getaddrinfo() - return original results
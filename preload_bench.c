@@ -0,0 +1,405 @@
+// Microbenchmarks for the libtailproxy.so hooks.
+//
+// Measures the per-call cost of the intercepted close(), connect() and
+// bind()/listen() against the raw libc symbols, with export mode off and on,
+// and scales 1..N threads hammering socket/connect/close to expose contention
+// on the preload's fd table.
+//
+// Usage: preload_bench [-n iterations] [-t max_threads] [-l libtailproxy.so]
+//
+// The parent process re-executes itself under LD_PRELOAD once per export
+// mode, since the preload reads its configuration in its constructor. Output
+// is one tab-separated row per measurement with a fixed column order so that
+// runs can be diffed against a baseline.
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define BENCH_FORMAT_VERSION 1
+
+// Raw libc symbols, bypassing the preload
+static int (*raw_connect)(int, const struct sockaddr *, socklen_t);
+static int (*raw_bind)(int, const struct sockaddr *, socklen_t);
+static int (*raw_listen)(int, int);
+static int (*raw_close)(int);
+
+static long iterations = 200000;
+static int max_threads = 0;
+static int export_mode = 0;
+
+static struct sockaddr_un unix_live_addr;
+static struct sockaddr_un unix_dead_addr;
+static struct sockaddr_in tcp_live_addr;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void print_row(const char *name, int threads, double hook_ns, double raw_ns, long iters) {
+    printf("%s\t%d\t%d\t%.1f\t%.1f\t%.1f\t%ld\n",
+           name, export_mode, threads, hook_ns, raw_ns, hook_ns - raw_ns, iters);
+    fflush(stdout);
+}
+
+// Accept and immediately close connections so connect() never blocks on a full backlog
+static void *acceptor_thread(void *arg) {
+    int lfd = (int)(long)arg;
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return NULL;
+        }
+        raw_close(fd);
+    }
+}
+
+// Drain control messages so the preload's MSG_DONTWAIT sends never fill the socket
+static void *control_drain_thread(void *arg) {
+    int lfd = (int)(long)arg;
+    char buf[4096];
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return NULL;
+        }
+        while (read(fd, buf, sizeof(buf)) > 0) {
+        }
+        raw_close(fd);
+    }
+}
+
+static int start_unix_listener(const char *path, void *(*fn)(void *)) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (raw_bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || raw_listen(fd, 4096) != 0) {
+        raw_close(fd);
+        return -1;
+    }
+    pthread_t t;
+    pthread_create(&t, NULL, fn, (void *)(long)fd);
+    pthread_detach(t);
+    return fd;
+}
+
+static int start_tcp_listener(struct sockaddr_in *out) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (raw_bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        raw_listen(fd, 4096) != 0 ||
+        getsockname(fd, (struct sockaddr *)out, &len) != 0) {
+        raw_close(fd);
+        return -1;
+    }
+    pthread_t t;
+    pthread_create(&t, NULL, acceptor_thread, (void *)(long)fd);
+    pthread_detach(t);
+    return fd;
+}
+
+// Each benchmark body runs `iters` operations with either the hooked or the
+// raw symbols and returns elapsed nanoseconds.
+typedef double (*bench_fn)(long iters, int hooked);
+
+static double bench_close(long iters, int hooked) {
+    int base = socket(AF_INET, SOCK_STREAM, 0);
+    int (*do_close)(int) = hooked ? close : raw_close;
+    double start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        int fd = dup(base);
+        do_close(fd);
+    }
+    double elapsed = now_ns() - start;
+    raw_close(base);
+    return elapsed;
+}
+
+static double bench_connect_unix(long iters, int hooked) {
+    int (*do_connect)(int, const struct sockaddr *, socklen_t) = hooked ? connect : raw_connect;
+    double start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        do_connect(fd, (struct sockaddr *)&unix_live_addr, sizeof(unix_live_addr));
+        raw_close(fd);
+    }
+    return now_ns() - start;
+}
+
+static double bench_connect_loopback(long iters, int hooked) {
+    int (*do_connect)(int, const struct sockaddr *, socklen_t) = hooked ? connect : raw_connect;
+    // Reset on close so the client side never sits in TIME_WAIT
+    struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+    double start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        do_connect(fd, (struct sockaddr *)&tcp_live_addr, sizeof(tcp_live_addr));
+        raw_close(fd);
+    }
+    return now_ns() - start;
+}
+
+static double bench_bind_listen(long iters, int hooked) {
+    int (*do_bind)(int, const struct sockaddr *, socklen_t) = hooked ? bind : raw_bind;
+    int (*do_listen)(int, int) = hooked ? listen : raw_listen;
+    int (*do_close)(int) = hooked ? close : raw_close;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    double start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        do_bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+        do_listen(fd, 1);
+        do_close(fd);
+    }
+    return now_ns() - start;
+}
+
+static void run_single(const char *name, bench_fn fn, long iters) {
+    // Warm up both paths before measuring
+    fn(iters / 10 + 1, 1);
+    fn(iters / 10 + 1, 0);
+    double hook = fn(iters, 1) / (double)iters;
+    double raw = fn(iters, 0) / (double)iters;
+    print_row(name, 1, hook, raw, iters);
+}
+
+typedef struct {
+    pthread_barrier_t *barrier;
+    long iters;
+    int hooked;
+} scale_arg_t;
+
+// socket/connect/close against a path with no listener: the kernel refuses
+// immediately, so the loop is dominated by the hooks rather than by an acceptor.
+static void *scale_worker(void *p) {
+    scale_arg_t *arg = p;
+    int (*do_connect)(int, const struct sockaddr *, socklen_t) = arg->hooked ? connect : raw_connect;
+    int (*do_close)(int) = arg->hooked ? close : raw_close;
+    pthread_barrier_wait(arg->barrier);
+    for (long i = 0; i < arg->iters; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        do_connect(fd, (struct sockaddr *)&unix_dead_addr, sizeof(unix_dead_addr));
+        do_close(fd);
+    }
+    pthread_barrier_wait(arg->barrier);
+    return NULL;
+}
+
+static double run_scale_once(int threads, long iters, int hooked) {
+    pthread_t tids[threads];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+    scale_arg_t arg = { .barrier = &barrier, .iters = iters, .hooked = hooked };
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, scale_worker, &arg);
+    }
+    pthread_barrier_wait(&barrier);
+    double start = now_ns();
+    pthread_barrier_wait(&barrier);
+    double elapsed = now_ns() - start;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    pthread_barrier_destroy(&barrier);
+    // Wall-clock ns per operation per thread: flat under perfect scaling
+    return elapsed / (double)iters;
+}
+
+static void run_scaling(long iters) {
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double hook = run_scale_once(threads, iters, 1);
+        double raw = run_scale_once(threads, iters, 0);
+        print_row("scale_socket_connect_close", threads, hook, raw, iters);
+        if (threads < max_threads && threads * 2 > max_threads) {
+            threads = max_threads / 2;
+        }
+    }
+}
+
+static int child_main(void) {
+    void *libc = dlopen("libc.so.6", RTLD_NOW | RTLD_NOLOAD);
+    if (!libc) {
+        fprintf(stderr, "preload_bench: cannot open libc: %s\n", dlerror());
+        return 1;
+    }
+    raw_connect = dlsym(libc, "connect");
+    raw_bind = dlsym(libc, "bind");
+    raw_listen = dlsym(libc, "listen");
+    raw_close = dlsym(libc, "close");
+    if (!raw_connect || !raw_bind || !raw_listen || !raw_close) {
+        fprintf(stderr, "preload_bench: cannot resolve libc symbols\n");
+        return 1;
+    }
+    if ((void *)connect == (void *)raw_connect) {
+        fprintf(stderr, "preload_bench: connect() is not interposed, is LD_PRELOAD set?\n");
+        return 1;
+    }
+
+    char dir[] = "/tmp/tailproxy-bench-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("preload_bench: mkdtemp");
+        return 1;
+    }
+
+    export_mode = getenv("TAILPROXY_EXPORT_LISTENERS") != NULL;
+    if (export_mode) {
+        // The preload connects to the control socket lazily, so it only has to exist before the first listen()
+        const char *ctl = getenv("TAILPROXY_CONTROL_SOCK");
+        if (!ctl || start_unix_listener(ctl, control_drain_thread) < 0) {
+            fprintf(stderr, "preload_bench: cannot start control socket\n");
+            return 1;
+        }
+    }
+
+    memset(&unix_live_addr, 0, sizeof(unix_live_addr));
+    unix_live_addr.sun_family = AF_UNIX;
+    snprintf(unix_live_addr.sun_path, sizeof(unix_live_addr.sun_path), "%s/live.sock", dir);
+    if (start_unix_listener(unix_live_addr.sun_path, acceptor_thread) < 0) {
+        fprintf(stderr, "preload_bench: cannot start unix listener\n");
+        return 1;
+    }
+
+    memset(&unix_dead_addr, 0, sizeof(unix_dead_addr));
+    unix_dead_addr.sun_family = AF_UNIX;
+    snprintf(unix_dead_addr.sun_path, sizeof(unix_dead_addr.sun_path), "%s/dead.sock", dir);
+
+    if (start_tcp_listener(&tcp_live_addr) < 0) {
+        fprintf(stderr, "preload_bench: cannot start loopback listener\n");
+        return 1;
+    }
+
+    run_single("close", bench_close, iterations);
+    run_single("connect_unix", bench_connect_unix, iterations / 4);
+    run_single("connect_loopback", bench_connect_loopback, iterations / 8);
+    run_single("bind_listen_close", bench_bind_listen, iterations / 8);
+    run_scaling(iterations / 4);
+
+    unlink(unix_live_addr.sun_path);
+    if (export_mode) {
+        unlink(getenv("TAILPROXY_CONTROL_SOCK"));
+    }
+    rmdir(dir);
+    return 0;
+}
+
+static int spawn_child(const char *self, const char *lib, int export) {
+    char ctl[64];
+    snprintf(ctl, sizeof(ctl), "/tmp/tailproxy-bench-%d.sock", (int)getpid());
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("preload_bench: fork");
+        return -1;
+    }
+    if (pid == 0) {
+        setenv("LD_PRELOAD", lib, 1);
+        setenv("TAILPROXY_BENCH_CHILD", "1", 1);
+        unsetenv("TAILPROXY_VERBOSE");
+        if (export) {
+            setenv("TAILPROXY_EXPORT_LISTENERS", "1", 1);
+            setenv("TAILPROXY_CONTROL_SOCK", ctl, 1);
+        } else {
+            unsetenv("TAILPROXY_EXPORT_LISTENERS");
+            unsetenv("TAILPROXY_CONTROL_SOCK");
+        }
+        char iters[32], threads[32];
+        snprintf(iters, sizeof(iters), "%ld", iterations);
+        snprintf(threads, sizeof(threads), "%d", max_threads);
+        execl(self, self, "-n", iters, "-t", threads, (char *)NULL);
+        perror("preload_bench: exec");
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *lib = "./libtailproxy.so";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:l:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'l':
+            lib = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [-t max_threads] [-l libtailproxy.so]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations < 80) {
+        iterations = 80;
+    }
+    if (max_threads <= 0) {
+        max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (max_threads <= 0) {
+            max_threads = 1;
+        }
+    }
+
+    if (getenv("TAILPROXY_BENCH_CHILD")) {
+        return child_main();
+    }
+
+    char libpath[4096];
+    if (!realpath(lib, libpath)) {
+        fprintf(stderr, "preload_bench: %s: %s\n", lib, strerror(errno));
+        return 1;
+    }
+
+    printf("# tailproxy preload bench v%d\n", BENCH_FORMAT_VERSION);
+    printf("bench\texport\tthreads\thook_ns\traw_ns\tdelta_ns\titers\n");
+    fflush(stdout);
+
+    for (int export = 0; export <= 1; export++) {
+        if (spawn_child("/proc/self/exe", libpath, export) != 0) {
+            fprintf(stderr, "preload_bench: run with export=%d failed\n", export);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,171 @@
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"encoding/hex"
+	"fmt"
+	"net/netip"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+)
+
+// Originating process identity for SOCKS clients.
+//
+// The preload sends "pid=<pid>;exe=<name>" as the SOCKS5 username, with
+// ";trace=<hex id>" appended for connections it traces (see trace.go), and the
+// process's cgroup as the password. For other clients the owner of the
+// loopback socket can still be found by looking the socket's inode up in
+// /proc/net/tcp{,6} and then scanning /proc/<pid>/fd for that inode. That
+// walks every process and is only done when a rule needs the process.
+
+type procIdent struct {
+	PID    int
+	Name   string // executable base name, or comm if exe is unreadable
+	Cgroup string
+	Trace  uint64 // trace id if the preload sampled this connection
+}
+
+// parseProcIdent decodes SOCKS5 credentials sent by the preload. Credentials
+// of other clients are kept as an opaque name.
+func parseProcIdent(user, pass string) *procIdent {
+	ident := &procIdent{Cgroup: pass}
+	for _, field := range strings.Split(user, ";") {
+		key, value, ok := strings.Cut(field, "=")
+		switch {
+		case ok && key == "pid":
+			ident.PID, _ = strconv.Atoi(value)
+		case ok && key == "exe":
+			ident.Name = value
+		case ok && key == "trace":
+			ident.Trace, _ = strconv.ParseUint(value, 16, 64)
+		}
+	}
+	if ident.Name == "" && ident.PID == 0 {
+		ident.Name = user
+	}
+	return ident
+}
+
+// lookupSocketOwner returns the process owning the TCP socket with local
+// address local connected to remote, as seen from that process.
+func lookupSocketOwner(local, remote netip.AddrPort) (procIdent, error) {
+	table := "/proc/net/tcp"
+	if local.Addr().Is6() && !local.Addr().Is4In6() {
+		table = "/proc/net/tcp6"
+	}
+	inode, err := findSocketInode(table, local, remote)
+	if err != nil {
+		return procIdent{}, err
+	}
+
+	pid, err := findInodeOwner(inode)
+	if err != nil {
+		return procIdent{}, err
+	}
+	return procIdent{PID: pid, Name: processName(pid), Cgroup: processCgroup(pid)}, nil
+}
+
+func findSocketInode(table string, local, remote netip.AddrPort) (string, error) {
+	f, err := os.Open(table)
+	if err != nil {
+		return "", err
+	}
+	defer f.Close()
+
+	scanner := bufio.NewScanner(f)
+	scanner.Scan() // header
+	for scanner.Scan() {
+		fields := strings.Fields(scanner.Text())
+		if len(fields) < 10 {
+			continue
+		}
+		l, err1 := parseProcNetAddr(fields[1])
+		r, err2 := parseProcNetAddr(fields[2])
+		if err1 != nil || err2 != nil {
+			continue
+		}
+		if l == local && r == remote && fields[9] != "0" {
+			return fields[9], nil
+		}
+	}
+	if err := scanner.Err(); err != nil {
+		return "", err
+	}
+	return "", fmt.Errorf("no socket %s -> %s in %s", local, remote, table)
+}
+
+// parseProcNetAddr parses "0100007F:1F90" style addresses, where the address
+// is stored as host-endian 32-bit words.
+func parseProcNetAddr(s string) (netip.AddrPort, error) {
+	addrHex, portHex, ok := strings.Cut(s, ":")
+	if !ok {
+		return netip.AddrPort{}, fmt.Errorf("bad address %q", s)
+	}
+	raw, err := hex.DecodeString(addrHex)
+	if err != nil || (len(raw) != 4 && len(raw) != 16) {
+		return netip.AddrPort{}, fmt.Errorf("bad address %q", s)
+	}
+	port, err := strconv.ParseUint(portHex, 16, 16)
+	if err != nil {
+		return netip.AddrPort{}, fmt.Errorf("bad port %q", s)
+	}
+
+	for i := 0; i < len(raw); i += 4 {
+		binary.BigEndian.PutUint32(raw[i:], binary.LittleEndian.Uint32(raw[i:]))
+	}
+	addr, _ := netip.AddrFromSlice(raw)
+	return netip.AddrPortFrom(addr.Unmap(), uint16(port)), nil
+}
+
+func findInodeOwner(inode string) (int, error) {
+	target := "socket:[" + inode + "]"
+	procs, err := os.ReadDir("/proc")
+	if err != nil {
+		return 0, err
+	}
+	for _, proc := range procs {
+		pid, err := strconv.Atoi(proc.Name())
+		if err != nil {
+			continue
+		}
+		fdDir := filepath.Join("/proc", proc.Name(), "fd")
+		fds, err := os.ReadDir(fdDir)
+		if err != nil {
+			continue
+		}
+		for _, fd := range fds {
+			if link, err := os.Readlink(filepath.Join(fdDir, fd.Name())); err == nil && link == target {
+				return pid, nil
+			}
+		}
+	}
+	return 0, fmt.Errorf("no process owns socket inode %s", inode)
+}
+
+// processCgroup returns the path of the first line of /proc/<pid>/cgroup,
+// which on cgroup v2 is the process's only cgroup.
+func processCgroup(pid int) string {
+	data, err := os.ReadFile(fmt.Sprintf("/proc/%d/cgroup", pid))
+	if err != nil {
+		return ""
+	}
+	line, _, _ := strings.Cut(string(data), "\n")
+	parts := strings.SplitN(line, ":", 3)
+	if len(parts) != 3 {
+		return ""
+	}
+	return parts[2]
+}
+
+func processName(pid int) string {
+	if exe, err := os.Readlink(fmt.Sprintf("/proc/%d/exe", pid)); err == nil {
+		return filepath.Base(strings.TrimSuffix(exe, " (deleted)"))
+	}
+	if comm, err := os.ReadFile(fmt.Sprintf("/proc/%d/comm", pid)); err == nil {
+		return strings.TrimSpace(string(comm))
+	}
+	return ""
+}
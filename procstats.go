@@ -0,0 +1,192 @@
+package main
+
+import (
+	"fmt"
+	"log"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Per-process accounting.
+//
+// The preload identifies the originating process in the SOCKS5 handshake,
+// so connections can be attributed to the executable (and cgroup) that made
+// them. This is what shows which job in a pipeline is using the tunnel.
+
+// latencyBuckets are the upper bounds of latencyHistogram buckets.
+var latencyBuckets = [...]time.Duration{
+	time.Millisecond, 2 * time.Millisecond, 5 * time.Millisecond,
+	10 * time.Millisecond, 25 * time.Millisecond, 50 * time.Millisecond,
+	100 * time.Millisecond, 250 * time.Millisecond, 500 * time.Millisecond,
+	time.Second, 2500 * time.Millisecond, 5 * time.Second, 10 * time.Second,
+}
+
+// latencyHistogram is a fixed-bucket histogram safe for concurrent use.
+type latencyHistogram struct {
+	counts [len(latencyBuckets) + 1]atomic.Uint64 // last one is overflow
+	sum    atomic.Int64                           // nanoseconds
+}
+
+func (h *latencyHistogram) observe(d time.Duration) {
+	i := sort.Search(len(latencyBuckets), func(i int) bool { return d <= latencyBuckets[i] })
+	h.counts[i].Add(1)
+	h.sum.Add(int64(d))
+}
+
+// histogramSnapshot holds non-cumulative bucket counts.
+type histogramSnapshot struct {
+	Counts [len(latencyBuckets) + 1]uint64
+	Sum    time.Duration
+}
+
+func (h *latencyHistogram) snapshot() histogramSnapshot {
+	var s histogramSnapshot
+	for i := range h.counts {
+		s.Counts[i] = h.counts[i].Load()
+	}
+	s.Sum = time.Duration(h.sum.Load())
+	return s
+}
+
+func (s histogramSnapshot) count() uint64 {
+	var n uint64
+	for _, c := range s.Counts {
+		n += c
+	}
+	return n
+}
+
+// quantile returns the upper bound of the bucket holding quantile q.
+func (s histogramSnapshot) quantile(q float64) time.Duration {
+	total := s.count()
+	if total == 0 {
+		return 0
+	}
+	rank := uint64(q * float64(total))
+	var seen uint64
+	for i, c := range s.Counts {
+		seen += c
+		if seen > rank {
+			if i < len(latencyBuckets) {
+				return latencyBuckets[i]
+			}
+			break
+		}
+	}
+	return latencyBuckets[len(latencyBuckets)-1]
+}
+
+type processKey struct {
+	name   string
+	cgroup string
+}
+
+type processEntry struct {
+	key     processKey
+	lastPID atomic.Int64
+
+	conns        atomic.Uint64
+	active       atomic.Int64
+	bytesIn      atomic.Uint64 // tailnet -> process
+	bytesOut     atomic.Uint64 // process -> tailnet
+	dialFailures atomic.Uint64
+	dialLatency  latencyHistogram
+}
+
+// processStats tracks processEntry by executable and cgroup.
+type processStats struct {
+	mu      sync.Mutex
+	entries map[processKey]*processEntry
+}
+
+// maxProcessEntries bounds the number of processes tracked; later ones are
+// counted under "other".
+const maxProcessEntries = 1024
+
+func newProcessStats() *processStats {
+	return &processStats{entries: make(map[processKey]*processEntry)}
+}
+
+// connect returns the entry for ident, counting a new connection.
+func (s *processStats) connect(ident *procIdent) *processEntry {
+	key := processKey{name: "unknown"}
+	if ident != nil && ident.Name != "" {
+		key = processKey{name: ident.Name, cgroup: ident.Cgroup}
+	}
+
+	s.mu.Lock()
+	e, ok := s.entries[key]
+	if !ok {
+		if len(s.entries) >= maxProcessEntries {
+			key = processKey{name: "other"}
+			e, ok = s.entries[key]
+		}
+		if !ok {
+			e = &processEntry{key: key}
+			s.entries[key] = e
+		}
+	}
+	s.mu.Unlock()
+
+	if ident != nil {
+		e.lastPID.Store(int64(ident.PID))
+	}
+	e.conns.Add(1)
+	return e
+}
+
+// processSnapshot is a point-in-time view of one process.
+type processSnapshot struct {
+	Name         string
+	Cgroup       string
+	LastPID      int64
+	Conns        uint64
+	Active       int64
+	BytesIn      uint64
+	BytesOut     uint64
+	DialFailures uint64
+	DialLatency  histogramSnapshot
+}
+
+func (s *processStats) snapshot() []processSnapshot {
+	s.mu.Lock()
+	entries := make([]*processEntry, 0, len(s.entries))
+	for _, e := range s.entries {
+		entries = append(entries, e)
+	}
+	s.mu.Unlock()
+
+	out := make([]processSnapshot, len(entries))
+	for i, e := range entries {
+		out[i] = processSnapshot{
+			Name:         e.key.name,
+			Cgroup:       e.key.cgroup,
+			LastPID:      e.lastPID.Load(),
+			Conns:        e.conns.Load(),
+			Active:       e.active.Load(),
+			BytesIn:      e.bytesIn.Load(),
+			BytesOut:     e.bytesOut.Load(),
+			DialFailures: e.dialFailures.Load(),
+			DialLatency:  e.dialLatency.snapshot(),
+		}
+	}
+	sort.Slice(out, func(i, j int) bool {
+		return out[i].BytesIn+out[i].BytesOut > out[j].BytesIn+out[j].BytesOut
+	})
+	return out
+}
+
+func (s *processStats) logSummary() {
+	for _, st := range s.snapshot() {
+		name := st.Name
+		if st.Cgroup != "" && st.Cgroup != "/" {
+			name = fmt.Sprintf("%s (%s)", st.Name, strings.TrimPrefix(st.Cgroup, "/"))
+		}
+		log.Printf("Process %s: conns=%d active=%d in=%d out=%d dial_failures=%d dial_p50=%v dial_p99=%v last_pid=%d",
+			name, st.Conns, st.Active, st.BytesIn, st.BytesOut, st.DialFailures,
+			st.DialLatency.quantile(0.5), st.DialLatency.quantile(0.99), st.LastPID)
+	}
+}
@@ -9,11 +9,13 @@ import (
 	"net/netip"
 	"os"
 	"path/filepath"
+	"runtime/pprof"
+	"strconv"
 	"sync"
+	"sync/atomic"
 	"time"
 
 	"tailscale.com/client/tailscale"
-	"tailscale.com/ipn"
 	"tailscale.com/tsnet"
 )
 
@@ -24,6 +26,28 @@ type ProxyServer struct {
 	dialer          *net.Dialer
 	exporterManager *ExporterManager
 	controlSockPath string
+	breaker         *dialBreaker
+	dialStats       *dialStats
+	preconnect      *preconnectPool
+	schedPorts      schedPorts
+	limits          *rateLimiter
+	procStats       *processStats
+	metrics         proxyMetrics
+	tracer          *tracer
+	conns           *connRegistry
+	nodes           []*tsnetNode
+	lc              *tailscale.LocalClient
+	started         time.Time
+
+	listener        net.Listener
+	controlListener *net.UnixListener
+	injectListener  *net.UnixListener
+	handoff         *upgradeHandoff
+	policyShm       *policyShm
+	loadConfig      func() (*Config, error) // for reloads; nil without a config file
+	reloadMu        sync.Mutex
+	inflight        atomic.Int64 // accepted SOCKS connections not yet closed
+	draining        atomic.Bool
 }
 
 func getStateDir(hostname string) string {
@@ -46,48 +70,75 @@ func getStateDir(hostname string) string {
 }
 
 func NewProxyServer(config *Config) (*ProxyServer, error) {
-	// Create state directory - use persistent location for stable node ID
-	stateDir := getStateDir(config.Hostname)
-	if err := os.MkdirAll(stateDir, 0700); err != nil {
-		return nil, fmt.Errorf("failed to create state directory: %w", err)
-	}
-
-	srv := &tsnet.Server{
-		Hostname: config.Hostname,
-		Dir:      stateDir,
-		Logf:     func(format string, args ...any) {
-			if config.Verbose {
-				log.Printf("[tsnet] "+format, args...)
-			}
-		},
+	schedPorts, err := compileSchedPorts(config)
+	if err != nil {
+		return nil, err
+	}
+	nodeCount := max(config.Nodes, 1)
+	nodes := make([]*tsnetNode, nodeCount)
+	for i := range nodes {
+		node, err := newTsnetNode(config, i)
+		if err != nil {
+			return nil, err
+		}
+		nodes[i] = node
 	}
 
-	if config.AuthKey != "" {
-		srv.AuthKey = config.AuthKey
+	pol, err := compilePolicy(config)
+	if err != nil {
+		return nil, err
+	}
+	limits := newRateLimiter(config, pol.limits)
+	tracer, err := newTracer(config)
+	if err != nil {
+		return nil, err
 	}
+	handoff, err := takeUpgradeHandoff()
+	if err != nil {
+		return nil, err
+	}
+	policyShm, err := openPolicyShm(filepath.Join(nodes[0].stateDir, "policy.shm"))
+	if err != nil {
+		return nil, err
+	}
+	policyShm.publish(config.ProxyPort, pol)
 
 	p := &ProxyServer{
 		config:          config,
-		server:          srv,
-		controlSockPath: filepath.Join(stateDir, "control.sock"),
-	}
+		server:          nodes[0].server,
+		nodes:           nodes,
+		controlSockPath: filepath.Join(nodes[0].stateDir, "control.sock"),
+		breaker:         newDialBreaker(config),
+		dialStats:       newDialStats(),
+		schedPorts:      schedPorts,
+		limits:          limits,
+		procStats:       newProcessStats(),
+		tracer:          tracer,
+		conns:           newConnRegistry(),
+		handoff:         handoff,
+		policyShm:       policyShm,
+	}
+
+	p.preconnect = newPreconnectPool(p)
 
 	// Create exporter manager if export mode is enabled
 	if config.ExportListeners {
-		p.exporterManager = NewExporterManager(config, srv)
+		p.exporterManager = NewExporterManager(config, nodes[0], limits, p.conns, pol.exports)
 	}
 
 	return p, nil
 }
 
-func (p *ProxyServer) waitForAuth(ctx context.Context, lc *tailscale.LocalClient) error {
+func (p *ProxyServer) waitForAuth(ctx context.Context, node *tsnetNode) error {
+	lc := node.lc
+
 	// If we have an auth key, tsnet handles it automatically
 	if p.config.AuthKey != "" {
 		if p.config.Verbose {
-			log.Println("Using provided auth key...")
+			log.Printf("Using provided auth key for %s...", node.hostname)
 		}
 		// Wait for the server to be ready with the auth key
-		_, err := p.server.Up(ctx)
+		_, err := node.server.Up(ctx)
 		return err
 	}
 
@@ -118,7 +169,11 @@ func (p *ProxyServer) waitForAuth(ctx context.Context, lc *tailscale.LocalClient
 		// Check if we need to print an auth URL
 		if status.AuthURL != "" && !authURLPrinted {
 			// Print the auth URL to stderr so user can click it
-			fmt.Fprintf(os.Stderr, "\nTo authenticate, visit:\n\n\t%s\n\n", status.AuthURL)
+			if len(p.nodes) > 1 {
+				fmt.Fprintf(os.Stderr, "\nTo authenticate %s, visit:\n\n\t%s\n\n", node.hostname, status.AuthURL)
+			} else {
+				fmt.Fprintf(os.Stderr, "\nTo authenticate, visit:\n\n\t%s\n\n", status.AuthURL)
+			}
 			authURLPrinted = true
 		}
 
@@ -135,10 +190,56 @@ func (p *ProxyServer) GetControlSocketPath() string {
 	return p.controlSockPath
 }
 
+// GetInjectSocketPath returns the path of the socket preloads open connection
+// injection channels on (export_inject).
+func (p *ProxyServer) GetInjectSocketPath() string {
+	return filepath.Join(filepath.Dir(p.controlSockPath), "inject.sock")
+}
+
+// GetExportUnixSpec returns the export_unix mapping for the preload, or ""
+// if there is none.
+func (p *ProxyServer) GetExportUnixSpec() string {
+	if p.exporterManager == nil {
+		return ""
+	}
+	return formatUnixExports(p.exporterManager.unix)
+}
+
+// GetPolicyShmPath returns the path of the preload policy snapshot.
+func (p *ProxyServer) GetPolicyShmPath() string {
+	return p.policyShm.path
+}
+
+// GetTraceFilePath returns the absolute path of the trace file, or "" when
+// tracing is disabled.
+func (p *ProxyServer) GetTraceFilePath() string {
+	if p.tracer == nil {
+		return ""
+	}
+	return p.tracer.path
+}
+
 func (p *ProxyServer) Stop() {
 	if p.exporterManager != nil {
 		p.exporterManager.Stop()
 	}
+	if p.config.Verbose {
+		p.dialStats.logSummary()
+		p.preconnect.logSummary()
+		p.limits.logSummary()
+		p.procStats.logSummary()
+		for _, node := range p.nodes {
+			node.exits.logSummary()
+			node.peers.logSummary()
+			node.schedUp.logSummary()
+			node.schedDown.logSummary()
+		}
+		if !p.started.IsZero() {
+			p.logNodeSummary(time.Since(p.started))
+		}
+	}
+	p.tracer.close()
+	p.policyShm.close()
 }
 
 func (p *ProxyServer) StartWithReady(ctx context.Context, ready chan<- struct{}) error {
@@ -154,18 +255,30 @@ func (p *ProxyServer) StartWithReady(ctx context.Context, ready chan<- struct{})
 		log.Println("Starting Tailscale network...")
 	}
 
-	// Get local client to configure exit node
-	lc, err := p.server.LocalClient()
-	if err != nil {
-		return fmt.Errorf("failed to get local client: %w", err)
+	// Get local clients to configure exit nodes
+	for _, node := range p.nodes {
+		lc, err := node.server.LocalClient()
+		if err != nil {
+			return fmt.Errorf("failed to get local client: %w", err)
+		}
+		node.lc = lc
 	}
+	p.lc = p.nodes[0].lc
 
-	// Wait for authentication to complete
-	if err := p.waitForAuth(ctx, lc); err != nil {
-		if originalOutput != nil {
-			log.SetOutput(originalOutput)
+	// Wait for authentication of every node to complete
+	authErrs := make(chan error, len(p.nodes))
+	for _, node := range p.nodes {
+		go func(node *tsnetNode) {
+			authErrs <- p.waitForAuth(ctx, node)
+		}(node)
+	}
+	for range p.nodes {
+		if err := <-authErrs; err != nil {
+			if originalOutput != nil {
+				log.SetOutput(originalOutput)
+			}
+			return fmt.Errorf("authentication failed: %w", err)
 		}
-		return fmt.Errorf("authentication failed: %w", err)
 	}
 
 	// Restore log output after tsnet startup noise
@@ -173,103 +286,53 @@ func (p *ProxyServer) StartWithReady(ctx context.Context, ready chan<- struct{})
 		log.SetOutput(originalOutput)
 	}
 
-	// Start exporter control socket if enabled
-	if p.config.ExportListeners && p.exporterManager != nil {
-		if err := p.exporterManager.StartControlSocket(p.controlSockPath); err != nil {
-			return fmt.Errorf("failed to start control socket: %w", err)
-		}
-		if p.config.Verbose {
-			log.Printf("Export listeners mode enabled, control socket at %s", p.controlSockPath)
-		}
+	// Start the control socket, used by the preload in export mode and by
+	// tailproxy -top
+	if err := p.startControlSocket(ctx, p.controlSockPath); err != nil {
+		return fmt.Errorf("failed to start control socket: %w", err)
 	}
-
-	// Set exit node if specified
-	if p.config.ExitNode != "" {
-		if p.config.Verbose {
-			log.Printf("Configuring exit node: %s", p.config.ExitNode)
-		}
-
-		// Get status to find the exit node peer
-		status, err := lc.Status(ctx)
-		if err != nil {
-			return fmt.Errorf("failed to get status: %w", err)
-		}
-
-		// Find the exit node by hostname or IP
-		var exitNodeIP string
-		var peerOnline bool
-		for _, peer := range status.Peer {
-			if peer.HostName == p.config.ExitNode || peer.DNSName == p.config.ExitNode ||
-				peer.DNSName == p.config.ExitNode+"."+status.MagicDNSSuffix {
-				if len(peer.TailscaleIPs) > 0 {
-					exitNodeIP = peer.TailscaleIPs[0].String()
-					peerOnline = peer.Online
-					break
-				}
-			}
-			// Also check by IP address
-			for _, ip := range peer.TailscaleIPs {
-				if ip.String() == p.config.ExitNode {
-					exitNodeIP = ip.String()
-					peerOnline = peer.Online
-					break
-				}
-			}
-		}
-
-		if exitNodeIP == "" {
-			return fmt.Errorf("exit node %q not found in peers (is it in your tailnet?)", p.config.ExitNode)
-		}
-
-		if !peerOnline {
-			return fmt.Errorf("exit node %q is offline (cannot route traffic)", p.config.ExitNode)
+	if p.config.ExportListeners && p.config.Verbose {
+		log.Printf("Export listeners mode enabled, control socket at %s", p.controlSockPath)
+	}
+	if p.exporterManager != nil && p.config.ExportInject {
+		if err := p.startInjectSocket(ctx, p.GetInjectSocketPath()); err != nil {
+			return err
 		}
+	}
 
-		if p.config.Verbose {
-			log.Printf("Setting exit node to %s (IP: %s)", p.config.ExitNode, exitNodeIP)
+	// Index each node's peers; exit node resolution and path monitoring
+	// use the index
+	for _, node := range p.nodes {
+		if err := node.peers.start(ctx, node.lc); err != nil {
+			return fmt.Errorf("failed to index peers of %s: %w", node.hostname, err)
 		}
+	}
 
-		// Set the exit node using EditPrefs
-		prefs := &ipn.MaskedPrefs{
-			Prefs: ipn.Prefs{
-				ExitNodeIP: netip.MustParseAddr(exitNodeIP),
-			},
-			ExitNodeIPSet: true,
+	// Select and activate an exit node on each node if any are configured
+	for _, node := range p.nodes {
+		if node.exits.enabled() && p.config.Verbose {
+			log.Printf("Configuring exit node for %s from candidates: %v", node.hostname, node.exits.names())
 		}
-		if _, err := lc.EditPrefs(ctx, prefs); err != nil {
-			return fmt.Errorf("failed to set exit node: %w", err)
+		if err := node.exits.start(ctx, node.lc, node.peers); err != nil {
+			return err
 		}
+	}
 
-		// Verify the exit node is actually active
-		time.Sleep(500 * time.Millisecond) // Give it a moment to apply
-		status, err = lc.Status(ctx)
+	// Listen on localhost for SOCKS5 connections, or keep accepting on the
+	// listener of the process this one replaces
+	var listener net.Listener
+	if p.handoff != nil {
+		listener = p.handoff.socks
+	} else {
+		var err error
+		listener, err = net.Listen("tcp", fmt.Sprintf("127.0.0.1:%d", p.config.ProxyPort))
 		if err != nil {
-			return fmt.Errorf("failed to verify exit node status: %w", err)
-		}
-
-		if status.ExitNodeStatus == nil {
-			return fmt.Errorf("exit node configuration failed: exit node not active")
-		}
-
-		if status.ExitNodeStatus.TailscaleIPs == nil || len(status.ExitNodeStatus.TailscaleIPs) == 0 ||
-			status.ExitNodeStatus.TailscaleIPs[0].String() != exitNodeIP {
-			return fmt.Errorf("exit node configuration failed: expected %s, got different or no exit node", exitNodeIP)
-		}
-
-		if !status.ExitNodeStatus.Online {
-			return fmt.Errorf("exit node %q became offline during configuration", p.config.ExitNode)
-		}
-
-		if p.config.Verbose {
-			log.Printf("Exit node %s verified and active", p.config.ExitNode)
+			return fmt.Errorf("failed to listen: %w", err)
 		}
 	}
-
-	// Listen on localhost for SOCKS5 connections
-	listener, err := net.Listen("tcp", fmt.Sprintf("127.0.0.1:%d", p.config.ProxyPort))
-	if err != nil {
-		return fmt.Errorf("failed to listen: %w", err)
-	}
+	p.mu.Lock()
+	p.listener = listener
+	p.mu.Unlock()
 
 	// Close listener when context is canceled to unblock Accept()
 	go func() {
@@ -281,10 +344,25 @@ func (p *ProxyServer) StartWithReady(ctx context.Context, ready chan<- struct{})
 		log.Printf("SOCKS5 proxy listening on 127.0.0.1:%d", p.config.ProxyPort)
 	}
 
+	if p.config.MetricsListen != "" {
+		if err := p.startMetrics(ctx); err != nil {
+			listener.Close()
+			return err
+		}
+	}
+
+	p.preconnect.start(ctx)
+	for _, node := range p.nodes {
+		node.schedUp.start(ctx)
+		node.schedDown.start(ctx)
+	}
+	p.started = time.Now()
+
 	// Signal that we're ready
 	if ready != nil {
 		close(ready)
 	}
+	p.handoff.signalReady()
 
 	// Accept connections
 	for {
@@ -293,18 +371,25 @@ func (p *ProxyServer) StartWithReady(ctx context.Context, ready chan<- struct{})
 			if ctx.Err() != nil {
 				return ctx.Err()
 			}
+			if p.draining.Load() {
+				return nil
+			}
 			if p.config.Verbose {
 				log.Printf("Accept error: %v", err)
 			}
 			continue
 		}
 
-		go p.handleConnection(ctx, conn)
+		p.inflight.Add(1)
+		go p.handleConnection(ctx, conn, time.Now())
 	}
 }
 
-func (p *ProxyServer) handleConnection(ctx context.Context, clientConn net.Conn) {
+func (p *ProxyServer) handleConnection(ctx context.Context, clientConn net.Conn, accepted time.Time) {
+	defer p.inflight.Add(-1)
 	defer clientConn.Close()
+	started := time.Now()
+	pprof.SetGoroutineLabels(pprof.WithLabels(ctx, pprof.Labels("stage", "handshake")))
 
 	// SOCKS5 handshake
 	buf := make([]byte, 256)
@@ -312,6 +397,7 @@ func (p *ProxyServer) handleConnection(ctx context.Context, clientConn net.Conn)
 	// Read version and methods
 	n, err := clientConn.Read(buf)
 	if err != nil {
+		p.metrics.handshakeFailed(handshakeGreeting)
 		if p.config.Verbose {
 			log.Printf("Failed to read SOCKS5 greeting: %v", err)
 		}
@@ -319,21 +405,46 @@ func (p *ProxyServer) handleConnection(ctx context.Context, clientConn net.Conn)
 	}
 
 	if n < 2 || buf[0] != 0x05 {
+		p.metrics.handshakeFailed(handshakeGreeting)
 		if p.config.Verbose {
 			log.Printf("Invalid SOCKS5 version: %d", buf[0])
 		}
 		return
 	}
 
-	// Send "no authentication required" response
-	_, err = clientConn.Write([]byte{0x05, 0x00})
+	// Prefer username/password auth when offered: the preload sends the
+	// originating process as credentials. Any credentials are accepted.
+	method := byte(0x00)
+	if nmethods := int(buf[1]); n >= 2+nmethods {
+		for _, m := range buf[2 : 2+nmethods] {
+			if m == 0x02 {
+				method = 0x02
+			}
+		}
+	}
+	_, err = clientConn.Write([]byte{0x05, method})
 	if err != nil {
+		p.metrics.handshakeFailed(handshakeGreeting)
 		return
 	}
 
+	var ident *procIdent
+	if method == 0x02 {
+		ident, err = readSOCKSCredentials(clientConn)
+		if err != nil {
+			p.metrics.handshakeFailed(handshakeAuth)
+			if p.config.Verbose {
+				log.Printf("Failed to read SOCKS5 credentials: %v", err)
+			}
+			return
+		}
+	}
+	trace := p.tracer.begin(ident, accepted, started)
+
 	// Read request
 	n, err = clientConn.Read(buf)
 	if err != nil {
+		p.metrics.handshakeFailed(handshakeRequest)
 		if p.config.Verbose {
 			log.Printf("Failed to read SOCKS5 request: %v", err)
 		}
@@ -341,12 +452,14 @@ func (p *ProxyServer) handleConnection(ctx context.Context, clientConn net.Conn)
 	}
 
 	if n < 7 || buf[0] != 0x05 {
+		p.metrics.handshakeFailed(handshakeRequest)
 		return
 	}
 
 	cmd := buf[1]
 	if cmd != 0x01 { // Only support CONNECT
-		clientConn.Write([]byte{0x05, 0x07, 0x00, 0x01, 0, 0, 0, 0, 0, 0})
+		p.metrics.handshakeFailed(handshakeCommand)
+		writeSOCKSReply(clientConn, socksReplyCommandNotSupported)
 		return
 	}
 
@@ -358,75 +471,230 @@ func (p *ProxyServer) handleConnection(ctx context.Context, clientConn net.Conn)
 	switch addrType {
 	case 0x01: // IPv4
 		if n < 10 {
+			p.metrics.handshakeFailed(handshakeRequest)
 			return
 		}
 		host = fmt.Sprintf("%d.%d.%d.%d", buf[4], buf[5], buf[6], buf[7])
 		port = uint16(buf[8])<<8 | uint16(buf[9])
 	case 0x03: // Domain name
 		if n < 5 {
+			p.metrics.handshakeFailed(handshakeRequest)
 			return
 		}
 		addrLen := int(buf[4])
 		if n < 5+addrLen+2 {
+			p.metrics.handshakeFailed(handshakeRequest)
 			return
 		}
 		host = string(buf[5 : 5+addrLen])
 		port = uint16(buf[5+addrLen])<<8 | uint16(buf[5+addrLen+1])
 	case 0x04: // IPv6
 		if n < 22 {
+			p.metrics.handshakeFailed(handshakeRequest)
 			return
 		}
 		host = net.IP(buf[4:20]).String()
 		port = uint16(buf[20])<<8 | uint16(buf[21])
 	default:
-		clientConn.Write([]byte{0x05, 0x08, 0x00, 0x01, 0, 0, 0, 0, 0, 0})
+		p.metrics.handshakeFailed(handshakeAddress)
+		writeSOCKSReply(clientConn, socksReplyAddressNotSupported)
 		return
 	}
 
 	target := net.JoinHostPort(host, fmt.Sprintf("%d", port))
+	defer trace.finish(target)
+	trace.span("handshake", started, time.Now(), nil)
+	pprof.SetGoroutineLabels(pprof.WithLabels(ctx, pprof.Labels("stage", "dial", "dest", target)))
+
+	node := p.pickNode(host)
+	pinned := false
+	if ident != nil {
+		if index, ok := p.config.ProcessNodes[ident.Name]; ok && index >= 0 {
+			node = p.nodes[index%len(p.nodes)]
+			pinned = true
+		}
+	}
+	proc := p.procStats.connect(ident)
 
-	if p.config.Verbose {
-		log.Printf("Connecting to %s via Tailscale", target)
+	// Fail fast if the destination is known to be down
+	if reply, ok := p.breaker.allow(target); !ok {
+		if p.config.Verbose {
+			log.Printf("Failing connect to %s fast (recent failure, reply 0x%02x)", target, reply)
+		}
+		p.metrics.dialFastFailures.Add(1)
+		writeSOCKSReply(clientConn, reply)
+		return
 	}
 
-	// Dial through Tailscale
-	var remoteConn net.Conn
-	if p.config.ExitNode != "" {
-		// Use tsnet's dialer which routes through the Tailscale network
-		remoteConn, err = p.server.Dial(ctx, "tcp", target)
-	} else {
-		// Direct connection through Tailscale network
-		remoteConn, err = p.server.Dial(ctx, "tcp", target)
+	// Keep the path to the peer this connection leaves through warm
+	var path *pathState
+	if p.config.PathWarmMs > 0 || p.config.PathWaitMs > 0 {
+		if peer := node.peers.peerFor(host); peer != nil {
+			path = node.peers.touch(peer)
+		}
 	}
 
-	if err != nil {
+	// Claim a pre-connected conn for hot destinations, otherwise dial through
+	// Tailscale; tsnet routes via the exit node if one is set
+	var remoteConn net.Conn
+	var pooledNode *tsnetNode
+	claimStart := time.Now()
+	if !pinned {
+		remoteConn, pooledNode = p.preconnect.claim(target, host, port, addrType == 0x03)
+	}
+	if remoteConn != nil {
+		node = pooledNode
+	}
+	// Counted only once the breaker has let the connection through, against
+	// the node that carries it
+	if exit := node.exits.recordConn(); exit != "" {
 		if p.config.Verbose {
-			log.Printf("Failed to connect to %s: %v", target, err)
+			log.Printf("Connecting to %s via Tailscale node %s, exit node %s", target, node.hostname, exit)
 		}
-		clientConn.Write([]byte{0x05, 0x05, 0x00, 0x01, 0, 0, 0, 0, 0, 0})
-		return
+	} else if p.config.Verbose {
+		log.Printf("Connecting to %s via Tailscale node %s", target, node.hostname)
+	}
+	if remoteConn != nil {
+		p.metrics.pooledConnects.Add(1)
+		trace.span("preconnect claim", claimStart, time.Now(), map[string]any{"node": node.hostname})
+		if p.config.Verbose {
+			log.Printf("Using pre-connected conn to %s", target)
+		}
+	} else {
+		if path != nil && p.config.PathWaitMs > 0 {
+			waitStart := time.Now()
+			node.peers.awaitDirect(ctx, path)
+			trace.span("path wait", waitStart, time.Now(), nil)
+		}
+		dialStart := time.Now()
+		remoteConn, err = p.dial(ctx, node, host, port, addrType == 0x03)
+		dialTime := time.Since(dialStart)
+		proc.dialLatency.observe(dialTime)
+		p.breaker.record(target, err, ctx.Err() != nil)
+		if trace != nil {
+			args := map[string]any{"node": node.hostname}
+			if exit := node.exits.current(); exit != "" {
+				args["exit_node"] = exit
+			}
+			if err != nil {
+				args["error"] = err.Error()
+			}
+			trace.span("dial", dialStart, dialStart.Add(dialTime), args)
+		}
+		if err != nil {
+			p.metrics.dialLatency[dialFailure].observe(dialTime)
+			proc.dialFailures.Add(1)
+			reply := dialErrorReply(err)
+			if p.config.Verbose {
+				log.Printf("Failed to connect to %s: %v (reply 0x%02x)", target, err, reply)
+			}
+			writeSOCKSReply(clientConn, reply)
+			return
+		}
+		p.metrics.dialLatency[dialSuccess].observe(dialTime)
 	}
 	defer remoteConn.Close()
 
 	// Send success response
-	_, err = clientConn.Write([]byte{0x05, 0x00, 0x00, 0x01, 0, 0, 0, 0, 0, 0})
-	if err != nil {
+	replyStart := time.Now()
+	if err := writeSOCKSReply(clientConn, socksReplySucceeded); err != nil {
 		return
 	}
+	relayStart := time.Now()
+	trace.span("reply", replyStart, relayStart, nil)
 
-	// Bidirectional copy
+	node.conns.Add(1)
+	node.active.Add(1)
+	defer node.active.Add(-1)
+	proc.active.Add(1)
+	defer proc.active.Add(-1)
+
+	entry := &connEntry{kind: connProxy, dest: target, node: node.hostname}
+	if ident != nil {
+		entry.process, entry.pid = ident.Name, int32(ident.PID)
+	}
+	p.conns.add(entry)
+	defer p.conns.remove(entry)
+
+	// Bidirectional copy, labelled so profiles attribute it to the node
 	var wg sync.WaitGroup
 	wg.Add(2)
 
-	go func() {
-		defer wg.Done()
-		io.Copy(remoteConn, clientConn)
-	}()
+	var flow *relayFlow
+	if node.schedUp != nil {
+		flow = p.classifyFlow(port)
+	}
+	limits := p.limits.proxyFlow(clientConn, remoteConn, host, port, ident)
 
-	go func() {
-		defer wg.Done()
-		io.Copy(clientConn, remoteConn)
-	}()
+	pprof.Do(ctx, pprof.Labels("stage", "relay", "dest", target, "node", node.hostname), func(context.Context) {
+		go func() {
+			defer wg.Done()
+			relay(remoteConn, clientConn, relayDir{flow, node.schedUp, limits, &node.bytesOut, &proc.bytesOut, &entry.bytesUp, trace, traceUp})
+		}()
+
+		go func() {
+			defer wg.Done()
+			relay(clientConn, remoteConn, relayDir{flow, node.schedDown, limits, &node.bytesIn, &proc.bytesIn, &entry.bytesDown, trace, traceDown})
+		}()
+	})
 
 	wg.Wait()
+
+	if trace != nil {
+		closeStart := time.Now()
+		trace.span("relay", relayStart, closeStart, nil)
+		remoteConn.Close()
+		clientConn.Close()
+		trace.span("close", closeStart, time.Now(), nil)
+	}
+}
+
+// dial connects to host:port over the tailnet, bounded by the configured dial
+// timeout. Domain names are resolved and raced Happy Eyeballs style unless
+// racing is disabled.
+func (p *ProxyServer) dial(ctx context.Context, node *tsnetNode, host string, port uint16, isDomain bool) (net.Conn, error) {
+	if p.config.DialTimeoutMs > 0 {
+		var cancel context.CancelFunc
+		ctx, cancel = context.WithTimeout(ctx, time.Duration(p.config.DialTimeoutMs)*time.Millisecond)
+		defer cancel()
+	}
+	portStr := strconv.Itoa(int(port))
+	if isDomain && p.config.DialStaggerMs >= 0 {
+		if _, err := netip.ParseAddr(host); err != nil {
+			return p.dialHappyEyeballs(ctx, node, host, portStr)
+		}
+	}
+	return node.server.Dial(ctx, "tcp", net.JoinHostPort(host, portStr))
+}
+
+// readSOCKSCredentials reads a username/password subnegotiation (RFC 1929),
+// accepts it and returns the process identity it carries.
+func readSOCKSCredentials(conn net.Conn) (*procIdent, error) {
+	// VER ULEN UNAME PLEN PASSWD
+	var hdr [2]byte
+	if _, err := io.ReadFull(conn, hdr[:]); err != nil {
+		return nil, err
+	}
+	if hdr[0] != 0x01 {
+		return nil, fmt.Errorf("unsupported auth version %d", hdr[0])
+	}
+	user := make([]byte, int(hdr[1])+1)
+	if _, err := io.ReadFull(conn, user); err != nil {
+		return nil, err
+	}
+	pass := make([]byte, int(user[len(user)-1]))
+	if _, err := io.ReadFull(conn, pass); err != nil {
+		return nil, err
+	}
+
+	if _, err := conn.Write([]byte{0x01, 0x00}); err != nil {
+		return nil, err
+	}
+	return parseProcIdent(string(user[:len(user)-1]), string(pass)), nil
+}
+
+// writeSOCKSReply sends a SOCKS5 reply with an unspecified IPv4 bind address.
+func writeSOCKSReply(conn net.Conn, reply byte) error {
+	_, err := conn.Write([]byte{0x05, reply, 0x00, 0x01, 0, 0, 0, 0, 0, 0})
+	return err
 }
@@ -0,0 +1,329 @@
+package main
+
+import (
+	"fmt"
+	"log"
+	"net"
+	"net/netip"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Token-bucket rate limits.
+//
+// Each entry of rate_limits is one token bucket shared by every flow it
+// matches, so a rule limits the aggregate of its destination, port, exported
+// port or process. A flow matching several rules draws from all of their
+// buckets and is held to the slowest, which makes the rules hierarchical: a
+// per-process cap can sit under a per-destination one.
+//
+// The rule table is swapped atomically on reload. Each flow caches the
+// buckets it matched together with the table they came from, so a flow no
+// rule matches pays two atomic loads per chunk, and a reload reaches existing
+// flows on their next chunk.
+
+// RateLimit is one rate_limits entry. Empty match fields match anything;
+// export_ports rules apply to exported ports, all others to proxied
+// connections.
+type RateLimit struct {
+	Dest        string `json:"dest,omitempty"`         // CIDR, IP or SOCKS hostname
+	Ports       string `json:"ports,omitempty"`        // destination ports, e.g. "443,8000-8100"
+	ExportPorts string `json:"export_ports,omitempty"` // exported ports
+	Process     string `json:"process,omitempty"`      // originating executable name
+	Cgroup      string `json:"cgroup,omitempty"`       // originating cgroup or a parent of it
+	KBps        int    `json:"kbps"`
+	BurstKB     int    `json:"burst_kb,omitempty"` // defaults to one second at kbps
+}
+
+func (r RateLimit) String() string {
+	var parts []string
+	for _, kv := range [][2]string{{"dest", r.Dest}, {"ports", r.Ports}, {"export_ports", r.ExportPorts}, {"process", r.Process}, {"cgroup", r.Cgroup}} {
+		if kv[1] != "" {
+			parts = append(parts, kv[0]+"="+kv[1])
+		}
+	}
+	if len(parts) == 0 {
+		parts = append(parts, "all")
+	}
+	return fmt.Sprintf("%s@%dKiB/s", strings.Join(parts, ","), r.KBps)
+}
+
+// tokenBucket lets bytes through at rate with bursts up to burst. Callers
+// take tokens up front and sleep off any debt, so a bucket never queues.
+type tokenBucket struct {
+	rule  RateLimit
+	rate  float64 // bytes per second
+	burst float64
+
+	prefix      netip.Prefix // parsed Dest, if it is an address or CIDR
+	hostname    string       // Dest, if it is not
+	ports       portSet      // parsed Ports
+	exportPorts portSet      // parsed ExportPorts
+
+	mu     sync.Mutex
+	tokens float64
+	last   time.Time
+
+	bytes    atomic.Uint64
+	waits    atomic.Uint64
+	waitTime atomic.Int64
+}
+
+func newTokenBucket(rule RateLimit) (*tokenBucket, error) {
+	if rule.KBps <= 0 {
+		return nil, fmt.Errorf("rate limit %v: kbps must be positive", rule)
+	}
+	b := &tokenBucket{
+		rule: rule,
+		rate: float64(rule.KBps) * 1024,
+		last: time.Now(),
+	}
+	b.burst = b.rate
+	if rule.BurstKB > 0 {
+		b.burst = float64(rule.BurstKB) * 1024
+	}
+	b.tokens = b.burst
+
+	var err error
+	if b.ports, err = parsePortSpec(rule.Ports); err != nil {
+		return nil, fmt.Errorf("rate limit %v: ports: %w", rule, err)
+	}
+	if b.exportPorts, err = parsePortSpec(rule.ExportPorts); err != nil {
+		return nil, fmt.Errorf("rate limit %v: export_ports: %w", rule, err)
+	}
+	if rule.Dest != "" {
+		if prefix, err := netip.ParsePrefix(rule.Dest); err == nil {
+			b.prefix = prefix.Masked()
+		} else if addr, err := netip.ParseAddr(rule.Dest); err == nil {
+			b.prefix = netip.PrefixFrom(addr, addr.BitLen())
+		} else {
+			b.hostname = strings.ToLower(rule.Dest)
+		}
+	}
+	return b, nil
+}
+
+// reserve takes n tokens and returns how long the caller must wait for them.
+func (b *tokenBucket) reserve(n int, now time.Time) time.Duration {
+	b.mu.Lock()
+	b.tokens = min(b.tokens+now.Sub(b.last).Seconds()*b.rate, b.burst)
+	b.last = now
+	b.tokens -= float64(n)
+	debt := -b.tokens
+	b.mu.Unlock()
+
+	b.bytes.Add(uint64(n))
+	if debt <= 0 {
+		return 0
+	}
+	return time.Duration(debt / b.rate * float64(time.Second))
+}
+
+// flowKey is what rules match a flow on.
+type flowKey struct {
+	host       string         // SOCKS hostname or address
+	dest       netip.Addr     // address actually dialed
+	port       int            // destination port, 0 for exports
+	exportPort int            // exported port, 0 for proxied connections
+	client     netip.AddrPort // application's end of the SOCKS connection
+	clientSide netip.AddrPort // proxy's end of the SOCKS connection
+}
+
+func (b *tokenBucket) matches(k *flowKey, process func() *procIdent) bool {
+	r := &b.rule
+	if r.ExportPorts != "" {
+		return k.exportPort != 0 && b.exportPorts.contains(k.exportPort)
+	}
+	if k.exportPort != 0 {
+		return false
+	}
+	if b.prefix.IsValid() && (!k.dest.IsValid() || !b.prefix.Contains(k.dest.Unmap())) {
+		return false
+	}
+	if b.hostname != "" && !strings.EqualFold(b.hostname, k.host) {
+		return false
+	}
+	if b.ports != nil && !b.ports.contains(k.port) {
+		return false
+	}
+	if r.Process != "" && process().Name != r.Process {
+		return false
+	}
+	if r.Cgroup != "" && !cgroupWithin(process().Cgroup, r.Cgroup) {
+		return false
+	}
+	return true
+}
+
+// cgroupWithin reports whether cgroup is parent or below it.
+func cgroupWithin(cgroup, parent string) bool {
+	parent = strings.TrimSuffix(parent, "/")
+	return cgroup == parent || strings.HasPrefix(cgroup, parent+"/")
+}
+
+type limitTable struct {
+	buckets []*tokenBucket
+}
+
+// rateLimiter holds the current rule table.
+type rateLimiter struct {
+	verbose bool
+	table   atomic.Pointer[limitTable]
+}
+
+func newRateLimiter(config *Config, t *limitTable) *rateLimiter {
+	rl := &rateLimiter{verbose: config.Verbose}
+	rl.table.Store(t)
+	return rl
+}
+
+// swap replaces the rule table. Token state starts afresh; existing flows
+// rematch on their next chunk.
+func (rl *rateLimiter) swap(t *limitTable) {
+	rl.table.Store(t)
+}
+
+func compileLimits(rules []RateLimit) (*limitTable, error) {
+	t := &limitTable{}
+	for _, rule := range rules {
+		b, err := newTokenBucket(rule)
+		if err != nil {
+			return nil, err
+		}
+		t.buckets = append(t.buckets, b)
+	}
+	return t, nil
+}
+
+// flowMatch is the set of buckets a flow matched in one table.
+type flowMatch struct {
+	table   *limitTable
+	buckets []*tokenBucket
+}
+
+// flowLimits is one flow's view of the rule table, shared by both relay
+// directions.
+type flowLimits struct {
+	rl    *rateLimiter
+	key   flowKey
+	match atomic.Pointer[flowMatch]
+
+	mu      sync.Mutex
+	process *procIdent // from the handshake, or resolved on first process rule
+}
+
+// proxyFlow returns the limits for a proxied connection. ident is the
+// process identity from the handshake, if the client sent one.
+func (rl *rateLimiter) proxyFlow(clientConn, remoteConn net.Conn, host string, port uint16, ident *procIdent) *flowLimits {
+	return &flowLimits{rl: rl, process: ident, key: flowKey{
+		host:       host,
+		dest:       addrPortOf(remoteConn.RemoteAddr()).Addr(),
+		port:       int(port),
+		client:     addrPortOf(clientConn.RemoteAddr()),
+		clientSide: addrPortOf(clientConn.LocalAddr()),
+	}}
+}
+
+// exportFlow returns the limits for a connection to an exported port.
+func (rl *rateLimiter) exportFlow(port int) *flowLimits {
+	return &flowLimits{rl: rl, key: flowKey{exportPort: port}}
+}
+
+func addrPortOf(addr net.Addr) netip.AddrPort {
+	switch a := addr.(type) {
+	case *net.TCPAddr:
+		return a.AddrPort()
+	case *net.UDPAddr:
+		return a.AddrPort()
+	}
+	ap, _ := netip.ParseAddrPort(addr.String())
+	return ap
+}
+
+// wait blocks until n more bytes of the flow fit every matching bucket.
+func (f *flowLimits) wait(n int) {
+	if f == nil {
+		return
+	}
+	t := f.rl.table.Load()
+	m := f.match.Load()
+	if m == nil || m.table != t {
+		m = f.rematch(t)
+	}
+	buckets := m.buckets
+	if len(buckets) == 0 {
+		return
+	}
+
+	now := time.Now()
+	var delay time.Duration
+	for _, b := range buckets {
+		delay = max(delay, b.reserve(n, now))
+	}
+	if delay > 0 {
+		for _, b := range buckets {
+			b.waits.Add(1)
+			b.waitTime.Add(int64(delay))
+		}
+		time.Sleep(delay)
+	}
+}
+
+// rematch matches the flow against t after a reload.
+func (f *flowLimits) rematch(t *limitTable) *flowMatch {
+	f.mu.Lock()
+	defer f.mu.Unlock()
+	m := &flowMatch{table: t}
+	for _, b := range t.buckets {
+		if b.matches(&f.key, f.processIdent) {
+			m.buckets = append(m.buckets, b)
+		}
+	}
+	f.match.Store(m)
+	return m
+}
+
+// processIdent resolves the originating process once. Called with f.mu held.
+func (f *flowLimits) processIdent() *procIdent {
+	if f.process == nil {
+		f.process = &procIdent{}
+		if f.key.client.IsValid() {
+			ident, err := lookupSocketOwner(f.key.client, f.key.clientSide)
+			if err != nil && f.rl.verbose {
+				log.Printf("Could not find process for %s: %v", f.key.client, err)
+			}
+			*f.process = ident
+		}
+	}
+	return f.process
+}
+
+// rateLimitStats is a point-in-time view of one rule.
+type rateLimitStats struct {
+	Rule     string
+	Bytes    uint64
+	Waits    uint64
+	WaitTime time.Duration
+}
+
+func (rl *rateLimiter) snapshot() []rateLimitStats {
+	t := rl.table.Load()
+	out := make([]rateLimitStats, len(t.buckets))
+	for i, b := range t.buckets {
+		out[i] = rateLimitStats{
+			Rule:     b.rule.String(),
+			Bytes:    b.bytes.Load(),
+			Waits:    b.waits.Load(),
+			WaitTime: time.Duration(b.waitTime.Load()),
+		}
+	}
+	return out
+}
+
+func (rl *rateLimiter) logSummary() {
+	for _, st := range rl.snapshot() {
+		log.Printf("Rate limit %s: bytes=%d throttled=%d wait=%v", st.Rule, st.Bytes, st.Waits, st.WaitTime)
+	}
+}
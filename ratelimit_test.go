@@ -0,0 +1,130 @@
+package main
+
+import (
+	"testing"
+	"time"
+)
+
+func TestTokenBucketReserve(t *testing.T) {
+	type step struct {
+		at   time.Duration // since the bucket was created
+		n    int
+		want time.Duration
+	}
+	tests := []struct {
+		name  string
+		rule  RateLimit
+		steps []step
+	}{
+		{
+			name: "burst passes, then waits",
+			rule: RateLimit{KBps: 100},
+			steps: []step{
+				{0, 100 * 1024, 0},
+				{0, 50 * 1024, 500 * time.Millisecond},
+			},
+		},
+		{
+			name: "debt accumulates",
+			rule: RateLimit{KBps: 100},
+			steps: []step{
+				{0, 100 * 1024, 0},
+				{0, 100 * 1024, time.Second},
+				{0, 100 * 1024, 2 * time.Second},
+			},
+		},
+		{
+			name: "refills at rate",
+			rule: RateLimit{KBps: 100},
+			steps: []step{
+				{0, 100 * 1024, 0},
+				{500 * time.Millisecond, 50 * 1024, 0},
+				{500 * time.Millisecond, 10 * 1024, 100 * time.Millisecond},
+			},
+		},
+		{
+			name: "refill is capped at burst",
+			rule: RateLimit{KBps: 100, BurstKB: 10},
+			steps: []step{
+				{10 * time.Second, 20 * 1024, 100 * time.Millisecond},
+			},
+		},
+		{
+			name: "debt is paid off over time",
+			rule: RateLimit{KBps: 1},
+			steps: []step{
+				{0, 3 * 1024, 2 * time.Second},
+				{2 * time.Second, 1, time.Second / 1024},
+			},
+		},
+	}
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			b, err := newTokenBucket(tt.rule)
+			if err != nil {
+				t.Fatal(err)
+			}
+			start := b.last
+			var total int
+			for i, s := range tt.steps {
+				got := b.reserve(s.n, start.Add(s.at))
+				if d := got - s.want; d < -time.Microsecond || d > time.Microsecond {
+					t.Errorf("step %d: reserve(%d) = %v, want %v", i, s.n, got, s.want)
+				}
+				total += s.n
+			}
+			if got := b.bytes.Load(); got != uint64(total) {
+				t.Errorf("bytes = %d, want %d", got, total)
+			}
+		})
+	}
+}
+
+func TestNewTokenBucketRejectsZeroRate(t *testing.T) {
+	if _, err := newTokenBucket(RateLimit{Dest: "10.0.0.0/8"}); err == nil {
+		t.Error("accepted a rule without kbps")
+	}
+}
+
+func TestNewTokenBucketRejectsBadPorts(t *testing.T) {
+	for _, rule := range []RateLimit{
+		{Ports: "8o", KBps: 1},
+		{Ports: "10000-", KBps: 1},
+		{ExportPorts: "22,0", KBps: 1},
+		{ExportPorts: "9-1", KBps: 1},
+	} {
+		if _, err := newTokenBucket(rule); err == nil {
+			t.Errorf("accepted %v", rule)
+		}
+	}
+	if _, err := compileLimits([]RateLimit{{KBps: 1}, {Ports: "http", KBps: 1}}); err == nil {
+		t.Error("compileLimits accepted a rule with bad ports")
+	}
+}
+
+func TestTokenBucketMatchesPorts(t *testing.T) {
+	none := func() *procIdent { return &procIdent{} }
+	tests := []struct {
+		rule RateLimit
+		key  flowKey
+		want bool
+	}{
+		{RateLimit{KBps: 1}, flowKey{port: 443}, true},
+		{RateLimit{KBps: 1}, flowKey{exportPort: 22}, false},
+		{RateLimit{Ports: "443,8000-8100", KBps: 1}, flowKey{port: 443}, true},
+		{RateLimit{Ports: "443,8000-8100", KBps: 1}, flowKey{port: 8100}, true},
+		{RateLimit{Ports: "443,8000-8100", KBps: 1}, flowKey{port: 80}, false},
+		{RateLimit{ExportPorts: "22", KBps: 1}, flowKey{exportPort: 22}, true},
+		{RateLimit{ExportPorts: "22", KBps: 1}, flowKey{exportPort: 23}, false},
+		{RateLimit{ExportPorts: "22", KBps: 1}, flowKey{port: 22}, false},
+	}
+	for _, tt := range tests {
+		b, err := newTokenBucket(tt.rule)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if got := b.matches(&tt.key, none); got != tt.want {
+			t.Errorf("%v matches %+v = %v, want %v", tt.rule, tt.key, got, tt.want)
+		}
+	}
+}
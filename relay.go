@@ -0,0 +1,399 @@
+package main
+
+import (
+	"context"
+	"fmt"
+	"io"
+	"log"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Fair-queuing relay scheduler.
+//
+// Without scheduling every relay goroutine races its writes into the node's
+// netstack, so a bulk download fills the path and interactive flows queue
+// behind it. With sched_rate_kbps set, each node paces both relay directions
+// at that rate and hands out the write capacity by deficit round robin over
+// three flow classes, weighted by sched_weight_*. A flow is interactive or
+// bulk by destination port policy, otherwise default; any flow that moves
+// more than sched_bulk_kbps in a one-second window is demoted to bulk.
+// While capacity is available and nothing is queued, writes pass straight
+// through, so the scheduler only reorders traffic under saturation.
+
+type flowClass int32
+
+const (
+	classInteractive flowClass = iota
+	classDefault
+	classBulk
+	numFlowClasses
+)
+
+var flowClassNames = [numFlowClasses]string{"interactive", "default", "bulk"}
+
+func (c flowClass) String() string {
+	return flowClassNames[c]
+}
+
+const (
+	relayBufSize   = 32 * 1024
+	schedQuantum   = 16 * 1024 // bytes per unit of weight per DRR round
+	schedMinBurst  = 64 * 1024
+	schedBurstTime = 10 * time.Millisecond
+	flowRateWindow = time.Second
+)
+
+// defaultInteractivePorts are SSH, DNS, RDP and VNC.
+const defaultInteractivePorts = "22,53,3389,5900"
+
+var relayBufPool = sync.Pool{
+	New: func() any {
+		relayBufAllocs.Add(1)
+		b := make([]byte, relayBufSize)
+		return &b
+	},
+}
+
+// Relay buffer pool statistics
+var (
+	relayBufAllocs atomic.Uint64
+	relayBufInUse  atomic.Int64
+)
+
+// relayFlow is one proxied connection as seen by the scheduler. Both relay
+// directions account their bytes against it.
+type relayFlow struct {
+	class       atomic.Int32
+	bulkRate    int64        // bytes per window that demote the flow to bulk
+	windowStart atomic.Int64 // unix nanoseconds
+	windowBytes atomic.Int64
+}
+
+// schedPorts is the compiled port policy that picks a flow's class.
+type schedPorts struct {
+	interactive portSet
+	bulk        portSet
+}
+
+func compileSchedPorts(config *Config) (schedPorts, error) {
+	var sp schedPorts
+	var err error
+	if sp.interactive, err = parsePortSpec(config.SchedInteractivePorts); err != nil {
+		return sp, fmt.Errorf("sched_interactive_ports: %w", err)
+	}
+	if sp.bulk, err = parsePortSpec(config.SchedBulkPorts); err != nil {
+		return sp, fmt.Errorf("sched_bulk_ports: %w", err)
+	}
+	return sp, nil
+}
+
+// classifyFlow starts scheduler accounting for a connection to port, in the
+// class its port policy gives it.
+func (p *ProxyServer) classifyFlow(port uint16) *relayFlow {
+	f := &relayFlow{bulkRate: int64(p.config.SchedBulkKBps) * 1024}
+	class := classDefault
+	switch {
+	case p.schedPorts.interactive.contains(int(port)):
+		class = classInteractive
+	case p.schedPorts.bulk.contains(int(port)):
+		class = classBulk
+	}
+	f.class.Store(int32(class))
+	f.windowStart.Store(time.Now().UnixNano())
+	return f
+}
+
+// account adds n bytes to the flow's rate window and returns its class,
+// demoting it to bulk once the window exceeds the bulk rate.
+func (f *relayFlow) account(n int) flowClass {
+	class := flowClass(f.class.Load())
+	if f.bulkRate <= 0 || class == classBulk {
+		return class
+	}
+
+	now := time.Now().UnixNano()
+	start := f.windowStart.Load()
+	if now-start >= int64(flowRateWindow) && f.windowStart.CompareAndSwap(start, now) {
+		f.windowBytes.Store(0)
+	}
+	if f.windowBytes.Add(int64(n)) > f.bulkRate {
+		f.class.Store(int32(classBulk))
+		return classBulk
+	}
+	return class
+}
+
+// relayDir is what relay applies to one direction of a connection. Every
+// field is optional.
+type relayDir struct {
+	flow   *relayFlow      // required when sched is set
+	sched  *relayScheduler // fair queuing across flows
+	limits *flowLimits     // rate limits
+	count  *atomic.Uint64  // bytes written, per node
+	pcount *atomic.Uint64  // bytes written, per process
+	ccount *atomic.Uint64  // bytes written, per connection
+	trace  *connTrace      // sampled connection trace
+	dir    int             // traceUp or traceDown
+}
+
+// relay copies src to dst through a pooled buffer. Every chunk first waits
+// out the flow's rate limits and then for its turn in the scheduler.
+func relay(dst io.Writer, src io.Reader, d relayDir) {
+	bp := relayBufPool.Get().(*[]byte)
+	relayBufInUse.Add(1)
+	defer func() {
+		relayBufInUse.Add(-1)
+		relayBufPool.Put(bp)
+	}()
+	buf := *bp
+
+	var ready chan struct{}
+	if d.sched != nil {
+		ready = make(chan struct{}, 1)
+	}
+	for {
+		n, err := src.Read(buf)
+		if n > 0 {
+			d.limits.wait(n)
+			if d.sched != nil {
+				d.sched.wait(d.flow.account(n), n, ready)
+			}
+			w, werr := dst.Write(buf[:n])
+			d.trace.markFirstByte(d.dir)
+			if d.count != nil {
+				d.count.Add(uint64(w))
+			}
+			if d.pcount != nil {
+				d.pcount.Add(uint64(w))
+			}
+			if d.ccount != nil {
+				d.ccount.Add(uint64(w))
+			}
+			if werr != nil || w != n {
+				return
+			}
+		}
+		if err != nil {
+			return
+		}
+	}
+}
+
+type schedRequest struct {
+	n     int
+	enq   time.Time
+	ready chan struct{}
+}
+
+// schedClassStats counts grants and queueing delay for one class.
+type schedClassStats struct {
+	Grants     uint64 // chunks written
+	Bytes      uint64
+	Queued     uint64 // chunks that had to wait
+	DelayTotal time.Duration
+	DelayMax   time.Duration
+}
+
+type schedClass struct {
+	quantum int
+	deficit int
+	queue   []*schedRequest
+	stats   schedClassStats
+}
+
+// relayScheduler paces one relay direction of a node.
+type relayScheduler struct {
+	name  string
+	rate  float64 // bytes per second
+	burst float64
+
+	mu      sync.Mutex
+	tokens  float64
+	last    time.Time
+	classes [numFlowClasses]schedClass
+	queued  int
+	cur     int
+	fresh   bool // cur has not received its quantum this round
+	closed  bool
+	wake    chan struct{}
+}
+
+// newRelayScheduler returns nil when scheduling is disabled.
+func newRelayScheduler(config *Config, name string) *relayScheduler {
+	if config.SchedRateKBps <= 0 {
+		return nil
+	}
+	rate := float64(config.SchedRateKBps) * 1024
+	s := &relayScheduler{
+		name:  name,
+		rate:  rate,
+		burst: max(rate*schedBurstTime.Seconds(), schedMinBurst),
+		last:  time.Now(),
+		fresh: true,
+		wake:  make(chan struct{}, 1),
+	}
+	weights := [numFlowClasses]int{config.SchedWeightInteractive, config.SchedWeightDefault, config.SchedWeightBulk}
+	for i, w := range weights {
+		s.classes[i].quantum = max(w, 1) * schedQuantum
+	}
+	s.tokens = s.burst
+	return s
+}
+
+// start runs the dispatcher until ctx is done.
+func (s *relayScheduler) start(ctx context.Context) {
+	if s == nil {
+		return
+	}
+	go s.run(ctx)
+}
+
+// wait blocks until n bytes of class may be written.
+func (s *relayScheduler) wait(class flowClass, n int, ready chan struct{}) {
+	now := time.Now()
+	s.mu.Lock()
+	c := &s.classes[class]
+	if s.closed {
+		s.mu.Unlock()
+		return
+	}
+	s.refillLocked(now)
+	if s.queued == 0 && s.tokens > 0 {
+		s.tokens -= float64(n)
+		c.stats.Grants++
+		c.stats.Bytes += uint64(n)
+		s.mu.Unlock()
+		return
+	}
+	c.queue = append(c.queue, &schedRequest{n: n, enq: now, ready: ready})
+	s.queued++
+	s.mu.Unlock()
+
+	select {
+	case s.wake <- struct{}{}:
+	default:
+	}
+	<-ready
+}
+
+func (s *relayScheduler) refillLocked(now time.Time) {
+	s.tokens = min(s.tokens+now.Sub(s.last).Seconds()*s.rate, s.burst)
+	s.last = now
+}
+
+func (s *relayScheduler) run(ctx context.Context) {
+	timer := time.NewTimer(time.Hour)
+	defer timer.Stop()
+	for {
+		s.mu.Lock()
+		if s.queued == 0 {
+			s.mu.Unlock()
+			select {
+			case <-ctx.Done():
+				s.close()
+				return
+			case <-s.wake:
+			}
+			continue
+		}
+
+		now := time.Now()
+		s.refillLocked(now)
+		if s.tokens <= 0 {
+			delay := time.Duration(-s.tokens/s.rate*float64(time.Second)) + time.Millisecond
+			s.mu.Unlock()
+			timer.Reset(delay)
+			select {
+			case <-ctx.Done():
+				s.close()
+				return
+			case <-timer.C:
+			}
+			continue
+		}
+
+		req, c := s.nextLocked()
+		s.tokens -= float64(req.n)
+		delay := now.Sub(req.enq)
+		c.stats.Grants++
+		c.stats.Bytes += uint64(req.n)
+		c.stats.Queued++
+		c.stats.DelayTotal += delay
+		c.stats.DelayMax = max(c.stats.DelayMax, delay)
+		s.mu.Unlock()
+		req.ready <- struct{}{}
+	}
+}
+
+// nextLocked dequeues the next request in deficit round robin order.
+// Called with s.mu held and at least one request queued.
+func (s *relayScheduler) nextLocked() (*schedRequest, *schedClass) {
+	for {
+		c := &s.classes[s.cur]
+		if len(c.queue) == 0 {
+			c.deficit = 0
+		} else {
+			if s.fresh {
+				c.deficit += c.quantum
+				s.fresh = false
+			}
+			if req := c.queue[0]; req.n <= c.deficit {
+				c.queue[0] = nil
+				c.queue = c.queue[1:]
+				c.deficit -= req.n
+				s.queued--
+				return req, c
+			}
+		}
+		s.cur = (s.cur + 1) % int(numFlowClasses)
+		s.fresh = true
+	}
+}
+
+// close releases every queued writer and lets later ones through unpaced.
+func (s *relayScheduler) close() {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	s.closed = true
+	for i := range s.classes {
+		c := &s.classes[i]
+		for _, req := range c.queue {
+			req.ready <- struct{}{}
+		}
+		c.queue = nil
+	}
+	s.queued = 0
+}
+
+// snapshot returns a copy of the per-class statistics.
+func (s *relayScheduler) snapshot() [numFlowClasses]schedClassStats {
+	var out [numFlowClasses]schedClassStats
+	if s == nil {
+		return out
+	}
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	for i := range s.classes {
+		out[i] = s.classes[i].stats
+	}
+	return out
+}
+
+func (s *relayScheduler) logSummary() {
+	if s == nil {
+		return
+	}
+	for i, st := range s.snapshot() {
+		if st.Grants == 0 {
+			continue
+		}
+		var avg time.Duration
+		if st.Queued > 0 {
+			avg = st.DelayTotal / time.Duration(st.Queued)
+		}
+		log.Printf("Scheduler %s %s: bytes=%d chunks=%d queued=%d avg_delay=%v max_delay=%v",
+			s.name, flowClass(i), st.Bytes, st.Grants, st.Queued, avg, st.DelayMax)
+	}
+}
@@ -0,0 +1,129 @@
+package main
+
+import (
+	"strings"
+	"testing"
+)
+
+func TestRelaySchedulerNext(t *testing.T) {
+	const k = 1024
+	tests := []struct {
+		name    string
+		weights [numFlowClasses]int
+		queues  [numFlowClasses][]int // request sizes per class
+		want    string                // classes served, in order
+	}{
+		{
+			name:    "weights split rounds",
+			weights: [numFlowClasses]int{4, 2, 1},
+			queues:  [numFlowClasses][]int{repeatSize(16*k, 8), repeatSize(16*k, 4), repeatSize(16*k, 2)},
+			want:    "IIIIDDB" + "IIIIDDB",
+		},
+		{
+			name:    "idle classes are skipped",
+			weights: [numFlowClasses]int{4, 2, 1},
+			queues:  [numFlowClasses][]int{nil, nil, repeatSize(16*k, 3)},
+			want:    "BBB",
+		},
+		{
+			name:    "small chunks share a quantum",
+			weights: [numFlowClasses]int{1, 1, 1},
+			queues:  [numFlowClasses][]int{repeatSize(4*k, 5), repeatSize(8*k, 3), nil},
+			want:    "IIII" + "DD" + "I" + "D",
+		},
+		{
+			name:    "oversized request builds deficit",
+			weights: [numFlowClasses]int{1, 1, 1},
+			queues:  [numFlowClasses][]int{nil, repeatSize(16*k, 4), {40 * k}},
+			want:    "DDDBD",
+		},
+		{
+			name:    "weight zero still gets a quantum",
+			weights: [numFlowClasses]int{0, 3, 0},
+			queues:  [numFlowClasses][]int{repeatSize(16*k, 2), repeatSize(16*k, 4), nil},
+			want:    "IDDDID",
+		},
+	}
+	letters := [numFlowClasses]byte{'I', 'D', 'B'}
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			s := newRelayScheduler(&Config{
+				SchedRateKBps:          1,
+				SchedWeightInteractive: tt.weights[classInteractive],
+				SchedWeightDefault:     tt.weights[classDefault],
+				SchedWeightBulk:        tt.weights[classBulk],
+			}, "test")
+			for class, sizes := range tt.queues {
+				for _, n := range sizes {
+					s.classes[class].queue = append(s.classes[class].queue, &schedRequest{n: n})
+					s.queued++
+				}
+			}
+
+			var got strings.Builder
+			for s.queued > 0 {
+				req, c := s.nextLocked()
+				for class := range s.classes {
+					if c == &s.classes[class] {
+						got.WriteByte(letters[class])
+					}
+				}
+				if req == nil {
+					t.Fatal("nil request")
+				}
+			}
+			if got.String() != tt.want {
+				t.Errorf("served %q, want %q", got.String(), tt.want)
+			}
+		})
+	}
+}
+
+func repeatSize(n, count int) []int {
+	out := make([]int, count)
+	for i := range out {
+		out[i] = n
+	}
+	return out
+}
+
+func TestClassifyFlow(t *testing.T) {
+	config := &Config{SchedInteractivePorts: defaultInteractivePorts, SchedBulkPorts: "873,9000-9100"}
+	sp, err := compileSchedPorts(config)
+	if err != nil {
+		t.Fatal(err)
+	}
+	p := &ProxyServer{config: config, schedPorts: sp}
+	tests := []struct {
+		port uint16
+		want flowClass
+	}{
+		{22, classInteractive},
+		{5900, classInteractive},
+		{873, classBulk},
+		{9050, classBulk},
+		{443, classDefault},
+		{9101, classDefault},
+	}
+	for _, tt := range tests {
+		if got := flowClass(p.classifyFlow(tt.port).class.Load()); got != tt.want {
+			t.Errorf("classifyFlow(%d) = %v, want %v", tt.port, got, tt.want)
+		}
+	}
+}
+
+func TestCompileSchedPortsErrors(t *testing.T) {
+	tests := []struct {
+		config Config
+		prefix string
+	}{
+		{Config{SchedInteractivePorts: "22,ssh"}, "sched_interactive_ports: "},
+		{Config{SchedBulkPorts: "10000-"}, "sched_bulk_ports: "},
+	}
+	for _, tt := range tests {
+		_, err := compileSchedPorts(&tt.config)
+		if err == nil || !strings.HasPrefix(err.Error(), tt.prefix) {
+			t.Errorf("compileSchedPorts(%+v) error = %v, want prefix %q", tt.config, err, tt.prefix)
+		}
+	}
+}
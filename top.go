@@ -0,0 +1,160 @@
+package main
+
+import (
+	"fmt"
+	"io"
+	"net"
+	"os"
+	"path/filepath"
+	"sort"
+	"time"
+)
+
+// tailproxy -top: a client for the connection table of a running proxy.
+
+const (
+	topSortRate  = "rate"
+	topSortAge   = "age"
+	topSortBytes = "bytes"
+)
+
+// fetchConnTable reads the connection table from the control socket.
+func fetchConnTable(socketPath string) (time.Time, []connSnapshot, error) {
+	conn, err := net.DialTimeout("unix", socketPath, 2*time.Second)
+	if err != nil {
+		return time.Time{}, nil, err
+	}
+	defer conn.Close()
+	conn.SetDeadline(time.Now().Add(5 * time.Second))
+	if _, err := io.WriteString(conn, "CONNS\n"); err != nil {
+		return time.Time{}, nil, err
+	}
+	return readConnTable(conn)
+}
+
+type topRow struct {
+	connSnapshot
+	age            time.Duration
+	rateUp, rateDn float64 // bytes per second
+}
+
+// runTop renders the connection table every interval until interrupted, or
+// once if interval is 0.
+func runTop(socketPath, sortBy string, interval time.Duration) error {
+	switch sortBy {
+	case topSortRate, topSortAge, topSortBytes:
+	default:
+		return fmt.Errorf("unknown sort %q (want %s, %s or %s)", sortBy, topSortRate, topSortAge, topSortBytes)
+	}
+
+	prev := make(map[uint64]connSnapshot)
+	var prevAt time.Time
+	for {
+		now, conns, err := fetchConnTable(socketPath)
+		if err != nil {
+			return fmt.Errorf("failed to read connection table from %s: %w", socketPath, err)
+		}
+
+		rows := make([]topRow, len(conns))
+		next := make(map[uint64]connSnapshot, len(conns))
+		for i, c := range conns {
+			r := topRow{connSnapshot: c, age: now.Sub(c.Started)}
+			// Rate over the last interval, or over the connection's life
+			// for connections new since the last refresh
+			base, since := connSnapshot{}, r.age
+			if p, ok := prev[c.ID]; ok {
+				base, since = p, now.Sub(prevAt)
+			}
+			if secs := since.Seconds(); secs > 0 {
+				r.rateUp = float64(c.BytesUp-base.BytesUp) / secs
+				r.rateDn = float64(c.BytesDown-base.BytesDown) / secs
+			}
+			rows[i] = r
+			next[c.ID] = c
+		}
+		prev, prevAt = next, now
+
+		sort.Slice(rows, func(i, j int) bool {
+			a, b := &rows[i], &rows[j]
+			switch sortBy {
+			case topSortAge:
+				return a.age > b.age
+			case topSortBytes:
+				return a.BytesUp+a.BytesDown > b.BytesUp+b.BytesDown
+			default:
+				return a.rateUp+a.rateDn > b.rateUp+b.rateDn
+			}
+		})
+
+		if interval > 0 {
+			fmt.Print("\033[H\033[2J")
+		}
+		renderTop(os.Stdout, now, rows, sortBy)
+		if interval <= 0 {
+			return nil
+		}
+		time.Sleep(interval)
+	}
+}
+
+func renderTop(w io.Writer, now time.Time, rows []topRow, sortBy string) {
+	var up, down float64
+	for _, r := range rows {
+		up += r.rateUp
+		down += r.rateDn
+	}
+	fmt.Fprintf(w, "tailproxy  %s  %d connections  up %s/s  down %s/s  sorted by %s\n\n",
+		now.Format("15:04:05"), len(rows), formatSize(up), formatSize(down), sortBy)
+	fmt.Fprintf(w, "%-8s %-6s %8s %10s %10s %9s %9s %-20s %-16s %s\n",
+		"ID", "KIND", "AGE", "UP/s", "DOWN/s", "UP", "DOWN", "PROCESS", "NODE", "DESTINATION")
+	for _, r := range rows {
+		process := r.Process
+		if r.PID != 0 {
+			process = fmt.Sprintf("%s[%d]", r.Process, r.PID)
+		}
+		dest := r.Dest
+		if r.Kind == connExport {
+			dest = fmt.Sprintf("%s -> :%d", r.Peer, r.ExportPort)
+		}
+		fmt.Fprintf(w, "%-8d %-6s %8s %10s %10s %9s %9s %-20s %-16s %s\n",
+			r.ID, r.Kind, formatAge(r.age), formatSize(r.rateUp), formatSize(r.rateDn),
+			formatSize(float64(r.BytesUp)), formatSize(float64(r.BytesDown)),
+			truncate(process, 20), truncate(r.Node, 16), dest)
+	}
+}
+
+func formatSize(n float64) string {
+	units := []string{"B", "KiB", "MiB", "GiB", "TiB"}
+	i := 0
+	for n >= 1024 && i < len(units)-1 {
+		n /= 1024
+		i++
+	}
+	if i == 0 {
+		return fmt.Sprintf("%.0f%s", n, units[i])
+	}
+	return fmt.Sprintf("%.1f%s", n, units[i])
+}
+
+func formatAge(d time.Duration) string {
+	switch {
+	case d < time.Minute:
+		return fmt.Sprintf("%.1fs", d.Seconds())
+	case d < time.Hour:
+		return fmt.Sprintf("%dm%02ds", int(d.Minutes()), int(d.Seconds())%60)
+	default:
+		return fmt.Sprintf("%dh%02dm", int(d.Hours()), int(d.Minutes())%60)
+	}
+}
+
+func truncate(s string, n int) string {
+	if len(s) <= n {
+		return s
+	}
+	return s[:n-1] + "~"
+}
+
+// topSocketPath returns the control socket of the proxy running as hostname.
+func topSocketPath(hostname string) string {
+	return filepath.Join(nodeStateDir(hostname, 0), "control.sock")
+}
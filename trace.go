@@ -0,0 +1,181 @@
+package main
+
+import (
+	"encoding/json"
+	"errors"
+	"fmt"
+	"log"
+	"math/rand"
+	"os"
+	"path/filepath"
+	"strconv"
+	"sync/atomic"
+	"time"
+)
+
+// Sampled connection tracing.
+//
+// With trace_file set, a fraction trace_sample of connections is traced in
+// the Chrome trace event format, which chrome://tracing and Perfetto load
+// directly. The preload decides for the connections it intercepts, stamps
+// its own stages (proxy connect, SOCKS greeting, request) and passes the
+// trace id to the proxy in the SOCKS5 username; the proxy then adds accept,
+// handshake, dial, reply, first byte each way, relay and close. Other SOCKS
+// clients are sampled by the proxy alone.
+//
+// Each connection is a thread track, with the trace id as tid, under the
+// process that recorded it, and a flow arrow links the preload's request to
+// the proxy's accept. Both sides append whole events to the same file with a
+// single O_APPEND write per connection. The file is a JSON array left open
+// at the end, which both viewers accept.
+
+// traceEvent is one Chrome trace event. Times are microseconds since the
+// Unix epoch, so the preload and the proxy share a clock.
+type traceEvent struct {
+	Name string         `json:"name"`
+	Cat  string         `json:"cat,omitempty"`
+	Ph   string         `json:"ph"`
+	Ts   int64          `json:"ts"`
+	Dur  *int64         `json:"dur,omitempty"`
+	Pid  int            `json:"pid"`
+	Tid  uint64         `json:"tid"`
+	ID   string         `json:"id,omitempty"`
+	Bp   string         `json:"bp,omitempty"`
+	Args map[string]any `json:"args,omitempty"`
+}
+
+// traceIDMask keeps ids within the integers JSON readers hold exactly.
+const traceIDMask = 1<<53 - 1
+
+type tracer struct {
+	file   *os.File
+	path   string
+	sample float64
+	pid    int
+}
+
+// newTracer creates the trace file and writes the array header and process
+// name. It returns nil when tracing is disabled.
+func newTracer(config *Config) (*tracer, error) {
+	if config.TraceFile == "" {
+		return nil, nil
+	}
+	path, err := filepath.Abs(config.TraceFile)
+	if err != nil {
+		return nil, err
+	}
+	f, err := os.OpenFile(path, os.O_WRONLY|os.O_CREATE|os.O_TRUNC|os.O_APPEND, 0644)
+	if err != nil {
+		return nil, fmt.Errorf("failed to create trace file: %w", err)
+	}
+	t := &tracer{file: f, path: path, sample: config.TraceSample, pid: os.Getpid()}
+	t.write([]byte("[\n"), []traceEvent{{
+		Name: "process_name", Ph: "M", Pid: t.pid,
+		Args: map[string]any{"name": "tailproxy"},
+	}})
+	return t, nil
+}
+
+func (t *tracer) write(prefix []byte, events []traceEvent) {
+	buf := prefix
+	for i := range events {
+		b, err := json.Marshal(&events[i])
+		if err != nil {
+			continue
+		}
+		buf = append(buf, b...)
+		buf = append(buf, ",\n"...)
+	}
+	if _, err := t.file.Write(buf); err != nil && !errors.Is(err, os.ErrClosed) {
+		log.Printf("Trace write failed: %v", err)
+	}
+}
+
+func (t *tracer) close() {
+	if t != nil {
+		t.file.Close()
+	}
+}
+
+// connTrace collects the proxy's spans for one sampled connection.
+type connTrace struct {
+	t      *tracer
+	id     uint64
+	linked bool // the preload traced the client side
+	events []traceEvent
+
+	// First byte relayed towards the tailnet and towards the client, in
+	// Unix nanoseconds; written by the relay goroutines.
+	firstByte [2]atomic.Int64
+}
+
+const (
+	traceUp   = 0 // client -> tailnet
+	traceDown = 1 // tailnet -> client
+)
+
+// begin decides whether to trace a connection. ident carries the preload's
+// decision, if the client is the preload; other clients are sampled here.
+func (t *tracer) begin(ident *procIdent, accepted, started time.Time) *connTrace {
+	if t == nil {
+		return nil
+	}
+	ct := &connTrace{t: t}
+	switch {
+	case ident != nil && ident.Trace != 0:
+		ct.id = ident.Trace & traceIDMask
+		ct.linked = true
+	case ident != nil && ident.PID != 0:
+		return nil // the preload sampled this connection out
+	case rand.Float64() < t.sample:
+		ct.id = rand.Uint64() & traceIDMask
+	default:
+		return nil
+	}
+	if ct.linked {
+		ct.events = append(ct.events, traceEvent{
+			Name: "socks", Cat: "conn", Ph: "f", Bp: "e",
+			Ts: accepted.UnixMicro(), Pid: t.pid, Tid: ct.id, ID: strconv.FormatUint(ct.id, 16),
+		})
+	}
+	ct.span("accept", accepted, started, nil)
+	return ct
+}
+
+// span records a complete event from start to end.
+func (ct *connTrace) span(name string, start, end time.Time, args map[string]any) {
+	if ct == nil {
+		return
+	}
+	dur := end.Sub(start).Microseconds()
+	ct.events = append(ct.events, traceEvent{
+		Name: name, Cat: "conn", Ph: "X", Ts: start.UnixMicro(), Dur: &dur,
+		Pid: ct.t.pid, Tid: ct.id, Args: args,
+	})
+}
+
+// markFirstByte records the first byte relayed in dir. Called from relay.
+func (ct *connTrace) markFirstByte(dir int) {
+	if ct != nil && ct.firstByte[dir].Load() == 0 {
+		ct.firstByte[dir].CompareAndSwap(0, time.Now().UnixNano())
+	}
+}
+
+// finish names the connection's track after target and writes its events.
+func (ct *connTrace) finish(target string) {
+	if ct == nil {
+		return
+	}
+	for dir, name := range [2]string{"first byte up", "first byte down"} {
+		if ns := ct.firstByte[dir].Load(); ns != 0 {
+			ct.events = append(ct.events, traceEvent{
+				Name: name, Cat: "conn", Ph: "i", Ts: ns / 1000, Pid: ct.t.pid, Tid: ct.id,
+			})
+		}
+	}
+	ct.events = append(ct.events, traceEvent{
+		Name: "thread_name", Ph: "M", Pid: ct.t.pid, Tid: ct.id,
+		Args: map[string]any{"name": target},
+	})
+	ct.t.write(nil, ct.events)
+}
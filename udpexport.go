@@ -0,0 +1,463 @@
+package main
+
+import (
+	"context"
+	"errors"
+	"log"
+	"net"
+	"net/netip"
+	"sort"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+	"unsafe"
+
+	"golang.org/x/net/ipv4"
+	"golang.org/x/net/ipv6"
+)
+
+// UDP exports.
+//
+// The preload reports bound UDP sockets on the control socket like TCP
+// listeners, with the families udp4 and udp6 ("LISTEN udp4 5353
+// 127.0.0.1:5353", "CLOSE udp4 5353"). UDP has no listen(), so a socket is
+// reported when it binds a fixed port. Its bind is not rewritten to loopback,
+// since the same socket may send to other hosts.
+//
+// The exporter receives datagrams for the port on node 0's tailnet addresses.
+// Each tailnet peer address and port is a flow with its own connected loopback
+// socket, so the app sees one source per peer and its replies can be routed
+// back. Replies are read with recvmmsg, up to udpBatch at a time, into buffers
+// taken from a pool only once the flow's socket is readable, so idle flows
+// hold none. Flows idle for export_udp_idle_ms are closed. A port has at most
+// export_udp_max_flows, and datagrams that would start another are dropped.
+// export_acls is checked as a flow starts; a peer not yet in the ACL cache is
+// looked up off the port's reader, so a slow WhoIs stalls only that peer's
+// first datagram. The netstack's packet conn has no batch API, so datagrams to
+// the app are sent one at a time. If another socket binds the port at a
+// different address, the port's flows are closed, and each peer's next
+// datagram starts a flow to the new address.
+
+const (
+	udpBatch       = 8
+	udpMaxDatagram = 65535
+	udpExpireMin   = 100 * time.Millisecond
+)
+
+type udpExporter struct {
+	port     int
+	refcount int // em.mu
+	local    atomic.Pointer[string]
+	st       *udpPortStats
+	pcs      []net.PacketConn // one per tailnet address family
+	ctx      context.Context
+	cancel   context.CancelFunc
+
+	mu      sync.Mutex
+	flows   map[netip.AddrPort]*udpFlow // nil once stopped
+	pending map[netip.AddrPort]bool     // peers being looked up for export_acls
+}
+
+type udpFlow struct {
+	key      netip.AddrPort
+	peer     *net.UDPAddr
+	pc       net.PacketConn // the tailnet side it arrived on
+	conn     *net.UDPConn   // connected to the app
+	lastUsed atomic.Int64   // unix nanoseconds
+}
+
+// udpPortStats counts activity on one exported UDP port, across re-exports.
+type udpPortStats struct {
+	flows      atomic.Int64
+	flowsTotal atomic.Uint64
+	expired    atomic.Uint64
+	dropped    atomic.Uint64 // flow limit, ACL or send failure
+	packetsIn  atomic.Uint64 // tailnet -> app
+	packetsOut atomic.Uint64 // app -> tailnet
+	bytesIn    atomic.Uint64
+	bytesOut   atomic.Uint64
+	batches    atomic.Uint64 // recvmmsg calls on the app side
+}
+
+// udpSnapshot is a point-in-time view of one exported UDP port.
+type udpSnapshot struct {
+	Port       int
+	Exported   bool
+	Flows      int64
+	FlowsTotal uint64
+	Expired    uint64
+	Dropped    uint64
+	PacketsIn  uint64
+	PacketsOut uint64
+	BytesIn    uint64
+	BytesOut   uint64
+	Batches    uint64
+}
+
+type udpBatchBufs struct {
+	msgs []ipv4.Message
+}
+
+var udpBatchPool = sync.Pool{New: func() any {
+	b := &udpBatchBufs{msgs: make([]ipv4.Message, udpBatch)}
+	for i := range b.msgs {
+		b.msgs[i].Buffers = [][]byte{make([]byte, udpMaxDatagram)}
+	}
+	return b
+}}
+
+// handleListenUDP exports UDP port. local is the address the socket is bound
+// to, as reported by the preload.
+func (em *ExporterManager) handleListenUDP(port int, local string) {
+	policy := em.policy.Load()
+	if !policy.allows(port) {
+		if em.config.Verbose {
+			log.Printf("UDP port %d not allowed by export policy", port)
+		}
+		return
+	}
+
+	em.mu.Lock()
+	defer em.mu.Unlock()
+	if em.ctx.Err() != nil {
+		return
+	}
+	if exp, exists := em.udp[port]; exists {
+		exp.refcount++
+		if *exp.local.Load() != local {
+			// Another socket on the port, bound elsewhere. Close the flows
+			// so each peer's next datagram dials the new address.
+			exp.local.Store(&local)
+			exp.mu.Lock()
+			for _, f := range exp.flows {
+				exp.closeFlowLocked(f)
+			}
+			exp.mu.Unlock()
+			if em.config.Verbose {
+				log.Printf("UDP port %d now bound at %s, closing its flows", port, local)
+			}
+		}
+		return
+	}
+	if len(em.exporters)+len(em.udp) >= policy.max {
+		if em.config.Verbose {
+			log.Printf("Cannot export UDP port %d: max exports (%d) reached", port, policy.max)
+		}
+		return
+	}
+	em.startUDPExporter(port, local)
+}
+
+func (em *ExporterManager) handleCloseUDP(port int) {
+	em.mu.Lock()
+	defer em.mu.Unlock()
+	exp, exists := em.udp[port]
+	if !exists {
+		return
+	}
+	exp.refcount--
+	if exp.refcount <= 0 {
+		em.stopUDPExporter(port)
+	}
+}
+
+// startUDPExporter listens for datagrams to port on the tailnet. Called with
+// em.mu held.
+func (em *ExporterManager) startUDPExporter(port int, local string) {
+	ip4, ip6 := em.server.TailscaleIPs()
+	var pcs []net.PacketConn
+	for _, ip := range []netip.Addr{ip4, ip6} {
+		if !ip.IsValid() {
+			continue
+		}
+		pc, err := em.server.ListenPacket("udp", netip.AddrPortFrom(ip, uint16(port)).String())
+		if err != nil {
+			log.Printf("Failed to export UDP port %d on %s: %v", port, ip, err)
+			continue
+		}
+		pcs = append(pcs, pc)
+	}
+	if len(pcs) == 0 {
+		return
+	}
+
+	st, ok := em.udpStats[port]
+	if !ok {
+		st = &udpPortStats{}
+		em.udpStats[port] = st
+	}
+	ctx, cancel := context.WithCancel(em.ctx)
+	exp := &udpExporter{
+		port:     port,
+		refcount: 1,
+		st:       st,
+		pcs:      pcs,
+		ctx:      ctx,
+		cancel:   cancel,
+		flows:    make(map[netip.AddrPort]*udpFlow),
+		pending:  make(map[netip.AddrPort]bool),
+	}
+	exp.local.Store(&local)
+	em.udp[port] = exp
+	for _, pc := range pcs {
+		go em.readUDP(exp, pc)
+	}
+	go em.expireUDP(exp)
+
+	if em.config.Verbose {
+		log.Printf("Exporting UDP port %d on tailnet (local %s)", port, local)
+	}
+}
+
+// stopUDPExporter closes the port's tailnet sockets and all its flows.
+// Called with em.mu held.
+func (em *ExporterManager) stopUDPExporter(port int) {
+	exp, exists := em.udp[port]
+	if !exists {
+		return
+	}
+	if em.config.Verbose {
+		log.Printf("Stopping export of UDP port %d", port)
+	}
+	delete(em.udp, port)
+	exp.cancel()
+	for _, pc := range exp.pcs {
+		pc.Close()
+	}
+	exp.mu.Lock()
+	for _, f := range exp.flows {
+		exp.closeFlowLocked(f)
+	}
+	exp.flows = nil
+	exp.mu.Unlock()
+}
+
+// readUDP relays datagrams from the tailnet to the app until pc is closed.
+func (em *ExporterManager) readUDP(exp *udpExporter, pc net.PacketConn) {
+	buf := make([]byte, udpMaxDatagram)
+	for {
+		n, addr, err := pc.ReadFrom(buf)
+		if err != nil {
+			if exp.ctx.Err() == nil && em.config.Verbose {
+				log.Printf("UDP port %d: tailnet read failed: %v", exp.port, err)
+			}
+			return
+		}
+		peer := addrPortOf(addr)
+		exp.mu.Lock()
+		f := exp.flows[peer]
+		exp.mu.Unlock()
+		if f == nil {
+			em.admitUDP(exp, peer, pc, buf[:n])
+			continue
+		}
+		exp.deliver(f, buf[:n])
+	}
+}
+
+// admitUDP starts a flow for a datagram from a new peer, if export_acls and
+// export_udp_max_flows allow, and delivers the datagram on it. A peer with
+// no cached ACL decision is looked up off the reader, so a slow or failing
+// WhoIs holds up only that peer: its first datagram waits for the lookup,
+// and any more that arrive meanwhile are dropped.
+func (em *ExporterManager) admitUDP(exp *udpExporter, peer netip.AddrPort, pc net.PacketConn, b []byte) {
+	port := uint16(exp.port)
+	acl := em.policy.Load().acl
+	if !acl.covers(port) {
+		exp.deliver(em.startUDPFlow(exp, peer, pc), b)
+		return
+	}
+	if allowed, ok := em.acls.cached(acl, peer.Addr(), port); ok {
+		if !allowed {
+			exp.st.dropped.Add(1)
+			return
+		}
+		exp.deliver(em.startUDPFlow(exp, peer, pc), b)
+		return
+	}
+
+	exp.mu.Lock()
+	// Lookups in flight count against the flow limit, which bounds them
+	admit := exp.flows != nil && !exp.pending[peer] &&
+		len(exp.flows)+len(exp.pending) < em.config.ExportUDPMaxFlows
+	if admit {
+		exp.pending[peer] = true
+	}
+	exp.mu.Unlock()
+	if !admit {
+		exp.st.dropped.Add(1)
+		return
+	}
+	held := append([]byte(nil), b...)
+	go func() {
+		allowed := em.acls.allows(exp.ctx, acl, peer.Addr(), port)
+		exp.mu.Lock()
+		delete(exp.pending, peer)
+		exp.mu.Unlock()
+		if !allowed {
+			exp.st.dropped.Add(1)
+			return
+		}
+		exp.deliver(em.startUDPFlow(exp, peer, pc), held)
+	}()
+}
+
+// startUDPFlow returns the flow for peer, starting one if
+// export_udp_max_flows allows. It returns nil if the port is unexported or
+// full.
+func (em *ExporterManager) startUDPFlow(exp *udpExporter, peer netip.AddrPort, pc net.PacketConn) *udpFlow {
+	exp.mu.Lock()
+	defer exp.mu.Unlock()
+	if f := exp.flows[peer]; f != nil || exp.flows == nil {
+		return f
+	}
+	if len(exp.flows)+len(exp.pending) >= em.config.ExportUDPMaxFlows {
+		return nil
+	}
+	conn, err := net.Dial("udp", *exp.local.Load())
+	if err != nil {
+		return nil
+	}
+	f := &udpFlow{key: peer, peer: net.UDPAddrFromAddrPort(peer), pc: pc, conn: conn.(*net.UDPConn)}
+	f.lastUsed.Store(time.Now().UnixNano())
+	exp.flows[peer] = f
+	exp.st.flows.Add(1)
+	exp.st.flowsTotal.Add(1)
+	go exp.replyUDP(f)
+	return f
+}
+
+// deliver writes a datagram from the tailnet to the app on f. A nil f
+// drops it.
+func (exp *udpExporter) deliver(f *udpFlow, b []byte) {
+	if f == nil {
+		exp.st.dropped.Add(1)
+		return
+	}
+	f.lastUsed.Store(time.Now().UnixNano())
+	if _, err := f.conn.Write(b); err != nil {
+		// Usually ECONNREFUSED: the app's socket is gone
+		exp.st.dropped.Add(1)
+		return
+	}
+	exp.st.packetsIn.Add(1)
+	exp.st.bytesIn.Add(uint64(len(b)))
+}
+
+// replyUDP relays the app's replies on a flow back to its peer, a batch at
+// a time, until the flow is closed.
+func (exp *udpExporter) replyUDP(f *udpFlow) {
+	defer func() {
+		exp.mu.Lock()
+		if exp.flows != nil && exp.flows[f.key] == f {
+			exp.closeFlowLocked(f)
+		}
+		exp.mu.Unlock()
+	}()
+	rc, err := f.conn.SyscallConn()
+	if err != nil {
+		return
+	}
+	// Both wrappers read the same message type; the flow socket is udp6
+	// when the app bound an IPv6 address
+	var pconn interface {
+		ReadBatch([]ipv4.Message, int) (int, error)
+	} = ipv4.NewPacketConn(f.conn)
+	if addr, ok := f.conn.RemoteAddr().(*net.UDPAddr); ok && addr.IP.To4() == nil {
+		pconn = ipv6.NewPacketConn(f.conn)
+	}
+	for {
+		if err := udpWaitReadable(rc); err != nil {
+			return
+		}
+		b := udpBatchPool.Get().(*udpBatchBufs)
+		n, err := pconn.ReadBatch(b.msgs, 0)
+		if n > 0 {
+			exp.st.batches.Add(1)
+			f.lastUsed.Store(time.Now().UnixNano())
+		}
+		for i := 0; i < n; i++ {
+			m := &b.msgs[i]
+			if _, werr := f.pc.WriteTo(m.Buffers[0][:m.N], f.peer); werr != nil {
+				exp.st.dropped.Add(1)
+				continue
+			}
+			exp.st.packetsOut.Add(1)
+			exp.st.bytesOut.Add(uint64(m.N))
+		}
+		udpBatchPool.Put(b)
+		if err != nil && errors.Is(err, net.ErrClosed) {
+			return
+		}
+		// Other errors, such as ECONNREFUSED after the app closed its
+		// socket, are reported once and cleared
+	}
+}
+
+// udpWaitReadable blocks until conn has a datagram or error queued, without
+// reading it.
+func udpWaitReadable(rc syscall.RawConn) error {
+	var b [1]byte
+	return rc.Read(func(fd uintptr) bool {
+		_, _, errno := syscall.Syscall6(syscall.SYS_RECVFROM, fd, uintptr(unsafe.Pointer(&b[0])), 1,
+			syscall.MSG_PEEK|syscall.MSG_DONTWAIT, 0, 0)
+		return errno != syscall.EAGAIN
+	})
+}
+
+// expireUDP closes flows idle for export_udp_idle_ms until the port is
+// unexported.
+func (em *ExporterManager) expireUDP(exp *udpExporter) {
+	idle := time.Duration(em.config.ExportUDPIdleMs) * time.Millisecond
+	ticker := time.NewTicker(max(idle/4, udpExpireMin))
+	defer ticker.Stop()
+	for {
+		select {
+		case <-exp.ctx.Done():
+			return
+		case now := <-ticker.C:
+			cutoff := now.Add(-idle).UnixNano()
+			exp.mu.Lock()
+			for _, f := range exp.flows {
+				if f.lastUsed.Load() < cutoff {
+					exp.closeFlowLocked(f)
+					exp.st.expired.Add(1)
+				}
+			}
+			exp.mu.Unlock()
+		}
+	}
+}
+
+// closeFlowLocked removes f and closes its socket, which ends its reply
+// loop. Called with exp.mu held.
+func (exp *udpExporter) closeFlowLocked(f *udpFlow) {
+	delete(exp.flows, f.key)
+	exp.st.flows.Add(-1)
+	f.conn.Close()
+}
+
+func (em *ExporterManager) snapshotUDP() []udpSnapshot {
+	em.mu.Lock()
+	defer em.mu.Unlock()
+	out := make([]udpSnapshot, 0, len(em.udpStats))
+	for port, st := range em.udpStats {
+		_, exported := em.udp[port]
+		out = append(out, udpSnapshot{
+			Port:       port,
+			Exported:   exported,
+			Flows:      st.flows.Load(),
+			FlowsTotal: st.flowsTotal.Load(),
+			Expired:    st.expired.Load(),
+			Dropped:    st.dropped.Load(),
+			PacketsIn:  st.packetsIn.Load(),
+			PacketsOut: st.packetsOut.Load(),
+			BytesIn:    st.bytesIn.Load(),
+			BytesOut:   st.bytesOut.Load(),
+			Batches:    st.batches.Load(),
+		})
+	}
+	sort.Slice(out, func(i, j int) bool { return out[i].Port < out[j].Port })
+	return out
+}
@@ -0,0 +1,126 @@
+package main
+
+import (
+	"context"
+	"net"
+	"net/netip"
+	"testing"
+	"time"
+)
+
+// udpTestPeer sends to the exporter's tailnet side from addr.
+func udpTestPeer(t *testing.T, addr string, to net.Addr) *net.UDPConn {
+	t.Helper()
+	c, err := net.ListenUDP("udp", net.UDPAddrFromAddrPort(netip.MustParseAddrPort(addr)))
+	if err != nil {
+		t.Skipf("cannot bind %s: %v", addr, err)
+	}
+	t.Cleanup(func() { c.Close() })
+	if _, err := c.WriteTo([]byte(addr), to); err != nil {
+		t.Fatal(err)
+	}
+	return c
+}
+
+// TestUDPExportACLLookups checks that peers whose WhoIs is slow or denied
+// don't hold up datagrams from other peers on the port.
+func TestUDPExportACLLookups(t *testing.T) {
+	const port = 5353
+	node := &tsnetNode{hostname: "test", peers: &peerMonitor{}}
+	whois := newWhoisCache(node)
+	seed := func(addr string, id *peerIdentity) *whoisEntry {
+		e := &whoisEntry{id: id, done: make(chan struct{})}
+		whois.entries[netip.MustParseAddr(addr)] = e
+		return e
+	}
+	close(seed("127.0.0.2", &peerIdentity{user: "ann@example.com"}).done)
+	close(seed("127.0.0.3", &peerIdentity{user: "eve@example.com"}).done)
+	slow := seed("127.0.0.4", nil) // lookup still in flight
+
+	acl, err := compileACLs([]ExportACL{{Ports: "5353", Users: "ann@example.com"}})
+	if err != nil {
+		t.Fatal(err)
+	}
+	ctx, cancel := context.WithCancel(context.Background())
+	em := &ExporterManager{config: &Config{ExportUDPMaxFlows: 8}, whois: whois, acls: newACLCache(whois), ctx: ctx}
+	em.policy.Store(&exportPolicy{acl: acl})
+
+	app, err := net.ListenUDP("udp", &net.UDPAddr{IP: net.IPv4(127, 0, 0, 1)})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer app.Close()
+	tailnet, err := net.ListenPacket("udp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	local := app.LocalAddr().String()
+	exp := &udpExporter{
+		port:    port,
+		st:      &udpPortStats{},
+		pcs:     []net.PacketConn{tailnet},
+		ctx:     ctx,
+		cancel:  cancel,
+		flows:   make(map[netip.AddrPort]*udpFlow),
+		pending: make(map[netip.AddrPort]bool),
+	}
+	exp.local.Store(&local)
+	go em.readUDP(exp, tailnet)
+	defer func() {
+		em.mu.Lock()
+		em.udp = map[int]*udpExporter{port: exp}
+		em.stopUDPExporter(port)
+		em.mu.Unlock()
+	}()
+
+	recv := func(timeout time.Duration) (string, net.Addr) {
+		buf := make([]byte, 64)
+		app.SetReadDeadline(time.Now().Add(timeout))
+		n, from, err := app.ReadFrom(buf)
+		if err != nil {
+			return "", nil
+		}
+		return string(buf[:n]), from
+	}
+
+	// The slow peer's lookup is pending while the others are admitted or
+	// refused
+	slowPeer := udpTestPeer(t, "127.0.0.4:40000", tailnet.LocalAddr())
+	udpTestPeer(t, "127.0.0.3:40000", tailnet.LocalAddr())
+	allowed := udpTestPeer(t, "127.0.0.2:40000", tailnet.LocalAddr())
+	got, from := recv(time.Second)
+	if got != "127.0.0.2:40000" {
+		t.Fatalf("app got %q, want the allowed peer's datagram", got)
+	}
+	if _, err := app.WriteTo([]byte("reply"), from); err != nil {
+		t.Fatal(err)
+	}
+	buf := make([]byte, 64)
+	allowed.SetReadDeadline(time.Now().Add(time.Second))
+	if n, _, err := allowed.ReadFrom(buf); err != nil || string(buf[:n]) != "reply" {
+		t.Fatalf("allowed peer got %q, %v", buf[:n], err)
+	}
+
+	// More from the slow peer is dropped while its lookup is in flight
+	slowPeer.WriteTo([]byte("again"), tailnet.LocalAddr())
+	if got, _ := recv(100 * time.Millisecond); got != "" {
+		t.Fatalf("app got %q before the slow lookup finished", got)
+	}
+
+	// Once it finishes, the held first datagram is delivered
+	slow.id = &peerIdentity{user: "ann@example.com"}
+	close(slow.done)
+	if got, _ := recv(time.Second); got != "127.0.0.4:40000" {
+		t.Fatalf("app got %q, want the slow peer's first datagram", got)
+	}
+
+	exp.mu.Lock()
+	flows, pending := len(exp.flows), len(exp.pending)
+	exp.mu.Unlock()
+	if flows != 2 || pending != 0 {
+		t.Errorf("%d flows and %d pending, want 2 and 0", flows, pending)
+	}
+	if d := exp.st.dropped.Load(); d != 2 {
+		t.Errorf("%d datagrams dropped, want 2 (denied peer, slow peer's second)", d)
+	}
+}
@@ -0,0 +1,104 @@
+package main
+
+import (
+	"fmt"
+	"log"
+	"net"
+	"sort"
+	"strconv"
+	"strings"
+)
+
+// Unix socket exports.
+//
+// export_unix maps Unix socket paths to tailnet ports, e.g.
+// "/run/gunicorn.sock=8000,@docker-api=2375" ("@" names an abstract
+// socket). The preload gets the mapping in TAILPROXY_EXPORT_UNIX. When an
+// AF_UNIX stream socket binds a mapped path (a relative path is taken against
+// the working directory) and listens, it reports "LISTEN unix 8000", and
+// "CLOSE unix 8000" when it is closed. An abstract name bound with its NUL
+// padding, as apps passing sizeof(struct sockaddr_un) do, is reported with
+// the padded length ("LISTEN unix 8000 108"). The padding is part of the
+// name, so it is dialed with it. The port is then exported like a TCP
+// listener's. Tailnet connections are dialed to the path the port maps to,
+// with the same queueing, deadlines, grace period and PROXY header; warm
+// connections and injection are TCP only. Since the preload reads the
+// mapping once, at start, changes need a restart of the command.
+
+const (
+	unixLocalPrefix = "unix:"
+	unixPathMax     = 108 // sizeof(sun_path)
+)
+
+// parseUnixExports parses export_unix into a map from port to path.
+func parseUnixExports(spec string) (map[int]string, error) {
+	out := make(map[int]string)
+	paths := make(map[string]bool)
+	for _, part := range strings.Split(spec, ",") {
+		part = strings.TrimSpace(part)
+		if part == "" {
+			continue
+		}
+		i := strings.LastIndex(part, "=")
+		if i < 0 {
+			return nil, fmt.Errorf("export_unix: %q is not path=port", part)
+		}
+		path, portStr := strings.TrimSpace(part[:i]), strings.TrimSpace(part[i+1:])
+		port, err := strconv.Atoi(portStr)
+		if err != nil || port < 1 || port > 65535 {
+			return nil, fmt.Errorf("export_unix: invalid port in %q", part)
+		}
+		if !strings.HasPrefix(path, "/") && !(strings.HasPrefix(path, "@") && len(path) > 1) {
+			return nil, fmt.Errorf("export_unix: %q must be an absolute path or @name", path)
+		}
+		if _, taken := out[port]; taken {
+			return nil, fmt.Errorf("export_unix: port %d mapped twice", port)
+		}
+		if paths[path] {
+			return nil, fmt.Errorf("export_unix: %s mapped twice", path)
+		}
+		out[port] = path
+		paths[path] = true
+	}
+	return out, nil
+}
+
+// formatUnixExports is the mapping as the preload reads it: path=port
+// pairs, comma-separated, without spaces.
+func formatUnixExports(m map[int]string) string {
+	ports := make([]int, 0, len(m))
+	for port := range m {
+		ports = append(ports, port)
+	}
+	sort.Ints(ports)
+	parts := make([]string, len(ports))
+	for i, port := range ports {
+		parts[i] = m[port] + "=" + strconv.Itoa(port)
+	}
+	return strings.Join(parts, ",")
+}
+
+// handleListenUnix exports port for a Unix socket listener the preload
+// reported. sunLen is the padded length of an abstract name, or "".
+func (em *ExporterManager) handleListenUnix(port int, sunLen string) {
+	path, ok := em.unix[port]
+	if !ok {
+		if em.config.Verbose {
+			log.Printf("Ignoring Unix socket listener for port %d: not in export_unix", port)
+		}
+		return
+	}
+	if n, err := strconv.Atoi(sunLen); err == nil && strings.HasPrefix(path, "@") && n > len(path) && n <= unixPathMax {
+		path += strings.Repeat("\x00", n-len(path))
+	}
+	em.handleListen(port, unixLocalPrefix+path)
+}
+
+// dialLocal connects to a local address from LISTEN: "unix:<path>" for a
+// Unix socket, otherwise a TCP address.
+func dialLocal(local string) (net.Conn, error) {
+	if path, ok := strings.CutPrefix(local, unixLocalPrefix); ok {
+		return net.Dial("unix", path)
+	}
+	return net.Dial("tcp", local)
+}
@@ -0,0 +1,65 @@
+package main
+
+import (
+	"reflect"
+	"strings"
+	"testing"
+)
+
+func TestParseUnixExports(t *testing.T) {
+	tests := []struct {
+		spec    string
+		want    map[int]string
+		wantErr string
+	}{
+		{spec: "", want: map[int]string{}},
+		{spec: "/run/gunicorn.sock=8000", want: map[int]string{8000: "/run/gunicorn.sock"}},
+		{spec: " /run/a=b.sock = 8000 , @docker=2375,", want: map[int]string{8000: "/run/a=b.sock", 2375: "@docker"}},
+		{spec: "/run/app.sock", wantErr: "is not path=port"},
+		{spec: "/run/app.sock=0", wantErr: "invalid port"},
+		{spec: "/run/app.sock=65536", wantErr: "invalid port"},
+		{spec: "/run/app.sock=http", wantErr: "invalid port"},
+		{spec: "run/app.sock=80", wantErr: "absolute path or @name"},
+		{spec: "@=80", wantErr: "absolute path or @name"},
+		{spec: "/a.sock=80,/b.sock=80", wantErr: "port 80 mapped twice"},
+		{spec: "/a.sock=80,/a.sock=81", wantErr: "/a.sock mapped twice"},
+	}
+	for _, tt := range tests {
+		got, err := parseUnixExports(tt.spec)
+		if tt.wantErr != "" {
+			if err == nil || !strings.Contains(err.Error(), tt.wantErr) {
+				t.Errorf("parseUnixExports(%q) error = %v, want %q", tt.spec, err, tt.wantErr)
+			}
+			continue
+		}
+		if err != nil {
+			t.Errorf("parseUnixExports(%q): %v", tt.spec, err)
+			continue
+		}
+		if !reflect.DeepEqual(got, tt.want) {
+			t.Errorf("parseUnixExports(%q) = %v, want %v", tt.spec, got, tt.want)
+		}
+	}
+}
+
+func TestFormatUnixExports(t *testing.T) {
+	tests := []struct {
+		m    map[int]string
+		want string
+	}{
+		{nil, ""},
+		{map[int]string{8000: "/run/gunicorn.sock"}, "/run/gunicorn.sock=8000"},
+		{map[int]string{8000: "/run/a=b.sock", 2375: "@docker", 9000: "/tmp/x"}, "@docker=2375,/run/a=b.sock=8000,/tmp/x=9000"},
+	}
+	for _, tt := range tests {
+		got := formatUnixExports(tt.m)
+		if got != tt.want {
+			t.Errorf("formatUnixExports(%v) = %q, want %q", tt.m, got, tt.want)
+		}
+		// What the preload reads parses back to the same mapping
+		back, err := parseUnixExports(got)
+		if err != nil || (len(tt.m) > 0 && !reflect.DeepEqual(back, tt.m)) {
+			t.Errorf("parseUnixExports(%q) = %v, %v, want %v", got, back, err, tt.m)
+		}
+	}
+}